@@ -66,6 +66,8 @@ extern "C" {
 /* modes */
 #define BSDIFF_MODE_READ  0
 #define BSDIFF_MODE_WRITE 1
+/* file streams only: write mode, keeping the existing contents of the file */
+#define BSDIFF_MODE_UPDATE 2
 
 /* seek origins */
 #define BSDIFF_SEEK_SET 0
@@ -91,13 +93,25 @@ struct bsdiff_stream
 	int (*flush)(void *state);
 	/* optional */
 	int (*get_buffer)(void *state, const void **ppbuffer, size_t *psize);
+	/* optional, read mode: read at 'offset' without moving the position,
+	   BSDIFF_END_OF_FILE if fewer than 'size' bytes are left */
+	int (*pread)(void *state, void *buffer, size_t size, int64_t offset, size_t *readed);
+	/* optional, for data that isn't contiguous: the run of contiguous bytes
+	   starting at 'offset', BSDIFF_END_OF_FILE at the end of the data */
+	int (*get_chunk)(void *state, int64_t offset, const void **ppbuffer, size_t *psize);
+	/* optional, POSIX: the descriptor of a file holding the data at offsets
+	   equal to the stream positions, after anything buffered is written;
+	   fails if the data isn't in such a file (at the moment) */
+	int (*get_fd)(void *state, int *fd);
 };
 
 /**
  * @brief
  *    Open a file based bsdiff_stream.
  * @param mode
- *    The working mode of the stream.
+ *    The working mode of the stream. BSDIFF_MODE_UPDATE opens an existing
+ *    file for writing without truncating it, the stream then reports
+ *    BSDIFF_MODE_WRITE.
  * @param filename
  *    The name of the file.
  * @param stream
@@ -133,6 +147,44 @@ int bsdiff_open_memory_stream(
 	size_t size,
 	struct bsdiff_stream *stream);
 
+/**
+ * @brief
+ *    Open a write-mode memory stream that grows by adding chunks instead of
+ *    reallocating one buffer, so that nothing is copied as it grows. It has
+ *    no get_buffer, the data is read back with get_chunk.
+ * @param chunk_size
+ *    The largest chunk size, 0 for 1 MiB. Chunks start at 4 KiB and double.
+ * @param stream
+ *    The stream to be opened.
+ * @return
+ *    BSDIFF_SUCCESS if no error.
+ */
+BSDIFF_API
+int bsdiff_open_chunked_memory_stream(
+	size_t chunk_size,
+	struct bsdiff_stream *stream);
+
+/**
+ * @brief
+ *    Open a chunked memory stream (1 MiB chunks) which moves its data to an
+ *    unlinked temporary file once it would grow beyond 'memory_limit'. Until
+ *    then the data is read back with get_chunk, afterwards with get_fd.
+ *    Windows keeps everything in memory.
+ * @param memory_limit
+ *    The most bytes kept in memory, 0 for no limit.
+ * @param dir
+ *    The directory of the temporary file, NULL for $TMPDIR or /tmp.
+ * @param stream
+ *    The stream to be opened.
+ * @return
+ *    BSDIFF_SUCCESS if no error.
+ */
+BSDIFF_API
+int bsdiff_open_spill_stream(
+	size_t memory_limit,
+	const char *dir,
+	struct bsdiff_stream *stream);
+
 /**
  * @brief
  *    Open a file based mmap bsdiff_stream.
@@ -151,6 +203,102 @@ int bsdiff_open_mmap_stream(
 	const char *filename,
 	struct bsdiff_stream *stream);
 
+/* access patterns of bsdiff_mmap_stream_options */
+#define BSDIFF_ACCESS_NORMAL     0
+#define BSDIFF_ACCESS_RANDOM     1   /* e.g. the old file of bsdiff */
+#define BSDIFF_ACCESS_SEQUENTIAL 2
+
+/* Mapping hints (POSIX, ignored on Windows) */
+struct bsdiff_mmap_stream_options
+{
+	int access;          /* BSDIFF_ACCESS_*, passed on with madvise */
+	int prefault;        /* fault the whole file in when it is opened
+	                        (MAP_POPULATE, MADV_WILLNEED) */
+	int huge_pages;      /* map at a 2 MiB boundary and advise transparent
+	                        huge pages, to cut TLB misses on large files */
+};
+
+/**
+ * @brief
+ *    bsdiff_open_mmap_stream with mapping hints.
+ * @param opts
+ *    Hints, may be NULL for none.
+ */
+BSDIFF_API
+int bsdiff_open_mmap_stream_ex(
+	int mode,
+	const char *filename,
+	const struct bsdiff_mmap_stream_options *opts,
+	struct bsdiff_stream *stream);
+
+struct bsdiff_fd_stream_options
+{
+	size_t buffer_size;  /* size of the page-aligned buffer, 0 for 1 MiB */
+	int64_t size_hint;   /* write mode: expected final size of the file, its
+	                        blocks are reserved up front (Linux); 0 if unknown */
+	int drop_cache;      /* drop the data behind the stream position from the
+	                        page cache, for files that are much larger than RAM */
+	int queue_depth;     /* io_uring streams: buffers in flight, 0 for 4 */
+};
+
+/**
+ * @brief
+ *    Open a bsdiff_stream on a file descriptor (POSIX only).
+ *    The stream reads and writes with pread/pwrite through a large buffer
+ *    and starts at the current offset of 'fd'. Descriptors that can't seek,
+ *    e.g. pipes, are read/written sequentially and only support seeking to
+ *    the current position.
+ * @param mode
+ *    The working mode of the stream, BSDIFF_MODE_UPDATE is reported as
+ *    BSDIFF_MODE_WRITE.
+ * @param fd
+ *    An open descriptor, e.g. a regular file, a memfd or a pipe.
+ * @param owns_fd
+ *    Non-zero if closing the stream should close 'fd'.
+ * @param opts
+ *    Options, may be NULL for the defaults.
+ * @param stream
+ *    The stream to be opened.
+ * @return
+ *    BSDIFF_SUCCESS if no error, BSDIFF_ERROR on platforms without it.
+ */
+BSDIFF_API
+int bsdiff_open_fd_stream(
+	int mode,
+	int fd,
+	int owns_fd,
+	const struct bsdiff_fd_stream_options *opts,
+	struct bsdiff_stream *stream);
+
+/**
+ * @brief
+ *    Open a file with bsdiff_open_fd_stream, the file is closed with the
+ *    stream. Modes are the same as for bsdiff_open_file_stream.
+ */
+BSDIFF_API
+int bsdiff_open_fd_file_stream(
+	int mode,
+	const char *filename,
+	const struct bsdiff_fd_stream_options *opts,
+	struct bsdiff_stream *stream);
+
+/**
+ * @brief
+ *    Open a file based bsdiff_stream that overlaps its I/O with the caller
+ *    through io_uring (Linux): reads run up to 'queue_depth' buffers ahead
+ *    of the position and full buffers are written behind it. Seeking out of
+ *    the read-ahead window or in write mode waits for the queued I/O.
+ *    Files that aren't regular files or block devices, kernels without
+ *    io_uring and other platforms get bsdiff_open_fd_file_stream instead.
+ *    Modes are the same as for bsdiff_open_file_stream.
+ */
+BSDIFF_API
+int bsdiff_open_uring_stream(
+	int mode,
+	const char *filename,
+	const struct bsdiff_fd_stream_options *opts,
+	struct bsdiff_stream *stream);
+
 /**
  * @brief
  *    Close a bsdiff_stream.
@@ -170,6 +318,16 @@ void bsdiff_close_stream(
  * - An array of entries, each contains a header, an optional diff data, and an optional extra data;
  *
  * Entry header is a (diff_len, extra_len, seek_len) triple.
+ *
+ * seek_new_pos is optional. When provided, it positions the reader so that the
+ * next read_entry_header returns the (possibly partial) entry which produces
+ * byte 'newpos' of the new file, and reports the matching position in the old
+ * file through 'oldpos'.
+ *
+ * view_entry_diff and view_entry_extra are optional. They work like
+ * read_entry_diff and read_entry_extra, but point '*data' at up to 'size'
+ * bytes held by the packer instead of copying them. The view is valid until
+ * the next call on the packer.
  */
 struct bsdiff_patch_packer
 {
@@ -196,6 +354,13 @@ struct bsdiff_patch_packer
 	int (*write_entry_extra)(
 		void *state, const void *buffer, size_t size);
 	int (*flush)(void *state);
+	/* optional, read mode only */
+	int (*seek_new_pos)(
+		void *state, int64_t newpos, int64_t *oldpos);
+	int (*view_entry_diff)(
+		void *state, size_t size, const void **data, size_t *len);
+	int (*view_entry_extra)(
+		void *state, size_t size, const void **data, size_t *len);
 };
 
 /**
@@ -218,6 +383,44 @@ int bsdiff_open_bz2_patch_packer(
 	struct bsdiff_stream *stream,
 	struct bsdiff_patch_packer *packer);
 
+struct bsdiff_bz2_options
+{
+	int concurrent;  /* non-zero compresses the ctrl, diff and extra blocks on
+	                    three worker threads, the patch is unchanged */
+	int threads;     /* above 1, the size of a thread pool which compresses each
+	                    block as concatenated 900k bzip2 streams (like pbzip2),
+	                    or decodes such streams ahead of the reader */
+	size_t spill_threshold;  /* above 0, compressed blocks larger than this
+	                            many bytes are kept in unlinked temporary files
+	                            until flush instead of memory */
+	const char *spill_dir;   /* directory of those files, NULL for $TMPDIR */
+};
+
+/**
+ * @brief
+ *    Open a bzip2 bsdiff_patch_packer with options.
+ *    The patches are readable by bsdiff_open_bz2_patch_packer and by any
+ *    BSDIFF40 reader which handles concatenated bzip2 streams.
+ * @param mode
+ *    The working mode of the packer.
+ * @param stream
+ *    The stream which managed the reading/writing of the persistent patch data.
+ *    The stream is borrowed by the packer and is still owned by the caller.
+ *    Caller is responsible for closing the stream.
+ * @param options
+ *    The options, may be NULL.
+ * @param packer
+ *    The packer to be opened.
+ * @return
+ *    BSDIFF_SUCCESS if no error.
+ */
+BSDIFF_API
+int bsdiff_open_bz2_patch_packer_ex(
+	int mode,
+	struct bsdiff_stream *stream,
+	const struct bsdiff_bz2_options *options,
+	struct bsdiff_patch_packer *packer);
+
 /**
  * @brief
  *    Open a zstd bsdiff_patch_packer.
@@ -238,6 +441,236 @@ int bsdiff_open_zstd_patch_packer(
 	struct bsdiff_stream *stream,
 	struct bsdiff_patch_packer *packer);
 
+/* A zstd dictionary, loaded once and shareable by any number of packers */
+struct bsdiff_zstd_dict;
+
+/* Compression parameters of one zstd block, zero selects the zstd default */
+struct bsdiff_zstd_block_options
+{
+	int level;                  /* negative for the fast levels, up to ZSTD_maxCLevel() */
+	int window_log;             /* log2 of the window size */
+	int long_distance_matching; /* non-zero enables long distance matching */
+	int strategy;               /* a ZSTD_strategy value (1: fast ... 9: btultra2) */
+	int workers;                /* compression threads, 0 compresses on the calling thread;
+	                               capped to 0 if zstd is built without multithreading */
+	const struct bsdiff_zstd_dict *dict; /* compress with this dictionary, its creation
+	                                        level replaces 'level' */
+	int shuffle;                /* transpose the bytes of elements of this size (2, 4,
+	                               8 or 16) before compression, for tables of integers
+	                               or floats ("ZSTDDIF2"); 0 or 1 disables it */
+};
+
+struct bsdiff_zstd_options
+{
+	struct bsdiff_zstd_block_options ctrl;
+	struct bsdiff_zstd_block_options diff;
+	struct bsdiff_zstd_block_options extra;
+	/* BSDIFF_MODE_READ: the dictionaries available for decompression, each
+	   block uses the one matching the dictID in its frame header. The array
+	   must outlive the packer. */
+	const struct bsdiff_zstd_dict *const *dicts;
+	size_t ndicts;
+	/* BSDIFF_MODE_READ: the largest window_log accepted, 0 for the zstd
+	   default of 27 (128 MiB). Patches written with a larger window_log
+	   need it, at the cost of that much memory per block. */
+	int max_window_log;
+	/* BSDIFF_MODE_WRITE: non-zero compresses the ctrl, diff and extra blocks
+	   on three worker threads, the patch is unchanged */
+	int concurrent;
+	/* BSDIFF_MODE_WRITE: non-zero writes the ctrl triples as LEB128 varints
+	   with delta-coded seeks ("ZSTDDIF2", read by this version onwards) */
+	int varint_ctrl;
+	/* BSDIFF_MODE_WRITE: non-zero stores the diff block as (zero run, literals)
+	   pairs before compressing it, which is faster on mostly-zero diffs
+	   ("ZSTDDIF2") */
+	int zero_runs;
+	/* BSDIFF_MODE_WRITE: above 0, compressed blocks larger than this many
+	   bytes are kept in unlinked temporary files in 'spill_dir' (NULL for
+	   $TMPDIR) until flush instead of memory, the patch is unchanged */
+	size_t spill_threshold;
+	const char *spill_dir;
+};
+
+/**
+ * @brief
+ *    Open a zstd bsdiff_patch_packer with compression parameters.
+ *    The patches are readable by bsdiff_open_zstd_patch_packer.
+ * @param mode
+ *    The working mode of the packer.
+ * @param stream
+ *    The stream which managed the reading/writing of the persistent patch data.
+ *    The stream is borrowed by the packer and is still owned by the caller.
+ *    Caller is responsible for closing the stream.
+ * @param options
+ *    The compression parameters (only used in BSDIFF_MODE_WRITE), may be NULL.
+ * @param packer
+ *    The packer to be opened.
+ * @return
+ *    BSDIFF_SUCCESS if no error, BSDIFF_INVALID_ARG if a parameter is out of range.
+ */
+BSDIFF_API
+int bsdiff_open_zstd_patch_packer_ex(
+	int mode,
+	struct bsdiff_stream *stream,
+	const struct bsdiff_zstd_options *options,
+	struct bsdiff_patch_packer *packer);
+
+/**
+ * @brief
+ *    Load a zstd dictionary (e.g. from bsdiff_train_zstd_dict).
+ *    The dictionary is read-only once created and may be used by several
+ *    packers and threads at once.
+ * @param data
+ *    The dictionary content, it is copied.
+ * @param size
+ *    The size of the dictionary content.
+ * @param level
+ *    The compression level when compressing with the dictionary, 0 for the default.
+ * @param dict
+ *    The created dictionary, release it with bsdiff_free_zstd_dict.
+ * @return
+ *    BSDIFF_SUCCESS if no error.
+ */
+BSDIFF_API
+int bsdiff_create_zstd_dict(
+	const void *data,
+	size_t size,
+	int level,
+	struct bsdiff_zstd_dict **dict);
+
+BSDIFF_API
+void bsdiff_free_zstd_dict(
+	struct bsdiff_zstd_dict *dict);
+
+/**
+ * @brief
+ *    The dictID recorded in the frames compressed with the dictionary.
+ */
+BSDIFF_API
+unsigned bsdiff_zstd_dict_id(
+	const struct bsdiff_zstd_dict *dict);
+
+/**
+ * @brief
+ *    Train a zstd dictionary from the ctrl, diff and extra blocks of a set of
+ *    existing patches.
+ * @param patches
+ *    The packers of the patches, in BSDIFF_MODE_READ; they are read to the end.
+ * @param npatches
+ *    The number of patches.
+ * @param dict_buffer
+ *    Receives the dictionary.
+ * @param capacity
+ *    The size of dict_buffer, which is the maximum size of the dictionary.
+ * @param dict_size
+ *    Receives the actual size of the dictionary.
+ * @return
+ *    BSDIFF_SUCCESS if no error, BSDIFF_ERROR if training failed (e.g. too few samples).
+ */
+BSDIFF_API
+int bsdiff_train_zstd_dict(
+	struct bsdiff_patch_packer *patches,
+	size_t npatches,
+	void *dict_buffer,
+	size_t capacity,
+	size_t *dict_size);
+
+/**
+ * @brief
+ *    Open a bsdiff_patch_packer using Matthew Endsley's "ENDSLEY/BSDIFF43" format.
+ *    Control, diff and extra data are interleaved in one bzip2 stream, so the
+ *    patch is written and read strictly sequentially: the stream may be a pipe
+ *    and no part of the patch is buffered in memory.
+ * @param mode
+ *    The working mode of the packer.
+ * @param stream
+ *    The stream which managed the reading/writing of the persistent patch data.
+ *    It doesn't need to support seek/tell.
+ *    The stream is borrowed by the packer and is still owned by the caller.
+ *    Caller is responsible for closing the stream.
+ * @param packer
+ *    The packer to be opened.
+ * @return
+ *    BSDIFF_SUCCESS if no error.
+ */
+BSDIFF_API
+int bsdiff_open_endsley_patch_packer(
+	int mode,
+	struct bsdiff_stream *stream,
+	struct bsdiff_patch_packer *packer);
+
+/**
+ * @brief
+ *    Open an uncompressed ("BSDIFFRW") bsdiff_patch_packer, for patches
+ *    which are compressed by the transport. Entries are stored in order, so
+ *    the stream doesn't need to support seek/tell. If the stream has a buffer
+ *    (e.g. bsdiff_open_mmap_stream) the reader provides view_entry_diff and
+ *    view_entry_extra, and bspatch applies the patch without copying it.
+ * @param mode
+ *    The working mode of the packer.
+ * @param stream
+ *    The stream which managed the reading/writing of the persistent patch data.
+ *    The stream is borrowed by the packer and is still owned by the caller.
+ *    Caller is responsible for closing the stream.
+ * @param packer
+ *    The packer to be opened.
+ * @return
+ *    BSDIFF_SUCCESS if no error.
+ */
+BSDIFF_API
+int bsdiff_open_raw_patch_packer(
+	int mode,
+	struct bsdiff_stream *stream,
+	struct bsdiff_patch_packer *packer);
+
+/**
+ * @brief
+ *    Open an adaptive ("BSDIFFAD") bsdiff_patch_packer. The writer trial
+ *    compresses the start of the ctrl, diff and extra blocks and stores each
+ *    block uncompressed, with zstd at a fast or a high level, or with bzip2,
+ *    whichever fits its data. Already compressed data is then stored instead
+ *    of being run through a slow compressor. The codecs are recorded in the
+ *    header.
+ * @param mode
+ *    The working mode of the packer.
+ * @param stream
+ *    The stream which managed the reading/writing of the persistent patch data.
+ *    The stream is borrowed by the packer and is still owned by the caller.
+ *    Caller is responsible for closing the stream.
+ * @param packer
+ *    The packer to be opened.
+ * @return
+ *    BSDIFF_SUCCESS if no error.
+ */
+BSDIFF_API
+int bsdiff_open_adaptive_patch_packer(
+	int mode,
+	struct bsdiff_stream *stream,
+	struct bsdiff_patch_packer *packer);
+
+/**
+ * @brief
+ *    Open a seekable bsdiff_patch_packer.
+ *    The patch stores an index of the control entries and splits the diff/extra
+ *    blocks into independent zstd frames, so that a reader can start decoding
+ *    at any position of the new file (see bspatch_range).
+ * @param mode
+ *    The working mode of the packer.
+ * @param stream
+ *    The stream which managed the reading/writing of the persistent patch data.
+ *    The stream is borrowed by the packer and is still owned by the caller.
+ *    Caller is responsible for closing the stream.
+ * @param packer
+ *    The packer to be opened.
+ * @return
+ *    BSDIFF_SUCCESS if no error.
+ */
+BSDIFF_API
+int bsdiff_open_seekable_patch_packer(
+	int mode,
+	struct bsdiff_stream *stream,
+	struct bsdiff_patch_packer *packer);
+
 /**
  * @brief
  *    Close a bsdiff_patch_packer.
@@ -249,6 +682,64 @@ void bsdiff_close_patch_packer(
 	struct bsdiff_patch_packer *packer);
 
 
+/**
+ * @brief An allocator serving the memory of bsdiff/bspatch calls.
+ * The blocks must be aligned for any type.
+ */
+struct bsdiff_allocator
+{
+	void *state;
+	/* returns NULL if out of memory */
+	void *(*alloc)(void *state, size_t size);
+	/* optional: grows or shrinks a block, NULL if out of memory (the block
+	   is left as is). Without it, blocks are moved with alloc and release. */
+	void *(*resize)(void *state, void *ptr, size_t old_size, size_t size);
+	/* optional: gives a block back, NULL for allocators which only free all
+	   at once */
+	void (*release)(void *state, void *ptr, size_t size);
+	void (*close)(void *state);
+};
+
+/**
+ * @brief
+ *    Create an arena allocator. Blocks are carved out of chunks of
+ *    block_size bytes and only freed all at once, by reset or close; larger
+ *    blocks get a chunk of their own, which is freed on release.
+ *    The allocator is thread-safe.
+ * @param block_size
+ *    The size of a chunk, 0 for a default of 1 MiB.
+ * @param allocator
+ *    The allocator to be initialized.
+ * @return
+ *    BSDIFF_SUCCESS if no error.
+ */
+BSDIFF_API
+int bsdiff_create_arena_allocator(
+	size_t block_size,
+	struct bsdiff_allocator *allocator);
+
+/**
+ * @brief
+ *    Free everything allocated from an arena allocator at once. One chunk is
+ *    kept for the next call.
+ * @param allocator
+ *    An allocator from bsdiff_create_arena_allocator.
+ */
+BSDIFF_API
+void bsdiff_reset_arena_allocator(
+	struct bsdiff_allocator *allocator);
+
+/**
+ * @brief
+ *    Close a bsdiff_allocator.
+ * @param allocator
+ *    The allocator to be closed.
+ */
+BSDIFF_API
+void bsdiff_close_allocator(
+	struct bsdiff_allocator *allocator);
+
+
 /**
  * @brief Memory allocation statistics.
  */
@@ -278,6 +769,35 @@ BSDIFF_API
 void bsdiff_reset_mem_stats(void);
 
 
+/**
+ * @brief A point from which bspatch_resume can continue.
+ */
+struct bsdiff_checkpoint
+{
+	int64_t entry;   /**< index of the control entry being applied */
+	int64_t newpos;  /**< bytes of the new file written and flushed */
+	int64_t oldpos;  /**< matching position in the old file */
+};
+
+/* bsdiff strategies, the ones further down need less memory but may find
+   fewer matches */
+#define BSDIFF_STRATEGY_COMPACT_SA  0  /* suffix array with 32-bit entries, old file below 2 GiB */
+#define BSDIFF_STRATEGY_FULL_SA     1  /* suffix array with 64-bit entries */
+#define BSDIFF_STRATEGY_SAMPLED_SA  2  /* one suffix out of every sample_step */
+#define BSDIFF_STRATEGY_WINDOWED    3  /* suffix arrays of window_size slices of the old
+                                          file, one per part of the new file */
+
+/**
+ * @brief The way bsdiff indexes the old file.
+ */
+struct bsdiff_strategy
+{
+	int type;             /**< one of BSDIFF_STRATEGY_* */
+	int64_t sample_step;  /**< BSDIFF_STRATEGY_SAMPLED_SA only */
+	int64_t window_size;  /**< BSDIFF_STRATEGY_WINDOWED only */
+	int64_t memory;       /**< estimated bytes of the buffers of bsdiff */
+};
+
 /**
  * @brief Some user-defined callbacks.
  */
@@ -285,8 +805,72 @@ struct bsdiff_ctx
 {
 	void *opaque;
 	void (*log_error)(void *opaque, const char *errmsg);
+	/* optional, bspatch only: called after roughly every checkpoint_interval
+	   bytes of the new file, once they have been flushed. A return value other
+	   than BSDIFF_SUCCESS aborts the patching. */
+	int64_t checkpoint_interval;
+	int (*checkpoint)(void *opaque, const struct bsdiff_checkpoint *cp);
+	/* optional, bspatch only: if the old file has no get_buffer and this is
+	   non-zero, it is read on demand through an LRU page cache of about this
+	   many bytes instead of being loaded whole. */
+	size_t old_cache_size;
+	/* optional: serves every allocation of the call, worker threads included.
+	   Streams and packers may keep blocks from it after the call returns, so
+	   it must outlive them. NULL means malloc. */
+	const struct bsdiff_allocator *allocator;
+	/* optional: the allocations of the call are also counted here, with
+	   atomic updates, so concurrent calls may each have their own stats (or
+	   share them) and they may be read with bsdiff_get_ctx_mem_stats while
+	   a call runs. Blocks freed after the call are still taken off, so the
+	   stats must outlive streams and packers as well. The counters are
+	   not reset by the call. */
+	struct bsdiff_mem_stats *mem_stats;
+	/* optional, bsdiff and bsdiff_compose: a budget in bytes for the buffers of bsdiff,
+	   i.e. the copies of old and new files without get_buffer and the index
+	   of the old file (the packer's buffers are up to its options). The
+	   first strategy which fits is used, BSDIFF_OUT_OF_MEMORY if none does.
+	   bsdiff_compose checks the A->B data it keeps against it as well.
+	   0 means no limit. */
+	int64_t max_memory;
+	/* optional, bsdiff only: filled with the strategy used */
+	struct bsdiff_strategy *strategy;
 };
 
+/**
+ * @brief
+ *    Get the memory allocation statistics of a context.
+ * @param ctx
+ *    The context, with mem_stats set.
+ * @param stats
+ *    The stats to be filled.
+ */
+BSDIFF_API
+void bsdiff_get_ctx_mem_stats(
+	const struct bsdiff_ctx *ctx,
+	struct bsdiff_mem_stats *stats);
+
+/**
+ * @brief
+ *    Get the strategy bsdiff picks for an old file, without running it.
+ * @param ctx
+ *    The context, its max_memory is the budget.
+ * @param oldsize
+ *    The size of the old file.
+ * @param copied
+ *    The bytes bsdiff copies into memory: the size of the old and of the new
+ *    file plus one each, for the streams without get_buffer.
+ * @param strategy
+ *    The strategy to be filled.
+ * @return
+ *    BSDIFF_SUCCESS, or BSDIFF_OUT_OF_MEMORY if no strategy fits.
+ */
+BSDIFF_API
+int bsdiff_plan_strategy(
+	const struct bsdiff_ctx *ctx,
+	int64_t oldsize,
+	int64_t copied,
+	struct bsdiff_strategy *strategy);
+
 /**
  * @brief
  *    Generate a patch between two binary files.
@@ -329,6 +913,83 @@ int bspatch(
 	struct bsdiff_stream *newfile,
 	struct bsdiff_patch_packer *packer);
 
+/**
+ * @brief
+ *    Re-create a byte range of the new file only.
+ *    Only the entries covering [offset, offset + length) are decoded.
+ * @param ctx
+ *    The context.
+ * @param oldfile
+ *    The stream of the old file.
+ * @param packer
+ *    The packer, it must support seek_new_pos (e.g. a seekable packer).
+ * @param offset
+ *    The offset of the range in the new file.
+ * @param length
+ *    The length of the range.
+ * @param out
+ *    The stream receiving the bytes of the range.
+ * @return
+ *    BSDIFF_SUCCESS if no error.
+ */
+BSDIFF_API
+int bspatch_range(
+	struct bsdiff_ctx *ctx,
+	struct bsdiff_stream *oldfile,
+	struct bsdiff_patch_packer *packer,
+	int64_t offset,
+	int64_t length,
+	struct bsdiff_stream *out);
+
+/**
+ * @brief
+ *    Continue an interrupted bspatch from a checkpoint.
+ * @param ctx
+ *    The context.
+ * @param oldfile
+ *    The stream of the old file.
+ * @param newfile
+ *    The stream of the partially written new file (see BSDIFF_MODE_UPDATE).
+ * @param packer
+ *    The packer, it must support seek_new_pos (e.g. a seekable packer).
+ * @param checkpoint
+ *    The last checkpoint reported through bsdiff_ctx.checkpoint.
+ * @return
+ *    BSDIFF_SUCCESS if no error.
+ */
+BSDIFF_API
+int bspatch_resume(
+	struct bsdiff_ctx *ctx,
+	struct bsdiff_stream *oldfile,
+	struct bsdiff_stream *newfile,
+	struct bsdiff_patch_packer *packer,
+	const struct bsdiff_checkpoint *checkpoint);
+
+/**
+ * @brief
+ *    Combine an A->B patch and a B->C patch into a direct A->C patch.
+ *    Neither A nor B is read: the A->B patch is loaded into memory (about the
+ *    size of B, at most ctx->max_memory if set) and the B->C patch is
+ *    streamed through. The A->C entries are written as they are built, with
+ *    at most about 1 MiB of diff and 1 MiB of extra bytes pending.
+ * @param ctx
+ *    The context.
+ * @param ab
+ *    The packer of the A->B patch (in BSDIFF_MODE_READ).
+ * @param bc
+ *    The packer of the B->C patch (in BSDIFF_MODE_READ).
+ * @param ac
+ *    The packer of the resulting A->C patch (in BSDIFF_MODE_WRITE).
+ * @return
+ *    BSDIFF_SUCCESS if no error.
+ */
+BSDIFF_API
+int bsdiff_compose(
+	struct bsdiff_ctx *ctx,
+	struct bsdiff_patch_packer *ab,
+	struct bsdiff_patch_packer *bc,
+	struct bsdiff_patch_packer *ac);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,231 @@
+#include <stdlib.h>
+#include <string.h>
+#include "bsdiff.h"
+#include "bsdiff_thread.h"
+
+#define DEFAULT_BLOCK_SIZE (1024 * 1024)
+#define ARENA_ALIGN 16
+#define ALIGN_UP(x) (((x) + (ARENA_ALIGN - 1)) & ~(size_t)(ARENA_ALIGN - 1))
+
+/*
+ * A chunk of memory, followed by its data. Small blocks are carved out of
+ * the current chunk; a block larger than a quarter chunk gets a chunk of its
+ * own, so its size alone tells which kind a block is.
+ */
+struct arena_chunk
+{
+	struct arena_chunk *prev, *next;
+	size_t size;
+};
+
+#define CHUNK_HEADER ALIGN_UP(sizeof(struct arena_chunk))
+#define CHUNK_DATA(c) ((uint8_t *)(c) + CHUNK_HEADER)
+
+struct arena
+{
+	bsdiff_mutex_t lock;
+	size_t block_size;
+	struct arena_chunk *current;  /* small blocks are carved from here */
+	size_t used;                  /* bytes of 'current' handed out */
+	struct arena_chunk *full;     /* earlier chunks of small blocks */
+	struct arena_chunk *large;    /* one chunk per large block */
+	void *last;                   /* the latest small block, can grow in place */
+};
+
+static int is_large(const struct arena *arena, size_t size)
+{
+	return size > arena->block_size / 4;
+}
+
+static struct arena_chunk *new_chunk(size_t size)
+{
+	struct arena_chunk *chunk;
+
+	if (size > SIZE_MAX - CHUNK_HEADER)
+		return NULL;
+	if ((chunk = malloc(CHUNK_HEADER + size)) == NULL)
+		return NULL;
+	chunk->prev = chunk->next = NULL;
+	chunk->size = size;
+	return chunk;
+}
+
+static void free_chunks(struct arena_chunk *chunk)
+{
+	struct arena_chunk *next;
+
+	for (; chunk != NULL; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+}
+
+static void link_large(struct arena *arena, struct arena_chunk *chunk)
+{
+	chunk->prev = NULL;
+	chunk->next = arena->large;
+	if (arena->large != NULL)
+		arena->large->prev = chunk;
+	arena->large = chunk;
+}
+
+static void unlink_large(struct arena *arena, struct arena_chunk *chunk)
+{
+	if (chunk->prev != NULL)
+		chunk->prev->next = chunk->next;
+	else
+		arena->large = chunk->next;
+	if (chunk->next != NULL)
+		chunk->next->prev = chunk->prev;
+}
+
+static void *alloc_locked(struct arena *arena, size_t size)
+{
+	struct arena_chunk *chunk;
+
+	if (is_large(arena, size)) {
+		if ((chunk = new_chunk(size)) == NULL)
+			return NULL;
+		link_large(arena, chunk);
+		return CHUNK_DATA(chunk);
+	}
+
+	size = ALIGN_UP(size);
+	if (arena->current == NULL || arena->current->size - arena->used < size) {
+		if ((chunk = new_chunk(arena->block_size)) == NULL)
+			return NULL;
+		if (arena->current != NULL) {
+			arena->current->next = arena->full;
+			arena->full = arena->current;
+		}
+		arena->current = chunk;
+		arena->used = 0;
+	}
+	arena->last = CHUNK_DATA(arena->current) + arena->used;
+	arena->used += size;
+	return arena->last;
+}
+
+static void release_locked(struct arena *arena, void *ptr, size_t size)
+{
+	if (is_large(arena, size)) {
+		struct arena_chunk *chunk = (struct arena_chunk *)((uint8_t *)ptr - CHUNK_HEADER);
+		unlink_large(arena, chunk);
+		free(chunk);
+	} else if (ptr == arena->last) {
+		/* Stack-like use gets its memory back */
+		arena->used = (size_t)((uint8_t *)ptr - CHUNK_DATA(arena->current));
+		arena->last = NULL;
+	}
+}
+
+static void *arena_alloc(void *state, size_t size)
+{
+	struct arena *arena = (struct arena *)state;
+	void *ptr;
+
+	bsdiff_mutex_lock(&arena->lock);
+	ptr = alloc_locked(arena, size);
+	bsdiff_mutex_unlock(&arena->lock);
+	return ptr;
+}
+
+static void *arena_resize(void *state, void *ptr, size_t old_size, size_t size)
+{
+	struct arena *arena = (struct arena *)state;
+	struct arena_chunk *chunk;
+	void *newptr = NULL;
+	size_t start;
+
+	bsdiff_mutex_lock(&arena->lock);
+	if (is_large(arena, old_size) && is_large(arena, size)) {
+		chunk = (struct arena_chunk *)((uint8_t *)ptr - CHUNK_HEADER);
+		unlink_large(arena, chunk);
+		if ((newptr = realloc(chunk, CHUNK_HEADER + size)) != NULL) {
+			chunk = (struct arena_chunk *)newptr;
+			chunk->size = size;
+			newptr = CHUNK_DATA(chunk);
+		}
+		link_large(arena, chunk);
+	} else if (ptr == arena->last && !is_large(arena, size) &&
+		(start = (size_t)((uint8_t *)ptr - CHUNK_DATA(arena->current))) + ALIGN_UP(size) <= arena->current->size) {
+		/* The latest block grows or shrinks in place */
+		arena->used = start + ALIGN_UP(size);
+		newptr = ptr;
+	} else if ((newptr = alloc_locked(arena, size)) != NULL) {
+		memcpy(newptr, ptr, (old_size < size) ? old_size : size);
+		release_locked(arena, ptr, old_size);
+	}
+	bsdiff_mutex_unlock(&arena->lock);
+	return newptr;
+}
+
+static void arena_release(void *state, void *ptr, size_t size)
+{
+	struct arena *arena = (struct arena *)state;
+
+	bsdiff_mutex_lock(&arena->lock);
+	release_locked(arena, ptr, size);
+	bsdiff_mutex_unlock(&arena->lock);
+}
+
+static void arena_reset(struct arena *arena)
+{
+	bsdiff_mutex_lock(&arena->lock);
+	free_chunks(arena->full);
+	free_chunks(arena->large);
+	arena->full = arena->large = NULL;
+	arena->used = 0;
+	arena->last = NULL;
+	bsdiff_mutex_unlock(&arena->lock);
+}
+
+static void arena_close(void *state)
+{
+	struct arena *arena = (struct arena *)state;
+
+	arena_reset(arena);
+	free(arena->current);
+	bsdiff_mutex_destroy(&arena->lock);
+	free(arena);
+}
+
+int bsdiff_create_arena_allocator(
+	size_t block_size,
+	struct bsdiff_allocator *allocator)
+{
+	struct arena *arena;
+
+	if (allocator == NULL)
+		return BSDIFF_INVALID_ARG;
+	if (block_size == 0)
+		block_size = DEFAULT_BLOCK_SIZE;
+	if (block_size < 4 * ARENA_ALIGN)
+		block_size = 4 * ARENA_ALIGN;
+
+	/* The arena itself lives outside of any arena */
+	if ((arena = malloc(sizeof(*arena))) == NULL)
+		return BSDIFF_OUT_OF_MEMORY;
+	memset(arena, 0, sizeof(*arena));
+	arena->block_size = ALIGN_UP(block_size);
+	if (bsdiff_mutex_init(&arena->lock) != BSDIFF_SUCCESS) {
+		free(arena);
+		return BSDIFF_ERROR;
+	}
+
+	memset(allocator, 0, sizeof(*allocator));
+	allocator->state = arena;
+	allocator->alloc = arena_alloc;
+	allocator->resize = arena_resize;
+	allocator->release = arena_release;
+	allocator->close = arena_close;
+
+	return BSDIFF_SUCCESS;
+}
+
+void bsdiff_reset_arena_allocator(
+	struct bsdiff_allocator *allocator)
+{
+	if (allocator != NULL && allocator->alloc == arena_alloc)
+		arena_reset((struct arena *)allocator->state);
+}
@@ -0,0 +1,387 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <stdint.h>
+
+#include "bsdiff.h"
+#include "bsdiff_private.h"
+#include "bsdiff_mem.h"
+
+/*
+ * Patch composition.
+ *
+ * Applying A->B gives every byte of B as either A[apos] + d1 (diff) or e1
+ * (extra); applying B->C gives every byte of C as either B[bpos] + d2 or e2.
+ * Substituting the first into the second, a byte of C is A[apos] + d1 + d2,
+ * e1 + d2, or a literal. The A->B patch is loaded into memory as a list of
+ * segments over B, the B->C patch is streamed and each of its bytes is
+ * rewritten in terms of A. Neither A nor B is needed.
+ *
+ * The seeks of B->C may go anywhere in B, so the diff and extra bytes of A->B
+ * are kept whole: about |B| bytes plus the segments, bounded by
+ * ctx->max_memory when it is set. The entry being built for A->C is written
+ * out once its diff or extra bytes reach COMPOSE_MAX_PENDING.
+ */
+
+#define COMPOSE_MAX_PENDING (1024 * 1024)
+
+struct compose_segment
+{
+	int64_t newpos;   /* first byte in B */
+	int64_t length;
+	int64_t oldpos;   /* first byte in A, or -1 for extra data */
+	int is_diff;
+};
+
+/* The A->B patch: per-byte diff/extra data of B, plus its segments */
+struct compose_source
+{
+	int64_t size;
+	uint8_t *data;
+	struct compose_segment *segs;
+	size_t nsegs;
+	size_t capacity;
+	int64_t max_memory;  /* for data and segs, 0 if unbounded */
+};
+
+/* The entry of the output patch which is being built */
+struct compose_pending
+{
+	int64_t oldpos;   /* old position at the start of the entry */
+	uint8_t *diff;
+	size_t diff_len, diff_cap;
+	uint8_t *extra;
+	size_t extra_len, extra_cap;
+	struct bsdiff_patch_packer *packer;
+};
+
+static int read_fully(
+	int (*read)(void *state, void *buffer, size_t size, size_t *readed),
+	void *state,
+	uint8_t *buffer,
+	int64_t size)
+{
+	int ret;
+	size_t cb, len;
+
+	while (size > 0) {
+		len = (size > 1024 * 1024) ? 1024 * 1024 : (size_t)size;
+		ret = read(state, buffer, len, &cb);
+		if ((ret != BSDIFF_SUCCESS && ret != BSDIFF_END_OF_FILE) || (cb != len))
+			return BSDIFF_CORRUPT_PATCH;
+		buffer += len;
+		size -= (int64_t)len;
+	}
+	return BSDIFF_SUCCESS;
+}
+
+static int add_segment(
+	struct compose_source *src,
+	int64_t newpos,
+	int64_t length,
+	int64_t oldpos,
+	int is_diff)
+{
+	struct compose_segment *segs;
+	size_t newcap;
+
+	if (length == 0)
+		return BSDIFF_SUCCESS;
+	if (src->nsegs == src->capacity) {
+		newcap = src->capacity ? src->capacity * 2 : 256;
+		if (src->max_memory > 0 &&
+			(uint64_t)src->size + newcap * sizeof(*segs) > (uint64_t)src->max_memory)
+			return BSDIFF_OUT_OF_MEMORY;
+		segs = bsdiff_realloc(src->segs, newcap * sizeof(*segs));
+		if (segs == NULL)
+			return BSDIFF_OUT_OF_MEMORY;
+		src->segs = segs;
+		src->capacity = newcap;
+	}
+	segs = &(src->segs[src->nsegs++]);
+	segs->newpos = newpos;
+	segs->length = length;
+	segs->oldpos = oldpos;
+	segs->is_diff = is_diff;
+	return BSDIFF_SUCCESS;
+}
+
+static int load_source(
+	struct bsdiff_ctx *ctx,
+	struct bsdiff_patch_packer *packer,
+	struct compose_source *src)
+{
+	int ret;
+	int64_t ctrl[3];
+	int64_t newpos = 0, oldpos = 0;
+
+	if (packer->read_new_size(packer->state, &src->size) != BSDIFF_SUCCESS)
+		HANDLE_ERROR(BSDIFF_FILE_ERROR, "read new size from the first patch");
+	if (src->size < 0 || (uint64_t)src->size >= (uint64_t)SIZE_MAX)
+		HANDLE_ERROR(BSDIFF_SIZE_TOO_LARGE, "intermediate file is too large");
+	if (src->max_memory > 0 && src->size >= src->max_memory)
+		HANDLE_ERROR(BSDIFF_OUT_OF_MEMORY, "intermediate file does not fit in max_memory");
+	if ((src->data = bsdiff_malloc((size_t)src->size + 1)) == NULL)
+		HANDLE_ERROR(BSDIFF_OUT_OF_MEMORY, "malloc for intermediate data");
+
+	while (newpos < src->size) {
+		ret = packer->read_entry_header(packer->state, &ctrl[0], &ctrl[1], &ctrl[2]);
+		if (ret != BSDIFF_SUCCESS && ret != BSDIFF_END_OF_FILE)
+			HANDLE_ERROR(BSDIFF_FILE_ERROR, "read control data of the first patch");
+		if ((ctrl[0] < 0) || (ctrl[1] < 0) ||
+			(ctrl[0] > src->size - newpos) || (ctrl[1] > src->size - newpos - ctrl[0]))
+			HANDLE_ERROR(BSDIFF_CORRUPT_PATCH, "invalid control data in the first patch");
+
+		if ((ret = read_fully(packer->read_entry_diff, packer->state, src->data + newpos, ctrl[0])) != BSDIFF_SUCCESS)
+			HANDLE_ERROR(ret, "read diff string of the first patch");
+		if ((ret = add_segment(src, newpos, ctrl[0], oldpos, 1)) != BSDIFF_SUCCESS)
+			HANDLE_ERROR(ret, "add segment");
+		newpos += ctrl[0];
+		oldpos += ctrl[0];
+
+		if ((ret = read_fully(packer->read_entry_extra, packer->state, src->data + newpos, ctrl[1])) != BSDIFF_SUCCESS)
+			HANDLE_ERROR(ret, "read extra string of the first patch");
+		if ((ret = add_segment(src, newpos, ctrl[1], -1, 0)) != BSDIFF_SUCCESS)
+			HANDLE_ERROR(ret, "add segment");
+		newpos += ctrl[1];
+		oldpos += ctrl[2];
+	}
+
+	ret = BSDIFF_SUCCESS;
+
+cleanup:
+	return ret;
+}
+
+/* Index of the segment which contains 'newpos' (which must be within B) */
+static size_t find_segment(const struct compose_source *src, int64_t newpos)
+{
+	size_t lo = 0, hi = src->nsegs, mid;
+
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (src->segs[mid].newpos <= newpos)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static int append_bytes(uint8_t **buf, size_t *len, size_t *cap, size_t n)
+{
+	uint8_t *newbuf;
+	size_t newcap;
+
+	if (*len + n > *cap) {
+		newcap = *cap ? *cap : 64 * 1024;
+		while (newcap < *len + n)
+			newcap = newcap / 2 * 3;
+		if ((newbuf = bsdiff_realloc(*buf, newcap)) == NULL)
+			return BSDIFF_OUT_OF_MEMORY;
+		*buf = newbuf;
+		*cap = newcap;
+	}
+	*len += n;
+	return BSDIFF_SUCCESS;
+}
+
+/* Write the pending entry, then continue at 'oldpos + diff_len + seek' */
+static int flush_pending(struct compose_pending *out, int64_t seek)
+{
+	struct bsdiff_patch_packer *packer = out->packer;
+
+	if (packer->write_entry_header(packer->state,
+		(int64_t)out->diff_len, (int64_t)out->extra_len, seek) != BSDIFF_SUCCESS)
+		return BSDIFF_FILE_ERROR;
+	if (out->diff_len > 0 &&
+		packer->write_entry_diff(packer->state, out->diff, out->diff_len) != BSDIFF_SUCCESS)
+		return BSDIFF_FILE_ERROR;
+	if (out->extra_len > 0 &&
+		packer->write_entry_extra(packer->state, out->extra, out->extra_len) != BSDIFF_SUCCESS)
+		return BSDIFF_FILE_ERROR;
+
+	out->oldpos += (int64_t)out->diff_len + seek;
+	out->diff_len = 0;
+	out->extra_len = 0;
+	return BSDIFF_SUCCESS;
+}
+
+/* Output 'n' diff bytes against old position 'oldpos', returns where to store them */
+static int emit_diff(struct compose_pending *out, int64_t oldpos, size_t n, uint8_t **dst)
+{
+	int ret;
+	int64_t next = out->oldpos + (int64_t)out->diff_len;
+
+	/* Extend the current diff run if it is contiguous, else start a new entry */
+	if (out->extra_len > 0 || next != oldpos) {
+		if ((ret = flush_pending(out, oldpos - next)) != BSDIFF_SUCCESS)
+			return ret;
+	} else if (out->diff_len > 0 && out->diff_len + n > COMPOSE_MAX_PENDING) {
+		/* A long run is split into entries which continue one another */
+		if ((ret = flush_pending(out, 0)) != BSDIFF_SUCCESS)
+			return ret;
+	}
+	if ((ret = append_bytes(&out->diff, &out->diff_len, &out->diff_cap, n)) != BSDIFF_SUCCESS)
+		return ret;
+	*dst = out->diff + out->diff_len - n;
+	return BSDIFF_SUCCESS;
+}
+
+static int emit_extra(struct compose_pending *out, size_t n, uint8_t **dst)
+{
+	int ret;
+
+	if (out->extra_len > 0 && out->extra_len + n > COMPOSE_MAX_PENDING) {
+		if ((ret = flush_pending(out, 0)) != BSDIFF_SUCCESS)
+			return ret;
+	}
+	if ((ret = append_bytes(&out->extra, &out->extra_len, &out->extra_cap, n)) != BSDIFF_SUCCESS)
+		return ret;
+	*dst = out->extra + out->extra_len - n;
+	return BSDIFF_SUCCESS;
+}
+
+/* Rewrite B[bpos, bpos + n) + d2 in terms of A */
+static int compose_diff(
+	const struct compose_source *src,
+	struct compose_pending *out,
+	int64_t bpos,
+	const uint8_t *d2,
+	size_t n)
+{
+	int ret;
+	size_t len, j, k;
+	uint8_t *dst;
+	const struct compose_segment *seg;
+
+	while (n > 0) {
+		if (bpos < 0 || bpos >= src->size) {
+			/* Outside of B, bspatch adds nothing */
+			len = n;
+			if (bpos < 0 && (int64_t)len > -bpos)
+				len = (size_t)(-bpos);
+			if ((ret = emit_extra(out, len, &dst)) != BSDIFF_SUCCESS)
+				return ret;
+			memcpy(dst, d2, len);
+		} else {
+			k = find_segment(src, bpos);
+			seg = &(src->segs[k]);
+			len = n;
+			if ((int64_t)len > seg->newpos + seg->length - bpos)
+				len = (size_t)(seg->newpos + seg->length - bpos);
+			if (seg->is_diff)
+				ret = emit_diff(out, seg->oldpos + (bpos - seg->newpos), len, &dst);
+			else
+				ret = emit_extra(out, len, &dst);
+			if (ret != BSDIFF_SUCCESS)
+				return ret;
+			for (j = 0; j < len; j++)
+				dst[j] = src->data[bpos + (int64_t)j] + d2[j];
+		}
+		bpos += (int64_t)len;
+		d2 += len;
+		n -= len;
+	}
+	return BSDIFF_SUCCESS;
+}
+
+int bsdiff_compose(
+	struct bsdiff_ctx *ctx,
+	struct bsdiff_patch_packer *ab,
+	struct bsdiff_patch_packer *bc,
+	struct bsdiff_patch_packer *ac)
+{
+	int ret;
+	size_t cb;
+	uint8_t *dst;
+	int64_t ctrl[3];
+	int64_t newsize, newpos = 0, bpos = 0;
+	int64_t i;
+	struct compose_source src;
+	struct compose_pending out;
+	size_t buffer_size = 128 * 1024;
+	uint8_t *buffer = NULL;
+	struct bsdiff_mem_scope scope;
+
+	if (ctx == NULL || ab == NULL || bc == NULL || ac == NULL)
+		return BSDIFF_INVALID_ARG;
+
+	assert(ab->get_mode(ab->state) == BSDIFF_MODE_READ);
+	assert(bc->get_mode(bc->state) == BSDIFF_MODE_READ);
+	assert(ac->get_mode(ac->state) == BSDIFF_MODE_WRITE);
+
+	memset(&src, 0, sizeof(src));
+	memset(&out, 0, sizeof(out));
+	src.max_memory = ctx->max_memory;
+	out.packer = ac;
+	bsdiff_mem_enter(ctx, &scope);
+
+	if ((ret = load_source(ctx, ab, &src)) != BSDIFF_SUCCESS)
+		goto cleanup;
+
+	if ((buffer = bsdiff_malloc(buffer_size)) == NULL)
+		HANDLE_ERROR(BSDIFF_OUT_OF_MEMORY, "malloc for scratch buffer");
+
+	if (bc->read_new_size(bc->state, &newsize) != BSDIFF_SUCCESS)
+		HANDLE_ERROR(BSDIFF_FILE_ERROR, "read new size from the second patch");
+	if (ac->write_new_size(ac->state, newsize) != BSDIFF_SUCCESS)
+		HANDLE_ERROR(BSDIFF_FILE_ERROR, "write new size");
+
+	while (newpos < newsize) {
+		ret = bc->read_entry_header(bc->state, &ctrl[0], &ctrl[1], &ctrl[2]);
+		if (ret != BSDIFF_SUCCESS && ret != BSDIFF_END_OF_FILE)
+			HANDLE_ERROR(BSDIFF_FILE_ERROR, "read control data of the second patch");
+		if ((ctrl[0] < 0) || (ctrl[1] < 0) ||
+			(ctrl[0] > newsize - newpos) || (ctrl[1] > newsize - newpos - ctrl[0]))
+			HANDLE_ERROR(BSDIFF_CORRUPT_PATCH, "invalid control data in the second patch");
+
+		for (i = 0; i < ctrl[0]; ) {
+			size_t len = (size_t)(ctrl[0] - i);
+			if (len > buffer_size)
+				len = buffer_size;
+			ret = bc->read_entry_diff(bc->state, buffer, len, &cb);
+			if ((ret != BSDIFF_SUCCESS && ret != BSDIFF_END_OF_FILE) || (cb != len))
+				HANDLE_ERROR(BSDIFF_FILE_ERROR, "read diff string of the second patch");
+			if ((ret = compose_diff(&src, &out, bpos, buffer, len)) != BSDIFF_SUCCESS)
+				HANDLE_ERROR(ret, "compose diff string");
+			bpos += (int64_t)len;
+			i += (int64_t)len;
+		}
+
+		for (i = 0; i < ctrl[1]; ) {
+			size_t len = (size_t)(ctrl[1] - i);
+			if (len > buffer_size)
+				len = buffer_size;
+			if ((ret = emit_extra(&out, len, &dst)) != BSDIFF_SUCCESS)
+				HANDLE_ERROR(ret, "compose extra string");
+			ret = bc->read_entry_extra(bc->state, dst, len, &cb);
+			if ((ret != BSDIFF_SUCCESS && ret != BSDIFF_END_OF_FILE) || (cb != len))
+				HANDLE_ERROR(BSDIFF_FILE_ERROR, "read extra string of the second patch");
+			i += (int64_t)len;
+		}
+
+		newpos += ctrl[0] + ctrl[1];
+		bpos += ctrl[2];
+	}
+
+	if (out.diff_len > 0 || out.extra_len > 0) {
+		if ((ret = flush_pending(&out, 0)) != BSDIFF_SUCCESS)
+			HANDLE_ERROR(ret, "write entry");
+	}
+	if (ac->flush(ac->state) != BSDIFF_SUCCESS)
+		HANDLE_ERROR(BSDIFF_FILE_ERROR, "flush patch_packer");
+
+	ret = BSDIFF_SUCCESS;
+
+cleanup:
+	if (buffer != NULL) { bsdiff_free(buffer); }
+	if (out.diff != NULL) { bsdiff_free(out.diff); }
+	if (out.extra != NULL) { bsdiff_free(out.extra); }
+	if (src.segs != NULL) { bsdiff_free(src.segs); }
+	if (src.data != NULL) { bsdiff_free(src.data); }
+	bsdiff_mem_leave(&scope);
+
+	return ret;
+}
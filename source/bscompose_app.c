@@ -0,0 +1,144 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright 2021 zhuyie
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions 
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ''AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "bsdiff.h"
+
+static void log_error(void *opaque, const char *errmsg)
+{
+	(void)opaque;
+	fprintf(stderr, "%s", errmsg);
+}
+
+/* "-" selects stdin/stdout, e.g. for piping an endsley patch */
+static const char *stdio_name(const char *name, int mode)
+{
+	if (strcmp(name, "-") != 0)
+		return name;
+	return (mode == BSDIFF_MODE_READ) ? "/dev/stdin" : "/dev/stdout";
+}
+
+static int open_packer(const char *name, int mode, struct bsdiff_stream *stream, struct bsdiff_patch_packer *packer)
+{
+	if (strcmp(name, "zstd") == 0)
+		return bsdiff_open_zstd_patch_packer(mode, stream, packer);
+	else if (strcmp(name, "seekable") == 0)
+		return bsdiff_open_seekable_patch_packer(mode, stream, packer);
+	else if (strcmp(name, "endsley") == 0)
+		return bsdiff_open_endsley_patch_packer(mode, stream, packer);
+	else if (strcmp(name, "raw") == 0)
+		return bsdiff_open_raw_patch_packer(mode, stream, packer);
+	else if (strcmp(name, "adaptive") == 0)
+		return bsdiff_open_adaptive_patch_packer(mode, stream, packer);
+	else
+		return bsdiff_open_bz2_patch_packer(mode, stream, packer);
+}
+
+int main(int argc, char * argv[])
+{
+	int ret = 1;
+	const char *packer_name = "bz2";
+	const char *out_packer_name = NULL;
+	const char *files[3] = { NULL, NULL, NULL };
+	int nfiles = 0;
+	int print_mem_stats = 0;
+	int i;
+	struct bsdiff_stream abfile = { 0 }, bcfile = { 0 }, acfile = { 0 };
+	struct bsdiff_ctx ctx = { 0 };
+	struct bsdiff_patch_packer ab = { 0 }, bc = { 0 }, ac = { 0 };
+
+	for (i = 1; i < argc; i++) {
+		if (strncmp(argv[i], "--", 2) == 0) {
+			if (strncmp(argv[i], "--packer=", 9) == 0) {
+				packer_name = argv[i] + 9;
+			} else if (strncmp(argv[i], "--out-packer=", 13) == 0) {
+				out_packer_name = argv[i] + 13;
+			} else if (strcmp(argv[i], "--mem-stats") == 0) {
+				print_mem_stats = 1;
+			} else {
+				fprintf(stderr, "unknown option: %s\n", argv[i]);
+				return 1;
+			}
+		} else {
+			if (nfiles < 3)
+				files[nfiles++] = argv[i];
+		}
+	}
+
+	if (nfiles != 3) {
+		fprintf(stderr, "usage: %s [--packer=bz2|zstd|seekable|endsley|raw|adaptive] [--out-packer=bz2|zstd|seekable|endsley|raw|adaptive] [--mem-stats] patch_ab patch_bc patch_ac\n", argv[0]);
+		return 1;
+	}
+	if (out_packer_name == NULL)
+		out_packer_name = packer_name;
+
+	if ((ret = bsdiff_open_file_stream(BSDIFF_MODE_READ, files[0], &abfile)) != BSDIFF_SUCCESS) {
+		fprintf(stderr, "can't open patch_ab: %s\n", files[0]);
+		goto cleanup;
+	}
+	if ((ret = bsdiff_open_file_stream(BSDIFF_MODE_READ, stdio_name(files[1], BSDIFF_MODE_READ), &bcfile)) != BSDIFF_SUCCESS) {
+		fprintf(stderr, "can't open patch_bc: %s\n", files[1]);
+		goto cleanup;
+	}
+	if ((ret = bsdiff_open_file_stream(BSDIFF_MODE_WRITE, stdio_name(files[2], BSDIFF_MODE_WRITE), &acfile)) != BSDIFF_SUCCESS) {
+		fprintf(stderr, "can't open patch_ac: %s\n", files[2]);
+		goto cleanup;
+	}
+
+	if (((ret = open_packer(packer_name, BSDIFF_MODE_READ, &abfile, &ab)) != BSDIFF_SUCCESS) ||
+		((ret = open_packer(packer_name, BSDIFF_MODE_READ, &bcfile, &bc)) != BSDIFF_SUCCESS) ||
+		((ret = open_packer(out_packer_name, BSDIFF_MODE_WRITE, &acfile, &ac)) != BSDIFF_SUCCESS)) {
+		fprintf(stderr, "can't create patch packer\n");
+		goto cleanup;
+	}
+
+	ctx.log_error = log_error;
+
+	if ((ret = bsdiff_compose(&ctx, &ab, &bc, &ac)) != BSDIFF_SUCCESS) {
+		fprintf(stderr, "bsdiff_compose failed: %d\n", ret);
+		goto cleanup;
+	}
+
+cleanup:
+	bsdiff_close_patch_packer(&ac);
+	bsdiff_close_patch_packer(&bc);
+	bsdiff_close_patch_packer(&ab);
+	bsdiff_close_stream(&acfile);
+	bsdiff_close_stream(&bcfile);
+	bsdiff_close_stream(&abfile);
+
+	if (print_mem_stats) {
+		struct bsdiff_mem_stats stats;
+		bsdiff_get_mem_stats(&stats);
+		fprintf(stderr, "bscompose memory: current=%lld peak=%lld allocs=%lld frees=%lld\n",
+			(long long)stats.current_bytes, (long long)stats.peak_bytes,
+			(long long)stats.total_allocs, (long long)stats.total_frees);
+	}
+
+	return ret;
+}
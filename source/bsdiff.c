@@ -43,6 +43,11 @@
 #define DB_BUF_LEN 65536
 #define MIN(x,y) (((x)<(y)) ? (x) : (y))
 
+#define SA_OVERHEAD (512 * 1024)       /* divsufsort's buckets, roughly */
+#define SORT_DEPTH 64                  /* sampled suffixes are ordered by this many bytes */
+#define MAX_SAMPLE_STEP 16
+#define MIN_WINDOW_SIZE (64 * 1024)
+
 static int64_t matchlen(uint8_t *old, int64_t oldsize, uint8_t *new, int64_t newsize)
 {
 	int64_t i;
@@ -116,6 +121,195 @@ static int64_t search64(uint8_t *buf, uint8_t *old, int64_t oldsize,
 	}
 }
 
+/*
+ * Suffixes of old[base, base + size), sorted. Entry 0 is the empty suffix,
+ * then come 'count' entries of 32 or 64 bits.
+ */
+struct suffix_index
+{
+	uint8_t *SA;
+	int wide;
+	int64_t base;
+	int64_t size;
+	int64_t count;
+};
+
+static int build_index(uint8_t *SA, uint8_t *old, int64_t base, int64_t size, struct suffix_index *idx)
+{
+	idx->SA = SA;
+	idx->wide = (size >= 0x7fffffff);
+	idx->base = base;
+	idx->size = size;
+	idx->count = size;
+	if (!idx->wide) {
+		((int32_t*)SA)[0] = (int32_t)size;
+		return (divsufsort(old + base, ((int32_t*)SA) + 1, (int32_t)size) == 0) ? BSDIFF_SUCCESS : BSDIFF_ERROR;
+	}
+	((int64_t*)SA)[0] = size;
+	return (divsufsort64(old + base, ((int64_t*)SA) + 1, size) == 0) ? BSDIFF_SUCCESS : BSDIFF_ERROR;
+}
+
+/* Byte 'depth' of the suffix at 'pos', -1 past its end */
+static int suffix_char(const uint8_t *old, int64_t oldsize, int64_t pos, int64_t depth)
+{
+	return (pos + depth < oldsize) ? old[pos + depth] : -1;
+}
+
+/*
+ * Multikey quicksort of the suffixes starting at a[0..n), which share their
+ * first 'depth' bytes. Only the first SORT_DEPTH bytes are ordered, which is
+ * plenty to find the matches and bounds the time on repetitive data. The
+ * two smaller partitions are sorted by recursion and the largest one by the
+ * loop, so at most log2(n) calls are nested.
+ */
+static void sort_suffixes(const uint8_t *old, int64_t oldsize, int64_t *a, int64_t n, int64_t depth)
+{
+	int64_t lt, gt, i, t;
+	int64_t *part[3], size[3], part_depth[3];
+	int c, v, k, largest;
+
+	while (n > 1 && depth < SORT_DEPTH) {
+		/* Median of three */
+		int c0 = suffix_char(old, oldsize, a[0], depth);
+		int c1 = suffix_char(old, oldsize, a[n / 2], depth);
+		int c2 = suffix_char(old, oldsize, a[n - 1], depth);
+		v = (c0 < c1) ? ((c1 < c2) ? c1 : ((c0 < c2) ? c2 : c0))
+		              : ((c0 < c2) ? c0 : ((c1 < c2) ? c2 : c1));
+
+		lt = 0; gt = n; i = 0;
+		while (i < gt) {
+			c = suffix_char(old, oldsize, a[i], depth);
+			if (c < v) {
+				t = a[lt]; a[lt++] = a[i]; a[i++] = t;
+			} else if (c > v) {
+				t = a[--gt]; a[gt] = a[i]; a[i] = t;
+			} else {
+				i++;
+			}
+		}
+
+		part[0] = a;      size[0] = lt;      part_depth[0] = depth;
+		part[1] = a + lt; size[1] = gt - lt; part_depth[1] = depth + 1;
+		part[2] = a + gt; size[2] = n - gt;  part_depth[2] = depth;
+		if (v < 0)
+			size[1] = 0;  /* the empty suffix, there is only one */
+
+		largest = 0;
+		for (k = 1; k < 3; k++) {
+			if (size[k] > size[largest])
+				largest = k;
+		}
+		for (k = 0; k < 3; k++) {
+			if (k != largest)
+				sort_suffixes(old, oldsize, part[k], size[k], part_depth[k]);
+		}
+		a = part[largest];
+		n = size[largest];
+		depth = part_depth[largest];
+	}
+}
+
+/* One suffix out of every 'step', the entries are 64 bits while sorting */
+static void build_sampled_index(uint8_t *SA, uint8_t *old, int64_t oldsize, int64_t step, struct suffix_index *idx)
+{
+	int64_t *SA64 = (int64_t*)SA;
+	int32_t *SA32 = (int32_t*)SA;
+	int64_t i;
+
+	idx->SA = SA;
+	idx->wide = (oldsize >= 0x7fffffff);
+	idx->base = 0;
+	idx->size = oldsize;
+	idx->count = (oldsize + step - 1) / step;
+
+	SA64[0] = oldsize;
+	for (i = 0; i < idx->count; i++)
+		SA64[i + 1] = i * step;
+	sort_suffixes(old, oldsize, SA64 + 1, idx->count, 0);
+	if (!idx->wide) {
+		/* In place, each entry is read before it is overwritten */
+		for (i = 0; i <= idx->count; i++)
+			SA32[i] = (int32_t)SA64[i];
+	}
+}
+
+static int64_t search_index(const struct suffix_index *idx, uint8_t *old,
+		uint8_t *new, int64_t newsize, int64_t *pos)
+{
+	int64_t len;
+
+	if (idx->wide)
+		len = search64(idx->SA, old + idx->base, idx->size, new, newsize, 0, idx->count, pos);
+	else
+		len = search32(idx->SA, old + idx->base, idx->size, new, newsize, 0, idx->count, pos);
+	*pos += idx->base;
+	return len;
+}
+
+/*
+ * Pick the most thorough strategy whose buffers fit in max_memory, next to
+ * the 'fixed' bytes of the file copies and the diff buffer.
+ */
+static int plan_strategy(int64_t max_memory, int64_t fixed, int64_t oldsize, struct bsdiff_strategy *plan)
+{
+	int64_t step, window;
+
+	memset(plan, 0, sizeof(*plan));
+	plan->type = (oldsize < 0x7fffffff) ? BSDIFF_STRATEGY_COMPACT_SA : BSDIFF_STRATEGY_FULL_SA;
+	plan->memory = fixed + SA_OVERHEAD + (oldsize + 1) * ((oldsize < 0x7fffffff) ? 4 : 8);
+	if (max_memory <= 0 || plan->memory <= max_memory)
+		return BSDIFF_SUCCESS;
+
+	plan->type = BSDIFF_STRATEGY_SAMPLED_SA;
+	for (step = 2; step <= MAX_SAMPLE_STEP; step *= 2) {
+		plan->sample_step = step;
+		plan->memory = fixed + (oldsize / step + 2) * 8;
+		if (plan->memory <= max_memory)
+			return BSDIFF_SUCCESS;
+	}
+
+	/* Slices below 2 GiB, for 32-bit suffix arrays */
+	plan->type = BSDIFF_STRATEGY_WINDOWED;
+	plan->sample_step = 0;
+	window = (max_memory - fixed - SA_OVERHEAD) / 4 - 1;
+	if (window > 0x7ffffffe)
+		window = 0x7ffffffe;
+	if (window < MIN_WINDOW_SIZE)
+		return BSDIFF_OUT_OF_MEMORY;
+	plan->window_size = window;
+	plan->memory = fixed + SA_OVERHEAD + (window + 1) * 4;
+	return BSDIFF_SUCCESS;
+}
+
+int bsdiff_plan_strategy(
+	const struct bsdiff_ctx *ctx,
+	int64_t oldsize,
+	int64_t copied,
+	struct bsdiff_strategy *strategy)
+{
+	if (ctx == NULL || oldsize < 0 || copied < 0 || strategy == NULL)
+		return BSDIFF_INVALID_ARG;
+	return plan_strategy(ctx->max_memory, DB_BUF_LEN + copied, oldsize, strategy);
+}
+
+/*
+ * Index the slice of the old file for window 'i' out of 'windows': the
+ * slice proportional to the window's part of the new file, widened to
+ * window_size bytes.
+ */
+static int build_window_index(uint8_t *SA, uint8_t *old, int64_t oldsize,
+		int64_t window_size, int64_t i, int64_t windows, struct suffix_index *idx)
+{
+	int64_t slice = oldsize / windows;
+	int64_t base = slice * i + slice / 2 - window_size / 2;
+
+	if (base > oldsize - window_size)
+		base = oldsize - window_size;
+	if (base < 0)
+		base = 0;
+	return build_index(SA, old, base, window_size, idx);
+}
+
 int bsdiff(
 	struct bsdiff_ctx *ctx,
 	struct bsdiff_stream *oldfile, 
@@ -125,6 +319,7 @@ int bsdiff(
 	int ret;
 	uint8_t *old = NULL, *new = NULL;
 	int64_t oldsize, newsize;
+	int copy_old = 0, copy_new = 0;
 	int64_t scan, pos, len;
 	int64_t lastscan, lastpos, lastoffset;
 	int64_t oldscore, scsc;
@@ -134,10 +329,12 @@ int bsdiff(
 	int64_t dblen;
 	uint8_t *db = NULL;
 	size_t cb;
-	int64_t (*psearch)(uint8_t*, uint8_t*, int64_t, uint8_t*, 
-		int64_t, int64_t, int64_t, int64_t*);
 	int64_t bufsize;
 	uint8_t *SA = NULL;
+	struct suffix_index idx;
+	struct bsdiff_strategy plan;
+	int64_t window, windows, segment_size, segment_end;
+	struct bsdiff_mem_scope scope;
 
 	if (ctx == NULL || oldfile == NULL || newfile == NULL || packer == NULL)
 		return BSDIFF_INVALID_ARG;
@@ -146,13 +343,17 @@ int bsdiff(
 	assert(newfile->get_mode(newfile->state) == BSDIFF_MODE_READ);
 	assert(packer->get_mode(packer->state) == BSDIFF_MODE_WRITE);
 
+	bsdiff_mem_enter(ctx, &scope);
+
 	/* Check if oldfile provides a direct buffer (e.g., mmap) */
-	if (oldfile->get_buffer && oldfile->get_buffer(oldfile->state, (const void **)&old, &cb) == BSDIFF_SUCCESS)
+	copy_old = !(oldfile->get_buffer && oldfile->get_buffer(oldfile->state, (const void **)&old, &cb) == BSDIFF_SUCCESS);
+	if (!copy_old)
 	{
 		oldsize = (int64_t)cb;
 	}
 	else
 	{
+		old = NULL;
 		if ((oldfile->seek(oldfile->state, 0, BSDIFF_SEEK_END) != BSDIFF_SUCCESS) ||
 			(oldfile->tell(oldfile->state, &oldsize) != BSDIFF_SUCCESS) ||
 			(oldfile->seek(oldfile->state, 0, BSDIFF_SEEK_SET) != BSDIFF_SUCCESS))
@@ -161,46 +362,17 @@ int bsdiff(
 		}
 		if (oldsize >= SIZE_MAX)
 			HANDLE_ERROR(BSDIFF_SIZE_TOO_LARGE, "oldfile is too large");
-		if ((old = bsdiff_malloc((size_t)(oldsize + 1))) == NULL)
-			HANDLE_ERROR(BSDIFF_OUT_OF_MEMORY, "malloc for old");
-		if ((oldfile->read(oldfile->state, old, (size_t)oldsize, &cb) != BSDIFF_SUCCESS) ||
-			(cb != (size_t)oldsize))
-		{
-			HANDLE_ERROR(BSDIFF_FILE_ERROR, "read oldfile");
-		}
-	}
-
-	/* Construct the suffix array */
-	bufsize = (oldsize + 1) * sizeof(int64_t);
-	if (oldsize < 0x7fffffff)
-		bufsize /= 2;
-	if (bufsize < SIZE_MAX)
-		SA = bsdiff_malloc((size_t)bufsize);
-	if (SA == NULL)
-		HANDLE_ERROR(BSDIFF_OUT_OF_MEMORY, "malloc for SA");
-
-	if (oldsize < 0x7fffffff)
-	{
-		((int32_t*)SA)[0] = (int32_t)oldsize;
-		if (divsufsort(old, ((int32_t*)SA) + 1, (int32_t)oldsize) != 0)
-			HANDLE_ERROR(BSDIFF_ERROR, "construct suffix array");
-		psearch = search32;
-	}
-	else
-	{
-		((int64_t*)SA)[0] = (int64_t)oldsize;
-		if (divsufsort64(old, ((int64_t*)SA) + 1, (int64_t)oldsize) != 0)
-			HANDLE_ERROR(BSDIFF_ERROR, "construct suffix array");
-		psearch = search64;
 	}
 
 	/* Check if newfile provides a direct buffer (e.g., mmap) */
-	if (newfile->get_buffer && newfile->get_buffer(newfile->state, (const void **)&new, &cb) == BSDIFF_SUCCESS)
+	copy_new = !(newfile->get_buffer && newfile->get_buffer(newfile->state, (const void **)&new, &cb) == BSDIFF_SUCCESS);
+	if (!copy_new)
 	{
 		newsize = (int64_t)cb;
 	}
 	else
 	{
+		new = NULL;
 		if ((newfile->seek(newfile->state, 0, BSDIFF_SEEK_END) != BSDIFF_SUCCESS) ||
 			(newfile->tell(newfile->state, &newsize) != BSDIFF_SUCCESS) ||
 			(newfile->seek(newfile->state, 0, BSDIFF_SEEK_SET) != BSDIFF_SUCCESS))
@@ -209,6 +381,29 @@ int bsdiff(
 		}
 		if (newsize >= SIZE_MAX)
 			HANDLE_ERROR(BSDIFF_SIZE_TOO_LARGE, "newfile is too large");
+	}
+
+	/* Choose how to index the old file, before anything large is allocated */
+	bufsize = 0;
+	if (copy_old)
+		bufsize += oldsize + 1;
+	if (copy_new)
+		bufsize += newsize + 1;
+	if ((ret = bsdiff_plan_strategy(ctx, oldsize, bufsize, &plan)) != BSDIFF_SUCCESS)
+		HANDLE_ERROR(ret, "max_memory of %lld bytes is too small", (long long)ctx->max_memory);
+
+	if (copy_old)
+	{
+		if ((old = bsdiff_malloc((size_t)(oldsize + 1))) == NULL)
+			HANDLE_ERROR(BSDIFF_OUT_OF_MEMORY, "malloc for old");
+		if ((oldfile->read(oldfile->state, old, (size_t)oldsize, &cb) != BSDIFF_SUCCESS) ||
+			(cb != (size_t)oldsize))
+		{
+			HANDLE_ERROR(BSDIFF_FILE_ERROR, "read oldfile");
+		}
+	}
+	if (copy_new)
+	{
 		if ((new = bsdiff_malloc((size_t)(newsize + 1))) == NULL)
 			HANDLE_ERROR(BSDIFF_OUT_OF_MEMORY, "malloc for new");
 		if ((newfile->read(newfile->state, new, (size_t)newsize, &cb) != BSDIFF_SUCCESS) ||
@@ -217,6 +412,34 @@ int bsdiff(
 			HANDLE_ERROR(BSDIFF_FILE_ERROR, "read newfile");
 		}
 	}
+	if (ctx->strategy != NULL)
+		*ctx->strategy = plan;
+
+	/* Construct the suffix array */
+	if (plan.type == BSDIFF_STRATEGY_SAMPLED_SA)
+		bufsize = (oldsize / plan.sample_step + 2) * sizeof(int64_t);
+	else if (plan.type == BSDIFF_STRATEGY_WINDOWED)
+		bufsize = (plan.window_size + 1) * sizeof(int32_t);
+	else
+		bufsize = (oldsize + 1) * ((oldsize < 0x7fffffff) ? sizeof(int32_t) : sizeof(int64_t));
+	if ((uint64_t)bufsize < (uint64_t)SIZE_MAX)
+		SA = bsdiff_malloc((size_t)bufsize);
+	if (SA == NULL)
+		HANDLE_ERROR(BSDIFF_OUT_OF_MEMORY, "malloc for SA");
+
+	segment_size = segment_end = newsize;
+	window = windows = 0;
+	if (plan.type == BSDIFF_STRATEGY_SAMPLED_SA) {
+		build_sampled_index(SA, old, oldsize, plan.sample_step, &idx);
+	} else if (plan.type == BSDIFF_STRATEGY_WINDOWED) {
+		/* The new file is split in as many segments as there are windows */
+		windows = (oldsize + plan.window_size - 1) / plan.window_size;
+		if (build_window_index(SA, old, oldsize, plan.window_size, 0, windows, &idx) != BSDIFF_SUCCESS)
+			HANDLE_ERROR(BSDIFF_ERROR, "construct suffix array");
+		segment_size = segment_end = (newsize + windows - 1) / windows;
+	} else if (build_index(SA, old, 0, oldsize, &idx) != BSDIFF_SUCCESS) {
+		HANDLE_ERROR(BSDIFF_ERROR, "construct suffix array");
+	}
 
 	if ((db = bsdiff_malloc(DB_BUF_LEN)) == NULL)
 		HANDLE_ERROR(BSDIFF_OUT_OF_MEMORY, "malloc for db");
@@ -226,14 +449,20 @@ int bsdiff(
 		HANDLE_ERROR(BSDIFF_FILE_ERROR, "write new size");
 
 	/* Scan */
-	scan = 0; len = 0;
+	scan = 0; len = 0; pos = 0;
 	lastscan = 0; lastpos = 0; lastoffset = 0;
 	while (scan < newsize) {
 		oldscore = 0;
 
 		for (scsc = scan+=len; scan < newsize; scan++) {
-			len = psearch(SA, old, oldsize, new+scan, newsize-scan,
-					0, oldsize, &pos);
+			/* Windowed: move on to the slice for this part of the new file */
+			if (scan >= segment_end) {
+				window = MIN(scan / segment_size, windows - 1);
+				if (build_window_index(SA, old, oldsize, plan.window_size, window, windows, &idx) != BSDIFF_SUCCESS)
+					HANDLE_ERROR(BSDIFF_ERROR, "construct suffix array");
+				segment_end = (window + 1 < windows) ? segment_size * (window + 1) : newsize;
+			}
+			len = search_index(&idx, old, new+scan, newsize-scan, &pos);
 
 			for (; scsc < scan + len; scsc++) {
 				if ((scsc + lastoffset < oldsize) &&
@@ -351,8 +580,9 @@ int bsdiff(
 cleanup:
 	if (db != NULL) { bsdiff_free(db); }
 	if (SA != NULL) { bsdiff_free(SA); }
-	if (old != NULL && (oldfile->get_buffer == NULL)) { bsdiff_free(old); }
-	if (new != NULL && (newfile->get_buffer == NULL)) { bsdiff_free(new); }
+	if (old != NULL && copy_old) { bsdiff_free(old); }
+	if (new != NULL && copy_new) { bsdiff_free(new); }
+	bsdiff_mem_leave(&scope);
 
 	return ret;
 }
@@ -26,6 +26,8 @@
  */
 
 #include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
 #include "bsdiff.h"
 
@@ -35,6 +37,113 @@ static void log_error(void *opaque, const char *errmsg)
 	fprintf(stderr, "%s", errmsg);
 }
 
+/* "-" selects stdin/stdout, e.g. for piping an endsley patch */
+static const char *stdio_name(const char *name, int mode)
+{
+	if (strcmp(name, "-") != 0)
+		return name;
+	return (mode == BSDIFF_MODE_READ) ? "/dev/stdin" : "/dev/stdout";
+}
+
+/* Outputs are written behind through io_uring, or at least through the
+   large-buffer descriptor stream where there is one */
+static int open_output_stream(int mode, const char *name, struct bsdiff_stream *stream)
+{
+	if (bsdiff_open_uring_stream(mode, name, NULL, stream) == BSDIFF_SUCCESS)
+		return BSDIFF_SUCCESS;
+	return bsdiff_open_file_stream(mode, name, stream);
+}
+
+/* Parse an integer option value, applied to the ctrl, diff and extra blocks */
+static int parse_zstd_option(const char *arg, const char *value, struct bsdiff_zstd_options *opts, size_t offset)
+{
+	char *endp;
+	long n = strtol(value, &endp, 0);
+
+	if (*value == '\0' || *endp != '\0') {
+		fprintf(stderr, "invalid value: %s\n", arg);
+		return 0;
+	}
+	*(int *)((char *)&opts->ctrl + offset) = (int)n;
+	*(int *)((char *)&opts->diff + offset) = (int)n;
+	*(int *)((char *)&opts->extra + offset) = (int)n;
+	return 1;
+}
+
+/* Train a dictionary from the zstd patches among argv and write it to 'dictname' */
+static int train_dict(const char *dictname, int argc, char *argv[])
+{
+	int ret = BSDIFF_ERROR;
+	int i, n = 0;
+	struct bsdiff_stream *streams = calloc((size_t)argc, sizeof(struct bsdiff_stream));
+	struct bsdiff_patch_packer *packers = calloc((size_t)argc, sizeof(struct bsdiff_patch_packer));
+	size_t capacity = 112640, dict_size = 0;
+	void *dict = malloc(capacity);
+	FILE *f;
+
+	if (!streams || !packers || !dict)
+		goto cleanup;
+	for (i = 1; i < argc; i++) {
+		if (strncmp(argv[i], "--", 2) == 0)
+			continue;
+		if ((ret = bsdiff_open_file_stream(BSDIFF_MODE_READ, argv[i], &streams[n])) != BSDIFF_SUCCESS) {
+			fprintf(stderr, "can't open patchfile: %s\n", argv[i]);
+			goto cleanup;
+		}
+		if ((ret = bsdiff_open_zstd_patch_packer(BSDIFF_MODE_READ, &streams[n], &packers[n])) != BSDIFF_SUCCESS) {
+			bsdiff_close_stream(&streams[n]);
+			goto cleanup;
+		}
+		n++;
+	}
+	if (n == 0) {
+		fprintf(stderr, "no patches to train from\n");
+		ret = BSDIFF_INVALID_ARG;
+		goto cleanup;
+	}
+	if ((ret = bsdiff_train_zstd_dict(packers, (size_t)n, dict, capacity, &dict_size)) != BSDIFF_SUCCESS) {
+		fprintf(stderr, "bsdiff_train_zstd_dict failed: %d\n", ret);
+		goto cleanup;
+	}
+	if ((f = fopen(dictname, "wb")) == NULL || fwrite(dict, 1, dict_size, f) != dict_size) {
+		fprintf(stderr, "can't write dictionary: %s\n", dictname);
+		if (f)
+			fclose(f);
+		ret = BSDIFF_FILE_ERROR;
+		goto cleanup;
+	}
+	fclose(f);
+
+cleanup:
+	for (i = 0; i < n; i++) {
+		bsdiff_close_patch_packer(&packers[i]);
+		bsdiff_close_stream(&streams[i]);
+	}
+	free(dict);
+	free(packers);
+	free(streams);
+	return ret;
+}
+
+static void print_strategy(const struct bsdiff_strategy *strategy)
+{
+	switch (strategy->type) {
+	case BSDIFF_STRATEGY_SAMPLED_SA:
+		fprintf(stderr, "bsdiff strategy: sampled suffix array, 1 in %lld", (long long)strategy->sample_step);
+		break;
+	case BSDIFF_STRATEGY_WINDOWED:
+		fprintf(stderr, "bsdiff strategy: windowed, %lld bytes per window", (long long)strategy->window_size);
+		break;
+	case BSDIFF_STRATEGY_FULL_SA:
+		fprintf(stderr, "bsdiff strategy: full suffix array");
+		break;
+	default:
+		fprintf(stderr, "bsdiff strategy: compact suffix array");
+		break;
+	}
+	fprintf(stderr, ", about %lld bytes\n", (long long)strategy->memory);
+}
+
 int main(int argc, char * argv[])
 {
 	int ret = 1;
@@ -42,15 +151,80 @@ int main(int argc, char * argv[])
 	const char *files[3] = { NULL, NULL, NULL };
 	int nfiles = 0;
 	int print_mem_stats = 0;
+	struct bsdiff_zstd_options zstd_opts = { 0 };
+	struct bsdiff_bz2_options bz2_opts = { 0 };
+	const char *dict_name = NULL;
+	struct bsdiff_zstd_dict *dict = NULL;
 	int i;
-	struct bsdiff_stream oldfile = { 0 }, newfile = { 0 }, patchfile = { 0 };
+	struct bsdiff_stream oldfile = { 0 }, newfile = { 0 }, patchfile = { 0 }, dictfile = { 0 };
+	/* The suffix array searches jump all over the old file, the new file is
+	   scanned once */
+	struct bsdiff_mmap_stream_options old_map = { BSDIFF_ACCESS_RANDOM, 1, 1 };
+	struct bsdiff_mmap_stream_options new_map = { BSDIFF_ACCESS_SEQUENTIAL, 0, 0 };
 	struct bsdiff_ctx ctx = { 0 };
+	struct bsdiff_strategy strategy = { 0 };
 	struct bsdiff_patch_packer packer = { 0 };
 
 	for (i = 1; i < argc; i++) {
 		if (strncmp(argv[i], "--", 2) == 0) {
 			if (strncmp(argv[i], "--packer=", 9) == 0) {
 				packer_name = argv[i] + 9;
+			} else if (strncmp(argv[i], "--zstd-level=", 13) == 0) {
+				if (!parse_zstd_option(argv[i], argv[i] + 13, &zstd_opts, offsetof(struct bsdiff_zstd_block_options, level)))
+					return 1;
+			} else if (strncmp(argv[i], "--zstd-window-log=", 18) == 0) {
+				if (!parse_zstd_option(argv[i], argv[i] + 18, &zstd_opts, offsetof(struct bsdiff_zstd_block_options, window_log)))
+					return 1;
+			} else if (strncmp(argv[i], "--zstd-strategy=", 16) == 0) {
+				if (!parse_zstd_option(argv[i], argv[i] + 16, &zstd_opts, offsetof(struct bsdiff_zstd_block_options, strategy)))
+					return 1;
+			} else if (strncmp(argv[i], "--zstd-workers=", 15) == 0) {
+				if (!parse_zstd_option(argv[i], argv[i] + 15, &zstd_opts, offsetof(struct bsdiff_zstd_block_options, workers)))
+					return 1;
+			} else if (strncmp(argv[i], "--zstd-dict=", 12) == 0) {
+				dict_name = argv[i] + 12;
+			} else if (strncmp(argv[i], "--train-zstd-dict=", 18) == 0) {
+				return train_dict(argv[i] + 18, argc, argv);
+			} else if (strncmp(argv[i], "--zstd-shuffle=", 15) == 0) {
+				if (!parse_zstd_option(argv[i], argv[i] + 15, &zstd_opts, offsetof(struct bsdiff_zstd_block_options, shuffle)))
+					return 1;
+			} else if (strcmp(argv[i], "--zstd-varint-ctrl") == 0) {
+				zstd_opts.varint_ctrl = 1;
+			} else if (strcmp(argv[i], "--zstd-zero-runs") == 0) {
+				zstd_opts.zero_runs = 1;
+			} else if (strcmp(argv[i], "--zstd-long") == 0) {
+				zstd_opts.ctrl.long_distance_matching = 1;
+				zstd_opts.diff.long_distance_matching = 1;
+				zstd_opts.extra.long_distance_matching = 1;
+			} else if (strncmp(argv[i], "--bz2-threads=", 14) == 0) {
+				char *endp;
+				bz2_opts.threads = (int)strtol(argv[i] + 14, &endp, 0);
+				if (argv[i][14] == '\0' || *endp != '\0' || bz2_opts.threads < 0) {
+					fprintf(stderr, "invalid value: %s\n", argv[i]);
+					return 1;
+				}
+			} else if (strncmp(argv[i], "--spill-threshold=", 18) == 0) {
+				char *endp;
+				long long n = strtoll(argv[i] + 18, &endp, 0);
+				if (argv[i][18] == '\0' || *endp != '\0' || n < 0) {
+					fprintf(stderr, "invalid value: %s\n", argv[i]);
+					return 1;
+				}
+				bz2_opts.spill_threshold = (size_t)n;
+				zstd_opts.spill_threshold = (size_t)n;
+			} else if (strncmp(argv[i], "--spill-dir=", 12) == 0) {
+				bz2_opts.spill_dir = argv[i] + 12;
+				zstd_opts.spill_dir = argv[i] + 12;
+			} else if (strncmp(argv[i], "--max-memory=", 13) == 0) {
+				char *endp;
+				ctx.max_memory = strtoll(argv[i] + 13, &endp, 0);
+				if (argv[i][13] == '\0' || *endp != '\0' || ctx.max_memory < 0) {
+					fprintf(stderr, "invalid value: %s\n", argv[i]);
+					return 1;
+				}
+			} else if (strcmp(argv[i], "--concurrent") == 0) {
+				bz2_opts.concurrent = 1;
+				zstd_opts.concurrent = 1;
 			} else if (strcmp(argv[i], "--mem-stats") == 0) {
 				print_mem_stats = 1;
 			} else {
@@ -64,27 +238,50 @@ int main(int argc, char * argv[])
 	}
 
 	if (nfiles != 3) {
-		fprintf(stderr, "usage: %s [--packer=bz2|zstd] [--mem-stats] oldfile newfile patchfile\n", argv[0]);
+		fprintf(stderr, "usage: %s [--packer=bz2|zstd|seekable|endsley|raw|adaptive] [--zstd-level=N] [--zstd-window-log=N] [--zstd-strategy=N] [--zstd-long] [--zstd-varint-ctrl] [--zstd-zero-runs] [--zstd-shuffle=N] [--zstd-workers=N] [--zstd-dict=file] [--concurrent] [--bz2-threads=N] [--spill-threshold=bytes] [--spill-dir=dir] [--max-memory=bytes] [--mem-stats] oldfile newfile patchfile\n", argv[0]);
+		fprintf(stderr, "       %s --train-zstd-dict=file zstd_patch...\n", argv[0]);
 		return 1;
 	}
 
-	if ((ret = bsdiff_open_mmap_stream(BSDIFF_MODE_READ, files[0], &oldfile)) != BSDIFF_SUCCESS) {
+	if (dict_name != NULL) {
+		const void *buf;
+		size_t size;
+		if ((ret = bsdiff_open_mmap_stream(BSDIFF_MODE_READ, dict_name, &dictfile)) != BSDIFF_SUCCESS ||
+			(ret = dictfile.get_buffer(dictfile.state, &buf, &size)) != BSDIFF_SUCCESS ||
+			(ret = bsdiff_create_zstd_dict(buf, size, zstd_opts.diff.level, &dict)) != BSDIFF_SUCCESS) {
+			fprintf(stderr, "can't load dictionary: %s\n", dict_name);
+			goto cleanup;
+		}
+		zstd_opts.ctrl.dict = dict;
+		zstd_opts.diff.dict = dict;
+		zstd_opts.extra.dict = dict;
+	}
+
+	if ((ret = bsdiff_open_mmap_stream_ex(BSDIFF_MODE_READ, files[0], &old_map, &oldfile)) != BSDIFF_SUCCESS) {
 		fprintf(stderr, "can't open oldfile with mmap: %s\n", files[0]);
 		goto cleanup;
 	}
-	if ((ret = bsdiff_open_mmap_stream(BSDIFF_MODE_READ, files[1], &newfile)) != BSDIFF_SUCCESS) {
+	if ((ret = bsdiff_open_mmap_stream_ex(BSDIFF_MODE_READ, files[1], &new_map, &newfile)) != BSDIFF_SUCCESS) {
 		fprintf(stderr, "can't open newfile with mmap: %s\n", files[1]);
 		goto cleanup;
 	}
-	if ((ret = bsdiff_open_file_stream(BSDIFF_MODE_WRITE, files[2], &patchfile)) != BSDIFF_SUCCESS) {
+	if ((ret = open_output_stream(BSDIFF_MODE_WRITE, stdio_name(files[2], BSDIFF_MODE_WRITE), &patchfile)) != BSDIFF_SUCCESS) {
 		fprintf(stderr, "can't open patchfile: %s\n", files[2]);
 		goto cleanup;
 	}
 
 	if (strcmp(packer_name, "zstd") == 0) {
-		ret = bsdiff_open_zstd_patch_packer(BSDIFF_MODE_WRITE, &patchfile, &packer);
+		ret = bsdiff_open_zstd_patch_packer_ex(BSDIFF_MODE_WRITE, &patchfile, &zstd_opts, &packer);
+	} else if (strcmp(packer_name, "seekable") == 0) {
+		ret = bsdiff_open_seekable_patch_packer(BSDIFF_MODE_WRITE, &patchfile, &packer);
+	} else if (strcmp(packer_name, "endsley") == 0) {
+		ret = bsdiff_open_endsley_patch_packer(BSDIFF_MODE_WRITE, &patchfile, &packer);
+	} else if (strcmp(packer_name, "raw") == 0) {
+		ret = bsdiff_open_raw_patch_packer(BSDIFF_MODE_WRITE, &patchfile, &packer);
+	} else if (strcmp(packer_name, "adaptive") == 0) {
+		ret = bsdiff_open_adaptive_patch_packer(BSDIFF_MODE_WRITE, &patchfile, &packer);
 	} else {
-		ret = bsdiff_open_bz2_patch_packer(BSDIFF_MODE_WRITE, &patchfile, &packer);
+		ret = bsdiff_open_bz2_patch_packer_ex(BSDIFF_MODE_WRITE, &patchfile, &bz2_opts, &packer);
 	}
 	if (ret != BSDIFF_SUCCESS) {
 		fprintf(stderr, "can't create patch packer\n");
@@ -92,17 +289,22 @@ int main(int argc, char * argv[])
 	}
 
 	ctx.log_error = log_error;
+	ctx.strategy = &strategy;
 
 	if ((ret = bsdiff(&ctx, &oldfile, &newfile, &packer)) != BSDIFF_SUCCESS) {
 		fprintf(stderr, "bsdiff failed: %d\n", ret);
 		goto cleanup;
 	}
+	if (ctx.max_memory > 0)
+		print_strategy(&strategy);
 
 cleanup:
 	bsdiff_close_patch_packer(&packer);
 	bsdiff_close_stream(&patchfile);
 	bsdiff_close_stream(&newfile);
 	bsdiff_close_stream(&oldfile);
+	bsdiff_free_zstd_dict(dict);
+	bsdiff_close_stream(&dictfile);
 
 	if (print_mem_stats) {
 		struct bsdiff_mem_stats stats;
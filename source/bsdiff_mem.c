@@ -1,51 +1,116 @@
 #include "bsdiff.h"
 #include "bsdiff_mem.h"
+#include "bsdiff_thread.h"
 #include <stdlib.h>
 #include <string.h>
 
 /*
  * Memory tracking implementation.
  *
- * Each allocation prepends a size_t header storing the usable size.
- * Layout: [size_t: size][user data ...]
- *                       ^ returned pointer
+ * Each allocation prepends a header storing the usable size, the
+ * allocator it came from and the stats of the ctx it is counted in.
+ * Layout: [header: size, allocator, stats][user data ...]
+ *                                         ^ returned pointer
  *
- * This allows bsdiff_free to know how many bytes are being freed,
- * and bsdiff_realloc to adjust the delta correctly.
+ * This allows bsdiff_free to know how many bytes are being freed, where
+ * to give them back and whom to tell, even on another thread or after the
+ * call which made the allocation has returned, and bsdiff_realloc to adjust
+ * the delta correctly. A NULL allocator means malloc.
  *
- * Global stats are maintained in a static struct (not thread-safe,
- * consistent with bsdiff's single-threaded design).
+ * Global stats are maintained in a static struct, and per-ctx stats in the
+ * caller's struct, both updated atomically since compressors may allocate
+ * from worker threads and calls may run concurrently.
  */
 
+struct mem_header
+{
+	size_t size;
+	const struct bsdiff_allocator *allocator;
+	struct bsdiff_mem_stats *stats;
+	void *unused;  /* keeps the user data 16-byte aligned */
+};
+
 static struct bsdiff_mem_stats g_mem_stats;
 
+#if defined(_MSC_VER)
+static __declspec(thread) struct bsdiff_mem_scope t_scope;
+#else
+static __thread struct bsdiff_mem_scope t_scope;
+#endif
+
+static void *raw_alloc(const struct bsdiff_allocator *allocator, size_t size)
+{
+	if (allocator == NULL)
+		return malloc(size);
+	return allocator->alloc(allocator->state, size);
+}
+
+static void raw_release(const struct bsdiff_allocator *allocator, void *raw, size_t size)
+{
+	if (allocator == NULL)
+		free(raw);
+	else if (allocator->release != NULL)
+		allocator->release(allocator->state, raw, size);
+}
+
+static void *raw_resize(const struct bsdiff_allocator *allocator, void *raw, size_t old_size, size_t size)
+{
+	void *newraw;
+
+	if (allocator == NULL)
+		return realloc(raw, size);
+	if (allocator->resize != NULL)
+		return allocator->resize(allocator->state, raw, old_size, size);
+
+	if ((newraw = allocator->alloc(allocator->state, size)) == NULL)
+		return NULL;
+	memcpy(newraw, raw, (old_size < size) ? old_size : size);
+	raw_release(allocator, raw, old_size);
+	return newraw;
+}
+
+static void count_resize(struct bsdiff_mem_stats *stats, int64_t delta)
+{
+	bsdiff_atomic_max(&stats->peak_bytes, bsdiff_atomic_add(&stats->current_bytes, delta));
+}
+
+static void count_alloc(struct bsdiff_mem_stats *stats, size_t size)
+{
+	count_resize(stats, (int64_t)size);
+	bsdiff_atomic_add(&stats->total_allocs, 1);
+}
+
+static void count_free(struct bsdiff_mem_stats *stats, size_t size)
+{
+	bsdiff_atomic_add(&stats->current_bytes, -(int64_t)size);
+	bsdiff_atomic_add(&stats->total_frees, 1);
+}
+
 void *bsdiff_malloc(size_t size)
 {
-	void *raw;
-	size_t *header;
+	struct mem_header *header;
 
 	if (size == 0)
 		size = 1;
 
-	raw = malloc(sizeof(size_t) + size);
-	if (raw == NULL)
+	header = raw_alloc(t_scope.allocator, sizeof(*header) + size);
+	if (header == NULL)
 		return NULL;
 
-	header = (size_t *)raw;
-	*header = size;
+	header->size = size;
+	header->allocator = t_scope.allocator;
+	header->stats = t_scope.stats;
 
-	g_mem_stats.current_bytes += (int64_t)size;
-	if (g_mem_stats.current_bytes > g_mem_stats.peak_bytes)
-		g_mem_stats.peak_bytes = g_mem_stats.current_bytes;
-	g_mem_stats.total_allocs++;
+	count_alloc(&g_mem_stats, size);
+	if (header->stats != NULL)
+		count_alloc(header->stats, size);
 
 	return (void *)(header + 1);
 }
 
 void *bsdiff_realloc(void *ptr, size_t size)
 {
-	void *raw, *newraw;
-	size_t *header;
+	struct mem_header *header;
 	size_t old_size;
 
 	if (ptr == NULL)
@@ -56,48 +121,86 @@ void *bsdiff_realloc(void *ptr, size_t size)
 		return NULL;
 	}
 
-	header = ((size_t *)ptr) - 1;
-	old_size = *header;
-	raw = (void *)header;
+	header = ((struct mem_header *)ptr) - 1;
+	old_size = header->size;
 
-	newraw = realloc(raw, sizeof(size_t) + size);
-	if (newraw == NULL)
+	header = raw_resize(header->allocator, header, sizeof(*header) + old_size, sizeof(*header) + size);
+	if (header == NULL)
 		return NULL;
 
-	header = (size_t *)newraw;
-	*header = size;
+	header->size = size;
 
-	g_mem_stats.current_bytes += (int64_t)size - (int64_t)old_size;
-	if (g_mem_stats.current_bytes > g_mem_stats.peak_bytes)
-		g_mem_stats.peak_bytes = g_mem_stats.current_bytes;
+	count_resize(&g_mem_stats, (int64_t)size - (int64_t)old_size);
+	if (header->stats != NULL)
+		count_resize(header->stats, (int64_t)size - (int64_t)old_size);
 
 	return (void *)(header + 1);
 }
 
 void bsdiff_free(void *ptr)
 {
-	size_t *header;
+	struct mem_header *header;
 	size_t size;
 
 	if (ptr == NULL)
 		return;
 
-	header = ((size_t *)ptr) - 1;
-	size = *header;
+	header = ((struct mem_header *)ptr) - 1;
+	size = header->size;
 
-	g_mem_stats.current_bytes -= (int64_t)size;
-	g_mem_stats.total_frees++;
+	count_free(&g_mem_stats, size);
+	if (header->stats != NULL)
+		count_free(header->stats, size);
 
-	free((void *)header);
+	raw_release(header->allocator, header, sizeof(*header) + size);
+}
+
+void bsdiff_mem_get_scope(struct bsdiff_mem_scope *scope)
+{
+	*scope = t_scope;
+}
+
+void bsdiff_mem_set_scope(const struct bsdiff_mem_scope *scope)
+{
+	t_scope = *scope;
+}
+
+void bsdiff_mem_enter(const struct bsdiff_ctx *ctx, struct bsdiff_mem_scope *saved)
+{
+	*saved = t_scope;
+	t_scope.allocator = ctx->allocator;
+	t_scope.stats = ctx->mem_stats;
+}
+
+void bsdiff_mem_leave(const struct bsdiff_mem_scope *saved)
+{
+	t_scope = *saved;
+}
+
+static void load_stats(struct bsdiff_mem_stats *counters, struct bsdiff_mem_stats *stats)
+{
+	stats->current_bytes = bsdiff_atomic_load(&counters->current_bytes);
+	stats->peak_bytes = bsdiff_atomic_load(&counters->peak_bytes);
+	stats->total_allocs = bsdiff_atomic_load(&counters->total_allocs);
+	stats->total_frees = bsdiff_atomic_load(&counters->total_frees);
 }
 
 void bsdiff_get_mem_stats(struct bsdiff_mem_stats *stats)
 {
 	if (stats != NULL)
-		*stats = g_mem_stats;
+		load_stats(&g_mem_stats, stats);
+}
+
+void bsdiff_get_ctx_mem_stats(const struct bsdiff_ctx *ctx, struct bsdiff_mem_stats *stats)
+{
+	if (ctx != NULL && ctx->mem_stats != NULL && stats != NULL)
+		load_stats(ctx->mem_stats, stats);
 }
 
 void bsdiff_reset_mem_stats(void)
 {
-	memset(&g_mem_stats, 0, sizeof(g_mem_stats));
+	bsdiff_atomic_store(&g_mem_stats.current_bytes, 0);
+	bsdiff_atomic_store(&g_mem_stats.peak_bytes, 0);
+	bsdiff_atomic_store(&g_mem_stats.total_allocs, 0);
+	bsdiff_atomic_store(&g_mem_stats.total_frees, 0);
 }
@@ -5,6 +5,10 @@
 
 #include <stddef.h>
 
+struct bsdiff_ctx;
+struct bsdiff_allocator;
+struct bsdiff_mem_stats;
+
 /*
  * Internal memory allocation wrappers with tracking.
  * These should be used instead of malloc/realloc/free
@@ -14,4 +18,23 @@ void *bsdiff_malloc(size_t size);
 void *bsdiff_realloc(void *ptr, size_t size);
 void  bsdiff_free(void *ptr);
 
+/*
+ * Where bsdiff_malloc takes memory from on the calling thread, and which
+ * stats count it besides the global ones. The public entry points install
+ * the scope of their ctx, and worker threads inherit the scope of whoever
+ * started them or submitted the job.
+ */
+struct bsdiff_mem_scope
+{
+	const struct bsdiff_allocator *allocator;
+	struct bsdiff_mem_stats *stats;
+};
+
+void bsdiff_mem_get_scope(struct bsdiff_mem_scope *scope);
+void bsdiff_mem_set_scope(const struct bsdiff_mem_scope *scope);
+
+/* Install the scope of 'ctx', the current one is saved for bsdiff_mem_leave */
+void bsdiff_mem_enter(const struct bsdiff_ctx *ctx, struct bsdiff_mem_scope *saved);
+void bsdiff_mem_leave(const struct bsdiff_mem_scope *saved);
+
 #endif /* !__BSDIFF_MEM_H__ */
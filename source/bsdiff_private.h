@@ -19,6 +19,88 @@ int bsdiff_open_substream(
 	struct bsdiff_stream *substream);
 
 
+/* Size and contents of a write-mode memory stream (get_chunk or get_buffer) */
+int bsdiff_stream_data_size(
+	struct bsdiff_stream *stream,
+	int64_t *size);
+
+/* Write the contents of 'src' to 'dst' chunk by chunk */
+int bsdiff_write_stream_data(
+	struct bsdiff_stream *dst,
+	struct bsdiff_stream *src);
+
+
+/* The offsets of the bsdiff 4.x formats: 8 bytes little-endian, the top bit
+   being the sign of the 63-bit magnitude */
+static inline int64_t bsdiff_offtin(const uint8_t *buf)
+{
+	int64_t y;
+
+	y = ((int64_t)buf[0]) |
+		((int64_t)buf[1] << 8) |
+		((int64_t)buf[2] << 16) |
+		((int64_t)buf[3] << 24) |
+		((int64_t)buf[4] << 32) |
+		((int64_t)buf[5] << 40) |
+		((int64_t)buf[6] << 48) |
+		(((int64_t)(buf[7] & 0x7F)) << 56);
+
+	if (buf[7] & 0x80)
+		y = -y;
+
+	return y;
+}
+
+static inline void bsdiff_offtout(int64_t x, uint8_t *buf)
+{
+	uint64_t y;
+
+	if (x < 0) {
+		y = (uint64_t)(-x);
+	} else {
+		y = (uint64_t)x;
+	}
+
+	buf[0] = (uint8_t)(y);
+	buf[1] = (uint8_t)(y >> 8);
+	buf[2] = (uint8_t)(y >> 16);
+	buf[3] = (uint8_t)(y >> 24);
+	buf[4] = (uint8_t)(y >> 32);
+	buf[5] = (uint8_t)(y >> 40);
+	buf[6] = (uint8_t)(y >> 48);
+	if (x < 0)
+		buf[7] = (uint8_t)((y >> 56) | 0x80);
+	else
+		buf[7] = (uint8_t)(y >> 56);
+}
+
+/* A ctrl entry of those formats: diff, extra and seek as 3 offsets */
+static inline int bsdiff_decode_ctrl(const uint8_t *buf, int64_t *diff, int64_t *extra, int64_t *seek)
+{
+	*diff = bsdiff_offtin(buf);
+	*extra = bsdiff_offtin(buf + 8);
+	*seek = bsdiff_offtin(buf + 16);
+	if (*diff < 0 || *extra < 0)
+		return BSDIFF_CORRUPT_PATCH;
+	return BSDIFF_SUCCESS;
+}
+
+static inline void bsdiff_encode_ctrl(int64_t diff, int64_t extra, int64_t seek, uint8_t *buf)
+{
+	bsdiff_offtout(diff, buf);
+	bsdiff_offtout(extra, buf + 8);
+	bsdiff_offtout(seek, buf + 16);
+}
+
+/* How much of a 'size' byte read fits in the 'remaining' bytes of an entry */
+static inline size_t bsdiff_entry_chunk(int64_t remaining, size_t size)
+{
+	if (remaining <= 0)
+		return 0;
+	return ((uint64_t)remaining < (uint64_t)size) ? (size_t)remaining : size;
+}
+
+
 /* bsdiff_compressor */
 struct bsdiff_compressor
 {
@@ -45,4 +127,36 @@ struct bsdiff_decompressor
 void bsdiff_close_decompressor(
 	struct bsdiff_decompressor *dec);
 
+
+/* Byte transposition of 'stride'-byte elements (2, 4, 8 or 16): byte j of
+   every element goes to plane j. A trailing partial element is copied. */
+void bsdiff_shuffle(const uint8_t *src, uint8_t *dst, size_t size, int stride);
+void bsdiff_unshuffle(const uint8_t *src, uint8_t *dst, size_t size, int stride);
+
+
+/* bsdiff_zstd_dict: the ZSTD_CDict and ZSTD_DDict of a dictionary */
+struct bsdiff_zstd_dict;
+const void *bsdiff_zstd_dict_cdict(const struct bsdiff_zstd_dict *dict);
+const void *bsdiff_zstd_dict_ddict(const struct bsdiff_zstd_dict *dict);
+
+
+/* bsdiff_page_cache: bounded LRU cache over a seekable read stream */
+struct bsdiff_page_cache;
+
+int bsdiff_open_page_cache(
+	struct bsdiff_stream *stream,
+	int64_t size,
+	size_t cache_size,
+	struct bsdiff_page_cache **pcache);
+
+/* buffer[j] += stream[pos + j] for the positions inside the stream */
+int bsdiff_page_cache_add(
+	struct bsdiff_page_cache *cache,
+	int64_t pos,
+	uint8_t *buffer,
+	size_t len);
+
+void bsdiff_close_page_cache(
+	struct bsdiff_page_cache *cache);
+
 #endif /* !__BSDIFF_PRIVATE_H__ */
@@ -0,0 +1,262 @@
+#include "bsdiff.h"
+#include "bsdiff_mem.h"
+#include "bsdiff_thread.h"
+#include <stdlib.h>
+#ifndef _WIN32
+#  include <unistd.h>
+#endif
+
+struct thread_start
+{
+	void (*func)(void *arg);
+	void *arg;
+	struct bsdiff_mem_scope scope;
+};
+
+#ifdef _WIN32
+
+int bsdiff_mutex_init(bsdiff_mutex_t *mutex)
+{
+	InitializeCriticalSection(mutex);
+	return BSDIFF_SUCCESS;
+}
+
+void bsdiff_mutex_destroy(bsdiff_mutex_t *mutex) { DeleteCriticalSection(mutex); }
+void bsdiff_mutex_lock(bsdiff_mutex_t *mutex) { EnterCriticalSection(mutex); }
+void bsdiff_mutex_unlock(bsdiff_mutex_t *mutex) { LeaveCriticalSection(mutex); }
+
+int bsdiff_cond_init(bsdiff_cond_t *cond)
+{
+	InitializeConditionVariable(cond);
+	return BSDIFF_SUCCESS;
+}
+
+void bsdiff_cond_destroy(bsdiff_cond_t *cond) { (void)cond; }
+void bsdiff_cond_wait(bsdiff_cond_t *cond, bsdiff_mutex_t *mutex) { SleepConditionVariableCS(cond, mutex, INFINITE); }
+void bsdiff_cond_broadcast(bsdiff_cond_t *cond) { WakeAllConditionVariable(cond); }
+
+static DWORD WINAPI thread_main(LPVOID param)
+{
+	struct thread_start start = *(struct thread_start *)param;
+
+	bsdiff_free(param);
+	bsdiff_mem_set_scope(&start.scope);
+	start.func(start.arg);
+	return 0;
+}
+
+int bsdiff_thread_create(bsdiff_thread_t *thread, void (*func)(void *arg), void *arg)
+{
+	struct thread_start *start = bsdiff_malloc(sizeof(*start));
+
+	if (start == NULL)
+		return BSDIFF_OUT_OF_MEMORY;
+	start->func = func;
+	start->arg = arg;
+	bsdiff_mem_get_scope(&start->scope);
+	*thread = CreateThread(NULL, 0, thread_main, start, 0, NULL);
+	if (*thread == NULL) {
+		bsdiff_free(start);
+		return BSDIFF_ERROR;
+	}
+	return BSDIFF_SUCCESS;
+}
+
+void bsdiff_thread_join(bsdiff_thread_t thread)
+{
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+}
+
+int bsdiff_cpu_count(void)
+{
+	SYSTEM_INFO info;
+
+	GetSystemInfo(&info);
+	return (info.dwNumberOfProcessors > 0) ? (int)info.dwNumberOfProcessors : 1;
+}
+
+#else
+
+int bsdiff_mutex_init(bsdiff_mutex_t *mutex)
+{
+	return (pthread_mutex_init(mutex, NULL) == 0) ? BSDIFF_SUCCESS : BSDIFF_ERROR;
+}
+
+void bsdiff_mutex_destroy(bsdiff_mutex_t *mutex) { pthread_mutex_destroy(mutex); }
+void bsdiff_mutex_lock(bsdiff_mutex_t *mutex) { pthread_mutex_lock(mutex); }
+void bsdiff_mutex_unlock(bsdiff_mutex_t *mutex) { pthread_mutex_unlock(mutex); }
+
+int bsdiff_cond_init(bsdiff_cond_t *cond)
+{
+	return (pthread_cond_init(cond, NULL) == 0) ? BSDIFF_SUCCESS : BSDIFF_ERROR;
+}
+
+void bsdiff_cond_destroy(bsdiff_cond_t *cond) { pthread_cond_destroy(cond); }
+void bsdiff_cond_wait(bsdiff_cond_t *cond, bsdiff_mutex_t *mutex) { pthread_cond_wait(cond, mutex); }
+void bsdiff_cond_broadcast(bsdiff_cond_t *cond) { pthread_cond_broadcast(cond); }
+
+static void *thread_main(void *param)
+{
+	struct thread_start start = *(struct thread_start *)param;
+
+	bsdiff_free(param);
+	bsdiff_mem_set_scope(&start.scope);
+	start.func(start.arg);
+	return NULL;
+}
+
+int bsdiff_thread_create(bsdiff_thread_t *thread, void (*func)(void *arg), void *arg)
+{
+	struct thread_start *start = bsdiff_malloc(sizeof(*start));
+
+	if (start == NULL)
+		return BSDIFF_OUT_OF_MEMORY;
+	start->func = func;
+	start->arg = arg;
+	bsdiff_mem_get_scope(&start->scope);
+	if (pthread_create(thread, NULL, thread_main, start) != 0) {
+		bsdiff_free(start);
+		return BSDIFF_ERROR;
+	}
+	return BSDIFF_SUCCESS;
+}
+
+void bsdiff_thread_join(bsdiff_thread_t thread)
+{
+	pthread_join(thread, NULL);
+}
+
+int bsdiff_cpu_count(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return (n > 0) ? (int)n : 1;
+}
+
+#endif
+
+/*
+ * Thread pool
+ */
+
+struct bsdiff_thread_pool
+{
+	bsdiff_mutex_t lock;
+	bsdiff_cond_t cond;
+	struct bsdiff_job *head, *tail;
+	int stop;
+	int nthreads;
+	bsdiff_thread_t threads[1];
+};
+
+static void thread_pool_main(void *arg)
+{
+	struct bsdiff_thread_pool *pool = (struct bsdiff_thread_pool*)arg;
+	struct bsdiff_job *job;
+
+	bsdiff_mutex_lock(&pool->lock);
+	while (1) {
+		if (pool->head != NULL) {
+			job = pool->head;
+			pool->head = job->next;
+			if (pool->head == NULL)
+				pool->tail = NULL;
+			bsdiff_mutex_unlock(&pool->lock);
+
+			bsdiff_mem_set_scope(&job->scope);
+			job->func(job);
+
+			bsdiff_mutex_lock(&pool->lock);
+			job->done = 1;
+			bsdiff_cond_broadcast(&pool->cond);
+		} else if (pool->stop) {
+			break;
+		} else {
+			bsdiff_cond_wait(&pool->cond, &pool->lock);
+		}
+	}
+	bsdiff_mutex_unlock(&pool->lock);
+}
+
+int bsdiff_create_thread_pool(int nthreads, struct bsdiff_thread_pool **ppool)
+{
+	struct bsdiff_thread_pool *pool;
+	int i;
+
+	if (nthreads < 1)
+		nthreads = 1;
+	pool = bsdiff_malloc(sizeof(*pool) + (size_t)(nthreads - 1) * sizeof(bsdiff_thread_t));
+	if (pool == NULL)
+		return BSDIFF_OUT_OF_MEMORY;
+	pool->head = pool->tail = NULL;
+	pool->stop = 0;
+	pool->nthreads = 0;
+	if (bsdiff_mutex_init(&pool->lock) != BSDIFF_SUCCESS) {
+		bsdiff_free(pool);
+		return BSDIFF_ERROR;
+	}
+	if (bsdiff_cond_init(&pool->cond) != BSDIFF_SUCCESS) {
+		bsdiff_mutex_destroy(&pool->lock);
+		bsdiff_free(pool);
+		return BSDIFF_ERROR;
+	}
+	for (i = 0; i < nthreads; i++) {
+		if (bsdiff_thread_create(&pool->threads[i], thread_pool_main, pool) != BSDIFF_SUCCESS) {
+			bsdiff_close_thread_pool(pool);
+			return BSDIFF_ERROR;
+		}
+		pool->nthreads++;
+	}
+
+	*ppool = pool;
+	return BSDIFF_SUCCESS;
+}
+
+int bsdiff_thread_pool_size(const struct bsdiff_thread_pool *pool)
+{
+	return pool->nthreads;
+}
+
+void bsdiff_thread_pool_submit(struct bsdiff_thread_pool *pool, struct bsdiff_job *job)
+{
+	job->done = 0;
+	job->next = NULL;
+	bsdiff_mem_get_scope(&job->scope);
+
+	bsdiff_mutex_lock(&pool->lock);
+	if (pool->tail != NULL)
+		pool->tail->next = job;
+	else
+		pool->head = job;
+	pool->tail = job;
+	bsdiff_cond_broadcast(&pool->cond);
+	bsdiff_mutex_unlock(&pool->lock);
+}
+
+void bsdiff_thread_pool_wait(struct bsdiff_thread_pool *pool, struct bsdiff_job *job)
+{
+	bsdiff_mutex_lock(&pool->lock);
+	while (!job->done)
+		bsdiff_cond_wait(&pool->cond, &pool->lock);
+	bsdiff_mutex_unlock(&pool->lock);
+}
+
+void bsdiff_close_thread_pool(struct bsdiff_thread_pool *pool)
+{
+	int i;
+
+	if (pool == NULL)
+		return;
+
+	bsdiff_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	bsdiff_cond_broadcast(&pool->cond);
+	bsdiff_mutex_unlock(&pool->lock);
+	for (i = 0; i < pool->nthreads; i++)
+		bsdiff_thread_join(pool->threads[i]);
+
+	bsdiff_cond_destroy(&pool->cond);
+	bsdiff_mutex_destroy(&pool->lock);
+	bsdiff_free(pool);
+}
@@ -0,0 +1,86 @@
+/** @file bsdiff_thread.h */
+
+#ifndef __BSDIFF_THREAD_H__
+#define __BSDIFF_THREAD_H__
+
+#include <stdint.h>
+#include "bsdiff_mem.h"
+
+/*
+ * Minimal threading primitives over pthreads or the Win32 API, used by the
+ * compressors that run on worker threads.
+ */
+
+#ifdef _WIN32
+#  include <windows.h>
+typedef CRITICAL_SECTION bsdiff_mutex_t;
+typedef CONDITION_VARIABLE bsdiff_cond_t;
+typedef HANDLE bsdiff_thread_t;
+#else
+#  include <pthread.h>
+typedef pthread_mutex_t bsdiff_mutex_t;
+typedef pthread_cond_t bsdiff_cond_t;
+typedef pthread_t bsdiff_thread_t;
+#endif
+
+int  bsdiff_mutex_init(bsdiff_mutex_t *mutex);
+void bsdiff_mutex_destroy(bsdiff_mutex_t *mutex);
+void bsdiff_mutex_lock(bsdiff_mutex_t *mutex);
+void bsdiff_mutex_unlock(bsdiff_mutex_t *mutex);
+
+int  bsdiff_cond_init(bsdiff_cond_t *cond);
+void bsdiff_cond_destroy(bsdiff_cond_t *cond);
+void bsdiff_cond_wait(bsdiff_cond_t *cond, bsdiff_mutex_t *mutex);
+void bsdiff_cond_broadcast(bsdiff_cond_t *cond);
+
+/* Run func(arg) on a new thread, which must be joined */
+int  bsdiff_thread_create(bsdiff_thread_t *thread, void (*func)(void *arg), void *arg);
+void bsdiff_thread_join(bsdiff_thread_t thread);
+
+/* Number of processors available, at least 1 */
+int  bsdiff_cpu_count(void);
+
+/* A fixed set of threads running jobs in submission order */
+struct bsdiff_thread_pool;
+
+struct bsdiff_job
+{
+	void (*func)(struct bsdiff_job *job);
+	volatile int done;
+	struct bsdiff_job *next;
+	struct bsdiff_mem_scope scope;  /* of the submitter */
+};
+
+int  bsdiff_create_thread_pool(int nthreads, struct bsdiff_thread_pool **pool);
+int  bsdiff_thread_pool_size(const struct bsdiff_thread_pool *pool);
+void bsdiff_thread_pool_submit(struct bsdiff_thread_pool *pool, struct bsdiff_job *job);
+/* Block until 'job' has run */
+void bsdiff_thread_pool_wait(struct bsdiff_thread_pool *pool, struct bsdiff_job *job);
+/* Waits for the submitted jobs */
+void bsdiff_close_thread_pool(struct bsdiff_thread_pool *pool);
+
+/* Atomic operations on a shared counter */
+#if defined(_MSC_VER)
+#  define bsdiff_atomic_add(p, v) (InterlockedExchangeAdd64((volatile LONG64 *)(p), (v)) + (v))
+#  define bsdiff_atomic_load(p) InterlockedCompareExchange64((volatile LONG64 *)(p), 0, 0)
+#  define bsdiff_atomic_store(p, v) ((void)InterlockedExchange64((volatile LONG64 *)(p), (v)))
+#  define bsdiff_atomic_cas(p, expected, desired) \
+	(InterlockedCompareExchange64((volatile LONG64 *)(p), (desired), (expected)) == (expected))
+#else
+#  define bsdiff_atomic_add(p, v) __atomic_add_fetch((p), (v), __ATOMIC_RELAXED)
+#  define bsdiff_atomic_load(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#  define bsdiff_atomic_store(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#  define bsdiff_atomic_cas(p, expected, desired) \
+	__atomic_compare_exchange_n((p), &(int64_t){ (expected) }, (desired), 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+#endif
+
+/* *p = max(*p, v) */
+static inline void bsdiff_atomic_max(volatile int64_t *p, int64_t v)
+{
+	int64_t cur = bsdiff_atomic_load(p);
+
+	while (cur < v && !bsdiff_atomic_cas(p, cur, v))
+		cur = bsdiff_atomic_load(p);
+}
+
+#endif /* !__BSDIFF_THREAD_H__ */
@@ -0,0 +1,86 @@
+/** @file bsdiff_varint.h */
+
+#ifndef __BSDIFF_VARINT_H__
+#define __BSDIFF_VARINT_H__
+
+#include <stdint.h>
+#if defined(_MSC_VER)
+#  include <intrin.h>
+#endif
+
+/*
+ * LEB128 varints: 7 bits per byte, least significant group first, the high
+ * bit set on all bytes but the last. A uint64_t takes up to 10 bytes.
+ */
+#define BSDIFF_MAX_VARINT 10
+
+static inline uint64_t bsdiff_load_le64(const uint8_t *p)
+{
+	return ((uint64_t)p[0]) | ((uint64_t)p[1] << 8) |
+	       ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) |
+	       ((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) |
+	       ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+}
+
+static inline int bsdiff_ctz64(uint64_t x)
+{
+#if defined(_MSC_VER)
+	unsigned long i;
+	_BitScanForward64(&i, x);
+	return (int)i;
+#else
+	return __builtin_ctzll(x);
+#endif
+}
+
+static inline uint8_t *bsdiff_encode_varint(uint64_t v, uint8_t *p)
+{
+	while (v >= 0x80) {
+		*p++ = (uint8_t)(v | 0x80);
+		v >>= 7;
+	}
+	*p++ = (uint8_t)v;
+	return p;
+}
+
+/*
+ * Decode a varint of up to 8 bytes without a loop: the first byte without
+ * the continuation bit ends it, and the 7-bit groups are packed together
+ * with shifts. 'p' must be followed by at least 8 readable bytes. Returns
+ * NULL if the varint is longer than 10 bytes.
+ */
+static inline const uint8_t *bsdiff_decode_varint(const uint8_t *p, uint64_t *value)
+{
+	uint64_t w = bsdiff_load_le64(p);
+	uint64_t stop = ~w & 0x8080808080808080ULL;
+	uint64_t v;
+	int bits, i;
+
+	if (stop != 0) {
+		bits = bsdiff_ctz64(stop) + 1;
+		if (bits < 64)
+			w &= (1ULL << bits) - 1;
+		*value = (w & 0x7fULL) |
+		         ((w >> 1) & (0x7fULL << 7)) |
+		         ((w >> 2) & (0x7fULL << 14)) |
+		         ((w >> 3) & (0x7fULL << 21)) |
+		         ((w >> 4) & (0x7fULL << 28)) |
+		         ((w >> 5) & (0x7fULL << 35)) |
+		         ((w >> 6) & (0x7fULL << 42)) |
+		         ((w >> 7) & (0x7fULL << 49));
+		return p + bits / 8;
+	}
+
+	/* 9 or 10 bytes, only for values of 2^56 and above */
+	v = 0;
+	for (i = 0; i < 10; i++) {
+		v |= (uint64_t)(p[i] & 0x7f) << (7 * i);
+		if (!(p[i] & 0x80)) {
+			*value = v;
+			return p + i + 1;
+		}
+	}
+	return NULL;
+}
+
+#endif /* !__BSDIFF_VARINT_H__ */
@@ -36,54 +36,131 @@
 #include "bsdiff_private.h"
 #include "bsdiff_mem.h"
 
-int bspatch(
+/* The old file, either fully in memory or read through a page cache */
+struct old_file
+{
+	const uint8_t *data;
+	int64_t size;
+	uint8_t *owned;
+	struct bsdiff_page_cache *cache;
+};
+
+static int load_old(
 	struct bsdiff_ctx *ctx,
-	struct bsdiff_stream *oldfile, 
-	struct bsdiff_stream *newfile,
-	struct bsdiff_patch_packer *packer)
+	struct bsdiff_stream *oldfile,
+	struct old_file *old)
 {
 	int ret;
 	size_t cb;
-	int64_t oldsize, newsize;
-	uint8_t *old = NULL;
-	int64_t oldpos, newpos;
-	int64_t ctrl[3];
-	int64_t i;
+	const void *buf;
 
-	if (ctx == NULL || oldfile == NULL || newfile == NULL || packer == NULL)
-		return BSDIFF_INVALID_ARG;
+	memset(old, 0, sizeof(*old));
 
-	assert(oldfile->get_mode(oldfile->state) == BSDIFF_MODE_READ);
-	assert(newfile->get_mode(newfile->state) == BSDIFF_MODE_WRITE);
-	
 	/* Check if oldfile provides a direct buffer (e.g., mmap) */
-	if (oldfile->get_buffer && oldfile->get_buffer(oldfile->state, (const void **)&old, &cb) == BSDIFF_SUCCESS)
+	if (oldfile->get_buffer && oldfile->get_buffer(oldfile->state, &buf, &cb) == BSDIFF_SUCCESS)
 	{
-		oldsize = (int64_t)cb;
+		old->data = (const uint8_t *)buf;
+		old->size = (int64_t)cb;
+		return BSDIFF_SUCCESS;
 	}
-	else
+
+	if ((oldfile->seek(oldfile->state, 0, BSDIFF_SEEK_END) != BSDIFF_SUCCESS) ||
+		(oldfile->tell(oldfile->state, &old->size) != BSDIFF_SUCCESS) ||
+		(oldfile->seek(oldfile->state, 0, BSDIFF_SEEK_SET) != BSDIFF_SUCCESS))
 	{
-		if ((oldfile->seek(oldfile->state, 0, BSDIFF_SEEK_END) != BSDIFF_SUCCESS) ||
-			(oldfile->tell(oldfile->state, &oldsize) != BSDIFF_SUCCESS) ||
-			(oldfile->seek(oldfile->state, 0, BSDIFF_SEEK_SET) != BSDIFF_SUCCESS))
-		{
-			HANDLE_ERROR(BSDIFF_FILE_ERROR, "retrieve size of oldfile");
-		}
-		if (oldsize >= SIZE_MAX)
-			HANDLE_ERROR(BSDIFF_SIZE_TOO_LARGE, "oldfile is too large");
-		if ((old = bsdiff_malloc((size_t)(oldsize + 1))) == NULL)
-			HANDLE_ERROR(BSDIFF_OUT_OF_MEMORY, "malloc for old");
-		if ((oldfile->read(oldfile->state, old, (size_t)oldsize, &cb) != BSDIFF_SUCCESS) ||
-			(cb != (size_t)oldsize))
-		{
-			HANDLE_ERROR(BSDIFF_FILE_ERROR, "read oldfile");
-		}
+		HANDLE_ERROR(BSDIFF_FILE_ERROR, "retrieve size of oldfile");
 	}
 
-	if (packer->read_new_size(packer->state, &newsize) != BSDIFF_SUCCESS)
-		HANDLE_ERROR(BSDIFF_FILE_ERROR, "read new size from patch_packer");
-	if (newsize >= SIZE_MAX)
-		HANDLE_ERROR(BSDIFF_SIZE_TOO_LARGE, "newfile is too large");
+	/* Read on demand, with bounded memory */
+	if (ctx->old_cache_size > 0) {
+		if ((ret = bsdiff_open_page_cache(oldfile, old->size, ctx->old_cache_size, &old->cache)) != BSDIFF_SUCCESS)
+			HANDLE_ERROR(ret, "create page cache for oldfile");
+		return BSDIFF_SUCCESS;
+	}
+
+	if (old->size >= SIZE_MAX)
+		HANDLE_ERROR(BSDIFF_SIZE_TOO_LARGE, "oldfile is too large");
+	if ((old->owned = bsdiff_malloc((size_t)(old->size + 1))) == NULL)
+		HANDLE_ERROR(BSDIFF_OUT_OF_MEMORY, "malloc for old");
+	if ((oldfile->read(oldfile->state, old->owned, (size_t)old->size, &cb) != BSDIFF_SUCCESS) ||
+		(cb != (size_t)old->size))
+	{
+		HANDLE_ERROR(BSDIFF_FILE_ERROR, "read oldfile");
+	}
+	old->data = old->owned;
+
+	return BSDIFF_SUCCESS;
+
+cleanup:
+	if (old->owned != NULL) { bsdiff_free(old->owned); old->owned = NULL; }
+	return ret;
+}
+
+static void release_old(struct old_file *old)
+{
+	if (old->owned != NULL) { bsdiff_free(old->owned); }
+	bsdiff_close_page_cache(old->cache);
+	memset(old, 0, sizeof(*old));
+}
+
+/*
+ * Flush the new file and report a checkpoint, if one is due.
+ */
+static int maybe_checkpoint(
+	struct bsdiff_ctx *ctx,
+	struct bsdiff_stream *newfile,
+	int64_t entry,
+	int64_t newpos,
+	int64_t oldpos,
+	int64_t *last)
+{
+	int ret;
+	struct bsdiff_checkpoint cp;
+
+	if (ctx->checkpoint == NULL || ctx->checkpoint_interval <= 0)
+		return BSDIFF_SUCCESS;
+	if (*last == INT64_MAX || newpos - *last < ctx->checkpoint_interval)
+		return BSDIFF_SUCCESS;
+
+	if (newfile->flush(newfile->state) != BSDIFF_SUCCESS)
+		HANDLE_ERROR(BSDIFF_FILE_ERROR, "flush newfile");
+	cp.entry = entry;
+	cp.newpos = newpos;
+	cp.oldpos = oldpos;
+	if ((ret = ctx->checkpoint(ctx->opaque, &cp)) != BSDIFF_SUCCESS)
+		HANDLE_ERROR(ret, "checkpoint at %lld", (long long)newpos);
+	*last = newpos;
+
+	ret = BSDIFF_SUCCESS;
+
+cleanup:
+	return ret;
+}
+
+/*
+ * Re-create [newpos, newend) of the new file, the packer must be positioned at
+ * the entry which produces byte 'newpos', and 'oldpos' is the matching position
+ * in the old file. 'entry' is the index of that entry. Checkpoints are only
+ * reported when 'checkpoints' is set.
+ */
+static int apply_entries(
+	struct bsdiff_ctx *ctx,
+	const struct old_file *old,
+	struct bsdiff_stream *newfile,
+	struct bsdiff_patch_packer *packer,
+	int64_t newsize,
+	int64_t newpos,
+	int64_t newend,
+	int64_t oldpos,
+	int64_t entry,
+	int checkpoints)
+{
+	int ret;
+	size_t cb;
+	int64_t ctrl[3];
+	int64_t i, n;
+	const void *view;
+	int64_t last_checkpoint = checkpoints ? newpos : INT64_MAX;
 
 	/* Allocate a scratch buffer for processing */
 	size_t buffer_size = 128 * 1024;
@@ -91,8 +168,7 @@ int bspatch(
 	if (buffer == NULL)
 		HANDLE_ERROR(BSDIFF_OUT_OF_MEMORY, "malloc for scratch buffer");
 
-	oldpos = 0; newpos = 0;
-	while (newpos < newsize) {
+	while (newpos < newend) {
 		/* Read control data */
 		ret = packer->read_entry_header(packer->state, &ctrl[0], &ctrl[1], &ctrl[2]);
 		if (ret != BSDIFF_SUCCESS && ret != BSDIFF_END_OF_FILE)
@@ -105,54 +181,102 @@ int bspatch(
 			HANDLE_ERROR(BSDIFF_CORRUPT_PATCH, "invalid control data");
 
 		/* Process diff string in chunks */
-		for (i = 0; i < ctrl[0]; ) {
-			size_t len = (size_t)(ctrl[0] - i);
+		n = ctrl[0];
+		if (n > newend - newpos)
+			n = newend - newpos;
+		for (i = 0; i < n; ) {
+			size_t len = (size_t)(n - i);
 			if (len > buffer_size)
 				len = buffer_size;
 
-			ret = packer->read_entry_diff(packer->state, buffer, len, &cb);
+			if (packer->view_entry_diff != NULL) {
+				ret = packer->view_entry_diff(packer->state, len, &view, &cb);
+			} else {
+				ret = packer->read_entry_diff(packer->state, buffer, len, &cb);
+				view = buffer;
+			}
 			if ((ret != BSDIFF_SUCCESS && ret != BSDIFF_END_OF_FILE) || (cb != len))
 				HANDLE_ERROR(BSDIFF_FILE_ERROR, "read diff string");
 
 			/* Add old data to diff string */
-			for (size_t j = 0; j < len; j++) {
-				if ((oldpos + i + (int64_t)j >= 0) && (oldpos + i + (int64_t)j < oldsize))
-					buffer[j] += old[oldpos + i + (int64_t)j];
+			if (old->cache != NULL) {
+				if (view != buffer)
+					memcpy(buffer, view, len);
+				if ((ret = bsdiff_page_cache_add(old->cache, oldpos, buffer, len)) != BSDIFF_SUCCESS)
+					HANDLE_ERROR(ret, "read oldfile");
+			} else {
+				const uint8_t *diff = (const uint8_t *)view;
+				for (size_t j = 0; j < len; j++) {
+					if ((oldpos + (int64_t)j >= 0) && (oldpos + (int64_t)j < old->size))
+						buffer[j] = diff[j] + old->data[oldpos + (int64_t)j];
+					else
+						buffer[j] = diff[j];
+				}
 			}
 
 			if (newfile->write(newfile->state, buffer, len) != BSDIFF_SUCCESS)
 				HANDLE_ERROR(BSDIFF_FILE_ERROR, "write newfile");
 
+			/* Adjust pointers */
 			i += (int64_t)len;
-		}
+			newpos += (int64_t)len;
+			oldpos += (int64_t)len;
 
-		/* Adjust pointers */
-		newpos += ctrl[0];
-		oldpos += ctrl[0];
+			if (i < ctrl[0] || ctrl[1] > 0) {
+				ret = maybe_checkpoint(ctx, newfile, entry, newpos, oldpos, &last_checkpoint);
+				if (ret != BSDIFF_SUCCESS)
+					goto cleanup;
+			}
+		}
+		if (newpos == newend)
+			break;
 
 		/* Sanity-check */
 		if (ctrl[1] > newsize - newpos)
 			HANDLE_ERROR(BSDIFF_CORRUPT_PATCH, "invalid control data");
 
 		/* Process extra string in chunks */
-		for (i = 0; i < ctrl[1]; ) {
-			size_t len = (size_t)(ctrl[1] - i);
+		n = ctrl[1];
+		if (n > newend - newpos)
+			n = newend - newpos;
+		for (i = 0; i < n; ) {
+			size_t len = (size_t)(n - i);
 			if (len > buffer_size)
 				len = buffer_size;
 
-			ret = packer->read_entry_extra(packer->state, buffer, len, &cb);
+			/* Extra bytes go to the new file as they are, from a view if possible */
+			if (packer->view_entry_extra != NULL) {
+				ret = packer->view_entry_extra(packer->state, len, &view, &cb);
+			} else {
+				ret = packer->read_entry_extra(packer->state, buffer, len, &cb);
+				view = buffer;
+			}
 			if ((ret != BSDIFF_SUCCESS && ret != BSDIFF_END_OF_FILE) || (cb != len))
 				HANDLE_ERROR(BSDIFF_FILE_ERROR, "read extra string");
 
-			if (newfile->write(newfile->state, buffer, len) != BSDIFF_SUCCESS)
+			if (newfile->write(newfile->state, view, len) != BSDIFF_SUCCESS)
 				HANDLE_ERROR(BSDIFF_FILE_ERROR, "write newfile");
 
 			i += (int64_t)len;
+			newpos += (int64_t)len;
+
+			if (i < ctrl[1]) {
+				ret = maybe_checkpoint(ctx, newfile, entry, newpos, oldpos, &last_checkpoint);
+				if (ret != BSDIFF_SUCCESS)
+					goto cleanup;
+			}
 		}
 
 		/* Adjust pointers */
-		newpos += ctrl[1];
 		oldpos += ctrl[2];
+		entry++;
+
+		/* Entry boundary */
+		if (newpos < newend) {
+			ret = maybe_checkpoint(ctx, newfile, entry, newpos, oldpos, &last_checkpoint);
+			if (ret != BSDIFF_SUCCESS)
+				goto cleanup;
+		}
 	}
 
 	/* Flush the new file */
@@ -163,7 +287,134 @@ int bspatch(
 
 cleanup:
 	if (buffer != NULL) { bsdiff_free(buffer); }
-	if (old != NULL && (oldfile->get_buffer == NULL)) { bsdiff_free(old); }
+
+	return ret;
+}
+
+int bspatch(
+	struct bsdiff_ctx *ctx,
+	struct bsdiff_stream *oldfile, 
+	struct bsdiff_stream *newfile,
+	struct bsdiff_patch_packer *packer)
+{
+	int ret;
+	int64_t newsize;
+	struct old_file old;
+	struct bsdiff_mem_scope scope;
+
+	if (ctx == NULL || oldfile == NULL || newfile == NULL || packer == NULL)
+		return BSDIFF_INVALID_ARG;
+
+	assert(oldfile->get_mode(oldfile->state) == BSDIFF_MODE_READ);
+	assert(newfile->get_mode(newfile->state) == BSDIFF_MODE_WRITE);
+
+	bsdiff_mem_enter(ctx, &scope);
+
+	if ((ret = load_old(ctx, oldfile, &old)) != BSDIFF_SUCCESS)
+		goto cleanup;
+
+	if (packer->read_new_size(packer->state, &newsize) != BSDIFF_SUCCESS)
+		HANDLE_ERROR(BSDIFF_FILE_ERROR, "read new size from patch_packer");
+	if (newsize >= SIZE_MAX)
+		HANDLE_ERROR(BSDIFF_SIZE_TOO_LARGE, "newfile is too large");
+
+	ret = apply_entries(ctx, &old, newfile, packer, newsize, 0, newsize, 0, 0, 1);
+
+cleanup:
+	release_old(&old);
+	bsdiff_mem_leave(&scope);
+
+	return ret;
+}
+
+int bspatch_range(
+	struct bsdiff_ctx *ctx,
+	struct bsdiff_stream *oldfile,
+	struct bsdiff_patch_packer *packer,
+	int64_t offset,
+	int64_t length,
+	struct bsdiff_stream *out)
+{
+	int ret;
+	int64_t newsize, oldpos;
+	struct old_file old;
+	struct bsdiff_mem_scope scope;
+
+	if (ctx == NULL || oldfile == NULL || packer == NULL || out == NULL)
+		return BSDIFF_INVALID_ARG;
+	if (packer->seek_new_pos == NULL || offset < 0 || length < 0)
+		return BSDIFF_INVALID_ARG;
+
+	assert(oldfile->get_mode(oldfile->state) == BSDIFF_MODE_READ);
+	assert(out->get_mode(out->state) == BSDIFF_MODE_WRITE);
+
+	bsdiff_mem_enter(ctx, &scope);
+
+	if ((ret = load_old(ctx, oldfile, &old)) != BSDIFF_SUCCESS)
+		goto cleanup;
+
+	if (packer->read_new_size(packer->state, &newsize) != BSDIFF_SUCCESS)
+		HANDLE_ERROR(BSDIFF_FILE_ERROR, "read new size from patch_packer");
+	if (offset > newsize || length > newsize - offset)
+		HANDLE_ERROR(BSDIFF_INVALID_ARG, "range is out of the new file");
+
+	/* Jump to the entry covering offset */
+	if (packer->seek_new_pos(packer->state, offset, &oldpos) != BSDIFF_SUCCESS)
+		HANDLE_ERROR(BSDIFF_CORRUPT_PATCH, "seek patch_packer to %lld", (long long)offset);
+
+	ret = apply_entries(ctx, &old, out, packer, newsize, offset, offset + length, oldpos, 0, 0);
+
+cleanup:
+	release_old(&old);
+	bsdiff_mem_leave(&scope);
+
+	return ret;
+}
+
+int bspatch_resume(
+	struct bsdiff_ctx *ctx,
+	struct bsdiff_stream *oldfile,
+	struct bsdiff_stream *newfile,
+	struct bsdiff_patch_packer *packer,
+	const struct bsdiff_checkpoint *checkpoint)
+{
+	int ret;
+	int64_t newsize, oldpos;
+	struct old_file old;
+	struct bsdiff_mem_scope scope;
+
+	if (ctx == NULL || oldfile == NULL || newfile == NULL || packer == NULL || checkpoint == NULL)
+		return BSDIFF_INVALID_ARG;
+	if (packer->seek_new_pos == NULL || checkpoint->newpos < 0 || checkpoint->entry < 0)
+		return BSDIFF_INVALID_ARG;
+
+	assert(oldfile->get_mode(oldfile->state) == BSDIFF_MODE_READ);
+	assert(newfile->get_mode(newfile->state) == BSDIFF_MODE_WRITE);
+
+	bsdiff_mem_enter(ctx, &scope);
+
+	if ((ret = load_old(ctx, oldfile, &old)) != BSDIFF_SUCCESS)
+		goto cleanup;
+
+	if (packer->read_new_size(packer->state, &newsize) != BSDIFF_SUCCESS)
+		HANDLE_ERROR(BSDIFF_FILE_ERROR, "read new size from patch_packer");
+	if (checkpoint->newpos > newsize)
+		HANDLE_ERROR(BSDIFF_INVALID_ARG, "checkpoint is beyond the new file");
+
+	/* Jump to the checkpoint, it must agree with the patch */
+	if (packer->seek_new_pos(packer->state, checkpoint->newpos, &oldpos) != BSDIFF_SUCCESS)
+		HANDLE_ERROR(BSDIFF_CORRUPT_PATCH, "seek patch_packer to %lld", (long long)checkpoint->newpos);
+	if (oldpos != checkpoint->oldpos)
+		HANDLE_ERROR(BSDIFF_INVALID_ARG, "checkpoint does not match the patch");
+	if (newfile->seek(newfile->state, checkpoint->newpos, BSDIFF_SEEK_SET) != BSDIFF_SUCCESS)
+		HANDLE_ERROR(BSDIFF_FILE_ERROR, "seek newfile to %lld", (long long)checkpoint->newpos);
+
+	ret = apply_entries(ctx, &old, newfile, packer, newsize,
+		checkpoint->newpos, newsize, oldpos, checkpoint->entry, 1);
+
+cleanup:
+	release_old(&old);
+	bsdiff_mem_leave(&scope);
 
 	return ret;
 }
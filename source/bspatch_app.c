@@ -26,15 +26,119 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "bsdiff.h"
 
+#if defined(_WIN32)
+#	include <windows.h>
+#	include <io.h>
+#	include <fcntl.h>
+#else
+#	include <fcntl.h>
+#	include <unistd.h>
+#endif
+
+struct checkpoint_file
+{
+	const char *newname;
+	char *path;     /* <newfile>.ckpt */
+	char *tmppath;  /* <newfile>.ckpt.tmp */
+};
+
 static void log_error(void *opaque, const char *errmsg)
 {
 	(void)opaque;
 	fprintf(stderr, "%s", errmsg);
 }
 
+/* "-" selects stdin/stdout, e.g. for piping an endsley patch */
+static const char *stdio_name(const char *name, int mode)
+{
+	if (strcmp(name, "-") != 0)
+		return name;
+	return (mode == BSDIFF_MODE_READ) ? "/dev/stdin" : "/dev/stdout";
+}
+
+/* Outputs are written behind through io_uring, or at least through the
+   large-buffer descriptor stream where there is one */
+static int open_output_stream(int mode, const char *name, struct bsdiff_stream *stream)
+{
+	if (bsdiff_open_uring_stream(mode, name, NULL, stream) == BSDIFF_SUCCESS)
+		return BSDIFF_SUCCESS;
+	return bsdiff_open_file_stream(mode, name, stream);
+}
+
+/* Make the contents of a file durable */
+static int sync_file(const char *path)
+{
+	int fd, n;
+#if defined(_WIN32)
+	fd = _open(path, _O_RDWR | _O_BINARY);
+	if (fd == -1)
+		return -1;
+	n = _commit(fd);
+	_close(fd);
+#else
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return -1;
+	n = fsync(fd);
+	close(fd);
+#endif
+	return n;
+}
+
+/*
+ * The sidecar holds one line "bsdiff-checkpoint entry newpos oldpos". It is
+ * written to a temporary file and renamed over the previous one, after the
+ * new file itself has been synced.
+ */
+static int save_checkpoint(void *opaque, const struct bsdiff_checkpoint *cp)
+{
+	struct checkpoint_file *ckpt = (struct checkpoint_file *)opaque;
+	FILE *f;
+
+	if (sync_file(ckpt->newname) != 0)
+		return BSDIFF_FILE_ERROR;
+
+	if ((f = fopen(ckpt->tmppath, "w")) == NULL)
+		return BSDIFF_FILE_ERROR;
+	if (fprintf(f, "bsdiff-checkpoint %lld %lld %lld\n",
+		(long long)cp->entry, (long long)cp->newpos, (long long)cp->oldpos) < 0) {
+		fclose(f);
+		return BSDIFF_FILE_ERROR;
+	}
+	if (fclose(f) != 0 || sync_file(ckpt->tmppath) != 0)
+		return BSDIFF_FILE_ERROR;
+#if defined(_WIN32)
+	if (!MoveFileExA(ckpt->tmppath, ckpt->path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+		return BSDIFF_FILE_ERROR;
+#else
+	if (rename(ckpt->tmppath, ckpt->path) != 0)
+		return BSDIFF_FILE_ERROR;
+#endif
+	return BSDIFF_SUCCESS;
+}
+
+static int load_checkpoint(const struct checkpoint_file *ckpt, struct bsdiff_checkpoint *cp)
+{
+	FILE *f;
+	long long entry, newpos, oldpos;
+	int n;
+
+	if ((f = fopen(ckpt->path, "r")) == NULL)
+		return BSDIFF_FILE_ERROR;
+	n = fscanf(f, "bsdiff-checkpoint %lld %lld %lld", &entry, &newpos, &oldpos);
+	fclose(f);
+	if (n != 3)
+		return BSDIFF_CORRUPT_PATCH;
+	cp->entry = entry;
+	cp->newpos = newpos;
+	cp->oldpos = oldpos;
+	return BSDIFF_SUCCESS;
+}
+
 int main(int argc, char * argv[])
 {
 	int ret = 1;
@@ -42,10 +146,24 @@ int main(int argc, char * argv[])
 	const char *files[3] = { NULL, NULL, NULL };
 	int nfiles = 0;
 	int print_mem_stats = 0;
+	int64_t range_offset = -1, range_length = 0;
+	int64_t checkpoint_interval = 0;
+	long long old_cache_size = 0;
+	int resume = 0;
+	char *endp;
 	int i;
 	struct bsdiff_stream oldfile = { 0 }, newfile = { 0 }, patchfile = { 0 };
+	struct bsdiff_mmap_stream_options patch_map = { BSDIFF_ACCESS_SEQUENTIAL, 0, 0 };
 	struct bsdiff_ctx ctx = { 0 };
 	struct bsdiff_patch_packer packer = { 0 };
+	struct checkpoint_file ckpt = { 0 };
+	const char *dict_name = NULL;
+	struct bsdiff_zstd_dict *dict = NULL;
+	const struct bsdiff_zstd_dict *dicts[1];
+	struct bsdiff_zstd_options zstd_opts = { 0 };
+	struct bsdiff_bz2_options bz2_opts = { 0 };
+	struct bsdiff_stream dictfile = { 0 };
+	struct bsdiff_checkpoint cp;
 
 	for (i = 1; i < argc; i++) {
 		if (strncmp(argv[i], "--", 2) == 0) {
@@ -53,6 +171,45 @@ int main(int argc, char * argv[])
 				packer_name = argv[i] + 9;
 			} else if (strcmp(argv[i], "--mem-stats") == 0) {
 				print_mem_stats = 1;
+			} else if (strncmp(argv[i], "--range=", 8) == 0) {
+				range_offset = strtoll(argv[i] + 8, &endp, 0);
+				if (*endp != ',' || range_offset < 0) {
+					fprintf(stderr, "invalid range: %s\n", argv[i] + 8);
+					return 1;
+				}
+				range_length = strtoll(endp + 1, &endp, 0);
+				if (*endp != '\0' || range_length < 0) {
+					fprintf(stderr, "invalid range: %s\n", argv[i] + 8);
+					return 1;
+				}
+			} else if (strncmp(argv[i], "--checkpoint-interval=", 22) == 0) {
+				checkpoint_interval = strtoll(argv[i] + 22, &endp, 0);
+				if (*endp != '\0' || checkpoint_interval <= 0) {
+					fprintf(stderr, "invalid checkpoint interval: %s\n", argv[i] + 22);
+					return 1;
+				}
+			} else if (strncmp(argv[i], "--old-cache=", 12) == 0) {
+				old_cache_size = strtoll(argv[i] + 12, &endp, 0);
+				if (*endp != '\0' || old_cache_size <= 0) {
+					fprintf(stderr, "invalid old cache size: %s\n", argv[i] + 12);
+					return 1;
+				}
+			} else if (strncmp(argv[i], "--bz2-threads=", 14) == 0) {
+				bz2_opts.threads = (int)strtol(argv[i] + 14, &endp, 0);
+				if (*endp != '\0' || bz2_opts.threads < 0) {
+					fprintf(stderr, "invalid thread count: %s\n", argv[i] + 14);
+					return 1;
+				}
+			} else if (strncmp(argv[i], "--zstd-dict=", 12) == 0) {
+				dict_name = argv[i] + 12;
+			} else if (strncmp(argv[i], "--zstd-max-window-log=", 22) == 0) {
+				zstd_opts.max_window_log = (int)strtol(argv[i] + 22, &endp, 0);
+				if (*endp != '\0' || zstd_opts.max_window_log <= 0) {
+					fprintf(stderr, "invalid window log: %s\n", argv[i] + 22);
+					return 1;
+				}
+			} else if (strcmp(argv[i], "--resume") == 0) {
+				resume = 1;
 			} else {
 				fprintf(stderr, "unknown option: %s\n", argv[i]);
 				return 1;
@@ -64,45 +221,122 @@ int main(int argc, char * argv[])
 	}
 
 	if (nfiles != 3) {
-		fprintf(stderr, "usage: %s [--packer=bz2|zstd] [--mem-stats] oldfile newfile patchfile\n", argv[0]);
+		fprintf(stderr, "usage: %s [--packer=bz2|zstd|seekable|endsley|raw|adaptive] [--range=offset,length] [--checkpoint-interval=bytes] [--resume] [--old-cache=bytes] [--bz2-threads=N] [--zstd-dict=file] [--zstd-max-window-log=N] [--mem-stats] oldfile newfile patchfile\n", argv[0]);
 		return 1;
 	}
 
-	if ((ret = bsdiff_open_mmap_stream(BSDIFF_MODE_READ, files[0], &oldfile)) != BSDIFF_SUCCESS) {
-		fprintf(stderr, "can't open oldfile with mmap: %s\n", files[0]);
-		goto cleanup;
+	if (checkpoint_interval > 0 || resume) {
+		ckpt.newname = files[1];
+		ckpt.path = malloc(strlen(files[1]) + 10);
+		ckpt.tmppath = malloc(strlen(files[1]) + 10);
+		if (ckpt.path == NULL || ckpt.tmppath == NULL) {
+			ret = BSDIFF_OUT_OF_MEMORY;
+			goto cleanup;
+		}
+		sprintf(ckpt.path, "%s.ckpt", files[1]);
+		sprintf(ckpt.tmppath, "%s.ckpt.tmp", files[1]);
+		/* Without a checkpoint, --resume starts from the beginning */
+		if (resume && load_checkpoint(&ckpt, &cp) != BSDIFF_SUCCESS)
+			resume = 0;
 	}
-	if ((ret = bsdiff_open_file_stream(BSDIFF_MODE_WRITE, files[1], &newfile)) != BSDIFF_SUCCESS) {
-		fprintf(stderr, "can't open newfile: %s\n", files[1]);
+
+	if (old_cache_size > 0) {
+		/* Plain reads through a bounded cache, for storage that can't be mapped */
+		if ((ret = bsdiff_open_file_stream(BSDIFF_MODE_READ, files[0], &oldfile)) != BSDIFF_SUCCESS) {
+			fprintf(stderr, "can't open oldfile: %s\n", files[0]);
+			goto cleanup;
+		}
+	} else if ((ret = bsdiff_open_mmap_stream(BSDIFF_MODE_READ, files[0], &oldfile)) != BSDIFF_SUCCESS) {
+		fprintf(stderr, "can't open oldfile with mmap: %s\n", files[0]);
 		goto cleanup;
 	}
-	if ((ret = bsdiff_open_file_stream(BSDIFF_MODE_READ, files[2], &patchfile)) != BSDIFF_SUCCESS) {
+	/* Mapped when possible, so that the raw packer applies the patch from
+	   zero-copy views and zstd decompresses the blocks in place */
+	if ((strcmp(files[2], "-") == 0 || bsdiff_open_mmap_stream_ex(BSDIFF_MODE_READ, files[2], &patch_map, &patchfile) != BSDIFF_SUCCESS) &&
+		(ret = bsdiff_open_file_stream(BSDIFF_MODE_READ, stdio_name(files[2], BSDIFF_MODE_READ), &patchfile)) != BSDIFF_SUCCESS) {
 		fprintf(stderr, "can't open patchfile: %s\n", files[2]);
 		goto cleanup;
 	}
 
+	if (dict_name != NULL) {
+		const void *buf;
+		size_t size;
+		if ((ret = bsdiff_open_mmap_stream(BSDIFF_MODE_READ, dict_name, &dictfile)) != BSDIFF_SUCCESS ||
+			(ret = dictfile.get_buffer(dictfile.state, &buf, &size)) != BSDIFF_SUCCESS ||
+			(ret = bsdiff_create_zstd_dict(buf, size, 0, &dict)) != BSDIFF_SUCCESS) {
+			fprintf(stderr, "can't load dictionary: %s\n", dict_name);
+			goto cleanup;
+		}
+		dicts[0] = dict;
+		zstd_opts.dicts = dicts;
+		zstd_opts.ndicts = 1;
+	}
+
 	if (strcmp(packer_name, "zstd") == 0) {
-		ret = bsdiff_open_zstd_patch_packer(BSDIFF_MODE_READ, &patchfile, &packer);
+		ret = bsdiff_open_zstd_patch_packer_ex(BSDIFF_MODE_READ, &patchfile, &zstd_opts, &packer);
+	} else if (strcmp(packer_name, "seekable") == 0) {
+		ret = bsdiff_open_seekable_patch_packer(BSDIFF_MODE_READ, &patchfile, &packer);
+	} else if (strcmp(packer_name, "endsley") == 0) {
+		ret = bsdiff_open_endsley_patch_packer(BSDIFF_MODE_READ, &patchfile, &packer);
+	} else if (strcmp(packer_name, "raw") == 0) {
+		ret = bsdiff_open_raw_patch_packer(BSDIFF_MODE_READ, &patchfile, &packer);
+	} else if (strcmp(packer_name, "adaptive") == 0) {
+		ret = bsdiff_open_adaptive_patch_packer(BSDIFF_MODE_READ, &patchfile, &packer);
 	} else {
-		ret = bsdiff_open_bz2_patch_packer(BSDIFF_MODE_READ, &patchfile, &packer);
+		ret = bsdiff_open_bz2_patch_packer_ex(BSDIFF_MODE_READ, &patchfile, &bz2_opts, &packer);
 	}
 	if (ret != BSDIFF_SUCCESS) {
 		fprintf(stderr, "can't create patch packer\n");
 		goto cleanup;
 	}
+	/* Resuming needs to jump into the patch, checkpoints are useless without */
+	if ((checkpoint_interval > 0 || resume) && packer.seek_new_pos == NULL) {
+		fprintf(stderr, "--checkpoint-interval and --resume need a seekable patch\n");
+		ret = BSDIFF_INVALID_ARG;
+		goto cleanup;
+	}
+	/* Opened last, so that a rejected run leaves it alone */
+	if ((ret = open_output_stream(resume ? BSDIFF_MODE_UPDATE : BSDIFF_MODE_WRITE, stdio_name(files[1], BSDIFF_MODE_WRITE), &newfile)) != BSDIFF_SUCCESS) {
+		fprintf(stderr, "can't open newfile: %s\n", files[1]);
+		goto cleanup;
+	}
 
 	ctx.log_error = log_error;
+	ctx.old_cache_size = (size_t)old_cache_size;
+	if (checkpoint_interval > 0) {
+		ctx.opaque = &ckpt;
+		ctx.checkpoint_interval = checkpoint_interval;
+		ctx.checkpoint = save_checkpoint;
+	}
 
-	if ((ret = bspatch(&ctx, &oldfile, &newfile, &packer)) != BSDIFF_SUCCESS) {
+	if (range_offset >= 0) {
+		if ((ret = bspatch_range(&ctx, &oldfile, &packer, range_offset, range_length, &newfile)) != BSDIFF_SUCCESS) {
+			fprintf(stderr, "bspatch_range failed: %d\n", ret);
+			goto cleanup;
+		}
+	} else if (resume) {
+		if ((ret = bspatch_resume(&ctx, &oldfile, &newfile, &packer, &cp)) != BSDIFF_SUCCESS) {
+			fprintf(stderr, "bspatch_resume failed: %d\n", ret);
+			goto cleanup;
+		}
+	} else if ((ret = bspatch(&ctx, &oldfile, &newfile, &packer)) != BSDIFF_SUCCESS) {
 		fprintf(stderr, "bspatch failed: %d\n", ret);
 		goto cleanup;
 	}
 
+	/* Done, the checkpoint is obsolete */
+	if (ckpt.path != NULL)
+		remove(ckpt.path);
+
 cleanup:
 	bsdiff_close_patch_packer(&packer);
 	bsdiff_close_stream(&patchfile);
 	bsdiff_close_stream(&newfile);
 	bsdiff_close_stream(&oldfile);
+	free(ckpt.path);
+	free(ckpt.tmppath);
+	bsdiff_free_zstd_dict(dict);
+	bsdiff_close_stream(&dictfile);
 
 	if (print_mem_stats) {
 		struct bsdiff_mem_stats stats;
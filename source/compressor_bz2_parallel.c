@@ -0,0 +1,222 @@
+#include "bsdiff.h"
+#include "bsdiff_mem.h"
+#include "bsdiff_private.h"
+#include "bsdiff_thread.h"
+#include <stdlib.h>
+#include <string.h>
+#include <bzlib.h>
+
+/*
+ * pbzip2-style compression: the input is cut into chunks of one bzip2 block
+ * (900k), each compressed into an independent bzip2 stream on a thread pool.
+ * The streams are written back to back in input order, which any decoder
+ * that handles concatenated bzip2 streams (bzip2, pbzip2, bspatch) reads as
+ * a single one.
+ */
+
+#define BZ2_CHUNK_SIZE 900000
+
+struct bz2_chunk
+{
+	struct bsdiff_job job;
+	char *in;
+	unsigned int in_len;
+	char *out;
+	unsigned int out_len;
+	int result;
+};
+
+struct bz2_parallel_compressor
+{
+	int initialized;
+	struct bsdiff_stream *strm;
+	struct bsdiff_thread_pool *pool;
+
+	struct bz2_chunk *chunks;
+	int nchunks;
+	int head, count;        /* submitted chunks, oldest first */
+	int filling;            /* the chunk after them is being filled */
+	int64_t nstreams;       /* written so far */
+	int error;
+};
+
+static void compress_chunk(struct bsdiff_job *job)
+{
+	struct bz2_chunk *chunk = (struct bz2_chunk*)job;
+
+	/* The worst case expansion of bzip2 is 1% + 600 bytes */
+	chunk->out_len = chunk->in_len + chunk->in_len / 100 + 600;
+	if (BZ2_bzBuffToBuffCompress(chunk->out, &chunk->out_len, chunk->in, chunk->in_len, 9, 0, 30) != BZ_OK)
+		chunk->result = BSDIFF_ERROR;
+	else
+		chunk->result = BSDIFF_SUCCESS;
+}
+
+/* Wait for the oldest submitted chunk and write its stream */
+static int write_oldest(struct bz2_parallel_compressor *enc)
+{
+	struct bz2_chunk *chunk = &enc->chunks[enc->head];
+
+	bsdiff_thread_pool_wait(enc->pool, &chunk->job);
+	enc->head = (enc->head + 1) % enc->nchunks;
+	enc->count--;
+
+	if (enc->error == BSDIFF_SUCCESS) {
+		if (chunk->result != BSDIFF_SUCCESS)
+			enc->error = chunk->result;
+		else if (enc->strm->write(enc->strm->state, chunk->out, chunk->out_len) != BSDIFF_SUCCESS)
+			enc->error = BSDIFF_ERROR;
+		else
+			enc->nstreams++;
+	}
+	return enc->error;
+}
+
+static void submit_filling(struct bz2_parallel_compressor *enc)
+{
+	struct bz2_chunk *chunk = &enc->chunks[(enc->head + enc->count) % enc->nchunks];
+
+	chunk->job.func = compress_chunk;
+	bsdiff_thread_pool_submit(enc->pool, &chunk->job);
+	enc->count++;
+	enc->filling = 0;
+}
+
+/* Get the chunk being filled, recycling the oldest one if all are in use */
+static int get_filling(struct bz2_parallel_compressor *enc, struct bz2_chunk **pchunk)
+{
+	struct bz2_chunk *chunk;
+	int ret;
+
+	if (!enc->filling) {
+		if (enc->count == enc->nchunks && (ret = write_oldest(enc)) != BSDIFF_SUCCESS)
+			return ret;
+		chunk = &enc->chunks[(enc->head + enc->count) % enc->nchunks];
+		if (chunk->in == NULL) {
+			chunk->in = bsdiff_malloc(BZ2_CHUNK_SIZE);
+			chunk->out = bsdiff_malloc(BZ2_CHUNK_SIZE + BZ2_CHUNK_SIZE / 100 + 600);
+			if (chunk->in == NULL || chunk->out == NULL)
+				return BSDIFF_OUT_OF_MEMORY;
+		}
+		chunk->in_len = 0;
+		enc->filling = 1;
+	}
+	*pchunk = &enc->chunks[(enc->head + enc->count) % enc->nchunks];
+	return BSDIFF_SUCCESS;
+}
+
+static int bz2_parallel_compressor_init(void *state, struct bsdiff_stream *stream)
+{
+	struct bz2_parallel_compressor *enc = (struct bz2_parallel_compressor*)state;
+
+	if (enc->initialized)
+		return BSDIFF_ERROR;
+	if (stream->read != NULL || stream->write == NULL || stream->flush == NULL)
+		return BSDIFF_INVALID_ARG;
+	enc->strm = stream;
+
+	/* Two chunks per thread keep the pool busy while the oldest one is written */
+	enc->nchunks = 2 * bsdiff_thread_pool_size(enc->pool);
+	enc->chunks = bsdiff_malloc((size_t)enc->nchunks * sizeof(struct bz2_chunk));
+	if (enc->chunks == NULL)
+		return BSDIFF_OUT_OF_MEMORY;
+	memset(enc->chunks, 0, (size_t)enc->nchunks * sizeof(struct bz2_chunk));
+
+	enc->initialized = 1;
+
+	return BSDIFF_SUCCESS;
+}
+
+static int bz2_parallel_compressor_write(void *state, const void *buffer, size_t size)
+{
+	struct bz2_parallel_compressor *enc = (struct bz2_parallel_compressor*)state;
+	const char *src = (const char*)buffer;
+	struct bz2_chunk *chunk;
+	size_t n;
+	int ret;
+
+	if (!enc->initialized || enc->error != BSDIFF_SUCCESS)
+		return BSDIFF_ERROR;
+
+	while (size > 0) {
+		if ((ret = get_filling(enc, &chunk)) != BSDIFF_SUCCESS)
+			return (enc->error = ret);
+		n = BZ2_CHUNK_SIZE - chunk->in_len;
+		if (n > size)
+			n = size;
+		memcpy(chunk->in + chunk->in_len, src, n);
+		chunk->in_len += (unsigned int)n;
+		src += n;
+		size -= n;
+		if (chunk->in_len == BZ2_CHUNK_SIZE)
+			submit_filling(enc);
+	}
+
+	return BSDIFF_SUCCESS;
+}
+
+static int bz2_parallel_compressor_flush(void *state)
+{
+	struct bz2_parallel_compressor *enc = (struct bz2_parallel_compressor*)state;
+	struct bz2_chunk *chunk;
+	int ret;
+
+	if (!enc->initialized || enc->error != BSDIFF_SUCCESS)
+		return BSDIFF_ERROR;
+
+	/* An empty input still needs one (empty) stream */
+	if (enc->filling || (enc->nstreams == 0 && enc->count == 0)) {
+		if ((ret = get_filling(enc, &chunk)) != BSDIFF_SUCCESS)
+			return (enc->error = ret);
+		submit_filling(enc);
+	}
+	while (enc->count > 0) {
+		if ((ret = write_oldest(enc)) != BSDIFF_SUCCESS)
+			return ret;
+	}
+
+	if (enc->strm->flush(enc->strm->state) != BSDIFF_SUCCESS)
+		return BSDIFF_ERROR;
+	return BSDIFF_SUCCESS;
+}
+
+static void bz2_parallel_compressor_close(void *state)
+{
+	struct bz2_parallel_compressor *enc = (struct bz2_parallel_compressor*)state;
+	int i;
+
+	if (enc->chunks != NULL) {
+		/* The pool may still be running submitted chunks */
+		for (i = 0; i < enc->count; i++)
+			bsdiff_thread_pool_wait(enc->pool, &enc->chunks[(enc->head + i) % enc->nchunks].job);
+		for (i = 0; i < enc->nchunks; i++) {
+			if (enc->chunks[i].in != NULL) { bsdiff_free(enc->chunks[i].in); }
+			if (enc->chunks[i].out != NULL) { bsdiff_free(enc->chunks[i].out); }
+		}
+		bsdiff_free(enc->chunks);
+	}
+
+	bsdiff_free(enc);
+}
+
+int bsdiff_create_bz2_parallel_compressor(
+	struct bsdiff_compressor *enc,
+	struct bsdiff_thread_pool *pool)
+{
+	struct bz2_parallel_compressor *state;
+
+	state = bsdiff_malloc(sizeof(struct bz2_parallel_compressor));
+	if (!state)
+		return BSDIFF_OUT_OF_MEMORY;
+	memset(state, 0, sizeof(*state));
+	state->pool = pool;
+
+	memset(enc, 0, sizeof(*enc));
+	enc->state = state;
+	enc->init = bz2_parallel_compressor_init;
+	enc->write = bz2_parallel_compressor_write;
+	enc->flush = bz2_parallel_compressor_flush;
+	enc->close = bz2_parallel_compressor_close;
+
+	return BSDIFF_SUCCESS;
+}
@@ -0,0 +1,131 @@
+#include "bsdiff.h"
+#include "bsdiff_mem.h"
+#include "bsdiff_private.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Shuffle filter in front of another compressor: the data is cut into
+ * chunks and the bytes of the elements in each chunk are transposed, so
+ * that e.g. the high bytes of a table of integers end up next to each
+ * other. The last chunk may be short.
+ */
+
+#define SHUFFLE_CHUNK_SIZE (256 * 1024)
+
+struct shuffle_compressor
+{
+	struct bsdiff_compressor inner;
+	int initialized;
+	int stride;
+
+	uint8_t *in;
+	size_t len;
+	uint8_t *out;
+};
+
+static int write_chunk(struct shuffle_compressor *enc)
+{
+	size_t len = enc->len;
+
+	bsdiff_shuffle(enc->in, enc->out, len, enc->stride);
+	enc->len = 0;
+	return enc->inner.write(enc->inner.state, enc->out, len);
+}
+
+static int shuffle_compressor_init(void *state, struct bsdiff_stream *stream)
+{
+	struct shuffle_compressor *enc = (struct shuffle_compressor*)state;
+	int ret;
+
+	if (enc->initialized)
+		return BSDIFF_ERROR;
+	if ((ret = enc->inner.init(enc->inner.state, stream)) != BSDIFF_SUCCESS)
+		return ret;
+	enc->initialized = 1;
+
+	return BSDIFF_SUCCESS;
+}
+
+static int shuffle_compressor_write(void *state, const void *buffer, size_t size)
+{
+	struct shuffle_compressor *enc = (struct shuffle_compressor*)state;
+	const uint8_t *src = (const uint8_t*)buffer;
+	size_t n;
+	int ret;
+
+	if (!enc->initialized)
+		return BSDIFF_ERROR;
+
+	while (size > 0) {
+		n = SHUFFLE_CHUNK_SIZE - enc->len;
+		if (n > size)
+			n = size;
+		memcpy(enc->in + enc->len, src, n);
+		enc->len += n;
+		src += n;
+		size -= n;
+		if (enc->len == SHUFFLE_CHUNK_SIZE && (ret = write_chunk(enc)) != BSDIFF_SUCCESS)
+			return ret;
+	}
+
+	return BSDIFF_SUCCESS;
+}
+
+static int shuffle_compressor_flush(void *state)
+{
+	struct shuffle_compressor *enc = (struct shuffle_compressor*)state;
+	int ret;
+
+	if (!enc->initialized)
+		return BSDIFF_ERROR;
+
+	if (enc->len > 0 && (ret = write_chunk(enc)) != BSDIFF_SUCCESS)
+		return ret;
+
+	return enc->inner.flush(enc->inner.state);
+}
+
+static void shuffle_compressor_close(void *state)
+{
+	struct shuffle_compressor *enc = (struct shuffle_compressor*)state;
+
+	bsdiff_close_compressor(&enc->inner);
+	if (enc->in != NULL)
+		bsdiff_free(enc->in);
+	if (enc->out != NULL)
+		bsdiff_free(enc->out);
+	bsdiff_free(enc);
+}
+
+int bsdiff_create_shuffle_compressor(
+	struct bsdiff_compressor *enc,
+	int stride)
+{
+	struct shuffle_compressor *state;
+
+	state = bsdiff_malloc(sizeof(struct shuffle_compressor));
+	if (!state)
+		return BSDIFF_OUT_OF_MEMORY;
+	memset(state, 0, sizeof(*state));
+	state->inner = *enc;
+	state->stride = stride;
+	state->in = bsdiff_malloc(SHUFFLE_CHUNK_SIZE);
+	state->out = bsdiff_malloc(SHUFFLE_CHUNK_SIZE);
+	if (state->in == NULL || state->out == NULL) {
+		shuffle_compressor_close(state);
+		/* The inner compressor was closed with the state */
+		memset(enc, 0, sizeof(*enc));
+		return BSDIFF_OUT_OF_MEMORY;
+	}
+
+	/* 'enc' now shuffles the data for the inner compressor */
+	memset(enc, 0, sizeof(*enc));
+	enc->state = state;
+	enc->init = shuffle_compressor_init;
+	enc->write = shuffle_compressor_write;
+	enc->flush = shuffle_compressor_flush;
+	enc->close = shuffle_compressor_close;
+
+	return BSDIFF_SUCCESS;
+}
@@ -0,0 +1,229 @@
+#include "bsdiff.h"
+#include "bsdiff_mem.h"
+#include "bsdiff_private.h"
+#include "bsdiff_thread.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Runs another compressor on a worker thread. Written data is copied into
+ * chunks which are handed over through a bounded queue, the writer blocks
+ * only when all of the chunks are waiting to be compressed.
+ */
+
+#define THREADED_CHUNK_SIZE (256 * 1024)
+#define THREADED_NUM_CHUNKS 4
+
+struct threaded_compressor
+{
+	struct bsdiff_compressor inner;
+	int started;
+	bsdiff_thread_t thread;
+	bsdiff_mutex_t lock;
+	bsdiff_cond_t cond;
+
+	uint8_t *chunks[THREADED_NUM_CHUNKS];
+	size_t lens[THREADED_NUM_CHUNKS];
+	int free_chunks[THREADED_NUM_CHUNKS];  /* stack of unused chunks */
+	int nfree;
+	int queue[THREADED_NUM_CHUNKS];        /* chunks to compress, in order */
+	int queue_head, queue_count;
+	int current;                           /* the chunk being filled, or -1 */
+
+	int flush_requested;
+	int flush_result;
+	int stop;
+	int error;
+};
+
+static void threaded_compressor_main(void *arg)
+{
+	struct threaded_compressor *enc = (struct threaded_compressor*)arg;
+	int chunk, ret, error;
+
+	bsdiff_mutex_lock(&enc->lock);
+	while (1) {
+		if (enc->queue_count > 0) {
+			chunk = enc->queue[enc->queue_head];
+			enc->queue_head = (enc->queue_head + 1) % THREADED_NUM_CHUNKS;
+			enc->queue_count--;
+			error = enc->error;
+			bsdiff_mutex_unlock(&enc->lock);
+
+			ret = BSDIFF_SUCCESS;
+			if (!error)
+				ret = enc->inner.write(enc->inner.state, enc->chunks[chunk], enc->lens[chunk]);
+
+			bsdiff_mutex_lock(&enc->lock);
+			if (ret != BSDIFF_SUCCESS)
+				enc->error = ret;
+			enc->free_chunks[enc->nfree++] = chunk;
+			bsdiff_cond_broadcast(&enc->cond);
+		} else if (enc->flush_requested) {
+			error = enc->error;
+			bsdiff_mutex_unlock(&enc->lock);
+			ret = error ? error : enc->inner.flush(enc->inner.state);
+			bsdiff_mutex_lock(&enc->lock);
+			enc->flush_result = ret;
+			enc->flush_requested = 0;
+			bsdiff_cond_broadcast(&enc->cond);
+		} else if (enc->stop) {
+			break;
+		} else {
+			bsdiff_cond_wait(&enc->cond, &enc->lock);
+		}
+	}
+	bsdiff_mutex_unlock(&enc->lock);
+}
+
+/* Queue the chunk being filled, the caller holds the lock */
+static void push_current(struct threaded_compressor *enc)
+{
+	if (enc->current == -1)
+		return;
+	enc->queue[(enc->queue_head + enc->queue_count) % THREADED_NUM_CHUNKS] = enc->current;
+	enc->queue_count++;
+	enc->current = -1;
+	bsdiff_cond_broadcast(&enc->cond);
+}
+
+static int threaded_compressor_init(void *state, struct bsdiff_stream *stream)
+{
+	struct threaded_compressor *enc = (struct threaded_compressor*)state;
+	int ret;
+
+	if (enc->started)
+		return BSDIFF_ERROR;
+	if ((ret = enc->inner.init(enc->inner.state, stream)) != BSDIFF_SUCCESS)
+		return ret;
+	if ((ret = bsdiff_thread_create(&enc->thread, threaded_compressor_main, enc)) != BSDIFF_SUCCESS)
+		return ret;
+	enc->started = 1;
+
+	return BSDIFF_SUCCESS;
+}
+
+static int threaded_compressor_write(void *state, const void *buffer, size_t size)
+{
+	struct threaded_compressor *enc = (struct threaded_compressor*)state;
+	const uint8_t *src = (const uint8_t*)buffer;
+	size_t n;
+	int ret = BSDIFF_SUCCESS;
+
+	if (!enc->started)
+		return BSDIFF_ERROR;
+
+	bsdiff_mutex_lock(&enc->lock);
+	while (size > 0) {
+		if (enc->error) {
+			ret = enc->error;
+			break;
+		}
+		if (enc->current == -1) {
+			while (enc->nfree == 0 && !enc->error)
+				bsdiff_cond_wait(&enc->cond, &enc->lock);
+			if (enc->error)
+				continue;
+			enc->current = enc->free_chunks[--enc->nfree];
+			enc->lens[enc->current] = 0;
+		}
+		/* Only the chunk being filled is touched without the lock */
+		bsdiff_mutex_unlock(&enc->lock);
+		n = THREADED_CHUNK_SIZE - enc->lens[enc->current];
+		if (n > size)
+			n = size;
+		memcpy(enc->chunks[enc->current] + enc->lens[enc->current], src, n);
+		enc->lens[enc->current] += n;
+		src += n;
+		size -= n;
+		bsdiff_mutex_lock(&enc->lock);
+		if (enc->lens[enc->current] == THREADED_CHUNK_SIZE)
+			push_current(enc);
+	}
+	bsdiff_mutex_unlock(&enc->lock);
+
+	return ret;
+}
+
+static int threaded_compressor_flush(void *state)
+{
+	struct threaded_compressor *enc = (struct threaded_compressor*)state;
+	int ret;
+
+	if (!enc->started)
+		return BSDIFF_ERROR;
+
+	bsdiff_mutex_lock(&enc->lock);
+	push_current(enc);
+	enc->flush_requested = 1;
+	bsdiff_cond_broadcast(&enc->cond);
+	while (enc->flush_requested)
+		bsdiff_cond_wait(&enc->cond, &enc->lock);
+	ret = enc->flush_result;
+	bsdiff_mutex_unlock(&enc->lock);
+
+	return ret;
+}
+
+static void threaded_compressor_close(void *state)
+{
+	struct threaded_compressor *enc = (struct threaded_compressor*)state;
+	int i;
+
+	if (enc->started) {
+		bsdiff_mutex_lock(&enc->lock);
+		enc->stop = 1;
+		bsdiff_cond_broadcast(&enc->cond);
+		bsdiff_mutex_unlock(&enc->lock);
+		bsdiff_thread_join(enc->thread);
+	}
+	bsdiff_close_compressor(&enc->inner);
+	bsdiff_cond_destroy(&enc->cond);
+	bsdiff_mutex_destroy(&enc->lock);
+	for (i = 0; i < THREADED_NUM_CHUNKS; i++) {
+		if (enc->chunks[i] != NULL) { bsdiff_free(enc->chunks[i]); }
+	}
+	bsdiff_free(enc);
+}
+
+int bsdiff_create_threaded_compressor(
+	struct bsdiff_compressor *enc)
+{
+	struct threaded_compressor *state;
+	int i;
+
+	state = bsdiff_malloc(sizeof(struct threaded_compressor));
+	if (!state)
+		return BSDIFF_OUT_OF_MEMORY;
+	memset(state, 0, sizeof(*state));
+	if (bsdiff_mutex_init(&state->lock) != BSDIFF_SUCCESS) {
+		bsdiff_free(state);
+		return BSDIFF_ERROR;
+	}
+	if (bsdiff_cond_init(&state->cond) != BSDIFF_SUCCESS) {
+		bsdiff_mutex_destroy(&state->lock);
+		bsdiff_free(state);
+		return BSDIFF_ERROR;
+	}
+	state->inner = *enc;
+	state->current = -1;
+	for (i = 0; i < THREADED_NUM_CHUNKS; i++) {
+		state->free_chunks[state->nfree++] = i;
+		if ((state->chunks[i] = bsdiff_malloc(THREADED_CHUNK_SIZE)) == NULL) {
+			threaded_compressor_close(state);
+			/* The inner compressor was closed with the state */
+			memset(enc, 0, sizeof(*enc));
+			return BSDIFF_OUT_OF_MEMORY;
+		}
+	}
+
+	/* 'enc' now drives the inner compressor through the worker */
+	memset(enc, 0, sizeof(*enc));
+	enc->state = state;
+	enc->init = threaded_compressor_init;
+	enc->write = threaded_compressor_write;
+	enc->flush = threaded_compressor_flush;
+	enc->close = threaded_compressor_close;
+
+	return BSDIFF_SUCCESS;
+}
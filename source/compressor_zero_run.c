@@ -0,0 +1,199 @@
+#include "bsdiff.h"
+#include "bsdiff_mem.h"
+#include "bsdiff_private.h"
+#include "bsdiff_varint.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Zero-run transform in front of another compressor. The data is written
+ * as pairs of
+ *
+ *   varint zeros, varint literals, <literals bytes>
+ *
+ * meaning 'zeros' zero bytes followed by the literal bytes. The diff block
+ * is mostly zeros, which then never reach the (much slower) entropy coder.
+ * Zero runs shorter than ZERO_RUN_MIN stay inside the literals, where they
+ * are cheaper than starting a new pair.
+ */
+
+#define ZERO_RUN_MIN 8
+#define ZERO_RUN_LITERALS (64 * 1024)
+#define ZERO_RUN_HEADER (2 * BSDIFF_MAX_VARINT)
+
+struct zero_run_compressor
+{
+	struct bsdiff_compressor inner;
+	int initialized;
+
+	uint64_t zeros;          /* zeros before the pending literals */
+	uint8_t *buf;            /* pair header room, then the literals */
+	size_t nlit;
+	uint64_t trailing;       /* zeros after the pending literals */
+};
+
+static size_t count_zeros(const uint8_t *p, size_t size)
+{
+	size_t n = 0;
+	uint64_t w;
+
+	while (size - n >= 8) {
+		memcpy(&w, p + n, 8);
+		if (w != 0)
+			break;
+		n += 8;
+	}
+	while (n < size && p[n] == 0)
+		n++;
+	return n;
+}
+
+static size_t count_nonzeros(const uint8_t *p, size_t size)
+{
+	size_t n = 0;
+	uint64_t w;
+
+	/* Skip words without a zero byte */
+	while (size - n >= 8) {
+		memcpy(&w, p + n, 8);
+		if (((w - 0x0101010101010101ULL) & ~w & 0x8080808080808080ULL) != 0)
+			break;
+		n += 8;
+	}
+	while (n < size && p[n] != 0)
+		n++;
+	return n;
+}
+
+/* Write the pending pair, as one write to the inner compressor */
+static int emit_pair(struct zero_run_compressor *enc)
+{
+	uint8_t header[ZERO_RUN_HEADER], *p;
+	size_t hlen, nlit = enc->nlit;
+
+	p = bsdiff_encode_varint(enc->zeros, header);
+	p = bsdiff_encode_varint(nlit, p);
+	hlen = (size_t)(p - header);
+	memcpy(enc->buf + ZERO_RUN_HEADER - hlen, header, hlen);
+
+	enc->zeros = 0;
+	enc->nlit = 0;
+	return enc->inner.write(enc->inner.state, enc->buf + ZERO_RUN_HEADER - hlen, hlen + nlit);
+}
+
+static int zero_run_compressor_init(void *state, struct bsdiff_stream *stream)
+{
+	struct zero_run_compressor *enc = (struct zero_run_compressor*)state;
+	int ret;
+
+	if (enc->initialized)
+		return BSDIFF_ERROR;
+	if ((ret = enc->inner.init(enc->inner.state, stream)) != BSDIFF_SUCCESS)
+		return ret;
+	enc->initialized = 1;
+
+	return BSDIFF_SUCCESS;
+}
+
+static int zero_run_compressor_write(void *state, const void *buffer, size_t size)
+{
+	struct zero_run_compressor *enc = (struct zero_run_compressor*)state;
+	const uint8_t *src = (const uint8_t*)buffer;
+	uint8_t *lit;
+	size_t n;
+	int ret;
+
+	if (!enc->initialized)
+		return BSDIFF_ERROR;
+
+	lit = enc->buf + ZERO_RUN_HEADER;
+	while (size > 0) {
+		if (*src == 0) {
+			n = count_zeros(src, size);
+			if (enc->nlit == 0)
+				enc->zeros += n;
+			else
+				enc->trailing += n;
+		} else {
+			if (enc->trailing > 0) {
+				if (enc->trailing >= ZERO_RUN_MIN || enc->nlit + enc->trailing >= ZERO_RUN_LITERALS) {
+					/* The zeros start the next pair */
+					if ((ret = emit_pair(enc)) != BSDIFF_SUCCESS)
+						return ret;
+					enc->zeros = enc->trailing;
+				} else {
+					memset(lit + enc->nlit, 0, (size_t)enc->trailing);
+					enc->nlit += (size_t)enc->trailing;
+				}
+				enc->trailing = 0;
+			}
+			n = count_nonzeros(src, (size < ZERO_RUN_LITERALS - enc->nlit) ? size : ZERO_RUN_LITERALS - enc->nlit);
+			memcpy(lit + enc->nlit, src, n);
+			enc->nlit += n;
+			if (enc->nlit == ZERO_RUN_LITERALS && (ret = emit_pair(enc)) != BSDIFF_SUCCESS)
+				return ret;
+		}
+		src += n;
+		size -= n;
+	}
+
+	return BSDIFF_SUCCESS;
+}
+
+static int zero_run_compressor_flush(void *state)
+{
+	struct zero_run_compressor *enc = (struct zero_run_compressor*)state;
+	int ret;
+
+	if (!enc->initialized)
+		return BSDIFF_ERROR;
+
+	if (enc->nlit > 0) {
+		if ((ret = emit_pair(enc)) != BSDIFF_SUCCESS)
+			return ret;
+		enc->zeros = enc->trailing;
+		enc->trailing = 0;
+	}
+	if (enc->zeros > 0 && (ret = emit_pair(enc)) != BSDIFF_SUCCESS)
+		return ret;
+
+	return enc->inner.flush(enc->inner.state);
+}
+
+static void zero_run_compressor_close(void *state)
+{
+	struct zero_run_compressor *enc = (struct zero_run_compressor*)state;
+
+	bsdiff_close_compressor(&enc->inner);
+	if (enc->buf != NULL)
+		bsdiff_free(enc->buf);
+	bsdiff_free(enc);
+}
+
+int bsdiff_create_zero_run_compressor(
+	struct bsdiff_compressor *enc)
+{
+	struct zero_run_compressor *state;
+
+	state = bsdiff_malloc(sizeof(struct zero_run_compressor));
+	if (!state)
+		return BSDIFF_OUT_OF_MEMORY;
+	memset(state, 0, sizeof(*state));
+	state->inner = *enc;
+	if ((state->buf = bsdiff_malloc(ZERO_RUN_HEADER + ZERO_RUN_LITERALS)) == NULL) {
+		zero_run_compressor_close(state);
+		/* The inner compressor was closed with the state */
+		memset(enc, 0, sizeof(*enc));
+		return BSDIFF_OUT_OF_MEMORY;
+	}
+
+	/* 'enc' now transforms the data for the inner compressor */
+	memset(enc, 0, sizeof(*enc));
+	enc->state = state;
+	enc->init = zero_run_compressor_init;
+	enc->write = zero_run_compressor_write;
+	enc->flush = zero_run_compressor_flush;
+	enc->close = zero_run_compressor_close;
+
+	return BSDIFF_SUCCESS;
+}
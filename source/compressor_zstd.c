@@ -7,6 +7,7 @@
 
 struct zstd_enc_state
 {
+	struct bsdiff_zstd_block_options opts;
 	struct bsdiff_stream *stream;
 	ZSTD_CStream *cctx;
 	ZSTD_outBuffer out;
@@ -25,9 +26,44 @@ static int zstd_enc_init(void *state, struct bsdiff_stream *stream)
 	if (!enc->cctx)
 		return BSDIFF_ERROR;
 
-	ret = ZSTD_initCStream(enc->cctx, ZSTD_CLEVEL_DEFAULT);
+	/* Zero means the zstd default for every parameter */
+	ret = ZSTD_CCtx_setParameter(enc->cctx, ZSTD_c_compressionLevel,
+	                             enc->opts.level ? enc->opts.level : ZSTD_CLEVEL_DEFAULT);
 	if (ZSTD_isError(ret))
-		return BSDIFF_ERROR;
+		return BSDIFF_INVALID_ARG;
+	if (enc->opts.window_log != 0) {
+		ret = ZSTD_CCtx_setParameter(enc->cctx, ZSTD_c_windowLog, enc->opts.window_log);
+		if (ZSTD_isError(ret))
+			return BSDIFF_INVALID_ARG;
+	}
+	if (enc->opts.long_distance_matching) {
+		ret = ZSTD_CCtx_setParameter(enc->cctx, ZSTD_c_enableLongDistanceMatching, 1);
+		if (ZSTD_isError(ret))
+			return BSDIFF_INVALID_ARG;
+	}
+	if (enc->opts.workers > 0) {
+		/* Frames stay standard, only the compression side is parallel */
+		ZSTD_bounds bounds = ZSTD_cParam_getBounds(ZSTD_c_nbWorkers);
+		int workers = enc->opts.workers;
+		if (ZSTD_isError(bounds.error))
+			workers = 0;
+		else if (workers > bounds.upperBound)
+			workers = bounds.upperBound;
+		ret = ZSTD_CCtx_setParameter(enc->cctx, ZSTD_c_nbWorkers, workers);
+		if (ZSTD_isError(ret))
+			return BSDIFF_INVALID_ARG;
+	}
+	if (enc->opts.dict != NULL) {
+		/* The compression level is the one the dictionary was created with */
+		ret = ZSTD_CCtx_refCDict(enc->cctx, (const ZSTD_CDict *)bsdiff_zstd_dict_cdict(enc->opts.dict));
+		if (ZSTD_isError(ret))
+			return BSDIFF_ERROR;
+	}
+	if (enc->opts.strategy != 0) {
+		ret = ZSTD_CCtx_setParameter(enc->cctx, ZSTD_c_strategy, enc->opts.strategy);
+		if (ZSTD_isError(ret))
+			return BSDIFF_INVALID_ARG;
+	}
 
 	enc->out_capacity = ZSTD_CStreamOutSize();
 	enc->out_buffer = bsdiff_malloc(enc->out_capacity);
@@ -93,7 +129,8 @@ static void zstd_enc_close(void *state)
 	bsdiff_free(enc);
 }
 
-int bsdiff_create_zstd_compressor(struct bsdiff_compressor *enc)
+int bsdiff_create_zstd_compressor_ex(struct bsdiff_compressor *enc,
+                                     const struct bsdiff_zstd_block_options *opts)
 {
 	struct zstd_enc_state *state;
 
@@ -102,6 +139,8 @@ int bsdiff_create_zstd_compressor(struct bsdiff_compressor *enc)
 		return BSDIFF_OUT_OF_MEMORY;
 	
 	memset(state, 0, sizeof(struct zstd_enc_state));
+	if (opts)
+		state->opts = *opts;
 
 	enc->state = state;
 	enc->init = zstd_enc_init;
@@ -111,3 +150,8 @@ int bsdiff_create_zstd_compressor(struct bsdiff_compressor *enc)
 
 	return BSDIFF_SUCCESS;
 }
+
+int bsdiff_create_zstd_compressor(struct bsdiff_compressor *enc)
+{
+	return bsdiff_create_zstd_compressor_ex(enc, NULL);
+}
@@ -40,6 +40,38 @@ static int bz2_decompressor_init(void *state, struct bsdiff_stream *stream)
 	return BSDIFF_SUCCESS;
 }
 
+/*
+ * Move past the end of a stream: BSDIFF_END_OF_FILE if the input is done,
+ * otherwise restart decoding for the concatenated stream (e.g. written by
+ * pbzip2 or a parallel bsdiff) that follows.
+ */
+static int next_stream(struct bz2_decompressor *dec)
+{
+	int ret;
+	size_t cb;
+
+	if (dec->bzstrm.avail_in == 0) {
+		ret = dec->strm->read(dec->strm->state, dec->buf, sizeof(dec->buf), &cb);
+		if (ret != BSDIFF_SUCCESS && ret != BSDIFF_END_OF_FILE)
+			return BSDIFF_ERROR;
+		if (cb == 0)
+			return BSDIFF_END_OF_FILE;
+		dec->bzstrm.next_in = dec->buf;
+		dec->bzstrm.avail_in = (unsigned int)cb;
+	}
+	/* Like bzip2, ignore trailing garbage */
+	if (dec->bzstrm.next_in[0] != 'B')
+		return BSDIFF_END_OF_FILE;
+
+	BZ2_bzDecompressEnd(&(dec->bzstrm));
+	if (BZ2_bzDecompressInit(&(dec->bzstrm), 0, 0) != BZ_OK) {
+		dec->initialized = 0;
+		return BSDIFF_ERROR;
+	}
+	dec->bzerr = BZ_OK;
+	return BSDIFF_SUCCESS;
+}
+
 static int bz2_decompressor_read(void *state, void *buffer, size_t size, size_t *readed)
 {
 	struct bz2_decompressor *dec = (struct bz2_decompressor*)state;
@@ -80,9 +112,14 @@ static int bz2_decompressor_read(void *state, void *buffer, size_t size, size_t
 		/* update readed */
 		*readed += old_avail_out - dec->bzstrm.avail_out;
 
-		/* the end of compressed stream was detected */
-		if (dec->bzerr == BZ_STREAM_END)
-			return BSDIFF_END_OF_FILE;
+		/* the end of compressed stream was detected, another one may follow */
+		if (dec->bzerr == BZ_STREAM_END) {
+			if ((ret = next_stream(dec)) != BSDIFF_SUCCESS)
+				return ret;
+			if (dec->bzstrm.avail_out == 0)
+				return BSDIFF_SUCCESS;
+			continue;
+		}
 		/* all output buffer has been consumed */
 		if (dec->bzstrm.avail_out == 0)
 			return BSDIFF_SUCCESS;
@@ -0,0 +1,445 @@
+#include "bsdiff.h"
+#include "bsdiff_mem.h"
+#include "bsdiff_private.h"
+#include "bsdiff_thread.h"
+#include <stdlib.h>
+#include <string.h>
+#include <bzlib.h>
+
+/*
+ * Decodes concatenated bzip2 streams on a thread pool. The input is cut
+ * where a stream header followed by a block header ("BZh9" 0x314159265359)
+ * starts, and the segments are decoded ahead of the reader. A segment only
+ * counts as decoded if it ends exactly at the end of its last stream, so a
+ * false match of the header inside compressed data is detected; decoding
+ * then continues serially from that segment on, as it does for input
+ * without stream boundaries (e.g. a single stream from a serial compressor)
+ * and for a segment whose output passes BZ2_MAX_SEGMENT_OUTPUT. Nothing is
+ * handed to the pool before a second stream start has been found, so single
+ * stream input is streamed serially from the start.
+ */
+
+#define BZ2_READ_SIZE (256 * 1024)
+#define BZ2_MAX_SEGMENT (4 * 1024 * 1024)
+#define BZ2_MAX_SEGMENT_OUTPUT (16 * 1024 * 1024)
+
+struct bz2_segment
+{
+	struct bsdiff_job job;
+	char *in;
+	size_t in_len, in_cap;
+	char *out;
+	size_t out_len, out_cap, out_pos;
+	int result;
+};
+
+struct bz2_parallel_decompressor
+{
+	int initialized;
+	struct bsdiff_stream *strm;
+	struct bsdiff_thread_pool *pool;
+
+	struct bz2_segment *segs;
+	int nsegs;
+	int head, count;           /* submitted segments, oldest first */
+
+	char *pending;             /* input read but not yet cut into segments */
+	size_t pending_len, pending_cap;
+	size_t scan_pos;           /* where to continue looking for a stream start */
+	int eof;                   /* no more input in the stream */
+	int too_large;             /* no stream start within BZ2_MAX_SEGMENT */
+	int multi;                 /* a second stream start has been found */
+
+	int serial;                /* decoding the rest on the calling thread */
+	bz_stream bzstrm;
+	int bzerr;
+};
+
+static int is_stream_start(const char *p)
+{
+	static const unsigned char block_magic[6] = { 0x31, 0x41, 0x59, 0x26, 0x53, 0x59 };
+
+	return p[0] == 'B' && p[1] == 'Z' && p[2] == 'h' && p[3] >= '1' && p[3] <= '9' &&
+		memcmp(p + 4, block_magic, 6) == 0;
+}
+
+static void decode_segment(struct bsdiff_job *job)
+{
+	struct bz2_segment *seg = (struct bz2_segment*)job;
+	bz_stream bzstrm;
+	char *out;
+	size_t cap;
+	int bzerr;
+
+	seg->result = BSDIFF_CORRUPT_PATCH;
+	memset(&bzstrm, 0, sizeof(bzstrm));
+	if (BZ2_bzDecompressInit(&bzstrm, 0, 0) != BZ_OK) {
+		seg->result = BSDIFF_ERROR;
+		return;
+	}
+	bzstrm.next_in = seg->in;
+	bzstrm.avail_in = (unsigned int)seg->in_len;
+
+	while (1) {
+		if (seg->out_len == seg->out_cap) {
+			/* Too much output to hold, the reader decodes it serially */
+			if (seg->out_cap >= BZ2_MAX_SEGMENT_OUTPUT) {
+				seg->result = BSDIFF_SIZE_TOO_LARGE;
+				break;
+			}
+			cap = seg->out_cap ? seg->out_cap * 2 : seg->in_len * 4 + 4096;
+			if (cap > BZ2_MAX_SEGMENT_OUTPUT)
+				cap = BZ2_MAX_SEGMENT_OUTPUT;
+			if ((out = bsdiff_realloc(seg->out, cap)) == NULL) {
+				seg->result = BSDIFF_OUT_OF_MEMORY;
+				break;
+			}
+			seg->out = out;
+			seg->out_cap = cap;
+		}
+		bzstrm.next_out = seg->out + seg->out_len;
+		bzstrm.avail_out = (unsigned int)((seg->out_cap - seg->out_len > UINT32_MAX) ?
+			UINT32_MAX : seg->out_cap - seg->out_len);
+		cap = bzstrm.avail_out;
+		bzerr = BZ2_bzDecompress(&bzstrm);
+		seg->out_len += cap - bzstrm.avail_out;
+
+		if (bzerr == BZ_STREAM_END) {
+			if (bzstrm.avail_in == 0) {
+				seg->result = BSDIFF_SUCCESS;
+				break;
+			}
+			/* Several streams in one segment */
+			BZ2_bzDecompressEnd(&bzstrm);
+			if (BZ2_bzDecompressInit(&bzstrm, 0, 0) != BZ_OK) {
+				seg->result = BSDIFF_ERROR;
+				return;
+			}
+		} else if (bzerr != BZ_OK || (bzstrm.avail_in == 0 && bzstrm.avail_out > 0)) {
+			/* Corrupt, or the segment ends inside of a stream */
+			break;
+		}
+	}
+	BZ2_bzDecompressEnd(&bzstrm);
+}
+
+/* Read more input to the end of the pending data */
+static int read_pending(struct bz2_parallel_decompressor *dec)
+{
+	char *buf;
+	size_t cap, cb;
+	int ret;
+
+	if (dec->pending_len + BZ2_READ_SIZE > dec->pending_cap) {
+		cap = dec->pending_len + BZ2_READ_SIZE;
+		if ((buf = bsdiff_realloc(dec->pending, cap)) == NULL)
+			return BSDIFF_OUT_OF_MEMORY;
+		dec->pending = buf;
+		dec->pending_cap = cap;
+	}
+	ret = dec->strm->read(dec->strm->state, dec->pending + dec->pending_len, BZ2_READ_SIZE, &cb);
+	if (ret != BSDIFF_SUCCESS && ret != BSDIFF_END_OF_FILE)
+		return BSDIFF_FILE_ERROR;
+	dec->pending_len += cb;
+	if (ret == BSDIFF_END_OF_FILE || cb == 0)
+		dec->eof = 1;
+	return BSDIFF_SUCCESS;
+}
+
+/* Move the first 'len' pending bytes into 'seg' */
+static int take_segment(struct bz2_parallel_decompressor *dec, struct bz2_segment *seg, size_t len)
+{
+	char *buf;
+
+	if (seg->in_cap < len) {
+		if ((buf = bsdiff_realloc(seg->in, len)) == NULL)
+			return BSDIFF_OUT_OF_MEMORY;
+		seg->in = buf;
+		seg->in_cap = len;
+	}
+	memcpy(seg->in, dec->pending, len);
+	seg->in_len = len;
+	seg->out_len = seg->out_pos = 0;
+	memmove(dec->pending, dec->pending + len, dec->pending_len - len);
+	dec->pending_len -= len;
+	dec->scan_pos = 1;
+	return BSDIFF_SUCCESS;
+}
+
+/* Cut the next segment off the input, '*found' is 0 if there is none (yet) */
+static int next_segment(struct bz2_parallel_decompressor *dec, struct bz2_segment *seg, int *found)
+{
+	const char *p, *end;
+	int ret;
+
+	*found = 0;
+	while (1) {
+		if (dec->scan_pos < 1)
+			dec->scan_pos = 1;
+		p = dec->pending + dec->scan_pos;
+		end = dec->pending + dec->pending_len;
+		while (end - p >= 10) {
+			if ((p = memchr(p, 'B', (size_t)(end - p) - 9)) == NULL)
+				break;
+			if (is_stream_start(p)) {
+				dec->multi = 1;
+				*found = 1;
+				return take_segment(dec, seg, (size_t)(p - dec->pending));
+			}
+			p++;
+		}
+		dec->scan_pos = (dec->pending_len > 9) ? dec->pending_len - 9 : 1;
+
+		if (dec->eof) {
+			/* Without a second stream the input is left to the serial path */
+			if (dec->pending_len == 0 || !dec->multi)
+				return BSDIFF_SUCCESS;
+			*found = 1;
+			return take_segment(dec, seg, dec->pending_len);
+		}
+		if (dec->pending_len >= BZ2_MAX_SEGMENT) {
+			dec->too_large = 1;
+			return BSDIFF_SUCCESS;
+		}
+		if ((ret = read_pending(dec)) != BSDIFF_SUCCESS)
+			return ret;
+	}
+}
+
+/* Keep the pool busy with the segments ahead of the reader */
+static int fill_segments(struct bz2_parallel_decompressor *dec)
+{
+	struct bz2_segment *seg;
+	int ret, found;
+
+	while (dec->count < dec->nsegs && !dec->too_large) {
+		seg = &dec->segs[(dec->head + dec->count) % dec->nsegs];
+		if ((ret = next_segment(dec, seg, &found)) != BSDIFF_SUCCESS)
+			return ret;
+		if (!found)
+			break;
+		seg->job.func = decode_segment;
+		bsdiff_thread_pool_submit(dec->pool, &seg->job);
+		dec->count++;
+	}
+	return BSDIFF_SUCCESS;
+}
+
+/* Continue serially with the input of the submitted segments and the pending data */
+static int switch_to_serial(struct bz2_parallel_decompressor *dec)
+{
+	struct bz2_segment *seg;
+	size_t total = dec->pending_len, pos = 0;
+	char *buf;
+	int i;
+
+	for (i = 0; i < dec->count; i++) {
+		seg = &dec->segs[(dec->head + i) % dec->nsegs];
+		bsdiff_thread_pool_wait(dec->pool, &seg->job);
+		total += seg->in_len;
+	}
+	if (total > UINT32_MAX)
+		return BSDIFF_SIZE_TOO_LARGE;
+	if ((buf = bsdiff_malloc(total > BZ2_READ_SIZE ? total : BZ2_READ_SIZE)) == NULL)
+		return BSDIFF_OUT_OF_MEMORY;
+	for (i = 0; i < dec->count; i++) {
+		seg = &dec->segs[(dec->head + i) % dec->nsegs];
+		memcpy(buf + pos, seg->in, seg->in_len);
+		pos += seg->in_len;
+	}
+	if (dec->pending_len > 0)
+		memcpy(buf + pos, dec->pending, dec->pending_len);
+	if (dec->pending != NULL)
+		bsdiff_free(dec->pending);
+	dec->pending = buf;
+	dec->pending_len = total;
+	dec->pending_cap = (total > BZ2_READ_SIZE) ? total : BZ2_READ_SIZE;
+	dec->count = 0;
+
+	memset(&(dec->bzstrm), 0, sizeof(dec->bzstrm));
+	if (BZ2_bzDecompressInit(&(dec->bzstrm), 0, 0) != BZ_OK)
+		return BSDIFF_ERROR;
+	dec->bzstrm.next_in = dec->pending;
+	dec->bzstrm.avail_in = (unsigned int)dec->pending_len;
+	dec->bzerr = BZ_OK;
+	dec->serial = 1;
+	return BSDIFF_SUCCESS;
+}
+
+/* Refill the serial input, BSDIFF_END_OF_FILE if there is no more */
+static int serial_fill(struct bz2_parallel_decompressor *dec)
+{
+	int ret;
+
+	if (dec->eof)
+		return BSDIFF_END_OF_FILE;
+	dec->pending_len = 0;
+	if ((ret = read_pending(dec)) != BSDIFF_SUCCESS)
+		return ret;
+	if (dec->pending_len == 0)
+		return BSDIFF_END_OF_FILE;
+	dec->bzstrm.next_in = dec->pending;
+	dec->bzstrm.avail_in = (unsigned int)dec->pending_len;
+	return BSDIFF_SUCCESS;
+}
+
+static int serial_read(struct bz2_parallel_decompressor *dec, char *buffer, size_t size, size_t *readed)
+{
+	unsigned int old_avail_out;
+	int ret;
+
+	if (dec->bzerr != BZ_OK)
+		return (dec->bzerr == BZ_STREAM_END) ? BSDIFF_END_OF_FILE : BSDIFF_ERROR;
+
+	dec->bzstrm.next_out = buffer;
+	dec->bzstrm.avail_out = (unsigned int)size;
+	while (1) {
+		if (dec->bzstrm.avail_in == 0 && (ret = serial_fill(dec)) != BSDIFF_SUCCESS)
+			return (ret == BSDIFF_END_OF_FILE) ? BSDIFF_ERROR : ret;
+
+		old_avail_out = dec->bzstrm.avail_out;
+		dec->bzerr = BZ2_bzDecompress(&(dec->bzstrm));
+		if (dec->bzerr != BZ_OK && dec->bzerr != BZ_STREAM_END)
+			return BSDIFF_ERROR;
+		*readed += old_avail_out - dec->bzstrm.avail_out;
+
+		if (dec->bzerr == BZ_STREAM_END) {
+			/* A concatenated stream may follow, trailing garbage is ignored */
+			if (dec->bzstrm.avail_in == 0 && (ret = serial_fill(dec)) != BSDIFF_SUCCESS)
+				return ret;
+			if (dec->bzstrm.next_in[0] != 'B')
+				return BSDIFF_END_OF_FILE;
+			BZ2_bzDecompressEnd(&(dec->bzstrm));
+			if (BZ2_bzDecompressInit(&(dec->bzstrm), 0, 0) != BZ_OK) {
+				dec->serial = 0;
+				dec->bzerr = BZ_MEM_ERROR;
+				return BSDIFF_ERROR;
+			}
+			dec->bzerr = BZ_OK;
+		}
+		if (dec->bzstrm.avail_out == 0)
+			return BSDIFF_SUCCESS;
+	}
+}
+
+static int bz2_parallel_decompressor_init(void *state, struct bsdiff_stream *stream)
+{
+	struct bz2_parallel_decompressor *dec = (struct bz2_parallel_decompressor*)state;
+
+	if (dec->initialized)
+		return BSDIFF_ERROR;
+	dec->strm = stream;
+
+	dec->nsegs = 2 * bsdiff_thread_pool_size(dec->pool);
+	dec->segs = bsdiff_malloc((size_t)dec->nsegs * sizeof(struct bz2_segment));
+	if (dec->segs == NULL)
+		return BSDIFF_OUT_OF_MEMORY;
+	memset(dec->segs, 0, (size_t)dec->nsegs * sizeof(struct bz2_segment));
+
+	dec->initialized = 1;
+
+	return BSDIFF_SUCCESS;
+}
+
+static int bz2_parallel_decompressor_read(void *state, void *buffer, size_t size, size_t *readed)
+{
+	struct bz2_parallel_decompressor *dec = (struct bz2_parallel_decompressor*)state;
+	struct bz2_segment *seg;
+	char *dst = (char*)buffer;
+	size_t n, got;
+	int ret;
+
+	*readed = 0;
+
+	if (!dec->initialized)
+		return BSDIFF_ERROR;
+	if (size >= UINT32_MAX)
+		return BSDIFF_INVALID_ARG;
+
+	while (size > 0) {
+		if (dec->serial) {
+			got = 0;
+			ret = serial_read(dec, dst, size, &got);
+			*readed += got;
+			return ret;
+		}
+
+		if ((ret = fill_segments(dec)) != BSDIFF_SUCCESS)
+			return ret;
+		if (dec->count == 0) {
+			if (dec->eof && dec->pending_len == 0)
+				return BSDIFF_END_OF_FILE;
+			if ((ret = switch_to_serial(dec)) != BSDIFF_SUCCESS)
+				return ret;
+			continue;
+		}
+
+		seg = &dec->segs[dec->head];
+		bsdiff_thread_pool_wait(dec->pool, &seg->job);
+		if (seg->result != BSDIFF_SUCCESS) {
+			if (seg->result != BSDIFF_CORRUPT_PATCH && seg->result != BSDIFF_SIZE_TOO_LARGE)
+				return seg->result;
+			if ((ret = switch_to_serial(dec)) != BSDIFF_SUCCESS)
+				return ret;
+			continue;
+		}
+
+		n = seg->out_len - seg->out_pos;
+		if (n > size)
+			n = size;
+		memcpy(dst, seg->out + seg->out_pos, n);
+		seg->out_pos += n;
+		dst += n;
+		size -= n;
+		*readed += n;
+		if (seg->out_pos == seg->out_len) {
+			dec->head = (dec->head + 1) % dec->nsegs;
+			dec->count--;
+		}
+	}
+
+	return BSDIFF_SUCCESS;
+}
+
+static void bz2_parallel_decompressor_close(void *state)
+{
+	struct bz2_parallel_decompressor *dec = (struct bz2_parallel_decompressor*)state;
+	int i;
+
+	if (dec->segs != NULL) {
+		for (i = 0; i < dec->count; i++)
+			bsdiff_thread_pool_wait(dec->pool, &dec->segs[(dec->head + i) % dec->nsegs].job);
+		for (i = 0; i < dec->nsegs; i++) {
+			if (dec->segs[i].in != NULL) { bsdiff_free(dec->segs[i].in); }
+			if (dec->segs[i].out != NULL) { bsdiff_free(dec->segs[i].out); }
+		}
+		bsdiff_free(dec->segs);
+	}
+	if (dec->serial)
+		BZ2_bzDecompressEnd(&(dec->bzstrm));
+	if (dec->pending != NULL)
+		bsdiff_free(dec->pending);
+
+	bsdiff_free(dec);
+}
+
+int bsdiff_create_bz2_parallel_decompressor(
+	struct bsdiff_decompressor *dec,
+	struct bsdiff_thread_pool *pool)
+{
+	struct bz2_parallel_decompressor *state;
+
+	state = bsdiff_malloc(sizeof(struct bz2_parallel_decompressor));
+	if (!state)
+		return BSDIFF_OUT_OF_MEMORY;
+	memset(state, 0, sizeof(*state));
+	state->pool = pool;
+
+	memset(dec, 0, sizeof(*dec));
+	dec->state = state;
+	dec->init = bz2_parallel_decompressor_init;
+	dec->read = bz2_parallel_decompressor_read;
+	dec->close = bz2_parallel_decompressor_close;
+
+	return BSDIFF_SUCCESS;
+}
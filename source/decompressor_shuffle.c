@@ -0,0 +1,140 @@
+#include "bsdiff.h"
+#include "bsdiff_mem.h"
+#include "bsdiff_private.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Reverses the shuffle filter of compressor_shuffle.c. Chunks are read
+ * whole from the inner decompressor; a chunk that fits in the caller's
+ * buffer is unshuffled straight into it.
+ */
+
+#define SHUFFLE_CHUNK_SIZE (256 * 1024)
+
+struct shuffle_decompressor
+{
+	struct bsdiff_decompressor inner;
+	int initialized;
+	int stride;
+
+	uint8_t *in;             /* shuffled chunk */
+	uint8_t *out;            /* unshuffled chunk, partly consumed */
+	size_t len, pos;
+	int eof;
+};
+
+/* Read the next chunk into 'in', its length is 0 at the end of the data */
+static int read_chunk(struct shuffle_decompressor *dec, size_t *len)
+{
+	size_t cb;
+	int ret;
+
+	*len = 0;
+	while (*len < SHUFFLE_CHUNK_SIZE && !dec->eof) {
+		cb = 0;
+		ret = dec->inner.read(dec->inner.state, dec->in + *len, SHUFFLE_CHUNK_SIZE - *len, &cb);
+		if (ret != BSDIFF_SUCCESS && ret != BSDIFF_END_OF_FILE)
+			return ret;
+		if (ret == BSDIFF_END_OF_FILE || cb == 0)
+			dec->eof = 1;
+		*len += cb;
+	}
+	return BSDIFF_SUCCESS;
+}
+
+static int shuffle_decompressor_init(void *state, struct bsdiff_stream *stream)
+{
+	struct shuffle_decompressor *dec = (struct shuffle_decompressor*)state;
+	int ret;
+
+	if (dec->initialized)
+		return BSDIFF_ERROR;
+	if ((ret = dec->inner.init(dec->inner.state, stream)) != BSDIFF_SUCCESS)
+		return ret;
+	dec->initialized = 1;
+
+	return BSDIFF_SUCCESS;
+}
+
+static int shuffle_decompressor_read(void *state, void *buffer, size_t size, size_t *readed)
+{
+	struct shuffle_decompressor *dec = (struct shuffle_decompressor*)state;
+	uint8_t *dst = (uint8_t*)buffer;
+	size_t n, len, done = 0;
+	int ret;
+
+	*readed = 0;
+	if (!dec->initialized)
+		return BSDIFF_ERROR;
+
+	while (done < size) {
+		if (dec->pos == dec->len) {
+			if ((ret = read_chunk(dec, &len)) != BSDIFF_SUCCESS)
+				return ret;
+			if (len == 0)
+				break;
+			if (len <= size - done) {
+				bsdiff_unshuffle(dec->in, dst + done, len, dec->stride);
+				done += len;
+				*readed = done;
+				continue;
+			}
+			bsdiff_unshuffle(dec->in, dec->out, len, dec->stride);
+			dec->len = len;
+			dec->pos = 0;
+		}
+		n = dec->len - dec->pos;
+		if (n > size - done)
+			n = size - done;
+		memcpy(dst + done, dec->out + dec->pos, n);
+		dec->pos += n;
+		done += n;
+		*readed = done;
+	}
+
+	return (done == 0 && size > 0) ? BSDIFF_END_OF_FILE : BSDIFF_SUCCESS;
+}
+
+static void shuffle_decompressor_close(void *state)
+{
+	struct shuffle_decompressor *dec = (struct shuffle_decompressor*)state;
+
+	bsdiff_close_decompressor(&dec->inner);
+	if (dec->in != NULL)
+		bsdiff_free(dec->in);
+	if (dec->out != NULL)
+		bsdiff_free(dec->out);
+	bsdiff_free(dec);
+}
+
+int bsdiff_create_shuffle_decompressor(
+	struct bsdiff_decompressor *dec,
+	int stride)
+{
+	struct shuffle_decompressor *state;
+
+	state = bsdiff_malloc(sizeof(struct shuffle_decompressor));
+	if (!state)
+		return BSDIFF_OUT_OF_MEMORY;
+	memset(state, 0, sizeof(*state));
+	state->inner = *dec;
+	state->stride = stride;
+	state->in = bsdiff_malloc(SHUFFLE_CHUNK_SIZE);
+	state->out = bsdiff_malloc(SHUFFLE_CHUNK_SIZE);
+	if (state->in == NULL || state->out == NULL) {
+		shuffle_decompressor_close(state);
+		/* The inner decompressor was closed with the state */
+		memset(dec, 0, sizeof(*dec));
+		return BSDIFF_OUT_OF_MEMORY;
+	}
+
+	/* 'dec' now unshuffles the output of the inner decompressor */
+	memset(dec, 0, sizeof(*dec));
+	dec->state = state;
+	dec->init = shuffle_decompressor_init;
+	dec->read = shuffle_decompressor_read;
+	dec->close = shuffle_decompressor_close;
+
+	return BSDIFF_SUCCESS;
+}
@@ -0,0 +1,162 @@
+#include "bsdiff.h"
+#include "bsdiff_mem.h"
+#include "bsdiff_private.h"
+#include "bsdiff_varint.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Reverses the zero-run transform of compressor_zero_run.c on the output of
+ * another decompressor. Zeros and literals are expanded straight into the
+ * caller's buffer; long literal runs are read from the inner decompressor
+ * without going through the pair buffer.
+ */
+
+#define ZERO_RUN_BUF_SIZE (64 * 1024)
+#define ZERO_RUN_SLACK 32
+#define ZERO_RUN_HEADER (2 * BSDIFF_MAX_VARINT)
+
+struct zero_run_decompressor
+{
+	struct bsdiff_decompressor inner;
+	int initialized;
+
+	uint8_t *buf;            /* transformed data read ahead */
+	size_t len, pos;
+	int eof;
+
+	uint64_t zeros;          /* left of the current pair */
+	uint64_t literals;
+};
+
+/* Decode the next pair header, END_OF_FILE at the end of the data */
+static int next_pair(struct zero_run_decompressor *dec)
+{
+	const uint8_t *p, *end;
+	size_t cb;
+	int ret;
+
+	if (dec->len - dec->pos < ZERO_RUN_HEADER && !dec->eof) {
+		memmove(dec->buf, dec->buf + dec->pos, dec->len - dec->pos);
+		dec->len -= dec->pos;
+		dec->pos = 0;
+		cb = 0;
+		ret = dec->inner.read(dec->inner.state, dec->buf + dec->len, ZERO_RUN_BUF_SIZE - dec->len, &cb);
+		if (ret != BSDIFF_SUCCESS && ret != BSDIFF_END_OF_FILE)
+			return ret;
+		dec->len += cb;
+		if (ret == BSDIFF_END_OF_FILE || cb == 0)
+			dec->eof = 1;
+		/* Zeroed slack, so that the 8-byte loads stay defined */
+		memset(dec->buf + dec->len, 0, ZERO_RUN_SLACK);
+	}
+	if (dec->pos == dec->len)
+		return BSDIFF_END_OF_FILE;
+
+	p = dec->buf + dec->pos;
+	end = dec->buf + dec->len;
+	if ((p = bsdiff_decode_varint(p, &dec->zeros)) == NULL ||
+	    (p = bsdiff_decode_varint(p, &dec->literals)) == NULL || p > end)
+		return BSDIFF_CORRUPT_PATCH;
+	dec->pos = (size_t)(p - dec->buf);
+	return BSDIFF_SUCCESS;
+}
+
+static int zero_run_decompressor_init(void *state, struct bsdiff_stream *stream)
+{
+	struct zero_run_decompressor *dec = (struct zero_run_decompressor*)state;
+	int ret;
+
+	if (dec->initialized)
+		return BSDIFF_ERROR;
+	if ((ret = dec->inner.init(dec->inner.state, stream)) != BSDIFF_SUCCESS)
+		return ret;
+	dec->initialized = 1;
+
+	return BSDIFF_SUCCESS;
+}
+
+static int zero_run_decompressor_read(void *state, void *buffer, size_t size, size_t *readed)
+{
+	struct zero_run_decompressor *dec = (struct zero_run_decompressor*)state;
+	uint8_t *out = (uint8_t*)buffer;
+	size_t n, cb, done = 0;
+	int ret;
+
+	*readed = 0;
+	if (!dec->initialized)
+		return BSDIFF_ERROR;
+
+	while (done < size) {
+		if (dec->zeros > 0) {
+			n = (dec->zeros < size - done) ? (size_t)dec->zeros : size - done;
+			memset(out + done, 0, n);
+			dec->zeros -= n;
+		} else if (dec->literals > 0) {
+			n = (dec->literals < size - done) ? (size_t)dec->literals : size - done;
+			if (dec->pos < dec->len) {
+				if (n > dec->len - dec->pos)
+					n = dec->len - dec->pos;
+				memcpy(out + done, dec->buf + dec->pos, n);
+				dec->pos += n;
+			} else {
+				cb = 0;
+				ret = dec->inner.read(dec->inner.state, out + done, n, &cb);
+				if (ret != BSDIFF_SUCCESS && ret != BSDIFF_END_OF_FILE)
+					return ret;
+				if (cb == 0)
+					return BSDIFF_CORRUPT_PATCH;
+				n = cb;
+			}
+			dec->literals -= n;
+		} else {
+			ret = next_pair(dec);
+			if (ret == BSDIFF_END_OF_FILE)
+				break;
+			if (ret != BSDIFF_SUCCESS)
+				return ret;
+			continue;
+		}
+		done += n;
+		*readed = done;
+	}
+
+	return (done == 0 && size > 0) ? BSDIFF_END_OF_FILE : BSDIFF_SUCCESS;
+}
+
+static void zero_run_decompressor_close(void *state)
+{
+	struct zero_run_decompressor *dec = (struct zero_run_decompressor*)state;
+
+	bsdiff_close_decompressor(&dec->inner);
+	if (dec->buf != NULL)
+		bsdiff_free(dec->buf);
+	bsdiff_free(dec);
+}
+
+int bsdiff_create_zero_run_decompressor(
+	struct bsdiff_decompressor *dec)
+{
+	struct zero_run_decompressor *state;
+
+	state = bsdiff_malloc(sizeof(struct zero_run_decompressor));
+	if (!state)
+		return BSDIFF_OUT_OF_MEMORY;
+	memset(state, 0, sizeof(*state));
+	state->inner = *dec;
+	if ((state->buf = bsdiff_malloc(ZERO_RUN_BUF_SIZE + ZERO_RUN_SLACK)) == NULL) {
+		zero_run_decompressor_close(state);
+		/* The inner decompressor was closed with the state */
+		memset(dec, 0, sizeof(*dec));
+		return BSDIFF_OUT_OF_MEMORY;
+	}
+
+	/* 'dec' now expands the output of the inner decompressor */
+	memset(dec, 0, sizeof(*dec));
+	dec->state = state;
+	dec->init = zero_run_decompressor_init;
+	dec->read = zero_run_decompressor_read;
+	dec->close = zero_run_decompressor_close;
+
+	return BSDIFF_SUCCESS;
+}
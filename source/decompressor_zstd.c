@@ -7,11 +7,16 @@
 
 struct zstd_dec_state
 {
+	const struct bsdiff_zstd_dict *const *dicts;
+	size_t ndicts;
+	int window_log_max;     /* 0 keeps the zstd default limit */
+	int started;
 	struct bsdiff_stream *stream;
 	ZSTD_DStream *dctx;
 	ZSTD_inBuffer in;
 	void *in_buffer;
 	size_t in_capacity;
+	int mapped;             /* 'in' is the whole stream, from get_buffer */
 };
 
 static int zstd_dec_init(void *state, struct bsdiff_stream *stream)
@@ -29,6 +34,23 @@ static int zstd_dec_init(void *state, struct bsdiff_stream *stream)
 	if (ZSTD_isError(ret))
 		return BSDIFF_ERROR;
 
+	/* Windows above the default limit (128 MiB) need memory the caller must
+	   have agreed to */
+	if (dec->window_log_max != 0) {
+		ret = ZSTD_DCtx_setParameter(dec->dctx, ZSTD_d_windowLogMax, dec->window_log_max);
+		if (ZSTD_isError(ret))
+			return BSDIFF_ERROR;
+	}
+
+	/* A stream in memory (e.g. a substream of a mapped patch) is decompressed
+	   where it is, instead of being copied through in_buffer */
+	if (stream->get_buffer != NULL &&
+	    stream->get_buffer(stream->state, &dec->in.src, &dec->in.size) == BSDIFF_SUCCESS) {
+		dec->in.pos = 0;
+		dec->mapped = 1;
+		return BSDIFF_SUCCESS;
+	}
+
 	dec->in_capacity = ZSTD_DStreamInSize();
 	dec->in_buffer = bsdiff_malloc(dec->in_capacity);
 	if (!dec->in_buffer)
@@ -41,6 +63,26 @@ static int zstd_dec_init(void *state, struct bsdiff_stream *stream)
 	return BSDIFF_SUCCESS;
 }
 
+/* Reference the dictionary named by the frame header, if any */
+static int select_dict(struct zstd_dec_state *dec)
+{
+	unsigned id = ZSTD_getDictID_fromFrame(dec->in.src, dec->in.size);
+	size_t i;
+
+	if (id == 0)
+		return BSDIFF_SUCCESS;
+	for (i = 0; i < dec->ndicts; i++) {
+		if (bsdiff_zstd_dict_id(dec->dicts[i]) == id) {
+			if (ZSTD_isError(ZSTD_DCtx_refDDict(dec->dctx,
+			        (const ZSTD_DDict *)bsdiff_zstd_dict_ddict(dec->dicts[i]))))
+				return BSDIFF_ERROR;
+			return BSDIFF_SUCCESS;
+		}
+	}
+	/* Let zstd report the missing dictionary */
+	return BSDIFF_SUCCESS;
+}
+
 static int zstd_dec_read(void *state, void *buffer, size_t size, size_t *readed)
 {
 	struct zstd_dec_state *dec = (struct zstd_dec_state *)state;
@@ -53,10 +95,13 @@ static int zstd_dec_read(void *state, void *buffer, size_t size, size_t *readed)
 	while (out.pos < out.size) {
 		if (dec->in.pos == dec->in.size) {
 			bread = 0;
-			r = dec->stream->read(dec->stream->state, dec->in_buffer,
-			                      dec->in_capacity, &bread);
-			if (r != BSDIFF_SUCCESS && r != BSDIFF_END_OF_FILE)
-				return BSDIFF_FILE_ERROR;
+			r = BSDIFF_END_OF_FILE;
+			if (!dec->mapped) {
+				r = dec->stream->read(dec->stream->state, dec->in_buffer,
+				                      dec->in_capacity, &bread);
+				if (r != BSDIFF_SUCCESS && r != BSDIFF_END_OF_FILE)
+					return BSDIFF_FILE_ERROR;
+			}
 
 			if (bread == 0 && r == BSDIFF_END_OF_FILE) {
 				*readed = out.pos;
@@ -68,6 +113,12 @@ static int zstd_dec_read(void *state, void *buffer, size_t size, size_t *readed)
 			dec->in.pos = 0;
 		}
 
+		if (!dec->started) {
+			dec->started = 1;
+			if ((r = select_dict(dec)) != BSDIFF_SUCCESS)
+				return r;
+		}
+
 		ret = ZSTD_decompressStream(dec->dctx, &out, &dec->in);
 		if (ZSTD_isError(ret))
 			return BSDIFF_ERROR;
@@ -88,7 +139,10 @@ static void zstd_dec_close(void *state)
 	bsdiff_free(dec);
 }
 
-int bsdiff_create_zstd_decompressor(struct bsdiff_decompressor *dec)
+int bsdiff_create_zstd_decompressor_ex(struct bsdiff_decompressor *dec,
+                                       const struct bsdiff_zstd_dict *const *dicts,
+                                       size_t ndicts,
+                                       int window_log_max)
 {
 	struct zstd_dec_state *state;
 
@@ -97,6 +151,9 @@ int bsdiff_create_zstd_decompressor(struct bsdiff_decompressor *dec)
 		return BSDIFF_OUT_OF_MEMORY;
 	
 	memset(state, 0, sizeof(struct zstd_dec_state));
+	state->dicts = dicts;
+	state->ndicts = ndicts;
+	state->window_log_max = window_log_max;
 
 	dec->state = state;
 	dec->init = zstd_dec_init;
@@ -105,3 +162,8 @@ int bsdiff_create_zstd_decompressor(struct bsdiff_decompressor *dec)
 
 	return BSDIFF_SUCCESS;
 }
+
+int bsdiff_create_zstd_decompressor(struct bsdiff_decompressor *dec)
+{
+	return bsdiff_create_zstd_decompressor_ex(dec, NULL, 0, 0);
+}
@@ -95,3 +95,12 @@ void bsdiff_close_patch_packer(
 		memset(packer, 0, sizeof(*packer));
 	}
 }
+
+void bsdiff_close_allocator(
+	struct bsdiff_allocator *allocator)
+{
+	if (allocator->close != NULL) {
+		allocator->close(allocator->state);
+		memset(allocator, 0, sizeof(*allocator));
+	}
+}
@@ -0,0 +1,227 @@
+#include "bsdiff.h"
+#include "bsdiff_mem.h"
+#include "bsdiff_private.h"
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+/*
+ * A fixed-size LRU cache of pages of a read-only stream. Pages are found
+ * through a chained hash table and kept in a doubly linked list ordered by
+ * recency, the least recently used one is recycled on a miss.
+ */
+
+#define PAGE_CACHE_MAX_PAGE_SIZE (64 * 1024)
+#define PAGE_CACHE_MIN_SIZE 4096
+
+struct bsdiff_page_cache
+{
+	struct bsdiff_stream *stream;
+	int64_t size;       /* of the stream */
+	size_t page_size;
+	int npages;
+
+	uint8_t *data;      /* npages * page_size */
+	int64_t *index;     /* page number held by each slot, -1 if empty */
+	int *prev, *next;   /* LRU list, head is the most recently used */
+	int head, tail;
+	int *bucket;        /* hash table, nbuckets heads */
+	int *chain;         /* next slot in the same bucket */
+	int nbuckets;
+};
+
+static int page_hash(const struct bsdiff_page_cache *cache, int64_t page)
+{
+	uint64_t h = (uint64_t)page * 0x9E3779B97F4A7C15ULL;
+	return (int)((h >> 32) & (uint64_t)(cache->nbuckets - 1));
+}
+
+static void lru_unlink(struct bsdiff_page_cache *cache, int slot)
+{
+	if (cache->prev[slot] != -1)
+		cache->next[cache->prev[slot]] = cache->next[slot];
+	else
+		cache->head = cache->next[slot];
+	if (cache->next[slot] != -1)
+		cache->prev[cache->next[slot]] = cache->prev[slot];
+	else
+		cache->tail = cache->prev[slot];
+}
+
+static void lru_push_front(struct bsdiff_page_cache *cache, int slot)
+{
+	cache->prev[slot] = -1;
+	cache->next[slot] = cache->head;
+	if (cache->head != -1)
+		cache->prev[cache->head] = slot;
+	cache->head = slot;
+	if (cache->tail == -1)
+		cache->tail = slot;
+}
+
+static void hash_remove(struct bsdiff_page_cache *cache, int slot)
+{
+	int *p = &(cache->bucket[page_hash(cache, cache->index[slot])]);
+
+	while (*p != slot)
+		p = &(cache->chain[*p]);
+	*p = cache->chain[slot];
+}
+
+/* Return the slot holding 'page', loading it if necessary */
+static int get_page(struct bsdiff_page_cache *cache, int64_t page, int *pslot)
+{
+	int h = page_hash(cache, page);
+	int slot;
+	int64_t offset;
+	size_t len, cb;
+	int ret;
+
+	for (slot = cache->bucket[h]; slot != -1; slot = cache->chain[slot]) {
+		if (cache->index[slot] == page) {
+			if (cache->head != slot) {
+				lru_unlink(cache, slot);
+				lru_push_front(cache, slot);
+			}
+			*pslot = slot;
+			return BSDIFF_SUCCESS;
+		}
+	}
+
+	/* Miss, recycle the least recently used slot */
+	slot = cache->tail;
+	lru_unlink(cache, slot);
+	if (cache->index[slot] != -1)
+		hash_remove(cache, slot);
+	cache->index[slot] = -1;
+	lru_push_front(cache, slot);
+
+	offset = page * (int64_t)cache->page_size;
+	len = cache->page_size;
+	if ((int64_t)len > cache->size - offset)
+		len = (size_t)(cache->size - offset);
+	if (cache->stream->seek(cache->stream->state, offset, BSDIFF_SEEK_SET) != BSDIFF_SUCCESS)
+		return BSDIFF_FILE_ERROR;
+	ret = cache->stream->read(cache->stream->state, cache->data + (size_t)slot * cache->page_size, len, &cb);
+	if ((ret != BSDIFF_SUCCESS && ret != BSDIFF_END_OF_FILE) || (cb != len))
+		return BSDIFF_FILE_ERROR;
+
+	cache->index[slot] = page;
+	cache->chain[slot] = cache->bucket[h];
+	cache->bucket[h] = slot;
+
+	*pslot = slot;
+	return BSDIFF_SUCCESS;
+}
+
+int bsdiff_open_page_cache(
+	struct bsdiff_stream *stream,
+	int64_t size,
+	size_t cache_size,
+	struct bsdiff_page_cache **pcache)
+{
+	struct bsdiff_page_cache *cache;
+	int i;
+
+	assert(stream && pcache);
+
+	if (cache_size < PAGE_CACHE_MIN_SIZE)
+		cache_size = PAGE_CACHE_MIN_SIZE;
+
+	cache = bsdiff_malloc(sizeof(*cache));
+	if (cache == NULL)
+		return BSDIFF_OUT_OF_MEMORY;
+	memset(cache, 0, sizeof(*cache));
+	cache->stream = stream;
+	cache->size = size;
+
+	/* Keep at least 4 pages, so that a chunk spanning pages does not thrash */
+	cache->page_size = PAGE_CACHE_MAX_PAGE_SIZE;
+	while (cache->page_size > 1024 && cache_size / cache->page_size < 4)
+		cache->page_size /= 2;
+	cache->npages = (int)((cache_size / cache->page_size > INT32_MAX / 4) ?
+		INT32_MAX / 4 : cache_size / cache->page_size);
+	for (cache->nbuckets = 1; cache->nbuckets < cache->npages; cache->nbuckets *= 2)
+		;
+
+	cache->data = bsdiff_malloc((size_t)cache->npages * cache->page_size);
+	cache->index = bsdiff_malloc((size_t)cache->npages * sizeof(int64_t));
+	cache->prev = bsdiff_malloc((size_t)cache->npages * sizeof(int));
+	cache->next = bsdiff_malloc((size_t)cache->npages * sizeof(int));
+	cache->chain = bsdiff_malloc((size_t)cache->npages * sizeof(int));
+	cache->bucket = bsdiff_malloc((size_t)cache->nbuckets * sizeof(int));
+	if (!cache->data || !cache->index || !cache->prev || !cache->next || !cache->chain || !cache->bucket) {
+		bsdiff_close_page_cache(cache);
+		return BSDIFF_OUT_OF_MEMORY;
+	}
+
+	cache->head = cache->tail = -1;
+	for (i = 0; i < cache->npages; i++) {
+		cache->index[i] = -1;
+		cache->chain[i] = -1;
+		lru_push_front(cache, i);
+	}
+	for (i = 0; i < cache->nbuckets; i++)
+		cache->bucket[i] = -1;
+
+	*pcache = cache;
+	return BSDIFF_SUCCESS;
+}
+
+int bsdiff_page_cache_add(
+	struct bsdiff_page_cache *cache,
+	int64_t pos,
+	uint8_t *buffer,
+	size_t len)
+{
+	int ret, slot;
+	int64_t page;
+	size_t off, n, j;
+	const uint8_t *src;
+
+	/* Bytes outside of the stream contribute nothing */
+	if (pos < 0) {
+		if ((int64_t)len <= -pos)
+			return BSDIFF_SUCCESS;
+		buffer += (size_t)(-pos);
+		len -= (size_t)(-pos);
+		pos = 0;
+	}
+	if (pos >= cache->size)
+		return BSDIFF_SUCCESS;
+	if ((int64_t)len > cache->size - pos)
+		len = (size_t)(cache->size - pos);
+
+	while (len > 0) {
+		page = pos / (int64_t)cache->page_size;
+		off = (size_t)(pos % (int64_t)cache->page_size);
+		n = cache->page_size - off;
+		if (n > len)
+			n = len;
+
+		if ((ret = get_page(cache, page, &slot)) != BSDIFF_SUCCESS)
+			return ret;
+		src = cache->data + (size_t)slot * cache->page_size + off;
+		for (j = 0; j < n; j++)
+			buffer[j] += src[j];
+
+		buffer += n;
+		pos += (int64_t)n;
+		len -= n;
+	}
+	return BSDIFF_SUCCESS;
+}
+
+void bsdiff_close_page_cache(
+	struct bsdiff_page_cache *cache)
+{
+	if (cache == NULL)
+		return;
+	if (cache->data != NULL) { bsdiff_free(cache->data); }
+	if (cache->index != NULL) { bsdiff_free(cache->index); }
+	if (cache->prev != NULL) { bsdiff_free(cache->prev); }
+	if (cache->next != NULL) { bsdiff_free(cache->next); }
+	if (cache->chain != NULL) { bsdiff_free(cache->chain); }
+	if (cache->bucket != NULL) { bsdiff_free(cache->bucket); }
+	bsdiff_free(cache);
+}
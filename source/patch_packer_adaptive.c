@@ -0,0 +1,584 @@
+#include "bsdiff.h"
+#include "bsdiff_mem.h"
+#include "bsdiff_private.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <bzlib.h>
+#include <zstd.h>
+
+int bsdiff_create_zstd_compressor_ex(struct bsdiff_compressor *enc,
+                                     const struct bsdiff_zstd_block_options *opts);
+int bsdiff_create_zstd_decompressor(struct bsdiff_decompressor *dec);
+int bsdiff_create_bz2_compressor(struct bsdiff_compressor *enc);
+int bsdiff_create_bz2_decompressor(struct bsdiff_decompressor *dec);
+
+/*
+	File format:
+		0		8	"BSDIFFAD"
+		8		8	X
+		16		8	Y
+		24		8	sizeof(newfile)
+		32		1	codec of the control block
+		33		1	codec of the diff block
+		34		1	codec of the extra block
+		35		5	zero
+		40		X	control block
+		40+X	Y	diff block
+		40+X+Y	???	extra block
+	with the blocks and triples of BSDIFF40, each block stored or compressed
+	with the codec picked for it when the patch was written.
+*/
+
+#define ADAPTIVE_STORE      0
+#define ADAPTIVE_ZSTD_FAST  1
+#define ADAPTIVE_ZSTD_HIGH  2
+#define ADAPTIVE_BZ2        3
+
+#define ADAPTIVE_ZSTD_FAST_LEVEL 1
+#define ADAPTIVE_ZSTD_HIGH_LEVEL 19
+
+/* The start of each block is buffered and trial-compressed to pick its codec */
+#define ADAPTIVE_SAMPLE_SIZE (256 * 1024)
+
+struct adaptive_block
+{
+	int codec;                   /* ADAPTIVE_*, -1 while sampling */
+	uint8_t *sample;
+	size_t sample_len;
+
+	struct bsdiff_stream stream; /* the substream, or the memory stream written to */
+	struct bsdiff_compressor enc;
+	struct bsdiff_decompressor dec;
+};
+
+struct adaptive_patch_packer
+{
+	struct bsdiff_stream *stream;
+	int mode;
+
+	int64_t new_size;
+
+	int64_t header_x;
+	int64_t header_y;
+	int64_t header_z;
+
+	struct adaptive_block blocks[3]; /* ctrl, diff, extra */
+};
+
+/* Compressed size of 'data' with 'codec', or 'size' if it doesn't shrink */
+static size_t trial_size(int codec, const uint8_t *data, size_t size, void *out, size_t out_size)
+{
+	unsigned int bz_size;
+	size_t n;
+
+	switch (codec) {
+	case ADAPTIVE_ZSTD_FAST:
+	case ADAPTIVE_ZSTD_HIGH:
+		n = ZSTD_compress(out, out_size, data, size,
+		                  (codec == ADAPTIVE_ZSTD_FAST) ? ADAPTIVE_ZSTD_FAST_LEVEL : ADAPTIVE_ZSTD_HIGH_LEVEL);
+		return (ZSTD_isError(n) || n > size) ? size : n;
+	case ADAPTIVE_BZ2:
+		bz_size = (unsigned int)out_size;
+		if (BZ2_bzBuffToBuffCompress(out, &bz_size, (char *)data, (unsigned int)size, 9, 0, 30) != BZ_OK)
+			return size;
+		return (bz_size > size) ? size : bz_size;
+	default:
+		return size;
+	}
+}
+
+/*
+ * Pick the codec of a block from its sample. Data that zstd at a fast level
+ * can't shrink by 3% is stored; otherwise the cheapest codec within 2% of
+ * the smallest result wins (zstd-fast, then zstd-high, then bz2).
+ */
+static int choose_codec(const uint8_t *data, size_t size, int *codec)
+{
+	size_t out_size, sizes[4], best;
+	void *out;
+	int c;
+
+	if (size == 0) {
+		*codec = ADAPTIVE_STORE;
+		return BSDIFF_SUCCESS;
+	}
+
+	/* Large enough for both zstd and the 1% + 600 bytes of bzip2 */
+	out_size = ZSTD_compressBound(size) + size / 100 + 600;
+	if ((out = bsdiff_malloc(out_size)) == NULL)
+		return BSDIFF_OUT_OF_MEMORY;
+
+	sizes[ADAPTIVE_ZSTD_FAST] = trial_size(ADAPTIVE_ZSTD_FAST, data, size, out, out_size);
+	if ((uint64_t)sizes[ADAPTIVE_ZSTD_FAST] * 100 >= (uint64_t)size * 97) {
+		bsdiff_free(out);
+		*codec = ADAPTIVE_STORE;
+		return BSDIFF_SUCCESS;
+	}
+	sizes[ADAPTIVE_ZSTD_HIGH] = trial_size(ADAPTIVE_ZSTD_HIGH, data, size, out, out_size);
+	sizes[ADAPTIVE_BZ2] = trial_size(ADAPTIVE_BZ2, data, size, out, out_size);
+	bsdiff_free(out);
+
+	best = sizes[ADAPTIVE_ZSTD_FAST];
+	for (c = ADAPTIVE_ZSTD_HIGH; c <= ADAPTIVE_BZ2; c++) {
+		if (sizes[c] < best)
+			best = sizes[c];
+	}
+	for (c = ADAPTIVE_ZSTD_FAST; c <= ADAPTIVE_BZ2; c++) {
+		if ((uint64_t)sizes[c] * 100 <= (uint64_t)best * 102)
+			break;
+	}
+	*codec = c;
+	return BSDIFF_SUCCESS;
+}
+
+static int create_compressor(int codec, struct bsdiff_compressor *enc)
+{
+	struct bsdiff_zstd_block_options opts;
+
+	switch (codec) {
+	case ADAPTIVE_ZSTD_FAST:
+	case ADAPTIVE_ZSTD_HIGH:
+		memset(&opts, 0, sizeof(opts));
+		opts.level = (codec == ADAPTIVE_ZSTD_FAST) ? ADAPTIVE_ZSTD_FAST_LEVEL : ADAPTIVE_ZSTD_HIGH_LEVEL;
+		return bsdiff_create_zstd_compressor_ex(enc, &opts);
+	case ADAPTIVE_BZ2:
+		return bsdiff_create_bz2_compressor(enc);
+	default:
+		return BSDIFF_INVALID_ARG;
+	}
+}
+
+static int create_decompressor(int codec, struct bsdiff_decompressor *dec)
+{
+	switch (codec) {
+	case ADAPTIVE_ZSTD_FAST:
+	case ADAPTIVE_ZSTD_HIGH:
+		return bsdiff_create_zstd_decompressor(dec);
+	case ADAPTIVE_BZ2:
+		return bsdiff_create_bz2_decompressor(dec);
+	default:
+		return BSDIFF_CORRUPT_PATCH;
+	}
+}
+
+/* Pick the codec from the sample and pass the sample on to it */
+static int start_block(struct adaptive_block *blk)
+{
+	int ret;
+
+	if ((ret = choose_codec(blk->sample, blk->sample_len, &blk->codec)) != BSDIFF_SUCCESS)
+		return ret;
+	if (blk->codec != ADAPTIVE_STORE) {
+		if ((ret = create_compressor(blk->codec, &blk->enc)) != BSDIFF_SUCCESS)
+			return ret;
+		if (blk->enc.init(blk->enc.state, &blk->stream) != BSDIFF_SUCCESS)
+			return BSDIFF_ERROR;
+	}
+	if (blk->sample_len > 0) {
+		ret = (blk->codec == ADAPTIVE_STORE)
+			? blk->stream.write(blk->stream.state, blk->sample, blk->sample_len)
+			: blk->enc.write(blk->enc.state, blk->sample, blk->sample_len);
+		if (ret != BSDIFF_SUCCESS)
+			return BSDIFF_ERROR;
+	}
+	if (blk->sample != NULL) {
+		bsdiff_free(blk->sample);
+		blk->sample = NULL;
+	}
+	return BSDIFF_SUCCESS;
+}
+
+static int block_write(struct adaptive_block *blk, const void *buffer, size_t size)
+{
+	const uint8_t *src = (const uint8_t *)buffer;
+	size_t n;
+	int ret;
+
+	if (blk->codec < 0) {
+		if (blk->sample == NULL && (blk->sample = bsdiff_malloc(ADAPTIVE_SAMPLE_SIZE)) == NULL)
+			return BSDIFF_OUT_OF_MEMORY;
+		n = ADAPTIVE_SAMPLE_SIZE - blk->sample_len;
+		if (n > size)
+			n = size;
+		memcpy(blk->sample + blk->sample_len, src, n);
+		blk->sample_len += n;
+		src += n;
+		size -= n;
+		if (blk->sample_len < ADAPTIVE_SAMPLE_SIZE)
+			return BSDIFF_SUCCESS;
+		if ((ret = start_block(blk)) != BSDIFF_SUCCESS)
+			return ret;
+	}
+	if (size == 0)
+		return BSDIFF_SUCCESS;
+	if (blk->codec == ADAPTIVE_STORE)
+		ret = blk->stream.write(blk->stream.state, src, size);
+	else
+		ret = blk->enc.write(blk->enc.state, src, size);
+	return (ret == BSDIFF_SUCCESS) ? BSDIFF_SUCCESS : BSDIFF_ERROR;
+}
+
+static int block_flush(struct adaptive_block *blk)
+{
+	int ret;
+
+	if (blk->codec < 0 && (ret = start_block(blk)) != BSDIFF_SUCCESS)
+		return ret;
+	if (blk->codec != ADAPTIVE_STORE && blk->enc.flush(blk->enc.state) != BSDIFF_SUCCESS)
+		return BSDIFF_ERROR;
+	return BSDIFF_SUCCESS;
+}
+
+/* Read exactly 'size' bytes unless the block ends */
+static int block_read(struct adaptive_block *blk, void *buffer, size_t size, size_t *readed)
+{
+	uint8_t *dst = (uint8_t *)buffer;
+	size_t cb;
+	int ret;
+
+	*readed = 0;
+	if (blk->codec == ADAPTIVE_STORE && blk->stream.read == NULL)
+		return BSDIFF_END_OF_FILE;
+	while (*readed < size) {
+		cb = 0;
+		if (blk->codec == ADAPTIVE_STORE)
+			ret = blk->stream.read(blk->stream.state, dst + *readed, size - *readed, &cb);
+		else
+			ret = blk->dec.read(blk->dec.state, dst + *readed, size - *readed, &cb);
+		if (ret != BSDIFF_SUCCESS && ret != BSDIFF_END_OF_FILE)
+			return ret;
+		*readed += cb;
+		if (ret == BSDIFF_END_OF_FILE || cb == 0)
+			break;
+	}
+	return (*readed == 0 && size > 0) ? BSDIFF_END_OF_FILE : BSDIFF_SUCCESS;
+}
+
+static int adaptive_patch_packer_read_new_size(void *state, int64_t *size)
+{
+	int ret, i;
+	uint8_t header[40];
+	size_t cb;
+	int64_t lens[3], newsize;
+	int64_t read_start, read_end;
+
+	struct adaptive_patch_packer *packer = (struct adaptive_patch_packer *)state;
+	assert(packer->mode == BSDIFF_MODE_READ);
+	assert(packer->new_size == -1);
+
+	/* Read header */
+	ret = packer->stream->read(packer->stream->state, header, 40, &cb);
+	if (ret != BSDIFF_SUCCESS || cb != 40)
+		return BSDIFF_FILE_ERROR;
+
+	/* Check for appropriate magic */
+	if (memcmp(header, "BSDIFFAD", 8) != 0)
+		return BSDIFF_CORRUPT_PATCH;
+
+	/* Read lengths from header */
+	lens[0] = bsdiff_offtin(header + 8);
+	lens[1] = bsdiff_offtin(header + 16);
+	newsize = bsdiff_offtin(header + 24);
+	if ((lens[0] < 0) || (lens[1] < 0) || (newsize < 0))
+		return BSDIFF_CORRUPT_PATCH;
+	for (i = 35; i < 40; i++) {
+		if (header[i] != 0)
+			return BSDIFF_CORRUPT_PATCH;
+	}
+
+	/* The extra block runs up to the end of the patch */
+	if ((packer->stream->seek(packer->stream->state, 0, BSDIFF_SEEK_END) != BSDIFF_SUCCESS) ||
+	    (packer->stream->tell(packer->stream->state, &read_end) != BSDIFF_SUCCESS))
+		return BSDIFF_FILE_ERROR;
+	lens[2] = read_end - 40 - lens[0] - lens[1];
+	if (lens[2] < 0)
+		return BSDIFF_CORRUPT_PATCH;
+
+	/* Open substreams and create decompressors */
+	read_start = 40;
+	for (i = 0; i < 3; i++) {
+		struct adaptive_block *blk = &packer->blocks[i];
+
+		blk->codec = header[32 + i];
+		/* An empty block can only be stored, and has no substream */
+		if (lens[i] == 0) {
+			if (blk->codec != ADAPTIVE_STORE)
+				return BSDIFF_CORRUPT_PATCH;
+			continue;
+		}
+		if (bsdiff_open_substream(packer->stream, read_start, read_start + lens[i],
+		                          &blk->stream) != BSDIFF_SUCCESS)
+			return BSDIFF_FILE_ERROR;
+		read_start += lens[i];
+		if (blk->codec != ADAPTIVE_STORE) {
+			if ((ret = create_decompressor(blk->codec, &blk->dec)) != BSDIFF_SUCCESS)
+				return ret;
+			if (blk->dec.init(blk->dec.state, &blk->stream) != BSDIFF_SUCCESS)
+				return BSDIFF_ERROR;
+		}
+	}
+
+	packer->new_size = newsize;
+
+	*size = packer->new_size;
+
+	return BSDIFF_SUCCESS;
+}
+
+static int adaptive_patch_packer_read_entry_header(
+	void *state, int64_t *diff, int64_t *extra, int64_t *seek)
+{
+	int ret;
+	uint8_t buf[24];
+	size_t cb;
+
+	struct adaptive_patch_packer *packer = (struct adaptive_patch_packer *)state;
+	assert(packer->mode == BSDIFF_MODE_READ);
+	assert(packer->new_size >= 0);
+	assert(packer->header_x == 0 && packer->header_y == 0);
+
+	ret = block_read(&packer->blocks[0], buf, 24, &cb);
+	if ((ret != BSDIFF_SUCCESS && ret != BSDIFF_END_OF_FILE) || (cb != 24))
+		return BSDIFF_ERROR;
+	if ((ret = bsdiff_decode_ctrl(buf, &(packer->header_x), &(packer->header_y), &(packer->header_z))) != BSDIFF_SUCCESS)
+		return ret;
+
+	*diff  = packer->header_x;
+	*extra = packer->header_y;
+	*seek  = packer->header_z;
+
+	return BSDIFF_SUCCESS;
+}
+
+static int adaptive_patch_packer_read_entry_diff(
+	void *state, void *buffer, size_t size, size_t *readed)
+{
+	int ret;
+	size_t cb;
+
+	struct adaptive_patch_packer *packer = (struct adaptive_patch_packer *)state;
+	assert(packer->mode == BSDIFF_MODE_READ);
+	assert(packer->new_size >= 0);
+	assert(packer->header_x >= 0);
+
+	*readed = 0;
+
+	if ((cb = bsdiff_entry_chunk(packer->header_x, size)) == 0)
+		return BSDIFF_END_OF_FILE;
+
+	ret = block_read(&packer->blocks[1], buffer, cb, readed);
+	packer->header_x -= (int64_t)(*readed);
+	return ret;
+}
+
+static int adaptive_patch_packer_read_entry_extra(
+	void *state, void *buffer, size_t size, size_t *readed)
+{
+	int ret;
+	size_t cb;
+
+	struct adaptive_patch_packer *packer = (struct adaptive_patch_packer *)state;
+	assert(packer->mode == BSDIFF_MODE_READ);
+	assert(packer->new_size >= 0);
+	assert(packer->header_y >= 0);
+
+	*readed = 0;
+
+	if ((cb = bsdiff_entry_chunk(packer->header_y, size)) == 0)
+		return BSDIFF_END_OF_FILE;
+
+	ret = block_read(&packer->blocks[2], buffer, cb, readed);
+	packer->header_y -= (int64_t)(*readed);
+	return ret;
+}
+
+static int adaptive_patch_packer_write_new_size(void *state, int64_t size)
+{
+	uint8_t header[40] = { 0 };
+	int i;
+
+	struct adaptive_patch_packer *packer = (struct adaptive_patch_packer *)state;
+	assert(packer->mode == BSDIFF_MODE_WRITE);
+	assert(packer->new_size == -1);
+	assert(size >= 0);
+
+	/* Write a pseudo header */
+	if (packer->stream->write(packer->stream->state, header, 40) != BSDIFF_SUCCESS)
+		return BSDIFF_FILE_ERROR;
+
+	/* The blocks are compressed into memory until flush */
+	for (i = 0; i < 3; i++) {
+		if (bsdiff_open_chunked_memory_stream(0, &packer->blocks[i].stream) != BSDIFF_SUCCESS)
+			return BSDIFF_OUT_OF_MEMORY;
+	}
+
+	packer->new_size = size;
+
+	return BSDIFF_SUCCESS;
+}
+
+static int adaptive_patch_packer_write_entry_header(
+	void *state, int64_t diff, int64_t extra, int64_t seek)
+{
+	uint8_t buf[24];
+
+	struct adaptive_patch_packer *packer = (struct adaptive_patch_packer *)state;
+	assert(packer->mode == BSDIFF_MODE_WRITE);
+	assert(packer->new_size >= 0);
+	assert(diff >= 0);
+	assert(extra >= 0);
+
+	assert(packer->header_x == 0 && packer->header_y == 0);
+	packer->header_x = diff;
+	packer->header_y = extra;
+	packer->header_z = seek;
+
+	/* Write a triple */
+	bsdiff_encode_ctrl(packer->header_x, packer->header_y, packer->header_z, buf);
+	return block_write(&packer->blocks[0], buf, 24);
+}
+
+static int adaptive_patch_packer_write_entry_diff(
+	void *state, const void *buffer, size_t size)
+{
+	int ret;
+
+	struct adaptive_patch_packer *packer = (struct adaptive_patch_packer *)state;
+	assert(packer->mode == BSDIFF_MODE_WRITE);
+	assert(packer->new_size >= 0);
+
+	if ((int64_t)size > packer->header_x)
+		return BSDIFF_INVALID_ARG;
+	if ((ret = block_write(&packer->blocks[1], buffer, size)) != BSDIFF_SUCCESS)
+		return ret;
+	packer->header_x -= (int64_t)size;
+
+	return BSDIFF_SUCCESS;
+}
+
+static int adaptive_patch_packer_write_entry_extra(
+	void *state, const void *buffer, size_t size)
+{
+	int ret;
+
+	struct adaptive_patch_packer *packer = (struct adaptive_patch_packer *)state;
+	assert(packer->mode == BSDIFF_MODE_WRITE);
+	assert(packer->new_size >= 0);
+
+	if ((int64_t)size > packer->header_y)
+		return BSDIFF_INVALID_ARG;
+	if ((ret = block_write(&packer->blocks[2], buffer, size)) != BSDIFF_SUCCESS)
+		return ret;
+	packer->header_y -= (int64_t)size;
+
+	return BSDIFF_SUCCESS;
+}
+
+static int adaptive_patch_packer_flush(void *state)
+{
+	uint8_t header[40] = { 0 };
+	int64_t sizes[3];
+	int ret, i;
+
+	struct adaptive_patch_packer *packer = (struct adaptive_patch_packer *)state;
+	assert(packer->mode == BSDIFF_MODE_WRITE);
+	assert(packer->new_size >= 0);
+	assert(packer->header_x == 0 && packer->header_y == 0);
+
+	/* Blocks shorter than a sample pick their codec now */
+	for (i = 0; i < 3; i++) {
+		if ((ret = block_flush(&packer->blocks[i])) != BSDIFF_SUCCESS)
+			return ret;
+		if (bsdiff_stream_data_size(&packer->blocks[i].stream, &sizes[i]) != BSDIFF_SUCCESS)
+			return BSDIFF_ERROR;
+		header[32 + i] = (uint8_t)packer->blocks[i].codec;
+	}
+
+	memcpy(header, "BSDIFFAD", 8);
+	bsdiff_offtout(sizes[0], header + 8);
+	bsdiff_offtout(sizes[1], header + 16);
+	bsdiff_offtout(packer->new_size, header + 24);
+
+	/* Seek to the beginning, write everything sequentially */
+	if (packer->stream->seek(packer->stream->state, 0, BSDIFF_SEEK_SET) != BSDIFF_SUCCESS)
+		return BSDIFF_FILE_ERROR;
+	if (packer->stream->write(packer->stream->state, header, 40) != BSDIFF_SUCCESS)
+		return BSDIFF_FILE_ERROR;
+	for (i = 0; i < 3; i++) {
+		if (bsdiff_write_stream_data(packer->stream, &packer->blocks[i].stream) != BSDIFF_SUCCESS)
+			return BSDIFF_FILE_ERROR;
+	}
+	if (packer->stream->flush(packer->stream->state) != BSDIFF_SUCCESS)
+		return BSDIFF_FILE_ERROR;
+
+	return BSDIFF_SUCCESS;
+}
+
+static void adaptive_patch_packer_close(void *state)
+{
+	struct adaptive_patch_packer *packer = (struct adaptive_patch_packer *)state;
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		struct adaptive_block *blk = &packer->blocks[i];
+
+		if (packer->mode == BSDIFF_MODE_READ)
+			bsdiff_close_decompressor(&blk->dec);
+		else
+			bsdiff_close_compressor(&blk->enc);
+		bsdiff_close_stream(&blk->stream);
+		if (blk->sample != NULL)
+			bsdiff_free(blk->sample);
+	}
+
+	bsdiff_free(packer);
+}
+
+static int adaptive_patch_packer_getmode(void *state)
+{
+	struct adaptive_patch_packer *packer = (struct adaptive_patch_packer *)state;
+	return packer->mode;
+}
+
+int bsdiff_open_adaptive_patch_packer(
+	int mode,
+	struct bsdiff_stream *stream,
+	struct bsdiff_patch_packer *packer)
+{
+	struct adaptive_patch_packer *state;
+	int i;
+
+	assert(mode >= BSDIFF_MODE_READ && mode <= BSDIFF_MODE_WRITE);
+	assert(stream);
+	assert(packer);
+
+	state = bsdiff_malloc(sizeof(struct adaptive_patch_packer));
+	if (!state)
+		return BSDIFF_OUT_OF_MEMORY;
+	memset(state, 0, sizeof(*state));
+	state->stream = stream;
+	state->mode = mode;
+	state->new_size = -1;
+	for (i = 0; i < 3; i++)
+		state->blocks[i].codec = -1;
+
+	memset(packer, 0, sizeof(*packer));
+	packer->state = state;
+	if (mode == BSDIFF_MODE_READ) {
+		packer->read_new_size      = adaptive_patch_packer_read_new_size;
+		packer->read_entry_header  = adaptive_patch_packer_read_entry_header;
+		packer->read_entry_diff    = adaptive_patch_packer_read_entry_diff;
+		packer->read_entry_extra   = adaptive_patch_packer_read_entry_extra;
+	} else {
+		packer->write_new_size     = adaptive_patch_packer_write_new_size;
+		packer->write_entry_header = adaptive_patch_packer_write_entry_header;
+		packer->write_entry_diff   = adaptive_patch_packer_write_entry_diff;
+		packer->write_entry_extra  = adaptive_patch_packer_write_entry_extra;
+		packer->flush              = adaptive_patch_packer_flush;
+	}
+	packer->close = adaptive_patch_packer_close;
+	packer->get_mode = adaptive_patch_packer_getmode;
+
+	return BSDIFF_SUCCESS;
+}
@@ -1,6 +1,7 @@
 #include "bsdiff.h"
 #include "bsdiff_mem.h"
 #include "bsdiff_private.h"
+#include "bsdiff_thread.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -8,51 +9,9 @@
 
 int bsdiff_create_bz2_compressor(struct bsdiff_compressor *enc);
 int bsdiff_create_bz2_decompressor(struct bsdiff_decompressor *dec);
-
-static int64_t offtin(uint8_t *buf)
-{
-	int64_t y;
-	
-	// Reconstruct the 63-bit value from little-endian bytes
-	y = ((int64_t)buf[0]) |
-		((int64_t)buf[1] << 8) |
-		((int64_t)buf[2] << 16) |
-		((int64_t)buf[3] << 24) |
-		((int64_t)buf[4] << 32) |
-		((int64_t)buf[5] << 40) |
-		((int64_t)buf[6] << 48) |
-		(((int64_t)(buf[7] & 0x7F)) << 56);
-
-	// Apply sign if negative
-	if (buf[7] & 0x80)
-		y = -y;
-
-	return y;
-}
-
-static void offtout(int64_t x, uint8_t *buf)
-{
-	uint64_t y;
-
-	if (x < 0) {
-		y = (uint64_t)(-x);
-	} else {
-		y = (uint64_t)x;
-	}
-
-	// Extract bytes in little-endian order using bit shifts
-	buf[0] = (uint8_t)(y);
-	buf[1] = (uint8_t)(y >> 8);
-	buf[2] = (uint8_t)(y >> 16);
-	buf[3] = (uint8_t)(y >> 24);
-	buf[4] = (uint8_t)(y >> 32);
-	buf[5] = (uint8_t)(y >> 40);
-	buf[6] = (uint8_t)(y >> 48);
-	if (x < 0)
-		buf[7] = (uint8_t)((y >> 56) | 0x80);
-	else
-		buf[7] = (uint8_t)(y >> 56);
-}
+int bsdiff_create_threaded_compressor(struct bsdiff_compressor *enc);
+int bsdiff_create_bz2_parallel_compressor(struct bsdiff_compressor *enc, struct bsdiff_thread_pool *pool);
+int bsdiff_create_bz2_parallel_decompressor(struct bsdiff_decompressor *dec, struct bsdiff_thread_pool *pool);
 
 struct bz2_patch_packer
 {
@@ -60,6 +19,8 @@ struct bz2_patch_packer
 	int mode;
 
 	int64_t new_size;
+	struct bsdiff_bz2_options opts;
+	struct bsdiff_thread_pool *pool;  /* shared by the three blocks if opts.threads > 1 */
 
 	int64_t header_x;
 	int64_t header_y;
@@ -80,6 +41,35 @@ struct bz2_patch_packer
 	struct bsdiff_stream epf_stream;
 };
 
+static int create_pool(struct bz2_patch_packer *packer)
+{
+	if (packer->opts.threads <= 1 || packer->pool != NULL)
+		return BSDIFF_SUCCESS;
+	return bsdiff_create_thread_pool(packer->opts.threads, &(packer->pool));
+}
+
+static int create_compressor(struct bz2_patch_packer *packer, struct bsdiff_compressor *enc)
+{
+	int ret;
+
+	if ((ret = create_pool(packer)) != BSDIFF_SUCCESS)
+		return ret;
+	if (packer->pool != NULL)
+		return bsdiff_create_bz2_parallel_compressor(enc, packer->pool);
+	return bsdiff_create_bz2_compressor(enc);
+}
+
+static int create_decompressor(struct bz2_patch_packer *packer, struct bsdiff_decompressor *dec)
+{
+	int ret;
+
+	if ((ret = create_pool(packer)) != BSDIFF_SUCCESS)
+		return ret;
+	if (packer->pool != NULL)
+		return bsdiff_create_bz2_parallel_decompressor(dec, packer->pool);
+	return bsdiff_create_bz2_decompressor(dec);
+}
+
 static int bz2_patch_packer_read_new_size(void *state, int64_t *size)
 {
 	int ret;
@@ -116,9 +106,9 @@ static int bz2_patch_packer_read_new_size(void *state, int64_t *size)
 		return BSDIFF_CORRUPT_PATCH;
 
 	/* Read lengths from header */
-	bzctrllen = offtin(header + 8);
-	bzdatalen = offtin(header + 16);
-	newsize = offtin(header + 24);
+	bzctrllen = bsdiff_offtin(header + 8);
+	bzdatalen = bsdiff_offtin(header + 16);
+	newsize = bsdiff_offtin(header + 24);
 	if ((bzctrllen < 0) || (bzdatalen < 0) || (newsize < 0))
 		return BSDIFF_CORRUPT_PATCH;
 
@@ -128,7 +118,7 @@ static int bz2_patch_packer_read_new_size(void *state, int64_t *size)
 	read_end = read_start + bzctrllen;
 	if (bsdiff_open_substream(packer->stream, read_start, read_end, &(packer->cpf)) != BSDIFF_SUCCESS)
 		return BSDIFF_FILE_ERROR;
-	if (bsdiff_create_bz2_decompressor(&(packer->cpf_dec)) != BSDIFF_SUCCESS)
+	if (create_decompressor(packer, &(packer->cpf_dec)) != BSDIFF_SUCCESS)
 		return BSDIFF_ERROR;
 	if (packer->cpf_dec.init(packer->cpf_dec.state, &(packer->cpf)) != BSDIFF_SUCCESS)
 		return BSDIFF_ERROR;
@@ -137,7 +127,7 @@ static int bz2_patch_packer_read_new_size(void *state, int64_t *size)
 	read_end = read_start + bzdatalen;
 	if (bsdiff_open_substream(packer->stream, read_start, read_end, &(packer->dpf)) != BSDIFF_SUCCESS)
 		return BSDIFF_FILE_ERROR;
-	if (bsdiff_create_bz2_decompressor(&(packer->dpf_dec)) != BSDIFF_SUCCESS)
+	if (create_decompressor(packer, &(packer->dpf_dec)) != BSDIFF_SUCCESS)
 		return BSDIFF_ERROR;
 	if (packer->dpf_dec.init(packer->dpf_dec.state, &(packer->dpf)) != BSDIFF_SUCCESS)
 		return BSDIFF_ERROR;
@@ -150,7 +140,7 @@ static int bz2_patch_packer_read_new_size(void *state, int64_t *size)
 	}
 	if (bsdiff_open_substream(packer->stream, read_start, read_end, &(packer->epf)) != BSDIFF_SUCCESS)
 		return BSDIFF_FILE_ERROR;
-	if (bsdiff_create_bz2_decompressor(&(packer->epf_dec)) != BSDIFF_SUCCESS)
+	if (create_decompressor(packer, &(packer->epf_dec)) != BSDIFF_SUCCESS)
 		return BSDIFF_ERROR;
 	if (packer->epf_dec.init(packer->epf_dec.state, &(packer->epf)) != BSDIFF_SUCCESS)
 		return BSDIFF_ERROR;
@@ -177,9 +167,8 @@ static int bz2_patch_packer_read_entry_header(
 	ret = packer->cpf_dec.read(packer->cpf_dec.state, buf, 24, &cb);
 	if ((ret != BSDIFF_SUCCESS && ret != BSDIFF_END_OF_FILE) || (cb != 24))
 		return BSDIFF_ERROR;
-	packer->header_x = offtin(buf);
-	packer->header_y = offtin(buf + 8);
-	packer->header_z = offtin(buf + 16);
+	if ((ret = bsdiff_decode_ctrl(buf, &(packer->header_x), &(packer->header_y), &(packer->header_z))) != BSDIFF_SUCCESS)
+		return ret;
 
 	*diff  = packer->header_x;
 	*extra = packer->header_y;
@@ -192,7 +181,7 @@ static int bz2_patch_packer_read_entry_diff(
 	void *state, void *buffer, size_t size, size_t *readed)
 {
 	int ret;
-	int64_t cb;
+	size_t cb;
 
 	struct bz2_patch_packer *packer = (struct bz2_patch_packer*)state;
 	assert(packer->mode == BSDIFF_MODE_READ);
@@ -201,13 +190,10 @@ static int bz2_patch_packer_read_entry_diff(
 
 	*readed = 0;
 
-	cb = (int64_t)size;
-	if (packer->header_x < cb)
-		cb = packer->header_x;
-	if (cb <= 0)
+	if ((cb = bsdiff_entry_chunk(packer->header_x, size)) == 0)
 		return BSDIFF_END_OF_FILE;
 
-	ret = packer->dpf_dec.read(packer->dpf_dec.state, buffer, (size_t)cb, readed);
+	ret = packer->dpf_dec.read(packer->dpf_dec.state, buffer, cb, readed);
 	packer->header_x -= (int64_t)(*readed);
 	return ret;
 }
@@ -216,7 +202,7 @@ static int bz2_patch_packer_read_entry_extra(
 	void *state, void *buffer, size_t size, size_t *readed)
 {
 	int ret;
-	int64_t cb;
+	size_t cb;
 
 	struct bz2_patch_packer *packer = (struct bz2_patch_packer*)state;
 	assert(packer->mode == BSDIFF_MODE_READ);
@@ -225,13 +211,10 @@ static int bz2_patch_packer_read_entry_extra(
 
 	*readed = 0;
 
-	cb = (int64_t)size;
-	if (packer->header_y < cb)
-		cb = packer->header_y;
-	if (cb <= 0)
+	if ((cb = bsdiff_entry_chunk(packer->header_y, size)) == 0)
 		return BSDIFF_END_OF_FILE;
 
-	ret = packer->epf_dec.read(packer->epf_dec.state, buffer, (size_t)cb, readed);
+	ret = packer->epf_dec.read(packer->epf_dec.state, buffer, cb, readed);
 	packer->header_y -= (int64_t)(*readed);
 	return ret;
 }
@@ -249,27 +232,30 @@ static int bz2_patch_packer_write_new_size(
 	if (packer->stream->write(packer->stream->state, header, 32) != BSDIFF_SUCCESS)
 		return BSDIFF_FILE_ERROR;
 
-	/* Initialize memory streams for ctrl, diff && extra */
-	if (bsdiff_open_memory_stream(BSDIFF_MODE_WRITE, NULL, 0, &(packer->cpf_stream)) != BSDIFF_SUCCESS)
+	/* Initialize memory streams for ctrl, diff && extra, which may spill to disk */
+	if (bsdiff_open_spill_stream(packer->opts.spill_threshold, packer->opts.spill_dir, &(packer->cpf_stream)) != BSDIFF_SUCCESS)
 		return BSDIFF_OUT_OF_MEMORY;
-	if (bsdiff_open_memory_stream(BSDIFF_MODE_WRITE, NULL, 0, &(packer->dpf_stream)) != BSDIFF_SUCCESS) {
+	if (bsdiff_open_spill_stream(packer->opts.spill_threshold, packer->opts.spill_dir, &(packer->dpf_stream)) != BSDIFF_SUCCESS) {
 		bsdiff_close_stream(&(packer->cpf_stream));
 		return BSDIFF_OUT_OF_MEMORY;
 	}
-	if (bsdiff_open_memory_stream(BSDIFF_MODE_WRITE, NULL, 0, &(packer->epf_stream)) != BSDIFF_SUCCESS) {
+	if (bsdiff_open_spill_stream(packer->opts.spill_threshold, packer->opts.spill_dir, &(packer->epf_stream)) != BSDIFF_SUCCESS) {
 		bsdiff_close_stream(&(packer->cpf_stream));
 		bsdiff_close_stream(&(packer->dpf_stream));
 		return BSDIFF_OUT_OF_MEMORY;
 	}
 
 	/* Initialize compressors */
-	if ((bsdiff_create_bz2_compressor(&(packer->cpf_enc)) != BSDIFF_SUCCESS) ||
+	if ((create_compressor(packer, &(packer->cpf_enc)) != BSDIFF_SUCCESS) ||
+		(packer->opts.concurrent && bsdiff_create_threaded_compressor(&(packer->cpf_enc)) != BSDIFF_SUCCESS) ||
 		(packer->cpf_enc.init(packer->cpf_enc.state, &(packer->cpf_stream)) != BSDIFF_SUCCESS))
 		return BSDIFF_ERROR;
-	if ((bsdiff_create_bz2_compressor(&(packer->dpf_enc)) != BSDIFF_SUCCESS) ||
+	if ((create_compressor(packer, &(packer->dpf_enc)) != BSDIFF_SUCCESS) ||
+		(packer->opts.concurrent && bsdiff_create_threaded_compressor(&(packer->dpf_enc)) != BSDIFF_SUCCESS) ||
 		(packer->dpf_enc.init(packer->dpf_enc.state, &(packer->dpf_stream)) != BSDIFF_SUCCESS))
 		return BSDIFF_ERROR;
-	if ((bsdiff_create_bz2_compressor(&(packer->epf_enc)) != BSDIFF_SUCCESS) ||
+	if ((create_compressor(packer, &(packer->epf_enc)) != BSDIFF_SUCCESS) ||
+		(packer->opts.concurrent && bsdiff_create_threaded_compressor(&(packer->epf_enc)) != BSDIFF_SUCCESS) ||
 		(packer->epf_enc.init(packer->epf_enc.state, &(packer->epf_stream)) != BSDIFF_SUCCESS))
 		return BSDIFF_ERROR;
 
@@ -294,9 +280,7 @@ static int bz2_patch_packer_write_entry_header(
 
 	/* Write a triple */
 	uint8_t buf[24];
-	offtout(packer->header_x, buf);
-	offtout(packer->header_y, buf + 8);
-	offtout(packer->header_z, buf + 16);
+	bsdiff_encode_ctrl(packer->header_x, packer->header_y, packer->header_z, buf);
 	int ret = packer->cpf_enc.write(packer->cpf_enc.state, buf, 24);
 	if (ret != BSDIFF_SUCCESS)
 		return ret;
@@ -346,7 +330,7 @@ static int bz2_patch_packer_flush(void *state)
 	assert(packer->header_x == 0 && packer->header_y == 0);
 
 	memcpy(header, "BSDIFF40", 8);
-	offtout(packer->new_size, header + 24);
+	bsdiff_offtout(packer->new_size, header + 24);
 
 	/* Flush all compressors */
 	if (packer->cpf_enc.flush(packer->cpf_enc.state) != BSDIFF_SUCCESS)
@@ -356,27 +340,27 @@ static int bz2_patch_packer_flush(void *state)
 	if (packer->epf_enc.flush(packer->epf_enc.state) != BSDIFF_SUCCESS)
 		return BSDIFF_ERROR;
 
-	/* Get compressed buffers and sizes */
-	const void *cpf_buf, *dpf_buf, *epf_buf;
-	size_t cpf_size, dpf_size, epf_size;
-	packer->cpf_stream.get_buffer(packer->cpf_stream.state, &cpf_buf, &cpf_size);
-	packer->dpf_stream.get_buffer(packer->dpf_stream.state, &dpf_buf, &dpf_size);
-	packer->epf_stream.get_buffer(packer->epf_stream.state, &epf_buf, &epf_size);
+	/* Get compressed sizes */
+	int64_t cpf_size, dpf_size;
+	if (bsdiff_stream_data_size(&(packer->cpf_stream), &cpf_size) != BSDIFF_SUCCESS ||
+		bsdiff_stream_data_size(&(packer->dpf_stream), &dpf_size) != BSDIFF_SUCCESS)
+		return BSDIFF_ERROR;
 
 	/* Fill header lengths */
-	offtout((int64_t)cpf_size, header + 8);
-	offtout((int64_t)dpf_size, header + 16);
+	bsdiff_offtout(cpf_size, header + 8);
+	bsdiff_offtout(dpf_size, header + 16);
 
-	/* Seek to the beginning, write everything sequentially */
+	/* Seek to the beginning, write everything sequentially, the blocks
+	   chunk by chunk as they were compressed */
 	if (packer->stream->seek(packer->stream->state, 0, BSDIFF_SEEK_SET) != BSDIFF_SUCCESS)
 		return BSDIFF_FILE_ERROR;
 	if (packer->stream->write(packer->stream->state, header, 32) != BSDIFF_SUCCESS)
 		return BSDIFF_FILE_ERROR;
-	if (packer->stream->write(packer->stream->state, cpf_buf, cpf_size) != BSDIFF_SUCCESS)
+	if (bsdiff_write_stream_data(packer->stream, &(packer->cpf_stream)) != BSDIFF_SUCCESS)
 		return BSDIFF_FILE_ERROR;
-	if (packer->stream->write(packer->stream->state, dpf_buf, dpf_size) != BSDIFF_SUCCESS)
+	if (bsdiff_write_stream_data(packer->stream, &(packer->dpf_stream)) != BSDIFF_SUCCESS)
 		return BSDIFF_FILE_ERROR;
-	if (packer->stream->write(packer->stream->state, epf_buf, epf_size) != BSDIFF_SUCCESS)
+	if (bsdiff_write_stream_data(packer->stream, &(packer->epf_stream)) != BSDIFF_SUCCESS)
 		return BSDIFF_FILE_ERROR;
 	if (packer->stream->flush(packer->stream->state) != BSDIFF_SUCCESS)
 		return BSDIFF_FILE_ERROR;
@@ -403,6 +387,7 @@ static void bz2_patch_packer_close(void *state)
 		bsdiff_close_stream(&(packer->dpf_stream));
 		bsdiff_close_stream(&(packer->epf_stream));
 	}
+	bsdiff_close_thread_pool(packer->pool);
 
 	bsdiff_free(packer);
 }
@@ -413,9 +398,10 @@ static int bz2_patch_packer_getmode(void *state)
 	return packer->mode;
 }
 
-int bsdiff_open_bz2_patch_packer(
+int bsdiff_open_bz2_patch_packer_ex(
 	int mode,
 	struct bsdiff_stream *stream,
+	const struct bsdiff_bz2_options *options,
 	struct bsdiff_patch_packer *packer)
 {
 	struct bz2_patch_packer *state;
@@ -430,6 +416,8 @@ int bsdiff_open_bz2_patch_packer(
 	state->stream = stream;
 	state->mode = mode;
 	state->new_size = -1;
+	if (options)
+		state->opts = *options;
 
 	memset(packer, 0, sizeof(*packer));
 	packer->state = state;
@@ -450,3 +438,11 @@ int bsdiff_open_bz2_patch_packer(
 	
 	return BSDIFF_SUCCESS;
 }
+
+int bsdiff_open_bz2_patch_packer(
+	int mode,
+	struct bsdiff_stream *stream,
+	struct bsdiff_patch_packer *packer)
+{
+	return bsdiff_open_bz2_patch_packer_ex(mode, stream, NULL, packer);
+}
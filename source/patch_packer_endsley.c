@@ -0,0 +1,289 @@
+#include "bsdiff.h"
+#include "bsdiff_mem.h"
+#include "bsdiff_private.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+
+/*
+ * The format used by Matthew Endsley's bsdiff:
+ *   0   16  "ENDSLEY/BSDIFF43"
+ *   16  8   length of the new file
+ *   24  ?   a single bzip2 stream of the entries, each one being
+ *           ctrl (3 x 8 bytes), then its diff bytes, then its extra bytes
+ *
+ * Everything is produced and consumed strictly in order, so the patch can be
+ * written to or read from a pipe.
+ */
+
+int bsdiff_create_bz2_compressor(struct bsdiff_compressor *enc);
+int bsdiff_create_bz2_decompressor(struct bsdiff_decompressor *dec);
+
+struct endsley_patch_packer
+{
+	struct bsdiff_stream *stream;
+	int mode;
+
+	int64_t new_size;
+
+	int64_t header_x;
+	int64_t header_y;
+	int64_t header_z;
+
+	struct bsdiff_decompressor dec;
+	struct bsdiff_compressor enc;
+};
+
+static int endsley_patch_packer_read_new_size(void *state, int64_t *size)
+{
+	uint8_t header[24];
+	size_t cb;
+	int64_t newsize;
+	int ret;
+
+	struct endsley_patch_packer *packer = (struct endsley_patch_packer*)state;
+	assert(packer->mode == BSDIFF_MODE_READ);
+	assert(packer->new_size == -1);
+
+	ret = packer->stream->read(packer->stream->state, header, 24, &cb);
+	if ((ret != BSDIFF_SUCCESS && ret != BSDIFF_END_OF_FILE) || (cb != 24))
+		return BSDIFF_CORRUPT_PATCH;
+	if (memcmp(header, "ENDSLEY/BSDIFF43", 16) != 0)
+		return BSDIFF_CORRUPT_PATCH;
+	newsize = bsdiff_offtin(header + 16);
+	if (newsize < 0)
+		return BSDIFF_CORRUPT_PATCH;
+
+	/* The decompressor continues right after the header */
+	if (bsdiff_create_bz2_decompressor(&(packer->dec)) != BSDIFF_SUCCESS)
+		return BSDIFF_OUT_OF_MEMORY;
+	if (packer->dec.init(packer->dec.state, packer->stream) != BSDIFF_SUCCESS)
+		return BSDIFF_ERROR;
+
+	packer->new_size = newsize;
+	*size = newsize;
+
+	return BSDIFF_SUCCESS;
+}
+
+static int endsley_patch_packer_read_entry_header(void *state, int64_t *diff, int64_t *extra, int64_t *seek)
+{
+	uint8_t buf[24];
+	size_t cb;
+	int ret;
+
+	struct endsley_patch_packer *packer = (struct endsley_patch_packer*)state;
+	assert(packer->mode == BSDIFF_MODE_READ);
+	assert(packer->new_size >= 0);
+
+	/* The previous entry must have been consumed completely */
+	if (packer->header_x != 0 || packer->header_y != 0)
+		return BSDIFF_ERROR;
+
+	ret = packer->dec.read(packer->dec.state, buf, 24, &cb);
+	if ((ret != BSDIFF_SUCCESS && ret != BSDIFF_END_OF_FILE) || (cb != 24))
+		return BSDIFF_CORRUPT_PATCH;
+	if ((ret = bsdiff_decode_ctrl(buf, &(packer->header_x), &(packer->header_y), &(packer->header_z))) != BSDIFF_SUCCESS)
+		return ret;
+
+	*diff = packer->header_x;
+	*extra = packer->header_y;
+	*seek = packer->header_z;
+
+	return BSDIFF_SUCCESS;
+}
+
+static int endsley_patch_packer_read_entry_diff(void *state, void *buffer, size_t size, size_t *readed)
+{
+	int ret;
+	size_t cb;
+
+	struct endsley_patch_packer *packer = (struct endsley_patch_packer*)state;
+	assert(packer->mode == BSDIFF_MODE_READ);
+	assert(packer->new_size >= 0);
+	assert(packer->header_x >= 0);
+
+	*readed = 0;
+
+	if ((cb = bsdiff_entry_chunk(packer->header_x, size)) == 0)
+		return BSDIFF_END_OF_FILE;
+
+	ret = packer->dec.read(packer->dec.state, buffer, cb, readed);
+	packer->header_x -= (int64_t)(*readed);
+	return ret;
+}
+
+static int endsley_patch_packer_read_entry_extra(void *state, void *buffer, size_t size, size_t *readed)
+{
+	int ret;
+	size_t cb;
+
+	struct endsley_patch_packer *packer = (struct endsley_patch_packer*)state;
+	assert(packer->mode == BSDIFF_MODE_READ);
+	assert(packer->new_size >= 0);
+	assert(packer->header_y >= 0);
+
+	*readed = 0;
+
+	/* Extra bytes follow the diff bytes of the same entry */
+	if (packer->header_x != 0)
+		return BSDIFF_ERROR;
+
+	if ((cb = bsdiff_entry_chunk(packer->header_y, size)) == 0)
+		return BSDIFF_END_OF_FILE;
+
+	ret = packer->dec.read(packer->dec.state, buffer, cb, readed);
+	packer->header_y -= (int64_t)(*readed);
+	return ret;
+}
+
+static int endsley_patch_packer_write_new_size(void *state, int64_t size)
+{
+	uint8_t header[24];
+
+	struct endsley_patch_packer *packer = (struct endsley_patch_packer*)state;
+	assert(packer->mode == BSDIFF_MODE_WRITE);
+	assert(packer->new_size == -1);
+	assert(size >= 0);
+
+	/* The header is final, nothing needs to be patched later */
+	memcpy(header, "ENDSLEY/BSDIFF43", 16);
+	bsdiff_offtout(size, header + 16);
+	if (packer->stream->write(packer->stream->state, header, 24) != BSDIFF_SUCCESS)
+		return BSDIFF_FILE_ERROR;
+
+	if (bsdiff_create_bz2_compressor(&(packer->enc)) != BSDIFF_SUCCESS)
+		return BSDIFF_OUT_OF_MEMORY;
+	if (packer->enc.init(packer->enc.state, packer->stream) != BSDIFF_SUCCESS)
+		return BSDIFF_ERROR;
+
+	packer->new_size = size;
+
+	return BSDIFF_SUCCESS;
+}
+
+static int endsley_patch_packer_write_entry_header(void *state, int64_t diff, int64_t extra, int64_t seek)
+{
+	uint8_t buf[24];
+
+	struct endsley_patch_packer *packer = (struct endsley_patch_packer*)state;
+	assert(packer->mode == BSDIFF_MODE_WRITE);
+	assert(packer->new_size >= 0);
+	assert(diff >= 0);
+	assert(extra >= 0);
+
+	if (packer->header_x != 0 || packer->header_y != 0)
+		return BSDIFF_ERROR;
+	packer->header_x = diff;
+	packer->header_y = extra;
+	packer->header_z = seek;
+
+	bsdiff_encode_ctrl(diff, extra, seek, buf);
+	if (packer->enc.write(packer->enc.state, buf, 24) != BSDIFF_SUCCESS)
+		return BSDIFF_ERROR;
+
+	return BSDIFF_SUCCESS;
+}
+
+static int endsley_patch_packer_write_entry_diff(void *state, const void *buffer, size_t size)
+{
+	struct endsley_patch_packer *packer = (struct endsley_patch_packer*)state;
+	assert(packer->mode == BSDIFF_MODE_WRITE);
+	assert(packer->new_size >= 0);
+
+	if ((int64_t)size > packer->header_x)
+		return BSDIFF_INVALID_ARG;
+	if (packer->enc.write(packer->enc.state, buffer, size) != BSDIFF_SUCCESS)
+		return BSDIFF_ERROR;
+	packer->header_x -= (int64_t)size;
+
+	return BSDIFF_SUCCESS;
+}
+
+static int endsley_patch_packer_write_entry_extra(void *state, const void *buffer, size_t size)
+{
+	struct endsley_patch_packer *packer = (struct endsley_patch_packer*)state;
+	assert(packer->mode == BSDIFF_MODE_WRITE);
+	assert(packer->new_size >= 0);
+
+	/* Extra bytes must follow all of the diff bytes of the entry */
+	if (packer->header_x != 0 || (int64_t)size > packer->header_y)
+		return BSDIFF_INVALID_ARG;
+	if (packer->enc.write(packer->enc.state, buffer, size) != BSDIFF_SUCCESS)
+		return BSDIFF_ERROR;
+	packer->header_y -= (int64_t)size;
+
+	return BSDIFF_SUCCESS;
+}
+
+static int endsley_patch_packer_flush(void *state)
+{
+	struct endsley_patch_packer *packer = (struct endsley_patch_packer*)state;
+	assert(packer->mode == BSDIFF_MODE_WRITE);
+	assert(packer->new_size >= 0);
+	assert(packer->header_x == 0 && packer->header_y == 0);
+
+	/* Finishes the bzip2 stream and flushes the underlying stream */
+	if (packer->enc.flush(packer->enc.state) != BSDIFF_SUCCESS)
+		return BSDIFF_ERROR;
+
+	return BSDIFF_SUCCESS;
+}
+
+static void endsley_patch_packer_close(void *state)
+{
+	struct endsley_patch_packer *packer = (struct endsley_patch_packer*)state;
+
+	if (packer->mode == BSDIFF_MODE_READ)
+		bsdiff_close_decompressor(&(packer->dec));
+	else
+		bsdiff_close_compressor(&(packer->enc));
+
+	bsdiff_free(packer);
+}
+
+static int endsley_patch_packer_getmode(void *state)
+{
+	struct endsley_patch_packer *packer = (struct endsley_patch_packer*)state;
+	return packer->mode;
+}
+
+int bsdiff_open_endsley_patch_packer(
+	int mode,
+	struct bsdiff_stream *stream,
+	struct bsdiff_patch_packer *packer)
+{
+	struct endsley_patch_packer *state;
+
+	assert(mode >= BSDIFF_MODE_READ && mode <= BSDIFF_MODE_WRITE);
+	assert(stream);
+	assert(packer);
+
+	state = bsdiff_malloc(sizeof(struct endsley_patch_packer));
+	if (!state)
+		return BSDIFF_OUT_OF_MEMORY;
+	memset(state, 0, sizeof(*state));
+	state->stream = stream;
+	state->mode = mode;
+	state->new_size = -1;
+
+	memset(packer, 0, sizeof(*packer));
+	packer->state = state;
+	if (mode == BSDIFF_MODE_READ) {
+		packer->read_new_size = endsley_patch_packer_read_new_size;
+		packer->read_entry_header = endsley_patch_packer_read_entry_header;
+		packer->read_entry_diff = endsley_patch_packer_read_entry_diff;
+		packer->read_entry_extra = endsley_patch_packer_read_entry_extra;
+	} else {
+		packer->write_new_size = endsley_patch_packer_write_new_size;
+		packer->write_entry_header = endsley_patch_packer_write_entry_header;
+		packer->write_entry_diff = endsley_patch_packer_write_entry_diff;
+		packer->write_entry_extra = endsley_patch_packer_write_entry_extra;
+		packer->flush = endsley_patch_packer_flush;
+	}
+	packer->close = endsley_patch_packer_close;
+	packer->get_mode = endsley_patch_packer_getmode;
+
+	return BSDIFF_SUCCESS;
+}
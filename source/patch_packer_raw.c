@@ -0,0 +1,324 @@
+#include "bsdiff.h"
+#include "bsdiff_mem.h"
+#include "bsdiff_private.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+
+/*
+ * An uncompressed format, for patches which are compressed by the transport:
+ *   0   8   "BSDIFFRW"
+ *   8   8   length of the new file
+ *   16  ?   the entries, each one being ctrl (3 x 8 bytes), then its diff
+ *           bytes, then its extra bytes
+ *
+ * When the stream has a buffer (mmap, memory), the reader hands out views
+ * of the diff and extra bytes instead of copying them.
+ */
+
+struct raw_patch_packer
+{
+	struct bsdiff_stream *stream;
+	int mode;
+
+	int64_t new_size;
+
+	int64_t header_x;
+	int64_t header_y;
+	int64_t header_z;
+
+	/* The whole patch, if the stream has a buffer */
+	const uint8_t *data;
+	size_t size;
+	size_t pos;
+};
+
+/* Read 'size' bytes, from the buffer if there is one */
+static int raw_read(struct raw_patch_packer *packer, void *buffer, size_t size, size_t *readed)
+{
+	int ret;
+
+	if (packer->data == NULL) {
+		ret = packer->stream->read(packer->stream->state, buffer, size, readed);
+		return (ret == BSDIFF_END_OF_FILE) ? BSDIFF_SUCCESS : ret;
+	}
+
+	*readed = (size < packer->size - packer->pos) ? size : packer->size - packer->pos;
+	memcpy(buffer, packer->data + packer->pos, *readed);
+	packer->pos += *readed;
+	return BSDIFF_SUCCESS;
+}
+
+static int raw_patch_packer_read_new_size(void *state, int64_t *size)
+{
+	uint8_t header[16];
+	size_t cb;
+	int64_t newsize;
+
+	struct raw_patch_packer *packer = (struct raw_patch_packer*)state;
+	assert(packer->mode == BSDIFF_MODE_READ);
+	assert(packer->new_size == -1);
+
+	if (raw_read(packer, header, 16, &cb) != BSDIFF_SUCCESS || cb != 16)
+		return BSDIFF_CORRUPT_PATCH;
+	if (memcmp(header, "BSDIFFRW", 8) != 0)
+		return BSDIFF_CORRUPT_PATCH;
+	newsize = bsdiff_offtin(header + 8);
+	if (newsize < 0)
+		return BSDIFF_CORRUPT_PATCH;
+
+	packer->new_size = newsize;
+	*size = newsize;
+
+	return BSDIFF_SUCCESS;
+}
+
+static int raw_patch_packer_read_entry_header(void *state, int64_t *diff, int64_t *extra, int64_t *seek)
+{
+	uint8_t buf[24];
+	size_t cb;
+	int ret;
+
+	struct raw_patch_packer *packer = (struct raw_patch_packer*)state;
+	assert(packer->mode == BSDIFF_MODE_READ);
+	assert(packer->new_size >= 0);
+
+	/* The previous entry must have been consumed completely */
+	if (packer->header_x != 0 || packer->header_y != 0)
+		return BSDIFF_ERROR;
+
+	if (raw_read(packer, buf, 24, &cb) != BSDIFF_SUCCESS || cb != 24)
+		return BSDIFF_CORRUPT_PATCH;
+	if ((ret = bsdiff_decode_ctrl(buf, &(packer->header_x), &(packer->header_y), &(packer->header_z))) != BSDIFF_SUCCESS)
+		return ret;
+
+	*diff = packer->header_x;
+	*extra = packer->header_y;
+	*seek = packer->header_z;
+
+	return BSDIFF_SUCCESS;
+}
+
+static int raw_patch_packer_read_entry_diff(void *state, void *buffer, size_t size, size_t *readed)
+{
+	int ret;
+	size_t cb;
+
+	struct raw_patch_packer *packer = (struct raw_patch_packer*)state;
+	assert(packer->mode == BSDIFF_MODE_READ);
+	assert(packer->new_size >= 0);
+
+	*readed = 0;
+
+	if ((cb = bsdiff_entry_chunk(packer->header_x, size)) == 0)
+		return BSDIFF_END_OF_FILE;
+
+	ret = raw_read(packer, buffer, cb, readed);
+	packer->header_x -= (int64_t)(*readed);
+	return ret;
+}
+
+static int raw_patch_packer_read_entry_extra(void *state, void *buffer, size_t size, size_t *readed)
+{
+	int ret;
+	size_t cb;
+
+	struct raw_patch_packer *packer = (struct raw_patch_packer*)state;
+	assert(packer->mode == BSDIFF_MODE_READ);
+	assert(packer->new_size >= 0);
+
+	*readed = 0;
+
+	/* Extra bytes follow the diff bytes of the same entry */
+	if (packer->header_x != 0)
+		return BSDIFF_ERROR;
+
+	if ((cb = bsdiff_entry_chunk(packer->header_y, size)) == 0)
+		return BSDIFF_END_OF_FILE;
+
+	ret = raw_read(packer, buffer, cb, readed);
+	packer->header_y -= (int64_t)(*readed);
+	return ret;
+}
+
+/* Point at up to 'size' of the 'remaining' bytes in the buffer */
+static int raw_view(struct raw_patch_packer *packer, int64_t *remaining, size_t size, const void **data, size_t *len)
+{
+	if ((int64_t)size > *remaining)
+		size = (size_t)(*remaining);
+	if (size > packer->size - packer->pos)
+		size = packer->size - packer->pos;
+
+	*data = packer->data + packer->pos;
+	*len = size;
+	packer->pos += size;
+	*remaining -= (int64_t)size;
+
+	return (size == 0) ? BSDIFF_END_OF_FILE : BSDIFF_SUCCESS;
+}
+
+static int raw_patch_packer_view_entry_diff(void *state, size_t size, const void **data, size_t *len)
+{
+	struct raw_patch_packer *packer = (struct raw_patch_packer*)state;
+	assert(packer->mode == BSDIFF_MODE_READ);
+	assert(packer->new_size >= 0);
+
+	return raw_view(packer, &(packer->header_x), size, data, len);
+}
+
+static int raw_patch_packer_view_entry_extra(void *state, size_t size, const void **data, size_t *len)
+{
+	struct raw_patch_packer *packer = (struct raw_patch_packer*)state;
+	assert(packer->mode == BSDIFF_MODE_READ);
+	assert(packer->new_size >= 0);
+
+	*len = 0;
+	if (packer->header_x != 0)
+		return BSDIFF_ERROR;
+	return raw_view(packer, &(packer->header_y), size, data, len);
+}
+
+static int raw_patch_packer_write_new_size(void *state, int64_t size)
+{
+	uint8_t header[16];
+
+	struct raw_patch_packer *packer = (struct raw_patch_packer*)state;
+	assert(packer->mode == BSDIFF_MODE_WRITE);
+	assert(packer->new_size == -1);
+	assert(size >= 0);
+
+	memcpy(header, "BSDIFFRW", 8);
+	bsdiff_offtout(size, header + 8);
+	if (packer->stream->write(packer->stream->state, header, 16) != BSDIFF_SUCCESS)
+		return BSDIFF_FILE_ERROR;
+
+	packer->new_size = size;
+
+	return BSDIFF_SUCCESS;
+}
+
+static int raw_patch_packer_write_entry_header(void *state, int64_t diff, int64_t extra, int64_t seek)
+{
+	uint8_t buf[24];
+
+	struct raw_patch_packer *packer = (struct raw_patch_packer*)state;
+	assert(packer->mode == BSDIFF_MODE_WRITE);
+	assert(packer->new_size >= 0);
+	assert(diff >= 0);
+	assert(extra >= 0);
+
+	if (packer->header_x != 0 || packer->header_y != 0)
+		return BSDIFF_ERROR;
+	packer->header_x = diff;
+	packer->header_y = extra;
+	packer->header_z = seek;
+
+	bsdiff_encode_ctrl(diff, extra, seek, buf);
+	if (packer->stream->write(packer->stream->state, buf, 24) != BSDIFF_SUCCESS)
+		return BSDIFF_FILE_ERROR;
+
+	return BSDIFF_SUCCESS;
+}
+
+static int raw_patch_packer_write_entry_diff(void *state, const void *buffer, size_t size)
+{
+	struct raw_patch_packer *packer = (struct raw_patch_packer*)state;
+	assert(packer->mode == BSDIFF_MODE_WRITE);
+	assert(packer->new_size >= 0);
+
+	if ((int64_t)size > packer->header_x)
+		return BSDIFF_INVALID_ARG;
+	if (packer->stream->write(packer->stream->state, buffer, size) != BSDIFF_SUCCESS)
+		return BSDIFF_FILE_ERROR;
+	packer->header_x -= (int64_t)size;
+
+	return BSDIFF_SUCCESS;
+}
+
+static int raw_patch_packer_write_entry_extra(void *state, const void *buffer, size_t size)
+{
+	struct raw_patch_packer *packer = (struct raw_patch_packer*)state;
+	assert(packer->mode == BSDIFF_MODE_WRITE);
+	assert(packer->new_size >= 0);
+
+	/* Extra bytes must follow all of the diff bytes of the entry */
+	if (packer->header_x != 0 || (int64_t)size > packer->header_y)
+		return BSDIFF_INVALID_ARG;
+	if (packer->stream->write(packer->stream->state, buffer, size) != BSDIFF_SUCCESS)
+		return BSDIFF_FILE_ERROR;
+	packer->header_y -= (int64_t)size;
+
+	return BSDIFF_SUCCESS;
+}
+
+static int raw_patch_packer_flush(void *state)
+{
+	struct raw_patch_packer *packer = (struct raw_patch_packer*)state;
+	assert(packer->mode == BSDIFF_MODE_WRITE);
+	assert(packer->new_size >= 0);
+	assert(packer->header_x == 0 && packer->header_y == 0);
+
+	if (packer->stream->flush(packer->stream->state) != BSDIFF_SUCCESS)
+		return BSDIFF_FILE_ERROR;
+
+	return BSDIFF_SUCCESS;
+}
+
+static void raw_patch_packer_close(void *state)
+{
+	bsdiff_free(state);
+}
+
+static int raw_patch_packer_getmode(void *state)
+{
+	struct raw_patch_packer *packer = (struct raw_patch_packer*)state;
+	return packer->mode;
+}
+
+int bsdiff_open_raw_patch_packer(
+	int mode,
+	struct bsdiff_stream *stream,
+	struct bsdiff_patch_packer *packer)
+{
+	struct raw_patch_packer *state;
+	const void *buf;
+
+	assert(mode >= BSDIFF_MODE_READ && mode <= BSDIFF_MODE_WRITE);
+	assert(stream);
+	assert(packer);
+
+	state = bsdiff_malloc(sizeof(struct raw_patch_packer));
+	if (!state)
+		return BSDIFF_OUT_OF_MEMORY;
+	memset(state, 0, sizeof(*state));
+	state->stream = stream;
+	state->mode = mode;
+	state->new_size = -1;
+
+	memset(packer, 0, sizeof(*packer));
+	packer->state = state;
+	if (mode == BSDIFF_MODE_READ) {
+		packer->read_new_size = raw_patch_packer_read_new_size;
+		packer->read_entry_header = raw_patch_packer_read_entry_header;
+		packer->read_entry_diff = raw_patch_packer_read_entry_diff;
+		packer->read_entry_extra = raw_patch_packer_read_entry_extra;
+		if (stream->get_buffer != NULL &&
+			stream->get_buffer(stream->state, &buf, &(state->size)) == BSDIFF_SUCCESS)
+		{
+			state->data = (const uint8_t*)buf;
+			packer->view_entry_diff = raw_patch_packer_view_entry_diff;
+			packer->view_entry_extra = raw_patch_packer_view_entry_extra;
+		}
+	} else {
+		packer->write_new_size = raw_patch_packer_write_new_size;
+		packer->write_entry_header = raw_patch_packer_write_entry_header;
+		packer->write_entry_diff = raw_patch_packer_write_entry_diff;
+		packer->write_entry_extra = raw_patch_packer_write_entry_extra;
+		packer->flush = raw_patch_packer_flush;
+	}
+	packer->close = raw_patch_packer_close;
+	packer->get_mode = raw_patch_packer_getmode;
+
+	return BSDIFF_SUCCESS;
+}
@@ -0,0 +1,780 @@
+#include "bsdiff.h"
+#include "bsdiff_mem.h"
+#include "bsdiff_private.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+File format:
+	0		8	"BSDIFFSK"
+	8		8	N, number of control entries
+	16		8	F, number of diff frames
+	24		8	G, number of extra frames
+	32		8	sizeof(newfile)
+	40		8	X, length of zstd(control block)
+	48		X	zstd(control block)
+	48+X	16*F	diff frame table
+	...		16*G	extra frame table
+	...		???	diff frames
+	...		???	extra frames
+
+The control block is the same triple list as in ZSTDDIFF. The diff and
+extra blocks are cut into independent zstd frames of SEEKABLE_FRAME_SIZE
+uncompressed bytes, and each frame table entry is an (uncompressed size,
+compressed size) pair. On reading, the control block is expanded into an
+in-memory index holding the cumulative new/old/diff offset of every entry,
+which lets seek_new_pos() restart decoding from the frame containing any
+byte of the new file.
+*/
+
+#define SEEKABLE_HEADER_SIZE 48
+#define SEEKABLE_FRAME_SIZE  (1024 * 1024)
+#define SEEKABLE_SKIP_SIZE   (16 * 1024)
+
+int bsdiff_create_zstd_compressor(struct bsdiff_compressor *enc);
+int bsdiff_create_zstd_decompressor(struct bsdiff_decompressor *dec);
+
+static int64_t seekable_read_int64(const uint8_t *buf)
+{
+	uint64_t y = ((uint64_t)buf[0]) |
+	             ((uint64_t)buf[1] << 8) |
+	             ((uint64_t)buf[2] << 16) |
+	             ((uint64_t)buf[3] << 24) |
+	             ((uint64_t)buf[4] << 32) |
+	             ((uint64_t)buf[5] << 40) |
+	             ((uint64_t)buf[6] << 48) |
+	             ((uint64_t)buf[7] << 56);
+	return (int64_t)((y >> 1) ^ (0ULL - (y & 1)));
+}
+
+static void seekable_write_int64(int64_t x, uint8_t *buf)
+{
+	uint64_t y = ((uint64_t)x << 1) ^ (uint64_t)((x < 0) ? ~0ULL : 0ULL);
+
+	buf[0] = (uint8_t)(y);
+	buf[1] = (uint8_t)(y >> 8);
+	buf[2] = (uint8_t)(y >> 16);
+	buf[3] = (uint8_t)(y >> 24);
+	buf[4] = (uint8_t)(y >> 32);
+	buf[5] = (uint8_t)(y >> 40);
+	buf[6] = (uint8_t)(y >> 48);
+	buf[7] = (uint8_t)(y >> 56);
+}
+
+struct seekable_entry
+{
+	int64_t diff;
+	int64_t extra;
+	int64_t seek;
+	int64_t newpos;
+	int64_t oldpos;
+	int64_t diffpos;
+};
+
+struct seekable_frame
+{
+	int64_t upos;	/* uncompressed start offset */
+	int64_t cpos;	/* compressed start offset, relative to the block */
+};
+
+/* Read side of a frame-split block */
+struct seekable_block
+{
+	int64_t start;	/* offset of the block in the patch stream */
+	int64_t nframes;
+	struct seekable_frame *frames;	/* nframes + 1, the last one is a sentinel */
+	int64_t pos;	/* uncompressed position of the decoder */
+	struct bsdiff_stream sub;
+	struct bsdiff_decompressor dec;
+};
+
+/* Write side of a frame-split block */
+struct seekable_writer
+{
+	struct bsdiff_compressor enc;
+	struct bsdiff_stream stream;	/* compressed frames */
+	struct bsdiff_stream table;	/* frame table */
+	int64_t nframes;
+	int64_t frame_fill;	/* uncompressed bytes in the current frame */
+	int64_t frame_start;	/* compressed offset of the current frame */
+};
+
+struct seekable_patch_packer
+{
+	struct bsdiff_stream *stream;
+	int mode;
+
+	int64_t new_size;
+
+	int64_t header_x;
+	int64_t header_y;
+	int64_t header_z;
+
+	/* read mode */
+	int64_t nentries;
+	struct seekable_entry *entries;
+	int64_t cur;
+	int pending;	/* a (partial) entry prepared by seek_new_pos */
+	int64_t pending_x;
+	int64_t pending_y;
+	int64_t pending_z;
+	struct seekable_block diff;
+	struct seekable_block extra;
+
+	/* write mode */
+	int64_t entry_count;
+	struct bsdiff_compressor cpf_enc;
+	struct bsdiff_stream cpf_stream;
+	struct seekable_writer dw;
+	struct seekable_writer ew;
+};
+
+static void seekable_block_close_decoder(struct seekable_block *blk)
+{
+	bsdiff_close_decompressor(&(blk->dec));
+	bsdiff_close_stream(&(blk->sub));
+}
+
+/* Restart decoding at the frame which contains the uncompressed offset 'pos' */
+static int seekable_block_seek(struct seekable_patch_packer *packer,
+                               struct seekable_block *blk, int64_t pos)
+{
+	int64_t lo, hi, mid, end;
+	uint8_t skip[SEEKABLE_SKIP_SIZE];
+	size_t cb, len;
+	int ret;
+
+	if (pos < 0 || pos > blk->frames[blk->nframes].upos)
+		return BSDIFF_CORRUPT_PATCH;
+	/* Close enough: just decode forward within the current frame */
+	if (blk->dec.state != NULL && pos >= blk->pos) {
+		lo = 0; hi = blk->nframes;
+		while (hi - lo > 1) {
+			mid = lo + (hi - lo) / 2;
+			if (blk->frames[mid].upos <= blk->pos) lo = mid; else hi = mid;
+		}
+		if (pos < blk->frames[lo + 1].upos)
+			goto skip_forward;
+	}
+
+	seekable_block_close_decoder(blk);
+	if (pos == blk->frames[blk->nframes].upos) {
+		blk->pos = pos;
+		return BSDIFF_SUCCESS;
+	}
+
+	/* Find the last frame whose start is <= pos */
+	lo = 0; hi = blk->nframes;
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (blk->frames[mid].upos <= pos) lo = mid; else hi = mid;
+	}
+
+	end = blk->start + blk->frames[blk->nframes].cpos;
+	if (bsdiff_open_substream(packer->stream, blk->start + blk->frames[lo].cpos,
+	                          end, &(blk->sub)) != BSDIFF_SUCCESS)
+		return BSDIFF_FILE_ERROR;
+	if ((bsdiff_create_zstd_decompressor(&(blk->dec)) != BSDIFF_SUCCESS) ||
+	    (blk->dec.init(blk->dec.state, &(blk->sub)) != BSDIFF_SUCCESS))
+		return BSDIFF_ERROR;
+	blk->pos = blk->frames[lo].upos;
+
+skip_forward:
+	while (blk->pos < pos) {
+		len = sizeof(skip);
+		if ((int64_t)len > pos - blk->pos)
+			len = (size_t)(pos - blk->pos);
+		ret = blk->dec.read(blk->dec.state, skip, len, &cb);
+		if ((ret != BSDIFF_SUCCESS && ret != BSDIFF_END_OF_FILE) || (cb != len))
+			return BSDIFF_CORRUPT_PATCH;
+		blk->pos += (int64_t)cb;
+	}
+	return BSDIFF_SUCCESS;
+}
+
+static int seekable_block_read(struct seekable_block *blk, void *buffer,
+                               size_t size, size_t *readed)
+{
+	int ret;
+
+	*readed = 0;
+	if (blk->dec.state == NULL)
+		return BSDIFF_END_OF_FILE;
+	ret = blk->dec.read(blk->dec.state, buffer, size, readed);
+	blk->pos += (int64_t)(*readed);
+	return ret;
+}
+
+static int seekable_read_frame_table(struct seekable_patch_packer *packer,
+                                     struct seekable_block *blk)
+{
+	uint8_t buf[16];
+	size_t cb;
+	int64_t i, usize, csize, pos, end;
+
+	/* Each frame takes 16 bytes of what is left of the patch */
+	if ((packer->stream->tell(packer->stream->state, &pos) != BSDIFF_SUCCESS) ||
+	    (packer->stream->seek(packer->stream->state, 0, BSDIFF_SEEK_END) != BSDIFF_SUCCESS) ||
+	    (packer->stream->tell(packer->stream->state, &end) != BSDIFF_SUCCESS) ||
+	    (packer->stream->seek(packer->stream->state, pos, BSDIFF_SEEK_SET) != BSDIFF_SUCCESS))
+		return BSDIFF_FILE_ERROR;
+	if (blk->nframes < 0 || blk->nframes > (end - pos) / 16 ||
+	    (uint64_t)(blk->nframes + 1) > SIZE_MAX / sizeof(struct seekable_frame))
+		return BSDIFF_CORRUPT_PATCH;
+	blk->frames = bsdiff_malloc((size_t)(blk->nframes + 1) * sizeof(struct seekable_frame));
+	if (blk->frames == NULL)
+		return BSDIFF_OUT_OF_MEMORY;
+
+	blk->frames[0].upos = 0;
+	blk->frames[0].cpos = 0;
+	for (i = 0; i < blk->nframes; i++) {
+		if (packer->stream->read(packer->stream->state, buf, 16, &cb) != BSDIFF_SUCCESS || cb != 16)
+			return BSDIFF_FILE_ERROR;
+		usize = seekable_read_int64(buf);
+		csize = seekable_read_int64(buf + 8);
+		if (usize <= 0 || csize <= 0 ||
+		    usize > INT64_MAX - blk->frames[i].upos || csize > INT64_MAX - blk->frames[i].cpos)
+			return BSDIFF_CORRUPT_PATCH;
+		blk->frames[i + 1].upos = blk->frames[i].upos + usize;
+		blk->frames[i + 1].cpos = blk->frames[i].cpos + csize;
+	}
+	return BSDIFF_SUCCESS;
+}
+
+static int seekable_patch_packer_read_new_size(void *state, int64_t *size)
+{
+	int ret;
+	uint8_t header[SEEKABLE_HEADER_SIZE];
+	uint8_t buf[24];
+	size_t cb;
+	int64_t ctrllen, newsize, i, pos;
+	int64_t newpos, oldpos, diffpos;
+	size_t capacity;
+	struct bsdiff_stream cpf = { 0 };
+	struct bsdiff_decompressor cpf_dec = { 0 };
+	struct seekable_entry *e;
+
+	struct seekable_patch_packer *packer = (struct seekable_patch_packer *)state;
+	assert(packer->mode == BSDIFF_MODE_READ);
+	assert(packer->new_size == -1);
+
+	/* Read header */
+	ret = packer->stream->read(packer->stream->state, header, SEEKABLE_HEADER_SIZE, &cb);
+	if (ret != BSDIFF_SUCCESS || cb != SEEKABLE_HEADER_SIZE)
+		return BSDIFF_FILE_ERROR;
+
+	/* Check for appropriate magic */
+	if (memcmp(header, "BSDIFFSK", 8) != 0)
+		return BSDIFF_CORRUPT_PATCH;
+
+	packer->nentries = seekable_read_int64(header + 8);
+	packer->diff.nframes = seekable_read_int64(header + 16);
+	packer->extra.nframes = seekable_read_int64(header + 24);
+	newsize = seekable_read_int64(header + 32);
+	ctrllen = seekable_read_int64(header + 40);
+	if ((packer->nentries < 0) || (newsize < 0) || (ctrllen < 0))
+		return BSDIFF_CORRUPT_PATCH;
+	if ((uint64_t)packer->nentries >= SIZE_MAX / sizeof(struct seekable_entry))
+		return BSDIFF_SIZE_TOO_LARGE;
+
+	/* Expand the control block into the entry index, which grows with the
+	   entries actually decoded rather than with the count in the header */
+	capacity = 256;
+	packer->entries = bsdiff_malloc(capacity * sizeof(struct seekable_entry));
+	if (packer->entries == NULL)
+		return BSDIFF_OUT_OF_MEMORY;
+	ret = BSDIFF_SUCCESS;
+	if (packer->nentries > 0) {
+		if (bsdiff_open_substream(packer->stream, SEEKABLE_HEADER_SIZE,
+		                          SEEKABLE_HEADER_SIZE + ctrllen, &cpf) != BSDIFF_SUCCESS)
+			return BSDIFF_FILE_ERROR;
+		if ((bsdiff_create_zstd_decompressor(&cpf_dec) != BSDIFF_SUCCESS) ||
+		    (cpf_dec.init(cpf_dec.state, &cpf) != BSDIFF_SUCCESS))
+			ret = BSDIFF_ERROR;
+	}
+	newpos = 0; oldpos = 0; diffpos = 0;
+	for (i = 0; i < packer->nentries && ret == BSDIFF_SUCCESS; i++) {
+		if (cpf_dec.read(cpf_dec.state, buf, 24, &cb) != BSDIFF_SUCCESS || cb != 24) {
+			ret = BSDIFF_CORRUPT_PATCH;
+			break;
+		}
+		/* Keep a slot for the sentinel */
+		if ((size_t)i + 1 == capacity) {
+			e = bsdiff_realloc(packer->entries, capacity * 2 * sizeof(struct seekable_entry));
+			if (e == NULL) {
+				ret = BSDIFF_OUT_OF_MEMORY;
+				break;
+			}
+			packer->entries = e;
+			capacity *= 2;
+		}
+		e = &(packer->entries[i]);
+		e->diff = seekable_read_int64(buf);
+		e->extra = seekable_read_int64(buf + 8);
+		e->seek = seekable_read_int64(buf + 16);
+		if (e->diff < 0 || e->extra < 0 ||
+		    e->diff > newsize - newpos || e->extra > newsize - newpos - e->diff) {
+			ret = BSDIFF_CORRUPT_PATCH;
+			break;
+		}
+		e->newpos = newpos;
+		e->oldpos = oldpos;
+		e->diffpos = diffpos;
+		newpos += e->diff + e->extra;
+		oldpos += e->diff + e->seek;
+		diffpos += e->diff;
+	}
+	bsdiff_close_decompressor(&cpf_dec);
+	bsdiff_close_stream(&cpf);
+	if (ret != BSDIFF_SUCCESS)
+		return ret;
+	/* Sentinel */
+	e = &(packer->entries[packer->nentries]);
+	memset(e, 0, sizeof(*e));
+	e->newpos = newpos;
+	e->oldpos = oldpos;
+	e->diffpos = diffpos;
+
+	/* Read frame tables */
+	if (packer->stream->seek(packer->stream->state, SEEKABLE_HEADER_SIZE + ctrllen, BSDIFF_SEEK_SET) != BSDIFF_SUCCESS)
+		return BSDIFF_FILE_ERROR;
+	if ((ret = seekable_read_frame_table(packer, &(packer->diff))) != BSDIFF_SUCCESS)
+		return ret;
+	if ((ret = seekable_read_frame_table(packer, &(packer->extra))) != BSDIFF_SUCCESS)
+		return ret;
+	if ((packer->diff.frames[packer->diff.nframes].upos != diffpos) ||
+	    (packer->extra.frames[packer->extra.nframes].upos != newpos - diffpos))
+		return BSDIFF_CORRUPT_PATCH;
+	if (packer->stream->tell(packer->stream->state, &pos) != BSDIFF_SUCCESS)
+		return BSDIFF_FILE_ERROR;
+	packer->diff.start = pos;
+	packer->extra.start = pos + packer->diff.frames[packer->diff.nframes].cpos;
+
+	/* Position both decoders at the beginning */
+	if ((ret = seekable_block_seek(packer, &(packer->diff), 0)) != BSDIFF_SUCCESS)
+		return ret;
+	if ((ret = seekable_block_seek(packer, &(packer->extra), 0)) != BSDIFF_SUCCESS)
+		return ret;
+
+	packer->cur = 0;
+	packer->new_size = newsize;
+
+	*size = packer->new_size;
+
+	return BSDIFF_SUCCESS;
+}
+
+static int seekable_patch_packer_read_entry_header(void *state, int64_t *diff,
+                                                   int64_t *extra, int64_t *seek)
+{
+	struct seekable_entry *e;
+	struct seekable_patch_packer *packer = (struct seekable_patch_packer *)state;
+	assert(packer->mode == BSDIFF_MODE_READ);
+	assert(packer->new_size >= 0);
+	assert(packer->header_x == 0 && packer->header_y == 0);
+
+	if (packer->pending) {
+		packer->header_x = packer->pending_x;
+		packer->header_y = packer->pending_y;
+		packer->header_z = packer->pending_z;
+		packer->pending = 0;
+	} else {
+		if (packer->cur >= packer->nentries)
+			return BSDIFF_CORRUPT_PATCH;
+		e = &(packer->entries[packer->cur++]);
+		packer->header_x = e->diff;
+		packer->header_y = e->extra;
+		packer->header_z = e->seek;
+	}
+
+	*diff = packer->header_x;
+	*extra = packer->header_y;
+	*seek = packer->header_z;
+
+	return BSDIFF_SUCCESS;
+}
+
+static int seekable_patch_packer_read_entry_diff(void *state, void *buffer,
+                                                 size_t size, size_t *readed)
+{
+	int ret;
+	int64_t cb;
+
+	struct seekable_patch_packer *packer = (struct seekable_patch_packer *)state;
+	assert(packer->mode == BSDIFF_MODE_READ);
+	assert(packer->new_size >= 0);
+	assert(packer->header_x >= 0);
+
+	*readed = 0;
+
+	cb = (int64_t)size;
+	if (packer->header_x < cb)
+		cb = packer->header_x;
+	if (cb <= 0)
+		return BSDIFF_END_OF_FILE;
+
+	ret = seekable_block_read(&(packer->diff), buffer, (size_t)cb, readed);
+	packer->header_x -= (int64_t)(*readed);
+	return ret;
+}
+
+static int seekable_patch_packer_read_entry_extra(void *state, void *buffer,
+                                                  size_t size, size_t *readed)
+{
+	int ret;
+	int64_t cb;
+
+	struct seekable_patch_packer *packer = (struct seekable_patch_packer *)state;
+	assert(packer->mode == BSDIFF_MODE_READ);
+	assert(packer->new_size >= 0);
+	assert(packer->header_y >= 0);
+
+	*readed = 0;
+
+	cb = (int64_t)size;
+	if (packer->header_y < cb)
+		cb = packer->header_y;
+	if (cb <= 0)
+		return BSDIFF_END_OF_FILE;
+
+	ret = seekable_block_read(&(packer->extra), buffer, (size_t)cb, readed);
+	packer->header_y -= (int64_t)(*readed);
+	return ret;
+}
+
+static int seekable_patch_packer_seek_new_pos(void *state, int64_t newpos, int64_t *oldpos)
+{
+	int ret;
+	int64_t lo, hi, mid, k;
+	int64_t diffpos, extrapos;
+	struct seekable_entry *e;
+
+	struct seekable_patch_packer *packer = (struct seekable_patch_packer *)state;
+	assert(packer->mode == BSDIFF_MODE_READ);
+	assert(packer->new_size >= 0);
+
+	if (newpos < 0 || newpos > packer->new_size)
+		return BSDIFF_INVALID_ARG;
+
+	/* Find the last entry starting at or before newpos */
+	lo = 0; hi = packer->nentries + 1;
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (packer->entries[mid].newpos <= newpos) lo = mid; else hi = mid;
+	}
+	e = &(packer->entries[lo]);
+	k = newpos - e->newpos;
+
+	packer->header_x = 0;
+	packer->header_y = 0;
+	packer->header_z = 0;
+	if (lo == packer->nentries) {
+		/* The end of the new file */
+		packer->pending = 0;
+		*oldpos = e->oldpos;
+		diffpos = e->diffpos;
+	} else if (k < e->diff) {
+		packer->pending = 1;
+		packer->pending_x = e->diff - k;
+		packer->pending_y = e->extra;
+		*oldpos = e->oldpos + k;
+		diffpos = e->diffpos + k;
+	} else {
+		packer->pending = 1;
+		packer->pending_x = 0;
+		packer->pending_y = e->extra - (k - e->diff);
+		*oldpos = e->oldpos + e->diff;
+		diffpos = e->diffpos + e->diff;
+	}
+	packer->pending_z = e->seek;
+	packer->cur = lo + 1;
+	extrapos = newpos - diffpos;
+
+	if ((ret = seekable_block_seek(packer, &(packer->diff), diffpos)) != BSDIFF_SUCCESS)
+		return ret;
+	if ((ret = seekable_block_seek(packer, &(packer->extra), extrapos)) != BSDIFF_SUCCESS)
+		return ret;
+
+	return BSDIFF_SUCCESS;
+}
+
+static int seekable_writer_open(struct seekable_writer *w)
+{
+	if (bsdiff_open_chunked_memory_stream(0, &(w->stream)) != BSDIFF_SUCCESS)
+		return BSDIFF_OUT_OF_MEMORY;
+	if (bsdiff_open_chunked_memory_stream(0, &(w->table)) != BSDIFF_SUCCESS)
+		return BSDIFF_OUT_OF_MEMORY;
+	if ((bsdiff_create_zstd_compressor(&(w->enc)) != BSDIFF_SUCCESS) ||
+	    (w->enc.init(w->enc.state, &(w->stream)) != BSDIFF_SUCCESS))
+		return BSDIFF_ERROR;
+	return BSDIFF_SUCCESS;
+}
+
+/* Terminate the current frame and record it in the frame table */
+static int seekable_writer_end_frame(struct seekable_writer *w)
+{
+	uint8_t buf[16];
+	int64_t pos;
+
+	if (w->frame_fill == 0)
+		return BSDIFF_SUCCESS;
+	if (w->enc.flush(w->enc.state) != BSDIFF_SUCCESS)
+		return BSDIFF_ERROR;
+	if (w->stream.tell(w->stream.state, &pos) != BSDIFF_SUCCESS)
+		return BSDIFF_ERROR;
+	seekable_write_int64(w->frame_fill, buf);
+	seekable_write_int64(pos - w->frame_start, buf + 8);
+	if (w->table.write(w->table.state, buf, 16) != BSDIFF_SUCCESS)
+		return BSDIFF_OUT_OF_MEMORY;
+	w->nframes++;
+	w->frame_fill = 0;
+	w->frame_start = pos;
+	return BSDIFF_SUCCESS;
+}
+
+static int seekable_writer_write(struct seekable_writer *w, const void *buffer, size_t size)
+{
+	const uint8_t *p = (const uint8_t *)buffer;
+	size_t cb;
+
+	while (size > 0) {
+		cb = size;
+		if ((int64_t)cb > SEEKABLE_FRAME_SIZE - w->frame_fill)
+			cb = (size_t)(SEEKABLE_FRAME_SIZE - w->frame_fill);
+		if (w->enc.write(w->enc.state, p, cb) != BSDIFF_SUCCESS)
+			return BSDIFF_ERROR;
+		w->frame_fill += (int64_t)cb;
+		if (w->frame_fill == SEEKABLE_FRAME_SIZE) {
+			if (seekable_writer_end_frame(w) != BSDIFF_SUCCESS)
+				return BSDIFF_ERROR;
+		}
+		p += cb;
+		size -= cb;
+	}
+	return BSDIFF_SUCCESS;
+}
+
+static void seekable_writer_close(struct seekable_writer *w)
+{
+	bsdiff_close_compressor(&(w->enc));
+	bsdiff_close_stream(&(w->stream));
+	bsdiff_close_stream(&(w->table));
+}
+
+static int seekable_patch_packer_write_new_size(void *state, int64_t size)
+{
+	uint8_t header[SEEKABLE_HEADER_SIZE];
+	struct seekable_patch_packer *packer = (struct seekable_patch_packer *)state;
+	assert(packer->mode == BSDIFF_MODE_WRITE);
+	assert(packer->new_size == -1);
+	assert(size >= 0);
+
+	memset(header, 0, sizeof(header));
+
+	/* Write a pseudo header */
+	if (packer->stream->write(packer->stream->state, header, SEEKABLE_HEADER_SIZE) !=
+	    BSDIFF_SUCCESS)
+		return BSDIFF_FILE_ERROR;
+
+	/* Initialize the control block */
+	if (bsdiff_open_chunked_memory_stream(0, &(packer->cpf_stream)) != BSDIFF_SUCCESS)
+		return BSDIFF_OUT_OF_MEMORY;
+	if ((bsdiff_create_zstd_compressor(&(packer->cpf_enc)) != BSDIFF_SUCCESS) ||
+	    (packer->cpf_enc.init(packer->cpf_enc.state, &(packer->cpf_stream)) != BSDIFF_SUCCESS))
+		return BSDIFF_ERROR;
+
+	/* Initialize the framed diff && extra blocks */
+	if (seekable_writer_open(&(packer->dw)) != BSDIFF_SUCCESS)
+		return BSDIFF_ERROR;
+	if (seekable_writer_open(&(packer->ew)) != BSDIFF_SUCCESS)
+		return BSDIFF_ERROR;
+
+	packer->new_size = size;
+
+	return BSDIFF_SUCCESS;
+}
+
+static int seekable_patch_packer_write_entry_header(void *state, int64_t diff,
+                                                    int64_t extra, int64_t seek)
+{
+	struct seekable_patch_packer *packer = (struct seekable_patch_packer *)state;
+	uint8_t buf[24];
+	int ret;
+
+	assert(packer->mode == BSDIFF_MODE_WRITE);
+	assert(packer->new_size >= 0);
+	assert(diff >= 0);
+	assert(extra >= 0);
+
+	assert(packer->header_x == 0 && packer->header_y == 0);
+	packer->header_x = diff;
+	packer->header_y = extra;
+	packer->header_z = seek;
+
+	/* Write a triple */
+	seekable_write_int64(packer->header_x, buf);
+	seekable_write_int64(packer->header_y, buf + 8);
+	seekable_write_int64(packer->header_z, buf + 16);
+	ret = packer->cpf_enc.write(packer->cpf_enc.state, buf, 24);
+	if (ret != BSDIFF_SUCCESS)
+		return ret;
+	packer->entry_count++;
+
+	return BSDIFF_SUCCESS;
+}
+
+static int seekable_patch_packer_write_entry_diff(void *state, const void *buffer,
+                                                  size_t size)
+{
+	struct seekable_patch_packer *packer = (struct seekable_patch_packer *)state;
+	assert(packer->mode == BSDIFF_MODE_WRITE);
+	assert(packer->new_size >= 0);
+
+	if ((int64_t)size > packer->header_x)
+		return BSDIFF_INVALID_ARG;
+	if (seekable_writer_write(&(packer->dw), buffer, size) != BSDIFF_SUCCESS)
+		return BSDIFF_ERROR;
+	packer->header_x -= (int64_t)size;
+
+	return BSDIFF_SUCCESS;
+}
+
+static int seekable_patch_packer_write_entry_extra(void *state, const void *buffer,
+                                                   size_t size)
+{
+	struct seekable_patch_packer *packer = (struct seekable_patch_packer *)state;
+	assert(packer->mode == BSDIFF_MODE_WRITE);
+	assert(packer->new_size >= 0);
+
+	if ((int64_t)size > packer->header_y)
+		return BSDIFF_INVALID_ARG;
+	if (seekable_writer_write(&(packer->ew), buffer, size) != BSDIFF_SUCCESS)
+		return BSDIFF_ERROR;
+	packer->header_y -= (int64_t)size;
+
+	return BSDIFF_SUCCESS;
+}
+
+static int seekable_patch_packer_flush(void *state)
+{
+	uint8_t header[SEEKABLE_HEADER_SIZE];
+	struct bsdiff_stream *blocks[5];
+	int64_t sizes[5];
+	int i;
+	struct seekable_patch_packer *packer = (struct seekable_patch_packer *)state;
+
+	assert(packer->mode == BSDIFF_MODE_WRITE);
+	assert(packer->new_size >= 0);
+	assert(packer->header_x == 0 && packer->header_y == 0);
+
+	/* Flush all compressors */
+	if (packer->cpf_enc.flush(packer->cpf_enc.state) != BSDIFF_SUCCESS)
+		return BSDIFF_ERROR;
+	if (seekable_writer_end_frame(&(packer->dw)) != BSDIFF_SUCCESS)
+		return BSDIFF_ERROR;
+	if (seekable_writer_end_frame(&(packer->ew)) != BSDIFF_SUCCESS)
+		return BSDIFF_ERROR;
+
+	/* Get blocks and sizes, in file order */
+	blocks[0] = &(packer->cpf_stream);
+	blocks[1] = &(packer->dw.table);
+	blocks[2] = &(packer->ew.table);
+	blocks[3] = &(packer->dw.stream);
+	blocks[4] = &(packer->ew.stream);
+	for (i = 0; i < 5; i++) {
+		if (bsdiff_stream_data_size(blocks[i], &sizes[i]) != BSDIFF_SUCCESS)
+			return BSDIFF_ERROR;
+	}
+
+	/* Fill header */
+	memset(header, 0, sizeof(header));
+	memcpy(header, "BSDIFFSK", 8);
+	seekable_write_int64(packer->entry_count, header + 8);
+	seekable_write_int64(packer->dw.nframes, header + 16);
+	seekable_write_int64(packer->ew.nframes, header + 24);
+	seekable_write_int64(packer->new_size, header + 32);
+	seekable_write_int64(packer->entry_count > 0 ? sizes[0] : 0, header + 40);
+
+	/* Seek to the beginning, write everything sequentially */
+	if (packer->stream->seek(packer->stream->state, 0, BSDIFF_SEEK_SET) != BSDIFF_SUCCESS)
+		return BSDIFF_FILE_ERROR;
+	if (packer->stream->write(packer->stream->state, header, SEEKABLE_HEADER_SIZE) != BSDIFF_SUCCESS)
+		return BSDIFF_FILE_ERROR;
+	for (i = 0; i < 5; i++) {
+		/* Without entries the ctrl block is left out */
+		if (i == 0 && packer->entry_count == 0)
+			continue;
+		if (bsdiff_write_stream_data(packer->stream, blocks[i]) != BSDIFF_SUCCESS)
+			return BSDIFF_FILE_ERROR;
+	}
+	if (packer->stream->flush(packer->stream->state) != BSDIFF_SUCCESS)
+		return BSDIFF_FILE_ERROR;
+
+	return BSDIFF_SUCCESS;
+}
+
+static void seekable_patch_packer_close(void *state)
+{
+	struct seekable_patch_packer *packer = (struct seekable_patch_packer *)state;
+
+	if (packer->mode == BSDIFF_MODE_READ) {
+		seekable_block_close_decoder(&(packer->diff));
+		seekable_block_close_decoder(&(packer->extra));
+		bsdiff_free(packer->diff.frames);
+		bsdiff_free(packer->extra.frames);
+		bsdiff_free(packer->entries);
+	} else {
+		bsdiff_close_compressor(&(packer->cpf_enc));
+		bsdiff_close_stream(&(packer->cpf_stream));
+		seekable_writer_close(&(packer->dw));
+		seekable_writer_close(&(packer->ew));
+	}
+
+	bsdiff_free(packer);
+}
+
+static int seekable_patch_packer_getmode(void *state)
+{
+	struct seekable_patch_packer *packer = (struct seekable_patch_packer *)state;
+	return packer->mode;
+}
+
+int bsdiff_open_seekable_patch_packer(int mode, struct bsdiff_stream *stream,
+                                      struct bsdiff_patch_packer *packer)
+{
+	struct seekable_patch_packer *state;
+
+	assert(mode >= BSDIFF_MODE_READ && mode <= BSDIFF_MODE_WRITE);
+	assert(stream);
+	assert(packer);
+
+	state = bsdiff_malloc(sizeof(struct seekable_patch_packer));
+	if (!state)
+		return BSDIFF_OUT_OF_MEMORY;
+	memset(state, 0, sizeof(*state));
+	state->stream = stream;
+	state->mode = mode;
+	state->new_size = -1;
+
+	memset(packer, 0, sizeof(*packer));
+	packer->state = state;
+	if (mode == BSDIFF_MODE_READ) {
+		packer->read_new_size = seekable_patch_packer_read_new_size;
+		packer->read_entry_header = seekable_patch_packer_read_entry_header;
+		packer->read_entry_diff = seekable_patch_packer_read_entry_diff;
+		packer->read_entry_extra = seekable_patch_packer_read_entry_extra;
+		packer->seek_new_pos = seekable_patch_packer_seek_new_pos;
+	} else {
+		packer->write_new_size = seekable_patch_packer_write_new_size;
+		packer->write_entry_header = seekable_patch_packer_write_entry_header;
+		packer->write_entry_diff = seekable_patch_packer_write_entry_diff;
+		packer->write_entry_extra = seekable_patch_packer_write_entry_extra;
+		packer->flush = seekable_patch_packer_flush;
+	}
+	packer->close = seekable_patch_packer_close;
+	packer->get_mode = seekable_patch_packer_getmode;
+
+	return BSDIFF_SUCCESS;
+}
@@ -1,13 +1,23 @@
 #include "bsdiff.h"
 #include "bsdiff_mem.h"
 #include "bsdiff_private.h"
+#include "bsdiff_varint.h"
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-
-int bsdiff_create_zstd_compressor(struct bsdiff_compressor *enc);
-int bsdiff_create_zstd_decompressor(struct bsdiff_decompressor *dec);
+#include <zstd.h>
+
+int bsdiff_create_zstd_compressor_ex(struct bsdiff_compressor *enc,
+                                     const struct bsdiff_zstd_block_options *opts);
+int bsdiff_create_zstd_decompressor_ex(struct bsdiff_decompressor *dec,
+                                       const struct bsdiff_zstd_dict *const *dicts,
+                                       size_t ndicts, int window_log_max);
+int bsdiff_create_threaded_compressor(struct bsdiff_compressor *enc);
+int bsdiff_create_zero_run_compressor(struct bsdiff_compressor *enc);
+int bsdiff_create_zero_run_decompressor(struct bsdiff_decompressor *dec);
+int bsdiff_create_shuffle_compressor(struct bsdiff_compressor *enc, int stride);
+int bsdiff_create_shuffle_decompressor(struct bsdiff_decompressor *dec, int stride);
 
 static int64_t zstd_read_int64(uint8_t *buf)
 {
@@ -36,12 +46,46 @@ static void zstd_write_int64(int64_t x, uint8_t *buf)
 	buf[7] = (uint8_t)(y >> 56);
 }
 
+/*
+ * ZSTDDIF2 is ZSTDDIFF with a flags word after the header, which selects
+ * the encodings below. Without flags the packer writes plain ZSTDDIFF.
+ */
+#define ZSTD_FLAG_VARINT_CTRL 1   /* ctrl triples as LEB128 varints, seek delta-coded */
+#define ZSTD_FLAG_ZERO_RUNS   2   /* diff block zero-run coded before zstd */
+#define ZSTD_FLAG_SHUFFLE     4   /* blocks byte-shuffled before zstd, the header
+                                     continues with the ctrl, diff and extra
+                                     strides in bytes 40, 41 and 42 */
+#define ZSTD_KNOWN_FLAGS      (ZSTD_FLAG_VARINT_CTRL | ZSTD_FLAG_ZERO_RUNS | ZSTD_FLAG_SHUFFLE)
+
+/* Decoded ctrl data kept ahead of the reader, plus slack for 8-byte loads */
+#define ZSTD_CTRL_BUF_SIZE (64 * 1024)
+#define ZSTD_CTRL_SLACK 32
+#define ZSTD_MAX_VARINT_TRIPLE (3 * BSDIFF_MAX_VARINT)
+
+static uint64_t zigzag(int64_t x)
+{
+	return ((uint64_t)x << 1) ^ (uint64_t)((x < 0) ? ~0ULL : 0ULL);
+}
+
+static int64_t unzigzag(uint64_t y)
+{
+	return (int64_t)((y >> 1) ^ (0ULL - (y & 1)));
+}
+
 struct zstd_patch_packer
 {
 	struct bsdiff_stream *stream;
 	int mode;
 
 	int64_t new_size;
+	struct bsdiff_zstd_options opts;
+	int64_t flags;               /* ZSTD_FLAG_* of the patch */
+	int strides[3];              /* shuffle strides of the ctrl, diff and extra blocks */
+	int64_t last_seek;           /* for delta coding the seek values */
+
+	uint8_t *ctrl_buf;           /* decoded varint ctrl data */
+	size_t ctrl_len, ctrl_pos;
+	int ctrl_eof;
 
 	int64_t header_x;
 	int64_t header_y;
@@ -62,10 +106,22 @@ struct zstd_patch_packer
 	struct bsdiff_stream epf_stream;
 };
 
+static int header_size(int64_t flags)
+{
+	if (flags == 0)
+		return 32;
+	return (flags & ZSTD_FLAG_SHUFFLE) ? 48 : 40;
+}
+
+static int valid_stride(int stride)
+{
+	return stride == 1 || stride == 2 || stride == 4 || stride == 8 || stride == 16;
+}
+
 static int zstd_patch_packer_read_new_size(void *state, int64_t *size)
 {
-	int ret;
-	uint8_t header[32];
+	int ret, i;
+	uint8_t header[48];
 	size_t cb;
 	int64_t ctrllen, datalen, newsize;
 	int64_t read_start, read_end;
@@ -79,9 +135,28 @@ static int zstd_patch_packer_read_new_size(void *state, int64_t *size)
 	if (ret != BSDIFF_SUCCESS)
 		return BSDIFF_FILE_ERROR;
 
-	/* Check for appropriate magic */
-	if (memcmp(header, "ZSTDDIFF", 8) != 0)
+	/* Check for appropriate magic, ZSTDDIF2 continues with the flags */
+	if (memcmp(header, "ZSTDDIF2", 8) == 0) {
+		ret = packer->stream->read(packer->stream->state, header + 32, 8, &cb);
+		if (ret != BSDIFF_SUCCESS)
+			return BSDIFF_FILE_ERROR;
+		packer->flags = zstd_read_int64(header + 32);
+		if (packer->flags & ~(int64_t)ZSTD_KNOWN_FLAGS)
+			return BSDIFF_CORRUPT_PATCH;
+	} else if (memcmp(header, "ZSTDDIFF", 8) != 0) {
 		return BSDIFF_CORRUPT_PATCH;
+	}
+	packer->strides[0] = packer->strides[1] = packer->strides[2] = 1;
+	if (packer->flags & ZSTD_FLAG_SHUFFLE) {
+		ret = packer->stream->read(packer->stream->state, header + 40, 8, &cb);
+		if (ret != BSDIFF_SUCCESS)
+			return BSDIFF_FILE_ERROR;
+		for (i = 0; i < 3; i++) {
+			packer->strides[i] = header[40 + i];
+			if (!valid_stride(packer->strides[i]))
+				return BSDIFF_CORRUPT_PATCH;
+		}
+	}
 
 	/* Read lengths from header */
 	ctrllen = zstd_read_int64(header + 8);
@@ -92,12 +167,15 @@ static int zstd_patch_packer_read_new_size(void *state, int64_t *size)
 
 	/* Open substreams and create decompressors */
 	/* control block */
-	read_start = 32;
+	read_start = header_size(packer->flags);
 	read_end = read_start + ctrllen;
 	if (bsdiff_open_substream(packer->stream, read_start, read_end,
 	                          &(packer->cpf)) != BSDIFF_SUCCESS)
 		return BSDIFF_FILE_ERROR;
-	if (bsdiff_create_zstd_decompressor(&(packer->cpf_dec)) != BSDIFF_SUCCESS)
+	if (bsdiff_create_zstd_decompressor_ex(&(packer->cpf_dec), packer->opts.dicts, packer->opts.ndicts, packer->opts.max_window_log) != BSDIFF_SUCCESS)
+		return BSDIFF_ERROR;
+	if (packer->strides[0] > 1 &&
+	    bsdiff_create_shuffle_decompressor(&(packer->cpf_dec), packer->strides[0]) != BSDIFF_SUCCESS)
 		return BSDIFF_ERROR;
 	if (packer->cpf_dec.init(packer->cpf_dec.state, &(packer->cpf)) !=
 	    BSDIFF_SUCCESS)
@@ -108,7 +186,13 @@ static int zstd_patch_packer_read_new_size(void *state, int64_t *size)
 	if (bsdiff_open_substream(packer->stream, read_start, read_end,
 	                          &(packer->dpf)) != BSDIFF_SUCCESS)
 		return BSDIFF_FILE_ERROR;
-	if (bsdiff_create_zstd_decompressor(&(packer->dpf_dec)) != BSDIFF_SUCCESS)
+	if (bsdiff_create_zstd_decompressor_ex(&(packer->dpf_dec), packer->opts.dicts, packer->opts.ndicts, packer->opts.max_window_log) != BSDIFF_SUCCESS)
+		return BSDIFF_ERROR;
+	if ((packer->flags & ZSTD_FLAG_ZERO_RUNS) &&
+	    bsdiff_create_zero_run_decompressor(&(packer->dpf_dec)) != BSDIFF_SUCCESS)
+		return BSDIFF_ERROR;
+	if (packer->strides[1] > 1 &&
+	    bsdiff_create_shuffle_decompressor(&(packer->dpf_dec), packer->strides[1]) != BSDIFF_SUCCESS)
 		return BSDIFF_ERROR;
 	if (packer->dpf_dec.init(packer->dpf_dec.state, &(packer->dpf)) !=
 	    BSDIFF_SUCCESS)
@@ -124,12 +208,21 @@ static int zstd_patch_packer_read_new_size(void *state, int64_t *size)
 	if (bsdiff_open_substream(packer->stream, read_start, read_end,
 	                          &(packer->epf)) != BSDIFF_SUCCESS)
 		return BSDIFF_FILE_ERROR;
-	if (bsdiff_create_zstd_decompressor(&(packer->epf_dec)) != BSDIFF_SUCCESS)
+	if (bsdiff_create_zstd_decompressor_ex(&(packer->epf_dec), packer->opts.dicts, packer->opts.ndicts, packer->opts.max_window_log) != BSDIFF_SUCCESS)
+		return BSDIFF_ERROR;
+	if (packer->strides[2] > 1 &&
+	    bsdiff_create_shuffle_decompressor(&(packer->epf_dec), packer->strides[2]) != BSDIFF_SUCCESS)
 		return BSDIFF_ERROR;
 	if (packer->epf_dec.init(packer->epf_dec.state, &(packer->epf)) !=
 	    BSDIFF_SUCCESS)
 		return BSDIFF_ERROR;
 
+	if (packer->flags & ZSTD_FLAG_VARINT_CTRL) {
+		packer->ctrl_buf = bsdiff_malloc(ZSTD_CTRL_BUF_SIZE + ZSTD_CTRL_SLACK);
+		if (packer->ctrl_buf == NULL)
+			return BSDIFF_OUT_OF_MEMORY;
+	}
+
 	packer->new_size = newsize;
 
 	*size = packer->new_size;
@@ -137,6 +230,46 @@ static int zstd_patch_packer_read_new_size(void *state, int64_t *size)
 	return BSDIFF_SUCCESS;
 }
 
+/* Decode the next varint triple into header_x/y/z */
+static int read_varint_triple(struct zstd_patch_packer *packer)
+{
+	const uint8_t *p, *end;
+	uint64_t x, y, z;
+	size_t cb;
+	int ret;
+
+	/* Keep a whole triple buffered, unless the block ends before */
+	if (packer->ctrl_len - packer->ctrl_pos < ZSTD_MAX_VARINT_TRIPLE && !packer->ctrl_eof) {
+		memmove(packer->ctrl_buf, packer->ctrl_buf + packer->ctrl_pos, packer->ctrl_len - packer->ctrl_pos);
+		packer->ctrl_len -= packer->ctrl_pos;
+		packer->ctrl_pos = 0;
+		ret = packer->cpf_dec.read(packer->cpf_dec.state, packer->ctrl_buf + packer->ctrl_len,
+		                           ZSTD_CTRL_BUF_SIZE - packer->ctrl_len, &cb);
+		if (ret != BSDIFF_SUCCESS && ret != BSDIFF_END_OF_FILE)
+			return BSDIFF_ERROR;
+		packer->ctrl_len += cb;
+		if (ret == BSDIFF_END_OF_FILE)
+			packer->ctrl_eof = 1;
+		/* Zeroed slack, so that the 8-byte loads stay defined */
+		memset(packer->ctrl_buf + packer->ctrl_len, 0, ZSTD_CTRL_SLACK);
+	}
+
+	p = packer->ctrl_buf + packer->ctrl_pos;
+	end = packer->ctrl_buf + packer->ctrl_len;
+	if ((p = bsdiff_decode_varint(p, &x)) == NULL || (p = bsdiff_decode_varint(p, &y)) == NULL ||
+	    (p = bsdiff_decode_varint(p, &z)) == NULL || p > end)
+		return BSDIFF_CORRUPT_PATCH;
+	if (x > INT64_MAX || y > INT64_MAX)
+		return BSDIFF_CORRUPT_PATCH;
+	packer->ctrl_pos = (size_t)(p - packer->ctrl_buf);
+
+	packer->header_x = (int64_t)x;
+	packer->header_y = (int64_t)y;
+	packer->header_z = (int64_t)((uint64_t)packer->last_seek + (uint64_t)unzigzag(z));
+	packer->last_seek = packer->header_z;
+	return BSDIFF_SUCCESS;
+}
+
 static int zstd_patch_packer_read_entry_header(void *state, int64_t *diff,
                                                int64_t *extra, int64_t *seek)
 {
@@ -149,12 +282,17 @@ static int zstd_patch_packer_read_entry_header(void *state, int64_t *diff,
 	assert(packer->new_size >= 0);
 	assert(packer->header_x == 0 && packer->header_y == 0);
 
-	ret = packer->cpf_dec.read(packer->cpf_dec.state, buf, 24, &cb);
-	if ((ret != BSDIFF_SUCCESS && ret != BSDIFF_END_OF_FILE) || (cb != 24))
-		return BSDIFF_ERROR;
-	packer->header_x = zstd_read_int64(buf);
-	packer->header_y = zstd_read_int64(buf + 8);
-	packer->header_z = zstd_read_int64(buf + 16);
+	if (packer->flags & ZSTD_FLAG_VARINT_CTRL) {
+		if ((ret = read_varint_triple(packer)) != BSDIFF_SUCCESS)
+			return ret;
+	} else {
+		ret = packer->cpf_dec.read(packer->cpf_dec.state, buf, 24, &cb);
+		if ((ret != BSDIFF_SUCCESS && ret != BSDIFF_END_OF_FILE) || (cb != 24))
+			return BSDIFF_ERROR;
+		packer->header_x = zstd_read_int64(buf);
+		packer->header_y = zstd_read_int64(buf + 8);
+		packer->header_z = zstd_read_int64(buf + 16);
+	}
 
 	*diff = packer->header_x;
 	*extra = packer->header_y;
@@ -213,7 +351,7 @@ static int zstd_patch_packer_read_entry_extra(void *state, void *buffer,
 
 static int zstd_patch_packer_write_new_size(void *state, int64_t size)
 {
-	uint8_t header[32];
+	uint8_t header[48];
 	struct zstd_patch_packer *packer = (struct zstd_patch_packer *)state;
 	assert(packer->mode == BSDIFF_MODE_WRITE);
 	assert(packer->new_size == -1);
@@ -222,31 +360,38 @@ static int zstd_patch_packer_write_new_size(void *state, int64_t size)
 	memset(header, 0, sizeof(header));
 
 	/* Write a pseudo header */
-	if (packer->stream->write(packer->stream->state, header, 32) !=
+	if (packer->stream->write(packer->stream->state, header, header_size(packer->flags)) !=
 	    BSDIFF_SUCCESS)
 		return BSDIFF_FILE_ERROR;
 
-	/* Initialize memory streams for ctrl, diff && extra */
-	if (bsdiff_open_memory_stream(BSDIFF_MODE_WRITE, NULL, 0, &(packer->cpf_stream)) != BSDIFF_SUCCESS)
+	/* Initialize memory streams for ctrl, diff && extra, which may spill to disk */
+	if (bsdiff_open_spill_stream(packer->opts.spill_threshold, packer->opts.spill_dir, &(packer->cpf_stream)) != BSDIFF_SUCCESS)
 		return BSDIFF_OUT_OF_MEMORY;
-	if (bsdiff_open_memory_stream(BSDIFF_MODE_WRITE, NULL, 0, &(packer->dpf_stream)) != BSDIFF_SUCCESS) {
+	if (bsdiff_open_spill_stream(packer->opts.spill_threshold, packer->opts.spill_dir, &(packer->dpf_stream)) != BSDIFF_SUCCESS) {
 		bsdiff_close_stream(&(packer->cpf_stream));
 		return BSDIFF_OUT_OF_MEMORY;
 	}
-	if (bsdiff_open_memory_stream(BSDIFF_MODE_WRITE, NULL, 0, &(packer->epf_stream)) != BSDIFF_SUCCESS) {
+	if (bsdiff_open_spill_stream(packer->opts.spill_threshold, packer->opts.spill_dir, &(packer->epf_stream)) != BSDIFF_SUCCESS) {
 		bsdiff_close_stream(&(packer->cpf_stream));
 		bsdiff_close_stream(&(packer->dpf_stream));
 		return BSDIFF_OUT_OF_MEMORY;
 	}
 
 	/* Initialize compressors */
-	if ((bsdiff_create_zstd_compressor(&(packer->cpf_enc)) != BSDIFF_SUCCESS) ||
+	if ((bsdiff_create_zstd_compressor_ex(&(packer->cpf_enc), &(packer->opts.ctrl)) != BSDIFF_SUCCESS) ||
+	    (packer->strides[0] > 1 && bsdiff_create_shuffle_compressor(&(packer->cpf_enc), packer->strides[0]) != BSDIFF_SUCCESS) ||
+	    (packer->opts.concurrent && bsdiff_create_threaded_compressor(&(packer->cpf_enc)) != BSDIFF_SUCCESS) ||
 	    (packer->cpf_enc.init(packer->cpf_enc.state, &(packer->cpf_stream)) != BSDIFF_SUCCESS))
 		return BSDIFF_ERROR;
-	if ((bsdiff_create_zstd_compressor(&(packer->dpf_enc)) != BSDIFF_SUCCESS) ||
+	if ((bsdiff_create_zstd_compressor_ex(&(packer->dpf_enc), &(packer->opts.diff)) != BSDIFF_SUCCESS) ||
+	    ((packer->flags & ZSTD_FLAG_ZERO_RUNS) && bsdiff_create_zero_run_compressor(&(packer->dpf_enc)) != BSDIFF_SUCCESS) ||
+	    (packer->strides[1] > 1 && bsdiff_create_shuffle_compressor(&(packer->dpf_enc), packer->strides[1]) != BSDIFF_SUCCESS) ||
+	    (packer->opts.concurrent && bsdiff_create_threaded_compressor(&(packer->dpf_enc)) != BSDIFF_SUCCESS) ||
 	    (packer->dpf_enc.init(packer->dpf_enc.state, &(packer->dpf_stream)) != BSDIFF_SUCCESS))
 		return BSDIFF_ERROR;
-	if ((bsdiff_create_zstd_compressor(&(packer->epf_enc)) != BSDIFF_SUCCESS) ||
+	if ((bsdiff_create_zstd_compressor_ex(&(packer->epf_enc), &(packer->opts.extra)) != BSDIFF_SUCCESS) ||
+	    (packer->strides[2] > 1 && bsdiff_create_shuffle_compressor(&(packer->epf_enc), packer->strides[2]) != BSDIFF_SUCCESS) ||
+	    (packer->opts.concurrent && bsdiff_create_threaded_compressor(&(packer->epf_enc)) != BSDIFF_SUCCESS) ||
 	    (packer->epf_enc.init(packer->epf_enc.state, &(packer->epf_stream)) != BSDIFF_SUCCESS))
 		return BSDIFF_ERROR;
 
@@ -259,7 +404,7 @@ static int zstd_patch_packer_write_entry_header(void *state, int64_t diff,
                                                 int64_t extra, int64_t seek)
 {
 	struct zstd_patch_packer *packer = (struct zstd_patch_packer *)state;
-	uint8_t buf[24];
+	uint8_t buf[ZSTD_MAX_VARINT_TRIPLE], *p;
 	int ret;
 
 	assert(packer->mode == BSDIFF_MODE_WRITE);
@@ -273,10 +418,18 @@ static int zstd_patch_packer_write_entry_header(void *state, int64_t diff,
 	packer->header_z = seek;
 
 	/* Write a triple */
-	zstd_write_int64(packer->header_x, buf);
-	zstd_write_int64(packer->header_y, buf + 8);
-	zstd_write_int64(packer->header_z, buf + 16);
-	ret = packer->cpf_enc.write(packer->cpf_enc.state, buf, 24);
+	if (packer->flags & ZSTD_FLAG_VARINT_CTRL) {
+		p = bsdiff_encode_varint((uint64_t)diff, buf);
+		p = bsdiff_encode_varint((uint64_t)extra, p);
+		p = bsdiff_encode_varint(zigzag((int64_t)((uint64_t)seek - (uint64_t)packer->last_seek)), p);
+		packer->last_seek = seek;
+		ret = packer->cpf_enc.write(packer->cpf_enc.state, buf, (size_t)(p - buf));
+	} else {
+		zstd_write_int64(packer->header_x, buf);
+		zstd_write_int64(packer->header_y, buf + 8);
+		zstd_write_int64(packer->header_z, buf + 16);
+		ret = packer->cpf_enc.write(packer->cpf_enc.state, buf, 24);
+	}
 	if (ret != BSDIFF_SUCCESS)
 		return ret;
 
@@ -317,7 +470,7 @@ static int zstd_patch_packer_write_entry_extra(void *state, const void *buffer,
 
 static int zstd_patch_packer_flush(void *state)
 {
-	uint8_t header[32];
+	uint8_t header[48];
 	int64_t patchsize, patchsize2;
 	struct zstd_patch_packer *packer = (struct zstd_patch_packer *)state;
 
@@ -326,8 +479,12 @@ static int zstd_patch_packer_flush(void *state)
 	assert(packer->header_x == 0 && packer->header_y == 0);
 
 	memset(header, 0, sizeof(header));
-	memcpy(header, "ZSTDDIFF", 8);
+	memcpy(header, packer->flags ? "ZSTDDIF2" : "ZSTDDIFF", 8);
 	zstd_write_int64(packer->new_size, header + 24);
+	zstd_write_int64(packer->flags, header + 32);
+	header[40] = (uint8_t)packer->strides[0];
+	header[41] = (uint8_t)packer->strides[1];
+	header[42] = (uint8_t)packer->strides[2];
 
 	/* Flush all compressors */
 	if (packer->cpf_enc.flush(packer->cpf_enc.state) != BSDIFF_SUCCESS)
@@ -337,27 +494,27 @@ static int zstd_patch_packer_flush(void *state)
 	if (packer->epf_enc.flush(packer->epf_enc.state) != BSDIFF_SUCCESS)
 		return BSDIFF_ERROR;
 
-	/* Get compressed buffers and sizes */
-	const void *cpf_buf, *dpf_buf, *epf_buf;
-	size_t cpf_size, dpf_size, epf_size;
-	packer->cpf_stream.get_buffer(packer->cpf_stream.state, &cpf_buf, &cpf_size);
-	packer->dpf_stream.get_buffer(packer->dpf_stream.state, &dpf_buf, &dpf_size);
-	packer->epf_stream.get_buffer(packer->epf_stream.state, &epf_buf, &epf_size);
+	/* Get compressed sizes */
+	int64_t cpf_size, dpf_size;
+	if (bsdiff_stream_data_size(&(packer->cpf_stream), &cpf_size) != BSDIFF_SUCCESS ||
+		bsdiff_stream_data_size(&(packer->dpf_stream), &dpf_size) != BSDIFF_SUCCESS)
+		return BSDIFF_ERROR;
 
 	/* Fill header lengths */
-	zstd_write_int64((int64_t)cpf_size, header + 8);
-	zstd_write_int64((int64_t)dpf_size, header + 16);
+	zstd_write_int64(cpf_size, header + 8);
+	zstd_write_int64(dpf_size, header + 16);
 
-	/* Seek to the beginning, write everything sequentially */
+	/* Seek to the beginning, write everything sequentially, the blocks
+	   chunk by chunk as they were compressed */
 	if (packer->stream->seek(packer->stream->state, 0, BSDIFF_SEEK_SET) != BSDIFF_SUCCESS)
 		return BSDIFF_FILE_ERROR;
-	if (packer->stream->write(packer->stream->state, header, 32) != BSDIFF_SUCCESS)
+	if (packer->stream->write(packer->stream->state, header, header_size(packer->flags)) != BSDIFF_SUCCESS)
 		return BSDIFF_FILE_ERROR;
-	if (packer->stream->write(packer->stream->state, cpf_buf, cpf_size) != BSDIFF_SUCCESS)
+	if (bsdiff_write_stream_data(packer->stream, &(packer->cpf_stream)) != BSDIFF_SUCCESS)
 		return BSDIFF_FILE_ERROR;
-	if (packer->stream->write(packer->stream->state, dpf_buf, dpf_size) != BSDIFF_SUCCESS)
+	if (bsdiff_write_stream_data(packer->stream, &(packer->dpf_stream)) != BSDIFF_SUCCESS)
 		return BSDIFF_FILE_ERROR;
-	if (packer->stream->write(packer->stream->state, epf_buf, epf_size) != BSDIFF_SUCCESS)
+	if (bsdiff_write_stream_data(packer->stream, &(packer->epf_stream)) != BSDIFF_SUCCESS)
 		return BSDIFF_FILE_ERROR;
 	if (packer->stream->flush(packer->stream->state) != BSDIFF_SUCCESS)
 		return BSDIFF_FILE_ERROR;
@@ -376,6 +533,8 @@ static void zstd_patch_packer_close(void *state)
 		bsdiff_close_stream(&(packer->cpf));
 		bsdiff_close_stream(&(packer->dpf));
 		bsdiff_close_stream(&(packer->epf));
+		if (packer->ctrl_buf != NULL)
+			bsdiff_free(packer->ctrl_buf);
 	} else {
 		bsdiff_close_compressor(&(packer->cpf_enc));
 		bsdiff_close_compressor(&(packer->dpf_enc));
@@ -394,8 +553,30 @@ static int zstd_patch_packer_getmode(void *state)
 	return packer->mode;
 }
 
-int bsdiff_open_zstd_patch_packer(int mode, struct bsdiff_stream *stream,
-                                  struct bsdiff_patch_packer *packer)
+static int in_bounds(ZSTD_cParameter param, int value)
+{
+	ZSTD_bounds bounds = ZSTD_cParam_getBounds(param);
+	return !ZSTD_isError(bounds.error) && value >= bounds.lowerBound && value <= bounds.upperBound;
+}
+
+static int check_block_options(const struct bsdiff_zstd_block_options *opts)
+{
+	if (opts->level != 0 && !in_bounds(ZSTD_c_compressionLevel, opts->level))
+		return 0;
+	if (opts->window_log != 0 && !in_bounds(ZSTD_c_windowLog, opts->window_log))
+		return 0;
+	if (opts->strategy != 0 && !in_bounds(ZSTD_c_strategy, opts->strategy))
+		return 0;
+	if (opts->workers < 0)
+		return 0;
+	if (opts->shuffle != 0 && !valid_stride(opts->shuffle))
+		return 0;
+	return 1;
+}
+
+int bsdiff_open_zstd_patch_packer_ex(int mode, struct bsdiff_stream *stream,
+                                     const struct bsdiff_zstd_options *options,
+                                     struct bsdiff_patch_packer *packer)
 {
 	struct zstd_patch_packer *state;
 
@@ -403,6 +584,17 @@ int bsdiff_open_zstd_patch_packer(int mode, struct bsdiff_stream *stream,
 	assert(stream);
 	assert(packer);
 
+	if (options && (!check_block_options(&options->ctrl) ||
+	                !check_block_options(&options->diff) ||
+	                !check_block_options(&options->extra)))
+		return BSDIFF_INVALID_ARG;
+	if (options && options->max_window_log != 0) {
+		ZSTD_bounds bounds = ZSTD_dParam_getBounds(ZSTD_d_windowLogMax);
+		if (ZSTD_isError(bounds.error) || options->max_window_log < bounds.lowerBound ||
+		    options->max_window_log > bounds.upperBound)
+			return BSDIFF_INVALID_ARG;
+	}
+
 	state = bsdiff_malloc(sizeof(struct zstd_patch_packer));
 	if (!state)
 		return BSDIFF_OUT_OF_MEMORY;
@@ -410,6 +602,17 @@ int bsdiff_open_zstd_patch_packer(int mode, struct bsdiff_stream *stream,
 	state->stream = stream;
 	state->mode = mode;
 	state->new_size = -1;
+	if (options)
+		state->opts = *options;
+	if (mode == BSDIFF_MODE_WRITE && state->opts.varint_ctrl)
+		state->flags |= ZSTD_FLAG_VARINT_CTRL;
+	if (mode == BSDIFF_MODE_WRITE && state->opts.zero_runs)
+		state->flags |= ZSTD_FLAG_ZERO_RUNS;
+	state->strides[0] = (state->opts.ctrl.shuffle > 1) ? state->opts.ctrl.shuffle : 1;
+	state->strides[1] = (state->opts.diff.shuffle > 1) ? state->opts.diff.shuffle : 1;
+	state->strides[2] = (state->opts.extra.shuffle > 1) ? state->opts.extra.shuffle : 1;
+	if (mode == BSDIFF_MODE_WRITE && (state->strides[0] > 1 || state->strides[1] > 1 || state->strides[2] > 1))
+		state->flags |= ZSTD_FLAG_SHUFFLE;
 
 	memset(packer, 0, sizeof(*packer));
 	packer->state = state;
@@ -430,3 +633,9 @@ int bsdiff_open_zstd_patch_packer(int mode, struct bsdiff_stream *stream,
 
 	return BSDIFF_SUCCESS;
 }
+
+int bsdiff_open_zstd_patch_packer(int mode, struct bsdiff_stream *stream,
+                                  struct bsdiff_patch_packer *packer)
+{
+	return bsdiff_open_zstd_patch_packer_ex(mode, stream, NULL, packer);
+}
@@ -0,0 +1,105 @@
+#include "bsdiff.h"
+#include "bsdiff_private.h"
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  include <emmintrin.h>
+#  define HAVE_SSE2 1
+#endif
+
+/*
+ * Byte transposition of 16 elements held in 'stride' vectors: one round
+ * interleaves the bytes of vector i with those of vector i + stride / 2.
+ * Four rounds turn 16 elements into 'stride' planes of 16 bytes, and
+ * log2(stride) rounds turn the planes back into elements.
+ */
+#ifdef HAVE_SSE2
+static void interleave_rounds(__m128i *v, int stride, int rounds)
+{
+	__m128i t[16];
+	int half = stride / 2;
+	int i, r;
+
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < half; i++) {
+			t[2 * i] = _mm_unpacklo_epi8(v[i], v[i + half]);
+			t[2 * i + 1] = _mm_unpackhi_epi8(v[i], v[i + half]);
+		}
+		for (i = 0; i < stride; i++)
+			v[i] = t[i];
+	}
+}
+
+static int log2_stride(int stride)
+{
+	int n = 0;
+
+	while ((1 << n) < stride)
+		n++;
+	return n;
+}
+#endif
+
+void bsdiff_shuffle(const uint8_t *src, uint8_t *dst, size_t size, int stride)
+{
+	size_t n = size / (size_t)stride, i = 0;
+	int j;
+
+	if (stride <= 1) {
+		memcpy(dst, src, size);
+		return;
+	}
+
+#ifdef HAVE_SSE2
+	{
+		__m128i v[16];
+
+		for (; i + 16 <= n; i += 16) {
+			for (j = 0; j < stride; j++)
+				v[j] = _mm_loadu_si128((const __m128i *)(src + i * (size_t)stride + 16 * (size_t)j));
+			interleave_rounds(v, stride, 4);
+			for (j = 0; j < stride; j++)
+				_mm_storeu_si128((__m128i *)(dst + (size_t)j * n + i), v[j]);
+		}
+	}
+#endif
+	for (; i < n; i++) {
+		for (j = 0; j < stride; j++)
+			dst[(size_t)j * n + i] = src[i * (size_t)stride + (size_t)j];
+	}
+
+	/* A partial element stays as it is */
+	memcpy(dst + n * (size_t)stride, src + n * (size_t)stride, size - n * (size_t)stride);
+}
+
+void bsdiff_unshuffle(const uint8_t *src, uint8_t *dst, size_t size, int stride)
+{
+	size_t n = size / (size_t)stride, i = 0;
+	int j;
+
+	if (stride <= 1) {
+		memcpy(dst, src, size);
+		return;
+	}
+
+#ifdef HAVE_SSE2
+	{
+		__m128i v[16];
+		int rounds = log2_stride(stride);
+
+		for (; i + 16 <= n; i += 16) {
+			for (j = 0; j < stride; j++)
+				v[j] = _mm_loadu_si128((const __m128i *)(src + (size_t)j * n + i));
+			interleave_rounds(v, stride, rounds);
+			for (j = 0; j < stride; j++)
+				_mm_storeu_si128((__m128i *)(dst + i * (size_t)stride + 16 * (size_t)j), v[j]);
+		}
+	}
+#endif
+	for (; i < n; i++) {
+		for (j = 0; j < stride; j++)
+			dst[i * (size_t)stride + (size_t)j] = src[(size_t)j * n + i];
+	}
+
+	memcpy(dst + n * (size_t)stride, src + n * (size_t)stride, size - n * (size_t)stride);
+}
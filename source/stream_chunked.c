@@ -0,0 +1,517 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#  define _GNU_SOURCE
+#endif
+#include "bsdiff.h"
+#include "bsdiff_mem.h"
+#include "bsdiff_private.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#if !defined(_WIN32)
+#  include <errno.h>
+#  include <fcntl.h>
+#  include <unistd.h>
+#  include <sys/stat.h>
+#endif
+
+/*
+ * Write-mode memory stream kept as a list of chunks, so that growing it
+ * never copies what was written. Chunks start small and double up to
+ * 'chunk_size', which keeps small blocks small. The contents are read back
+ * with get_chunk.
+ *
+ * With a memory limit the stream spills to an unlinked temporary file once
+ * it would grow beyond the limit: the chunks are written out and freed,
+ * and from then on a single chunk-sized buffer sits in front of the file,
+ * whose descriptor is handed out by get_fd.
+ */
+
+#define CHUNKED_FIRST_CHUNK 4096
+#define CHUNKED_DEFAULT_CHUNK (1024 * 1024)
+#define COPY_BUFFER_SIZE (1024 * 1024)
+
+struct chunk
+{
+	struct chunk *next;
+	int64_t offset;          /* of data[0] in the stream */
+	size_t size;             /* bytes written */
+	size_t capacity;
+	uint8_t data[1];
+};
+
+struct chunkstream_state
+{
+	struct chunk *head, *tail;
+	struct chunk *cursor;    /* last chunk looked up */
+	size_t chunk_size;
+	int64_t size;
+	int64_t pos;
+
+	size_t memory_limit;     /* 0 to never spill */
+	char *dir;               /* of the temporary file, NULL for $TMPDIR */
+	int fd;                  /* the temporary file, -1 until spilled */
+	uint8_t *wbuf;           /* spilled: pending writes at wbuf_off */
+	size_t wlen;
+	int64_t wbuf_off;
+};
+
+#if !defined(_WIN32)
+static int pwrite_all(int fd, const uint8_t *buf, size_t size, int64_t offset)
+{
+	ssize_t n;
+
+	while (size > 0) {
+		n = pwrite(fd, buf, size, (off_t)offset);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return BSDIFF_FILE_ERROR;
+		}
+		buf += n;
+		size -= (size_t)n;
+		offset += n;
+	}
+	return BSDIFF_SUCCESS;
+}
+
+static int open_temp_file(const char *dir)
+{
+	char *path;
+	int fd;
+
+	if (dir == NULL && (dir = getenv("TMPDIR")) == NULL)
+		dir = "/tmp";
+#if defined(O_TMPFILE)
+	fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+	if (fd != -1)
+		return fd;
+#endif
+	if ((path = bsdiff_malloc(strlen(dir) + 16)) == NULL)
+		return -1;
+	sprintf(path, "%s/bsdiff.XXXXXX", dir);
+	fd = mkstemp(path);
+	if (fd != -1)
+		unlink(path);
+	bsdiff_free(path);
+	return fd;
+}
+
+static int flush_spilled(struct chunkstream_state *s)
+{
+	int ret;
+
+	if (s->wlen > 0 && (ret = pwrite_all(s->fd, s->wbuf, s->wlen, s->wbuf_off)) != BSDIFF_SUCCESS)
+		return ret;
+	s->wbuf_off += (int64_t)s->wlen;
+	s->wlen = 0;
+	return BSDIFF_SUCCESS;
+}
+
+/* Move the chunks to a temporary file */
+static int spill(struct chunkstream_state *s)
+{
+	struct chunk *c, *next;
+	int ret = BSDIFF_SUCCESS;
+
+	if ((s->fd = open_temp_file(s->dir)) == -1)
+		return BSDIFF_FILE_ERROR;
+	/* Kept from an earlier attempt which failed */
+	if (s->wbuf == NULL && (s->wbuf = bsdiff_malloc(s->chunk_size)) == NULL)
+		ret = BSDIFF_OUT_OF_MEMORY;
+	for (c = s->head; c != NULL && ret == BSDIFF_SUCCESS; c = c->next)
+		ret = pwrite_all(s->fd, c->data, c->size, c->offset);
+	if (ret != BSDIFF_SUCCESS) {
+		/* Still in memory */
+		close(s->fd);
+		s->fd = -1;
+		return ret;
+	}
+	for (c = s->head; c != NULL; c = next) {
+		next = c->next;
+		bsdiff_free(c);
+	}
+	s->head = s->tail = s->cursor = NULL;
+	s->wbuf_off = s->pos;
+	return BSDIFF_SUCCESS;
+}
+
+static int write_spilled(struct chunkstream_state *s, const uint8_t *src, size_t size)
+{
+	size_t n;
+	int ret;
+
+	if (s->pos != s->wbuf_off + (int64_t)s->wlen) {
+		if ((ret = flush_spilled(s)) != BSDIFF_SUCCESS)
+			return ret;
+		s->wbuf_off = s->pos;
+	}
+	while (size > 0) {
+		n = s->chunk_size - s->wlen;
+		if (n > size)
+			n = size;
+		memcpy(s->wbuf + s->wlen, src, n);
+		s->wlen += n;
+		s->pos += (int64_t)n;
+		src += n;
+		size -= n;
+		if (s->wlen == s->chunk_size && (ret = flush_spilled(s)) != BSDIFF_SUCCESS)
+			return ret;
+	}
+	if (s->pos > s->size)
+		s->size = s->pos;
+	return BSDIFF_SUCCESS;
+}
+#endif
+
+/* The chunk holding 'offset' < size, searched from the cursor when possible */
+static struct chunk *find_chunk(struct chunkstream_state *s, int64_t offset)
+{
+	struct chunk *c = s->cursor;
+
+	if (c == NULL || c->offset > offset)
+		c = s->head;
+	while (offset >= c->offset + (int64_t)c->size)
+		c = c->next;
+	s->cursor = c;
+	return c;
+}
+
+static int append_chunk(struct chunkstream_state *s)
+{
+	size_t capacity = CHUNKED_FIRST_CHUNK;
+	struct chunk *c;
+
+	if (s->tail != NULL)
+		capacity = s->tail->capacity * 2;
+	if (capacity > s->chunk_size)
+		capacity = s->chunk_size;
+
+	c = bsdiff_malloc(offsetof(struct chunk, data) + capacity);
+	if (c == NULL)
+		return BSDIFF_OUT_OF_MEMORY;
+	c->next = NULL;
+	c->offset = s->size;
+	c->size = 0;
+	c->capacity = capacity;
+	if (s->tail != NULL)
+		s->tail->next = c;
+	else
+		s->head = c;
+	s->tail = c;
+	return BSDIFF_SUCCESS;
+}
+
+static int chunkstream_seek(void *state, int64_t offset, int origin)
+{
+	struct chunkstream_state *s = (struct chunkstream_state*)state;
+	int64_t newpos = -1;
+
+	switch (origin) {
+	case BSDIFF_SEEK_SET: newpos = offset; break;
+	case BSDIFF_SEEK_CUR: newpos = s->pos + offset; break;
+	case BSDIFF_SEEK_END: newpos = s->size + offset; break;
+	}
+	if (newpos < 0 || newpos > s->size)
+		return BSDIFF_INVALID_ARG;
+
+	s->pos = newpos;
+	return BSDIFF_SUCCESS;
+}
+
+static int chunkstream_tell(void *state, int64_t *position)
+{
+	struct chunkstream_state *s = (struct chunkstream_state*)state;
+	*position = s->pos;
+	return BSDIFF_SUCCESS;
+}
+
+static int chunkstream_write(void *state, const void *buffer, size_t size)
+{
+	struct chunkstream_state *s = (struct chunkstream_state*)state;
+	const uint8_t *src = (const uint8_t*)buffer;
+	struct chunk *c;
+	size_t n, off;
+	int ret;
+
+#if !defined(_WIN32)
+	if (s->fd == -1 && s->memory_limit > 0 && s->size + (int64_t)size > (int64_t)s->memory_limit &&
+		(ret = spill(s)) != BSDIFF_SUCCESS)
+		return ret;
+	if (s->fd != -1)
+		return write_spilled(s, src, size);
+#endif
+
+	/* Overwrite what was written after a seek back */
+	while (size > 0 && s->pos < s->size) {
+		c = find_chunk(s, s->pos);
+		off = (size_t)(s->pos - c->offset);
+		n = c->size - off;
+		if (n > size)
+			n = size;
+		memcpy(c->data + off, src, n);
+		s->pos += (int64_t)n;
+		src += n;
+		size -= n;
+	}
+
+	/* Append */
+	while (size > 0) {
+		if ((s->tail == NULL || s->tail->size == s->tail->capacity) &&
+			(ret = append_chunk(s)) != BSDIFF_SUCCESS)
+			return ret;
+		c = s->tail;
+		n = c->capacity - c->size;
+		if (n > size)
+			n = size;
+		memcpy(c->data + c->size, src, n);
+		c->size += n;
+		s->size += (int64_t)n;
+		s->pos = s->size;
+		src += n;
+		size -= n;
+	}
+
+	return BSDIFF_SUCCESS;
+}
+
+static int chunkstream_flush(void *state)
+{
+	(void)state;
+	return BSDIFF_SUCCESS;
+}
+
+static int chunkstream_getchunk(void *state, int64_t offset, const void **ppbuffer, size_t *psize)
+{
+	struct chunkstream_state *s = (struct chunkstream_state*)state;
+	struct chunk *c;
+
+	*ppbuffer = NULL;
+	*psize = 0;
+	if (offset < 0)
+		return BSDIFF_INVALID_ARG;
+	if (s->fd != -1)
+		return BSDIFF_ERROR;  /* spilled, see get_fd */
+	if (offset >= s->size)
+		return BSDIFF_END_OF_FILE;
+
+	c = find_chunk(s, offset);
+	*ppbuffer = c->data + (offset - c->offset);
+	*psize = c->size - (size_t)(offset - c->offset);
+	return BSDIFF_SUCCESS;
+}
+
+#if !defined(_WIN32)
+static int chunkstream_getfd(void *state, int *fd)
+{
+	struct chunkstream_state *s = (struct chunkstream_state*)state;
+	int ret;
+
+	if (s->fd == -1)
+		return BSDIFF_ERROR;  /* in memory, see get_chunk */
+	if ((ret = flush_spilled(s)) != BSDIFF_SUCCESS)
+		return ret;
+	*fd = s->fd;
+	return BSDIFF_SUCCESS;
+}
+#endif
+
+static void chunkstream_close(void *state)
+{
+	struct chunkstream_state *s = (struct chunkstream_state*)state;
+	struct chunk *c, *next;
+
+	for (c = s->head; c != NULL; c = next) {
+		next = c->next;
+		bsdiff_free(c);
+	}
+#if !defined(_WIN32)
+	if (s->fd != -1)
+		close(s->fd);
+#endif
+	if (s->wbuf != NULL)
+		bsdiff_free(s->wbuf);
+	if (s->dir != NULL)
+		bsdiff_free(s->dir);
+	bsdiff_free(s);
+}
+
+static int chunkstream_getmode(void *state)
+{
+	(void)state;
+	return BSDIFF_MODE_WRITE;
+}
+
+int bsdiff_open_spill_stream(
+	size_t memory_limit,
+	const char *dir,
+	struct bsdiff_stream *stream)
+{
+	struct chunkstream_state *state;
+	assert(stream);
+
+	state = bsdiff_malloc(sizeof(struct chunkstream_state));
+	if (state == NULL)
+		return BSDIFF_OUT_OF_MEMORY;
+	memset(state, 0, sizeof(*state));
+	state->fd = -1;
+	state->chunk_size = CHUNKED_DEFAULT_CHUNK;
+	state->memory_limit = memory_limit;
+	if (dir != NULL) {
+		if ((state->dir = bsdiff_malloc(strlen(dir) + 1)) == NULL) {
+			bsdiff_free(state);
+			return BSDIFF_OUT_OF_MEMORY;
+		}
+		strcpy(state->dir, dir);
+	}
+
+	memset(stream, 0, sizeof(*stream));
+	stream->state = state;
+	stream->close = chunkstream_close;
+	stream->get_mode = chunkstream_getmode;
+	stream->seek = chunkstream_seek;
+	stream->tell = chunkstream_tell;
+	stream->write = chunkstream_write;
+	stream->flush = chunkstream_flush;
+	stream->get_chunk = chunkstream_getchunk;
+#if !defined(_WIN32)
+	stream->get_fd = chunkstream_getfd;
+#endif
+
+	return BSDIFF_SUCCESS;
+}
+
+int bsdiff_open_chunked_memory_stream(
+	size_t chunk_size,
+	struct bsdiff_stream *stream)
+{
+	int ret;
+
+	if ((ret = bsdiff_open_spill_stream(0, NULL, stream)) != BSDIFF_SUCCESS)
+		return ret;
+	if (chunk_size > 0)
+		((struct chunkstream_state*)stream->state)->chunk_size = chunk_size;
+	return BSDIFF_SUCCESS;
+}
+
+int bsdiff_stream_data_size(
+	struct bsdiff_stream *stream,
+	int64_t *size)
+{
+	const void *buf;
+	size_t cb;
+	int ret;
+#if !defined(_WIN32)
+	struct stat st;
+	int fd;
+#endif
+
+	/* Chunked streams keep a running total, in memory or spilled */
+	if (stream->get_chunk == chunkstream_getchunk) {
+		*size = ((struct chunkstream_state*)stream->state)->size;
+		return BSDIFF_SUCCESS;
+	}
+
+#if !defined(_WIN32)
+	if (stream->get_fd != NULL && stream->get_fd(stream->state, &fd) == BSDIFF_SUCCESS) {
+		if (fstat(fd, &st) != 0)
+			return BSDIFF_FILE_ERROR;
+		*size = (int64_t)st.st_size;
+		return BSDIFF_SUCCESS;
+	}
+#endif
+
+	*size = 0;
+	if (stream->get_chunk == NULL) {
+		if (stream->get_buffer == NULL ||
+			stream->get_buffer(stream->state, &buf, &cb) != BSDIFF_SUCCESS)
+			return BSDIFF_INVALID_ARG;
+		*size = (int64_t)cb;
+		return BSDIFF_SUCCESS;
+	}
+	while ((ret = stream->get_chunk(stream->state, *size, &buf, &cb)) == BSDIFF_SUCCESS)
+		*size += (int64_t)cb;
+	return (ret == BSDIFF_END_OF_FILE) ? BSDIFF_SUCCESS : ret;
+}
+
+#if !defined(_WIN32)
+/* Copy a file into 'dst', in the kernel when 'dst' is a file too */
+static int write_file_data(struct bsdiff_stream *dst, int in_fd, int64_t size)
+{
+	int64_t pos, off = 0;
+	uint8_t *buf;
+	ssize_t n;
+	int ret = BSDIFF_SUCCESS;
+#if defined(__linux__)
+	loff_t in_off, out_off;
+	int out_fd;
+
+	if (dst->get_fd != NULL && dst->get_fd(dst->state, &out_fd) == BSDIFF_SUCCESS &&
+		dst->tell(dst->state, &pos) == BSDIFF_SUCCESS) {
+		while (off < size) {
+			in_off = off;
+			out_off = pos + off;
+			n = copy_file_range(in_fd, &in_off, out_fd, &out_off, (size_t)(size - off), 0);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				break;  /* e.g. EXDEV or no support, the rest is copied below */
+			off += n;
+		}
+		if (off > 0 && dst->seek(dst->state, pos + off, BSDIFF_SEEK_SET) != BSDIFF_SUCCESS)
+			return BSDIFF_FILE_ERROR;
+		if (off == size)
+			return BSDIFF_SUCCESS;
+	}
+#endif
+
+	if ((buf = bsdiff_malloc(COPY_BUFFER_SIZE)) == NULL)
+		return BSDIFF_OUT_OF_MEMORY;
+	while (off < size) {
+		n = pread(in_fd, buf, (size - off < COPY_BUFFER_SIZE) ? (size_t)(size - off) : COPY_BUFFER_SIZE, (off_t)off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			ret = BSDIFF_FILE_ERROR;
+			break;
+		}
+		if ((ret = dst->write(dst->state, buf, (size_t)n)) != BSDIFF_SUCCESS)
+			break;
+		off += n;
+	}
+	bsdiff_free(buf);
+	return ret;
+}
+#endif
+
+int bsdiff_write_stream_data(
+	struct bsdiff_stream *dst,
+	struct bsdiff_stream *src)
+{
+	const void *buf;
+	size_t cb;
+	int64_t offset = 0;
+	int ret;
+#if !defined(_WIN32)
+	int fd;
+
+	if (src->get_fd != NULL && src->get_fd(src->state, &fd) == BSDIFF_SUCCESS) {
+		if ((ret = bsdiff_stream_data_size(src, &offset)) != BSDIFF_SUCCESS)
+			return ret;
+		return write_file_data(dst, fd, offset);
+	}
+#endif
+
+	if (src->get_chunk == NULL) {
+		if (src->get_buffer == NULL ||
+			src->get_buffer(src->state, &buf, &cb) != BSDIFF_SUCCESS)
+			return BSDIFF_INVALID_ARG;
+		return dst->write(dst->state, buf, cb);
+	}
+	while ((ret = src->get_chunk(src->state, offset, &buf, &cb)) == BSDIFF_SUCCESS) {
+		if ((ret = dst->write(dst->state, buf, cb)) != BSDIFF_SUCCESS)
+			return ret;
+		offset += (int64_t)cb;
+	}
+	return (ret == BSDIFF_END_OF_FILE) ? BSDIFF_SUCCESS : ret;
+}
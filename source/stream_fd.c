@@ -0,0 +1,407 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#  define _GNU_SOURCE
+#endif
+#include "bsdiff.h"
+#include "bsdiff_mem.h"
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#if !defined(_WIN32)
+#  include <errno.h>
+#  include <fcntl.h>
+#  include <unistd.h>
+#  include <sys/types.h>
+#  include <sys/stat.h>
+#endif
+
+/*
+ * Stream on a raw file descriptor. Reads and writes go through one large
+ * page-aligned buffer with pread/pwrite at the stream position, so the
+ * offset of the descriptor itself is never used. Pipes and other
+ * descriptors that can't seek fall back to read/write and only support
+ * sequential access.
+ */
+
+#define FD_STREAM_DEFAULT_BUFFER (1024 * 1024)
+#define FD_STREAM_ALIGN 4096
+
+#if !defined(_WIN32)
+
+struct fdstream_state
+{
+	int fd;
+	int owns_fd;
+	int mode;                /* BSDIFF_MODE_READ or BSDIFF_MODE_WRITE */
+	int seekable;
+	int drop_cache;
+
+	uint8_t *raw;            /* allocation behind 'buf' */
+	uint8_t *buf;
+	size_t bufsize;
+	int64_t buf_off;         /* file offset of buf[0] */
+	size_t len;              /* valid bytes (read) or pending bytes (write) */
+	int64_t pos;
+
+	int64_t dropped;         /* page cache is dropped below this offset */
+	int64_t synced;          /* drop_cache, write mode: end of the written range
+	                            still being written back */
+};
+
+static int read_fd(struct fdstream_state *s, void *buffer, size_t size, int64_t offset, size_t *readed)
+{
+	ssize_t n;
+
+	*readed = 0;
+	while (*readed < size) {
+		if (s->seekable)
+			n = pread(s->fd, (uint8_t*)buffer + *readed, size - *readed, (off_t)(offset + (int64_t)*readed));
+		else
+			n = read(s->fd, (uint8_t*)buffer + *readed, size - *readed);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return BSDIFF_FILE_ERROR;
+		}
+		if (n == 0)
+			return BSDIFF_END_OF_FILE;
+		*readed += (size_t)n;
+	}
+
+	return BSDIFF_SUCCESS;
+}
+
+static int write_fd(struct fdstream_state *s, const void *buffer, size_t size, int64_t offset)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < size) {
+		if (s->seekable)
+			n = pwrite(s->fd, (const uint8_t*)buffer + done, size - done, (off_t)(offset + (int64_t)done));
+		else
+			n = write(s->fd, (const uint8_t*)buffer + done, size - done);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return BSDIFF_FILE_ERROR;
+		}
+		done += (size_t)n;
+	}
+
+#if defined(__linux__)
+	/* Start the writeback of this range, wait for the previous one and
+	   drop it from the page cache */
+	if (s->drop_cache && s->seekable) {
+		sync_file_range(s->fd, (off_t)offset, (off_t)size, SYNC_FILE_RANGE_WRITE);
+		if (s->synced > s->dropped) {
+			sync_file_range(s->fd, (off_t)s->dropped, (off_t)(s->synced - s->dropped),
+				SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+			posix_fadvise(s->fd, (off_t)s->dropped, (off_t)(s->synced - s->dropped), POSIX_FADV_DONTNEED);
+		}
+		s->dropped = offset;
+		s->synced = offset + (int64_t)size;
+	}
+#endif
+
+	return BSDIFF_SUCCESS;
+}
+
+static int flush_buffer(struct fdstream_state *s)
+{
+	int ret = BSDIFF_SUCCESS;
+
+	if (s->mode == BSDIFF_MODE_WRITE && s->len > 0)
+		ret = write_fd(s, s->buf, s->len, s->buf_off);
+	s->len = 0;
+	s->buf_off = s->pos;
+	return ret;
+}
+
+static int fdstream_seek(void *state, int64_t offset, int origin)
+{
+	struct fdstream_state *s = (struct fdstream_state*)state;
+	struct stat st;
+	int64_t new_pos;
+	int ret;
+
+	switch (origin) {
+	case BSDIFF_SEEK_SET: new_pos = offset; break;
+	case BSDIFF_SEEK_CUR: new_pos = s->pos + offset; break;
+	case BSDIFF_SEEK_END:
+		if ((ret = flush_buffer(s)) != BSDIFF_SUCCESS)
+			return ret;
+		if (fstat(s->fd, &st) != 0)
+			return BSDIFF_FILE_ERROR;
+		new_pos = (int64_t)st.st_size + offset;
+		break;
+	default: return BSDIFF_INVALID_ARG;
+	}
+	if (new_pos < 0)
+		return BSDIFF_INVALID_ARG;
+	if (new_pos == s->pos)
+		return BSDIFF_SUCCESS;
+	if (!s->seekable)
+		return BSDIFF_FILE_ERROR;
+
+	/* Pending writes go out first, buffered reads stay valid */
+	if (s->mode == BSDIFF_MODE_WRITE && (ret = flush_buffer(s)) != BSDIFF_SUCCESS)
+		return ret;
+	s->pos = new_pos;
+	if (s->mode == BSDIFF_MODE_WRITE)
+		s->buf_off = new_pos;
+
+	return BSDIFF_SUCCESS;
+}
+
+static int fdstream_tell(void *state, int64_t *position)
+{
+	struct fdstream_state *s = (struct fdstream_state*)state;
+	*position = s->pos;
+	return BSDIFF_SUCCESS;
+}
+
+static int fdstream_read(void *state, void *buffer, size_t size, size_t *readed)
+{
+	struct fdstream_state *s = (struct fdstream_state*)state;
+	uint8_t *dst = (uint8_t*)buffer;
+	size_t n, cb;
+	int ret;
+
+	*readed = 0;
+	while (*readed < size) {
+		if (s->pos >= s->buf_off && s->pos < s->buf_off + (int64_t)s->len) {
+			n = (size_t)(s->buf_off + (int64_t)s->len - s->pos);
+			if (n > size - *readed)
+				n = size - *readed;
+			memcpy(dst + *readed, s->buf + (s->pos - s->buf_off), n);
+			s->pos += (int64_t)n;
+			*readed += n;
+			continue;
+		}
+
+		n = size - *readed;
+		if (n >= s->bufsize) {
+			/* Large reads bypass the buffer */
+			ret = read_fd(s, dst + *readed, n, s->pos, &cb);
+			s->pos += (int64_t)cb;
+			*readed += cb;
+			return ret;
+		}
+
+		s->buf_off = s->pos;
+		ret = read_fd(s, s->buf, s->bufsize, s->pos, &s->len);
+		if (ret != BSDIFF_SUCCESS && ret != BSDIFF_END_OF_FILE)
+			return ret;
+		if (s->len == 0)
+			return BSDIFF_END_OF_FILE;
+#if defined(POSIX_FADV_DONTNEED)
+		if (s->drop_cache && s->seekable && s->buf_off > s->dropped) {
+			posix_fadvise(s->fd, (off_t)s->dropped, (off_t)(s->buf_off - s->dropped), POSIX_FADV_DONTNEED);
+			s->dropped = s->buf_off;
+		}
+#endif
+	}
+
+	return BSDIFF_SUCCESS;
+}
+
+static int fdstream_pread(void *state, void *buffer, size_t size, int64_t offset, size_t *readed)
+{
+	struct fdstream_state *s = (struct fdstream_state*)state;
+
+	*readed = 0;
+	if (offset < 0)
+		return BSDIFF_INVALID_ARG;
+	return read_fd(s, buffer, size, offset, readed);
+}
+
+static int fdstream_write(void *state, const void *buffer, size_t size)
+{
+	struct fdstream_state *s = (struct fdstream_state*)state;
+	const uint8_t *src = (const uint8_t*)buffer;
+	size_t n;
+	int ret;
+
+	if (s->len == 0 && size >= s->bufsize) {
+		/* Large writes bypass the buffer */
+		if ((ret = write_fd(s, src, size, s->pos)) != BSDIFF_SUCCESS)
+			return ret;
+		s->pos += (int64_t)size;
+		s->buf_off = s->pos;
+		return BSDIFF_SUCCESS;
+	}
+
+	while (size > 0) {
+		n = s->bufsize - s->len;
+		if (n > size)
+			n = size;
+		memcpy(s->buf + s->len, src, n);
+		s->len += n;
+		s->pos += (int64_t)n;
+		src += n;
+		size -= n;
+		if (s->len == s->bufsize && (ret = flush_buffer(s)) != BSDIFF_SUCCESS)
+			return ret;
+	}
+
+	return BSDIFF_SUCCESS;
+}
+
+static int fdstream_flush(void *state)
+{
+	struct fdstream_state *s = (struct fdstream_state*)state;
+	return flush_buffer(s);
+}
+
+static int fdstream_getfd(void *state, int *fd)
+{
+	struct fdstream_state *s = (struct fdstream_state*)state;
+	int ret;
+
+	if ((ret = flush_buffer(s)) != BSDIFF_SUCCESS)
+		return ret;
+	*fd = s->fd;
+	return BSDIFF_SUCCESS;
+}
+
+static void fdstream_close(void *state)
+{
+	struct fdstream_state *s = (struct fdstream_state*)state;
+
+	flush_buffer(s);
+	if (s->owns_fd)
+		close(s->fd);
+	bsdiff_free(s->raw);
+	bsdiff_free(s);
+}
+
+static int fdstream_getmode(void *state)
+{
+	struct fdstream_state *s = (struct fdstream_state*)state;
+	return s->mode;
+}
+
+static int open_fd_stream(
+	int mode,
+	int fd,
+	int owns_fd,
+	const struct bsdiff_fd_stream_options *opts,
+	struct bsdiff_stream *stream)
+{
+	struct fdstream_state *s;
+	off_t cur;
+
+	s = bsdiff_malloc(sizeof(struct fdstream_state));
+	if (s == NULL)
+		return BSDIFF_OUT_OF_MEMORY;
+	memset(s, 0, sizeof(*s));
+	s->fd = fd;
+	s->owns_fd = owns_fd;
+	s->mode = (mode == BSDIFF_MODE_READ) ? BSDIFF_MODE_READ : BSDIFF_MODE_WRITE;
+	s->bufsize = (opts != NULL && opts->buffer_size > 0) ? opts->buffer_size : FD_STREAM_DEFAULT_BUFFER;
+	s->drop_cache = (opts != NULL) ? opts->drop_cache : 0;
+	s->raw = bsdiff_malloc(s->bufsize + FD_STREAM_ALIGN - 1);
+	if (s->raw == NULL) {
+		bsdiff_free(s);
+		return BSDIFF_OUT_OF_MEMORY;
+	}
+	s->buf = (uint8_t*)(((uintptr_t)s->raw + FD_STREAM_ALIGN - 1) & ~(uintptr_t)(FD_STREAM_ALIGN - 1));
+
+	/* Pipes, sockets and terminals can't seek */
+	cur = lseek(fd, 0, SEEK_CUR);
+	s->seekable = (cur != (off_t)-1);
+	s->pos = s->seekable ? (int64_t)cur : 0;
+	s->buf_off = s->pos;
+	s->dropped = s->pos;
+	s->synced = s->pos;
+
+#if defined(POSIX_FADV_SEQUENTIAL)
+	if (s->seekable && s->mode == BSDIFF_MODE_READ)
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+#if defined(__linux__)
+	/* Reserve the blocks without changing the size, in case less is written */
+	if (s->seekable && s->mode == BSDIFF_MODE_WRITE && opts != NULL && opts->size_hint > s->pos)
+		fallocate(fd, FALLOC_FL_KEEP_SIZE, (off_t)s->pos, (off_t)(opts->size_hint - s->pos));
+#endif
+
+	memset(stream, 0, sizeof(*stream));
+	stream->state = s;
+	stream->close = fdstream_close;
+	stream->get_mode = fdstream_getmode;
+	stream->seek = fdstream_seek;
+	stream->tell = fdstream_tell;
+	if (s->mode == BSDIFF_MODE_READ) {
+		stream->read = fdstream_read;
+		if (s->seekable)
+			stream->pread = fdstream_pread;
+	} else {
+		stream->write = fdstream_write;
+		stream->flush = fdstream_flush;
+	}
+	if (s->seekable)
+		stream->get_fd = fdstream_getfd;
+
+	return BSDIFF_SUCCESS;
+}
+
+#endif /* !_WIN32 */
+
+int bsdiff_open_fd_stream(
+	int mode,
+	int fd,
+	int owns_fd,
+	const struct bsdiff_fd_stream_options *opts,
+	struct bsdiff_stream *stream)
+{
+	assert(mode >= BSDIFF_MODE_READ && mode <= BSDIFF_MODE_UPDATE);
+	assert(stream);
+
+#if defined(_WIN32)
+	(void)mode; (void)fd; (void)owns_fd; (void)opts; (void)stream;
+	return BSDIFF_ERROR;
+#else
+	if (fd < 0)
+		return BSDIFF_INVALID_ARG;
+	return open_fd_stream(mode, fd, owns_fd, opts, stream);
+#endif
+}
+
+int bsdiff_open_fd_file_stream(
+	int mode,
+	const char *filename,
+	const struct bsdiff_fd_stream_options *opts,
+	struct bsdiff_stream *stream)
+{
+	assert(mode >= BSDIFF_MODE_READ && mode <= BSDIFF_MODE_UPDATE);
+	assert(filename);
+	assert(stream);
+
+#if defined(_WIN32)
+	(void)opts; (void)stream;
+	return BSDIFF_ERROR;
+#else
+	{
+		int fd, flags, ret;
+
+		switch (mode) {
+		case BSDIFF_MODE_WRITE: flags = O_WRONLY | O_CREAT | O_TRUNC; break;
+		case BSDIFF_MODE_UPDATE: flags = O_RDWR; break;
+		default: flags = O_RDONLY; break;
+		}
+#if defined(O_CLOEXEC)
+		flags |= O_CLOEXEC;
+#endif
+		do {
+			fd = open(filename, flags, 0666);
+		} while (fd == -1 && errno == EINTR);
+		if (fd == -1)
+			return BSDIFF_FILE_ERROR;
+
+		if ((ret = open_fd_stream(mode, fd, 1, opts, stream)) != BSDIFF_SUCCESS)
+			close(fd);
+		return ret;
+	}
+#endif
+}
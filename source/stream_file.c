@@ -2,6 +2,10 @@
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#if !defined(_WIN32)
+#  include <errno.h>
+#  include <unistd.h>
+#endif
 
 static int filestream_seek(void *state, int64_t offset, int origin)
 {
@@ -45,6 +49,45 @@ static int filestream_read(void *state, void *buffer, size_t size, size_t *reade
 	return BSDIFF_SUCCESS;
 }
 
+#if !defined(_WIN32)
+/* pread on the descriptor, which neither moves nor flushes the FILE buffer */
+static int filestream_pread(void *state, void *buffer, size_t size, int64_t offset, size_t *readed)
+{
+	FILE *f = (FILE*)state;
+	ssize_t n;
+
+	*readed = 0;
+	if (offset < 0)
+		return BSDIFF_INVALID_ARG;
+
+	while (*readed < size) {
+		n = pread(fileno(f), (char*)buffer + *readed, size - *readed, (off_t)offset + (off_t)*readed);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return BSDIFF_FILE_ERROR;
+		}
+		if (n == 0)
+			return BSDIFF_END_OF_FILE;
+		*readed += (size_t)n;
+	}
+
+	return BSDIFF_SUCCESS;
+}
+#endif
+
+#if !defined(_WIN32)
+static int filestream_getfd(void *state, int *fd)
+{
+	FILE *f = (FILE*)state;
+
+	if (fflush(f) != 0)
+		return BSDIFF_FILE_ERROR;
+	*fd = fileno(f);
+	return BSDIFF_SUCCESS;
+}
+#endif
+
 static int filestream_write(void *state, const void *buffer, size_t size)
 {
 	FILE *f = (FILE*)state;
@@ -80,11 +123,15 @@ int bsdiff_open_file_stream(
 	struct bsdiff_stream *stream)
 {
 	FILE *f;
-	assert(mode >= BSDIFF_MODE_READ && mode <= BSDIFF_MODE_WRITE);
+	assert(mode >= BSDIFF_MODE_READ && mode <= BSDIFF_MODE_UPDATE);
 	assert(filename);
 	assert(stream);
 
-	f = fopen(filename, (mode == BSDIFF_MODE_WRITE) ? "wb" : "rb");
+	switch (mode) {
+	case BSDIFF_MODE_WRITE: f = fopen(filename, "wb"); break;
+	case BSDIFF_MODE_UPDATE: f = fopen(filename, "r+b"); break;
+	default: f = fopen(filename, "rb"); break;
+	}
 	if (f == NULL)
 		return BSDIFF_FILE_ERROR;
 
@@ -93,13 +140,19 @@ int bsdiff_open_file_stream(
 	stream->close = filestream_close;
 	stream->seek = filestream_seek;
 	stream->tell = filestream_tell;
-	if (mode != BSDIFF_MODE_WRITE) {
+	if (mode == BSDIFF_MODE_READ) {
 		stream->get_mode = filestream_getmode_read;
 		stream->read = filestream_read;
+#if !defined(_WIN32)
+		stream->pread = filestream_pread;
+#endif
 	} else {
 		stream->get_mode = filestream_getmode_write;
 		stream->write = filestream_write;
 		stream->flush = filestream_flush;
+#if !defined(_WIN32)
+		stream->get_fd = filestream_getfd;
+#endif
 	}
 
 	return BSDIFF_SUCCESS;
@@ -70,6 +70,22 @@ static int memstream_read(void *state, void *buffer, size_t size, size_t *readed
 	return BSDIFF_SUCCESS;
 }
 
+static int memstream_pread(void *state, void *buffer, size_t size, int64_t offset, size_t *readed)
+{
+	struct memstream_state *s = (struct memstream_state*)state;
+
+	*readed = 0;
+	if (offset < 0)
+		return BSDIFF_INVALID_ARG;
+	if ((uint64_t)offset >= s->size)
+		return (size == 0) ? BSDIFF_SUCCESS : BSDIFF_END_OF_FILE;
+
+	*readed = (size > s->size - (size_t)offset) ? s->size - (size_t)offset : size;
+	memcpy(buffer, (uint8_t*)s->buffer + offset, *readed);
+
+	return (*readed < size) ? BSDIFF_END_OF_FILE : BSDIFF_SUCCESS;
+}
+
 static size_t calc_new_capacity(size_t current, size_t required)
 {
 	size_t cap = current;
@@ -214,6 +230,7 @@ int bsdiff_open_memory_stream(
 	stream->tell = memstream_tell;
 	if (state->mode == BSDIFF_MODE_READ) {
 		stream->read = memstream_read;
+		stream->pread = memstream_pread;
 	} else {
 		stream->write = memstream_write;
 		stream->flush = memstream_flush;
@@ -94,6 +94,22 @@ static int mmapstream_read(void *state, void *buffer, size_t size, size_t *reade
 	return (size == 0 && remain > 0) ? BSDIFF_SUCCESS : (size > 0 ? BSDIFF_SUCCESS : BSDIFF_END_OF_FILE);
 }
 
+static int mmapstream_pread(void *state, void *buffer, size_t size, int64_t offset, size_t *readed)
+{
+	struct filestream_mmap_state *s = (struct filestream_mmap_state *)state;
+
+	*readed = 0;
+	if (offset < 0)
+		return BSDIFF_INVALID_ARG;
+	if (offset >= s->size)
+		return (size == 0) ? BSDIFF_SUCCESS : BSDIFF_END_OF_FILE;
+
+	*readed = ((int64_t)size > s->size - offset) ? (size_t)(s->size - offset) : size;
+	memcpy(buffer, (uint8_t *)s->addr + offset, *readed);
+
+	return (*readed < size) ? BSDIFF_END_OF_FILE : BSDIFF_SUCCESS;
+}
+
 static int mmapstream_getbuffer(void *state, const void **ppbuffer, size_t *psize)
 {
 	struct filestream_mmap_state *s = (struct filestream_mmap_state *)state;
@@ -102,16 +118,91 @@ static int mmapstream_getbuffer(void *state, const void **ppbuffer, size_t *psiz
 	return BSDIFF_SUCCESS;
 }
 
+#if !defined(_WIN32)
+#define HUGE_PAGE_SIZE ((size_t)2 * 1024 * 1024)
+
+/* Map the file at a huge page boundary, so that khugepaged can collapse it */
+static void *map_aligned(int fd, size_t size, int flags)
+{
+	uint8_t *base, *addr, *tail, *end;
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	size_t head;
+
+	base = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED)
+		return MAP_FAILED;
+	addr = (uint8_t*)(((uintptr_t)base + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+	if (mmap(addr, size, PROT_READ, flags | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		munmap(base, size + HUGE_PAGE_SIZE);
+		return MAP_FAILED;
+	}
+	head = (size_t)(addr - base);
+	if (head > 0)
+		munmap(base, head);
+	/* The file mapping covers whole pages, so the rest starts at the next one */
+	tail = addr + ((size + page - 1) & ~(page - 1));
+	end = base + size + HUGE_PAGE_SIZE;
+	if (tail < end)
+		munmap(tail, (size_t)(end - tail));
+	return addr;
+}
+
+static void *map_file(int fd, size_t size, const struct bsdiff_mmap_stream_options *opts)
+{
+	int flags = MAP_PRIVATE;
+	void *addr;
+
+#if defined(MAP_POPULATE)
+	if (opts->prefault)
+		flags |= MAP_POPULATE;
+#endif
+#if defined(MADV_HUGEPAGE)
+	if (opts->huge_pages && size >= HUGE_PAGE_SIZE)
+		addr = map_aligned(fd, size, flags);
+	else
+#endif
+		addr = mmap(NULL, size, PROT_READ, flags, fd, 0);
+	if (addr == MAP_FAILED)
+		return MAP_FAILED;
+
+	/* Advice only, failures are ignored */
+#if defined(MADV_HUGEPAGE)
+	if (opts->huge_pages)
+		madvise(addr, size, MADV_HUGEPAGE);
+#endif
+	if (opts->access == BSDIFF_ACCESS_RANDOM)
+		madvise(addr, size, MADV_RANDOM);
+	else if (opts->access == BSDIFF_ACCESS_SEQUENTIAL)
+		madvise(addr, size, MADV_SEQUENTIAL);
+	if (opts->prefault)
+		madvise(addr, size, MADV_WILLNEED);
+	return addr;
+}
+#endif
+
 int bsdiff_open_mmap_stream(
 	int mode,
 	const char *filename,
 	struct bsdiff_stream *stream)
 {
+	return bsdiff_open_mmap_stream_ex(mode, filename, NULL, stream);
+}
+
+int bsdiff_open_mmap_stream_ex(
+	int mode,
+	const char *filename,
+	const struct bsdiff_mmap_stream_options *opts,
+	struct bsdiff_stream *stream)
+{
+	static const struct bsdiff_mmap_stream_options default_opts = { 0 };
 	struct filestream_mmap_state *s;
 #if !defined(_WIN32)
 	struct stat st;
 #endif
 
+	if (opts == NULL)
+		opts = &default_opts;
+
 	if (mode != BSDIFF_MODE_READ)
 		return BSDIFF_INVALID_ARG;
 
@@ -163,7 +254,7 @@ int bsdiff_open_mmap_stream(
 	s->size = st.st_size;
 
 	if (s->size > 0) {
-		s->addr = mmap(NULL, (size_t)s->size, PROT_READ, MAP_PRIVATE, s->fd, 0);
+		s->addr = map_file(s->fd, (size_t)s->size, opts);
 		if (s->addr == MAP_FAILED) {
 			close(s->fd);
 			free(s);
@@ -179,6 +270,7 @@ int bsdiff_open_mmap_stream(
 	stream->seek = mmapstream_seek;
 	stream->tell = mmapstream_tell;
 	stream->read = mmapstream_read;
+	stream->pread = mmapstream_pread;
 	stream->get_buffer = mmapstream_getbuffer;
 
 	return BSDIFF_SUCCESS;
@@ -50,6 +50,13 @@ static int substream_read(void *state, void *buffer, size_t size, size_t *readed
 	cb = size;
 	if (substream->current + (int64_t)size > substream->end)
 		cb = (size_t)(substream->end - substream->current);
+	/* positional read, leaving the shared position of the base alone */
+	if (base->pread != NULL) {
+		ret = base->pread(base->state, buffer, cb, substream->current, readed);
+		if (ret == BSDIFF_SUCCESS || ret == BSDIFF_END_OF_FILE)
+			substream->current += *readed;
+		return ret;
+	}
 	/* (re)seek to current */
 	if (base->seek(base->state, substream->current, BSDIFF_SEEK_SET) != BSDIFF_SUCCESS)
 		return BSDIFF_FILE_ERROR;
@@ -62,6 +69,24 @@ static int substream_read(void *state, void *buffer, size_t size, size_t *readed
 	return ret;
 }
 
+/* The part of the base buffer covered by the substream */
+static int substream_getbuffer(void *state, const void **ppbuffer, size_t *psize)
+{
+	struct substream_state *substream = (struct substream_state*)state;
+	const void *buffer;
+	size_t size;
+	int ret;
+
+	ret = substream->base->get_buffer(substream->base->state, &buffer, &size);
+	if (ret != BSDIFF_SUCCESS)
+		return ret;
+	if ((uint64_t)substream->end > (uint64_t)size)
+		return BSDIFF_ERROR;
+	*ppbuffer = (const uint8_t *)buffer + substream->start;
+	*psize = (size_t)(substream->end - substream->start);
+	return BSDIFF_SUCCESS;
+}
+
 static void substream_close(void *state)
 {
 	struct substream_state *substream = (struct substream_state*)state;
@@ -113,6 +138,8 @@ int bsdiff_open_substream(
 	substream->seek = substream_seek;
 	substream->tell = substream_tell;
 	substream->read = substream_read;
+	if (base->get_buffer != NULL)
+		substream->get_buffer = substream_getbuffer;
 
 	return BSDIFF_SUCCESS;
 }
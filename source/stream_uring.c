@@ -0,0 +1,632 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#  define _GNU_SOURCE
+#endif
+#include "bsdiff.h"
+#include "bsdiff_mem.h"
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#if defined(__linux__) && defined(HAVE_LINUX_IO_URING_H)
+#  include <errno.h>
+#  include <fcntl.h>
+#  include <unistd.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <sys/syscall.h>
+#  include <linux/io_uring.h>
+#  if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#    define HAVE_URING_STREAM 1
+#  endif
+#endif
+
+/*
+ * Stream on a regular file that keeps several buffers in flight through an
+ * io_uring: reads run ahead of the position, writes are submitted when a
+ * buffer fills up and only waited for when that buffer is needed again.
+ * The ring is driven with the raw syscalls. Without io_uring the file is
+ * opened with bsdiff_open_fd_stream instead.
+ */
+
+#define URING_DEFAULT_BUFFER (1024 * 1024)
+#define URING_DEFAULT_DEPTH 4
+#define URING_MAX_DEPTH 64
+#define URING_ALIGN 4096
+
+#if defined(HAVE_URING_STREAM)
+
+struct uring
+{
+	int fd;
+	unsigned *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_len, cq_len, sqes_len;
+};
+
+struct uring_slot
+{
+	uint8_t *buf;
+	int64_t off;
+	size_t len;              /* requested (read) or filled (write) */
+	int busy;                /* submitted, not completed yet */
+	int res;                 /* result of the completion */
+};
+
+struct uringstream_state
+{
+	struct uring ring;
+	int fd;
+	int mode;                /* BSDIFF_MODE_READ or BSDIFF_MODE_WRITE */
+	int drop_cache;
+	int error;               /* sticky error of a completed write */
+
+	uint8_t *raw;
+	struct uring_slot slots[URING_MAX_DEPTH];
+	int depth;
+	size_t bufsize;
+	int64_t pos;
+
+	/* read mode: slots [first, first + used) cover [slots[first].off, next_off) */
+	int64_t size;
+	int first, used;
+	int64_t next_off;
+
+	/* write mode: the slot being filled */
+	int cur;
+};
+
+static int uring_setup(struct uring *ring, unsigned entries)
+{
+	struct io_uring_params p;
+	int fd;
+
+	memset(&p, 0, sizeof(p));
+	fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+	if (fd < 0)
+		return BSDIFF_ERROR;
+
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = fd;
+	ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_len > ring->sq_len)
+			ring->sq_len = ring->cq_len;
+		ring->cq_len = 0;
+	}
+	ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED)
+		goto fail;
+	ring->cq_ptr = ring->sq_ptr;
+	if (ring->cq_len > 0) {
+		ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ptr == MAP_FAILED)
+			goto fail;
+	}
+	ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto fail;
+
+	ring->sq_tail = (unsigned*)((uint8_t*)ring->sq_ptr + p.sq_off.tail);
+	ring->sq_mask = (unsigned*)((uint8_t*)ring->sq_ptr + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned*)((uint8_t*)ring->sq_ptr + p.sq_off.array);
+	ring->cq_head = (unsigned*)((uint8_t*)ring->cq_ptr + p.cq_off.head);
+	ring->cq_tail = (unsigned*)((uint8_t*)ring->cq_ptr + p.cq_off.tail);
+	ring->cq_mask = (unsigned*)((uint8_t*)ring->cq_ptr + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)((uint8_t*)ring->cq_ptr + p.cq_off.cqes);
+
+	return BSDIFF_SUCCESS;
+
+fail:
+	if (ring->sq_ptr != NULL && ring->sq_ptr != MAP_FAILED)
+		munmap(ring->sq_ptr, ring->sq_len);
+	if (ring->cq_len > 0 && ring->cq_ptr != NULL && ring->cq_ptr != MAP_FAILED)
+		munmap(ring->cq_ptr, ring->cq_len);
+	close(fd);
+	return BSDIFF_ERROR;
+}
+
+/* IORING_OP_READ and IORING_OP_WRITE came with Linux 5.6, as did the probe,
+   so on older kernels the ring sets up but can't be used */
+static int uring_has_ops(struct uring *ring)
+{
+#if defined(__NR_io_uring_register) && defined(IO_URING_OP_SUPPORTED)
+	uint64_t buf[(sizeof(struct io_uring_probe) + (IORING_OP_WRITE + 1) * sizeof(struct io_uring_probe_op) + 7) / 8];
+	struct io_uring_probe *probe = (struct io_uring_probe*)buf;
+
+	memset(buf, 0, sizeof(buf));
+	if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, IORING_OP_WRITE + 1) < 0)
+		return 0;
+	if (probe->last_op < IORING_OP_WRITE)
+		return 0;
+	return (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+		(probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+#else
+	(void)ring;
+	return 0;
+#endif
+}
+
+static void uring_teardown(struct uring *ring)
+{
+	munmap(ring->sqes, ring->sqes_len);
+	if (ring->cq_len > 0)
+		munmap(ring->cq_ptr, ring->cq_len);
+	munmap(ring->sq_ptr, ring->sq_len);
+	close(ring->fd);
+}
+
+static int uring_enter(struct uring *ring, unsigned to_submit, unsigned min_complete)
+{
+	long n;
+
+	do {
+		n = syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete,
+			min_complete > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (n < 0 && errno == EINTR);
+	return (n < 0) ? BSDIFF_FILE_ERROR : BSDIFF_SUCCESS;
+}
+
+static int submit_slot(struct uringstream_state *s, int i, int op)
+{
+	struct uring *ring = &s->ring;
+	struct uring_slot *slot = &s->slots[i];
+	struct io_uring_sqe *sqe;
+	unsigned tail, idx;
+
+	/* The ring has an entry per slot, so it is never full */
+	tail = *ring->sq_tail;
+	idx = tail & *ring->sq_mask;
+	sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = (uint8_t)op;
+	sqe->fd = s->fd;
+	sqe->addr = (uint64_t)(uintptr_t)slot->buf;
+	sqe->len = (uint32_t)slot->len;
+	sqe->off = (uint64_t)slot->off;
+	sqe->user_data = (uint64_t)i;
+	ring->sq_array[idx] = idx;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	slot->busy = 1;
+	if (uring_enter(ring, 1, 0) != BSDIFF_SUCCESS) {
+		slot->busy = 0;
+		return BSDIFF_FILE_ERROR;
+	}
+	return BSDIFF_SUCCESS;
+}
+
+/* Wait for one completion and record it in its slot */
+static int reap_one(struct uringstream_state *s)
+{
+	struct uring *ring = &s->ring;
+	struct io_uring_cqe *cqe;
+	struct uring_slot *slot;
+	unsigned head;
+	int ret;
+
+	for (;;) {
+		head = *ring->cq_head;
+		if (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+			break;
+		if ((ret = uring_enter(ring, 0, 1)) != BSDIFF_SUCCESS)
+			return ret;
+	}
+	cqe = &ring->cqes[head & *ring->cq_mask];
+	slot = &s->slots[cqe->user_data];
+	slot->res = cqe->res;
+	slot->busy = 0;
+	__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+	if (s->mode == BSDIFF_MODE_WRITE) {
+		size_t done = (slot->res > 0) ? (size_t)slot->res : 0;
+		ssize_t n;
+
+		/* Finish a short write synchronously */
+		while (slot->res >= 0 && done < slot->len) {
+			n = pwrite(s->fd, slot->buf + done, slot->len - done, (off_t)(slot->off + (int64_t)done));
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0) {
+				slot->res = -1;
+				break;
+			}
+			done += (size_t)n;
+		}
+		if (slot->res < 0)
+			s->error = BSDIFF_FILE_ERROR;
+		slot->len = 0;
+	}
+	return BSDIFF_SUCCESS;
+}
+
+static int wait_slot(struct uringstream_state *s, int i)
+{
+	int ret;
+
+	while (s->slots[i].busy) {
+		if ((ret = reap_one(s)) != BSDIFF_SUCCESS)
+			return ret;
+	}
+	return BSDIFF_SUCCESS;
+}
+
+static int wait_all(struct uringstream_state *s)
+{
+	int i, ret;
+
+	for (i = 0; i < s->depth; i++) {
+		if ((ret = wait_slot(s, i)) != BSDIFF_SUCCESS)
+			return ret;
+	}
+	return BSDIFF_SUCCESS;
+}
+
+/* Queue reads until every slot is in use or the end of the file */
+static int read_ahead(struct uringstream_state *s)
+{
+	struct uring_slot *slot;
+	int i, ret;
+
+	while (s->used < s->depth && s->next_off < s->size) {
+		i = (s->first + s->used) % s->depth;
+		slot = &s->slots[i];
+		slot->off = s->next_off;
+		slot->len = (s->size - s->next_off < (int64_t)s->bufsize) ? (size_t)(s->size - s->next_off) : s->bufsize;
+		if ((ret = submit_slot(s, i, IORING_OP_READ)) != BSDIFF_SUCCESS)
+			return ret;
+		s->used++;
+		s->next_off += (int64_t)slot->len;
+	}
+	return BSDIFF_SUCCESS;
+}
+
+/* Wait for the oldest read, a short one is completed synchronously. Once
+   complete, calling it again does nothing. */
+static int complete_read(struct uringstream_state *s, struct uring_slot *slot)
+{
+	size_t done;
+	ssize_t n;
+	int ret;
+
+	if ((ret = wait_slot(s, (int)(slot - s->slots))) != BSDIFF_SUCCESS)
+		return ret;
+	if (slot->res < 0)
+		return BSDIFF_FILE_ERROR;
+	done = (size_t)slot->res;
+	while (done < slot->len) {
+		n = pread(s->fd, slot->buf + done, slot->len - done, (off_t)(slot->off + (int64_t)done));
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return BSDIFF_FILE_ERROR;
+		done += (size_t)n;
+	}
+	slot->res = (int)slot->len;
+	return BSDIFF_SUCCESS;
+}
+
+static int uringstream_read(void *state, void *buffer, size_t size, size_t *readed)
+{
+	struct uringstream_state *s = (struct uringstream_state*)state;
+	struct uring_slot *slot;
+	size_t n;
+	int ret;
+
+	*readed = 0;
+	while (*readed < size) {
+		if (s->pos >= s->size)
+			return BSDIFF_END_OF_FILE;
+
+		/* Start over at the position after a seek out of the window */
+		if (s->used == 0 || s->pos < s->slots[s->first].off || s->pos >= s->next_off) {
+			if ((ret = wait_all(s)) != BSDIFF_SUCCESS)
+				return ret;
+			s->first = 0;
+			s->used = 0;
+			s->next_off = s->pos;
+			if ((ret = read_ahead(s)) != BSDIFF_SUCCESS)
+				return ret;
+		}
+
+		slot = &s->slots[s->first];
+		if (s->pos >= slot->off + (int64_t)slot->len) {
+			/* Consumed, reuse it further ahead */
+			if ((ret = wait_slot(s, s->first)) != BSDIFF_SUCCESS)
+				return ret;
+			if (s->drop_cache)
+				posix_fadvise(s->fd, (off_t)slot->off, (off_t)slot->len, POSIX_FADV_DONTNEED);
+			s->first = (s->first + 1) % s->depth;
+			s->used--;
+			if ((ret = read_ahead(s)) != BSDIFF_SUCCESS)
+				return ret;
+			continue;
+		}
+		/* Also when the completion was reaped while waiting on another slot:
+		   its result is only checked here */
+		if ((ret = complete_read(s, slot)) != BSDIFF_SUCCESS)
+			return ret;
+
+		n = (size_t)(slot->off + (int64_t)slot->len - s->pos);
+		if (n > size - *readed)
+			n = size - *readed;
+		memcpy((uint8_t*)buffer + *readed, slot->buf + (s->pos - slot->off), n);
+		s->pos += (int64_t)n;
+		*readed += n;
+	}
+
+	return BSDIFF_SUCCESS;
+}
+
+static int uringstream_pread(void *state, void *buffer, size_t size, int64_t offset, size_t *readed)
+{
+	struct uringstream_state *s = (struct uringstream_state*)state;
+	ssize_t n;
+
+	*readed = 0;
+	if (offset < 0)
+		return BSDIFF_INVALID_ARG;
+	while (*readed < size) {
+		n = pread(s->fd, (uint8_t*)buffer + *readed, size - *readed, (off_t)(offset + (int64_t)*readed));
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return BSDIFF_FILE_ERROR;
+		}
+		if (n == 0)
+			return BSDIFF_END_OF_FILE;
+		*readed += (size_t)n;
+	}
+	return BSDIFF_SUCCESS;
+}
+
+/* Submit the slot being filled and move on to the next free one */
+static int write_behind(struct uringstream_state *s)
+{
+	struct uring_slot *slot = &s->slots[s->cur];
+	int ret;
+
+	if (slot->len > 0) {
+		if ((ret = submit_slot(s, s->cur, IORING_OP_WRITE)) != BSDIFF_SUCCESS)
+			return ret;
+		s->cur = (s->cur + 1) % s->depth;
+		if ((ret = wait_slot(s, s->cur)) != BSDIFF_SUCCESS)
+			return ret;
+	}
+	s->slots[s->cur].off = s->pos;
+	return s->error;
+}
+
+static int uringstream_write(void *state, const void *buffer, size_t size)
+{
+	struct uringstream_state *s = (struct uringstream_state*)state;
+	const uint8_t *src = (const uint8_t*)buffer;
+	struct uring_slot *slot;
+	size_t n;
+	int ret;
+
+	if (s->error != BSDIFF_SUCCESS)
+		return s->error;
+
+	while (size > 0) {
+		slot = &s->slots[s->cur];
+		n = s->bufsize - slot->len;
+		if (n > size)
+			n = size;
+		memcpy(slot->buf + slot->len, src, n);
+		slot->len += n;
+		s->pos += (int64_t)n;
+		src += n;
+		size -= n;
+		if (slot->len == s->bufsize && (ret = write_behind(s)) != BSDIFF_SUCCESS)
+			return ret;
+	}
+
+	return BSDIFF_SUCCESS;
+}
+
+static int uringstream_flush(void *state)
+{
+	struct uringstream_state *s = (struct uringstream_state*)state;
+	int ret;
+
+	if ((ret = write_behind(s)) != BSDIFF_SUCCESS)
+		return ret;
+	if ((ret = wait_all(s)) != BSDIFF_SUCCESS)
+		return ret;
+	return s->error;
+}
+
+static int uringstream_seek(void *state, int64_t offset, int origin)
+{
+	struct uringstream_state *s = (struct uringstream_state*)state;
+	struct stat st;
+	int64_t new_pos;
+	int ret;
+
+	/* Writes land before the file is looked at or written elsewhere */
+	if (s->mode == BSDIFF_MODE_WRITE && (ret = uringstream_flush(s)) != BSDIFF_SUCCESS)
+		return ret;
+
+	switch (origin) {
+	case BSDIFF_SEEK_SET: new_pos = offset; break;
+	case BSDIFF_SEEK_CUR: new_pos = s->pos + offset; break;
+	case BSDIFF_SEEK_END:
+		if (s->mode == BSDIFF_MODE_READ) {
+			new_pos = s->size + offset;
+		} else {
+			if (fstat(s->fd, &st) != 0)
+				return BSDIFF_FILE_ERROR;
+			new_pos = (int64_t)st.st_size + offset;
+		}
+		break;
+	default: return BSDIFF_INVALID_ARG;
+	}
+	if (new_pos < 0)
+		return BSDIFF_INVALID_ARG;
+
+	s->pos = new_pos;
+	if (s->mode == BSDIFF_MODE_WRITE)
+		s->slots[s->cur].off = new_pos;
+	return BSDIFF_SUCCESS;
+}
+
+static int uringstream_tell(void *state, int64_t *position)
+{
+	struct uringstream_state *s = (struct uringstream_state*)state;
+	*position = s->pos;
+	return BSDIFF_SUCCESS;
+}
+
+static int uringstream_getmode(void *state)
+{
+	struct uringstream_state *s = (struct uringstream_state*)state;
+	return s->mode;
+}
+
+static int uringstream_getfd(void *state, int *fd)
+{
+	struct uringstream_state *s = (struct uringstream_state*)state;
+	int ret;
+
+	if (s->mode == BSDIFF_MODE_WRITE && (ret = uringstream_flush(s)) != BSDIFF_SUCCESS)
+		return ret;
+	*fd = s->fd;
+	return BSDIFF_SUCCESS;
+}
+
+static void uringstream_close(void *state)
+{
+	struct uringstream_state *s = (struct uringstream_state*)state;
+
+	/* The kernel may still be using the buffers */
+	if (s->mode == BSDIFF_MODE_WRITE)
+		write_behind(s);
+	wait_all(s);
+	uring_teardown(&s->ring);
+	close(s->fd);
+	bsdiff_free(s->raw);
+	bsdiff_free(s);
+}
+
+static int open_uring_stream(
+	int mode,
+	int fd,
+	const struct bsdiff_fd_stream_options *opts,
+	struct bsdiff_stream *stream)
+{
+	struct uringstream_state *s;
+	uint8_t *base;
+	int i;
+
+	s = bsdiff_malloc(sizeof(struct uringstream_state));
+	if (s == NULL)
+		return BSDIFF_OUT_OF_MEMORY;
+	memset(s, 0, sizeof(*s));
+	s->fd = fd;
+	s->mode = (mode == BSDIFF_MODE_READ) ? BSDIFF_MODE_READ : BSDIFF_MODE_WRITE;
+	s->drop_cache = (opts != NULL) ? opts->drop_cache : 0;
+	s->bufsize = (opts != NULL && opts->buffer_size > 0) ? opts->buffer_size : URING_DEFAULT_BUFFER;
+	s->bufsize = (s->bufsize + URING_ALIGN - 1) & ~(size_t)(URING_ALIGN - 1);
+	if (s->bufsize > 0x7ffff000)
+		s->bufsize = 0x7ffff000;
+	s->depth = (opts != NULL && opts->queue_depth > 0) ? opts->queue_depth : URING_DEFAULT_DEPTH;
+	if (s->depth > URING_MAX_DEPTH)
+		s->depth = URING_MAX_DEPTH;
+
+	s->raw = bsdiff_malloc(s->bufsize * (size_t)s->depth + URING_ALIGN - 1);
+	if (s->raw == NULL) {
+		bsdiff_free(s);
+		return BSDIFF_OUT_OF_MEMORY;
+	}
+	if (uring_setup(&s->ring, (unsigned)s->depth) != BSDIFF_SUCCESS) {
+		bsdiff_free(s->raw);
+		bsdiff_free(s);
+		return BSDIFF_ERROR;
+	}
+	if (!uring_has_ops(&s->ring)) {
+		uring_teardown(&s->ring);
+		bsdiff_free(s->raw);
+		bsdiff_free(s);
+		return BSDIFF_ERROR;
+	}
+	base = (uint8_t*)(((uintptr_t)s->raw + URING_ALIGN - 1) & ~(uintptr_t)(URING_ALIGN - 1));
+	for (i = 0; i < s->depth; i++)
+		s->slots[i].buf = base + (size_t)i * s->bufsize;
+
+	if (s->mode == BSDIFF_MODE_READ) {
+		s->size = (int64_t)lseek(fd, 0, SEEK_END);
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	} else if (opts != NULL && opts->size_hint > 0) {
+		fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, (off_t)opts->size_hint);
+	}
+
+	memset(stream, 0, sizeof(*stream));
+	stream->state = s;
+	stream->close = uringstream_close;
+	stream->get_mode = uringstream_getmode;
+	stream->seek = uringstream_seek;
+	stream->tell = uringstream_tell;
+	if (s->mode == BSDIFF_MODE_READ) {
+		stream->read = uringstream_read;
+		stream->pread = uringstream_pread;
+	} else {
+		stream->write = uringstream_write;
+		stream->flush = uringstream_flush;
+	}
+	stream->get_fd = uringstream_getfd;
+
+	return BSDIFF_SUCCESS;
+}
+
+#endif /* HAVE_URING_STREAM */
+
+int bsdiff_open_uring_stream(
+	int mode,
+	const char *filename,
+	const struct bsdiff_fd_stream_options *opts,
+	struct bsdiff_stream *stream)
+{
+	assert(mode >= BSDIFF_MODE_READ && mode <= BSDIFF_MODE_UPDATE);
+	assert(filename);
+	assert(stream);
+
+#if defined(HAVE_URING_STREAM)
+	{
+		struct stat st;
+		int fd, flags, ret;
+
+		switch (mode) {
+		case BSDIFF_MODE_WRITE: flags = O_WRONLY | O_CREAT | O_TRUNC; break;
+		case BSDIFF_MODE_UPDATE: flags = O_RDWR; break;
+		default: flags = O_RDONLY; break;
+		}
+		do {
+			fd = open(filename, flags | O_CLOEXEC, 0666);
+		} while (fd == -1 && errno == EINTR);
+		if (fd == -1)
+			return BSDIFF_FILE_ERROR;
+
+		/* Pipes and the like go through the fd stream, as does everything
+		   when io_uring is missing, not permitted or without read/write */
+		if (fstat(fd, &st) == 0 && (S_ISREG(st.st_mode) || S_ISBLK(st.st_mode))) {
+			ret = open_uring_stream(mode, fd, opts, stream);
+			if (ret != BSDIFF_ERROR) {
+				if (ret != BSDIFF_SUCCESS)
+					close(fd);
+				return ret;
+			}
+		}
+		if ((ret = bsdiff_open_fd_stream(mode, fd, 1, opts, stream)) != BSDIFF_SUCCESS)
+			close(fd);
+		return ret;
+	}
+#else
+	return bsdiff_open_fd_file_stream(mode, filename, opts, stream);
+#endif
+}
@@ -0,0 +1,252 @@
+#include "bsdiff.h"
+#include "bsdiff_mem.h"
+#include "bsdiff_private.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zstd.h>
+#include <zdict.h>
+
+/* Blocks are cut into samples of this size for training */
+#define ZSTD_DICT_SAMPLE_SIZE (16 * 1024)
+
+struct bsdiff_zstd_dict
+{
+	ZSTD_CDict *cdict;
+	ZSTD_DDict *ddict;
+	unsigned id;
+};
+
+int bsdiff_create_zstd_dict(
+	const void *data,
+	size_t size,
+	int level,
+	struct bsdiff_zstd_dict **pdict)
+{
+	struct bsdiff_zstd_dict *dict;
+
+	if (data == NULL || size == 0 || pdict == NULL)
+		return BSDIFF_INVALID_ARG;
+
+	dict = bsdiff_malloc(sizeof(*dict));
+	if (dict == NULL)
+		return BSDIFF_OUT_OF_MEMORY;
+	memset(dict, 0, sizeof(*dict));
+
+	dict->cdict = ZSTD_createCDict(data, size, level ? level : ZSTD_CLEVEL_DEFAULT);
+	dict->ddict = ZSTD_createDDict(data, size);
+	if (dict->cdict == NULL || dict->ddict == NULL) {
+		bsdiff_free_zstd_dict(dict);
+		return BSDIFF_ERROR;
+	}
+	dict->id = ZSTD_getDictID_fromDict(data, size);
+
+	*pdict = dict;
+	return BSDIFF_SUCCESS;
+}
+
+void bsdiff_free_zstd_dict(
+	struct bsdiff_zstd_dict *dict)
+{
+	if (dict == NULL)
+		return;
+	if (dict->cdict != NULL)
+		ZSTD_freeCDict(dict->cdict);
+	if (dict->ddict != NULL)
+		ZSTD_freeDDict(dict->ddict);
+	bsdiff_free(dict);
+}
+
+unsigned bsdiff_zstd_dict_id(
+	const struct bsdiff_zstd_dict *dict)
+{
+	return dict->id;
+}
+
+const void *bsdiff_zstd_dict_cdict(const struct bsdiff_zstd_dict *dict)
+{
+	return dict->cdict;
+}
+
+const void *bsdiff_zstd_dict_ddict(const struct bsdiff_zstd_dict *dict)
+{
+	return dict->ddict;
+}
+
+/*
+ * Training
+ */
+
+struct dict_samples
+{
+	uint8_t *data;
+	size_t size, capacity;
+	size_t *sizes;
+	size_t count, sizes_capacity;
+};
+
+static void dict_write_int64(int64_t x, uint8_t *buf)
+{
+	uint64_t y = ((uint64_t)x << 1) ^ (uint64_t)((x < 0) ? ~0ULL : 0ULL);
+	int i;
+
+	for (i = 0; i < 8; i++)
+		buf[i] = (uint8_t)(y >> (8 * i));
+}
+
+/* Reserve 'n' bytes at the end of the sample data */
+static int reserve_bytes(struct dict_samples *s, size_t n, uint8_t **dst)
+{
+	uint8_t *data;
+	size_t cap;
+
+	if (s->size + n > s->capacity) {
+		cap = s->capacity ? s->capacity : 1024 * 1024;
+		while (cap < s->size + n)
+			cap = cap / 2 * 3;
+		if ((data = bsdiff_realloc(s->data, cap)) == NULL)
+			return BSDIFF_OUT_OF_MEMORY;
+		s->data = data;
+		s->capacity = cap;
+	}
+	*dst = s->data + s->size;
+	s->size += n;
+	return BSDIFF_SUCCESS;
+}
+
+/* Close the current sample, which ends at the end of the data */
+static int end_sample(struct dict_samples *s, size_t start)
+{
+	size_t *sizes;
+	size_t cap;
+
+	if (s->size == start)
+		return BSDIFF_SUCCESS;
+	if (s->count == s->sizes_capacity) {
+		cap = s->sizes_capacity ? s->sizes_capacity * 2 : 1024;
+		if ((sizes = bsdiff_realloc(s->sizes, cap * sizeof(size_t))) == NULL)
+			return BSDIFF_OUT_OF_MEMORY;
+		s->sizes = sizes;
+		s->sizes_capacity = cap;
+	}
+	s->sizes[s->count++] = s->size - start;
+	return BSDIFF_SUCCESS;
+}
+
+/* Append a diff or extra string, as samples of up to ZSTD_DICT_SAMPLE_SIZE */
+static int add_string(
+	struct dict_samples *s,
+	int (*read)(void *state, void *buffer, size_t size, size_t *readed),
+	void *state,
+	int64_t length)
+{
+	int ret;
+	size_t len, cb, start;
+	uint8_t *dst;
+
+	while (length > 0) {
+		len = (length > ZSTD_DICT_SAMPLE_SIZE) ? ZSTD_DICT_SAMPLE_SIZE : (size_t)length;
+		start = s->size;
+		if ((ret = reserve_bytes(s, len, &dst)) != BSDIFF_SUCCESS)
+			return ret;
+		ret = read(state, dst, len, &cb);
+		if ((ret != BSDIFF_SUCCESS && ret != BSDIFF_END_OF_FILE) || (cb != len))
+			return BSDIFF_CORRUPT_PATCH;
+		if ((ret = end_sample(s, start)) != BSDIFF_SUCCESS)
+			return ret;
+		length -= (int64_t)len;
+	}
+	return BSDIFF_SUCCESS;
+}
+
+static int add_patch(struct dict_samples *s, struct bsdiff_patch_packer *packer)
+{
+	int ret;
+	int64_t newsize, newpos = 0;
+	int64_t ctrl[3];
+	struct dict_samples ctrls;
+	size_t start;
+	uint8_t *dst;
+
+	memset(&ctrls, 0, sizeof(ctrls));
+
+	if (packer->read_new_size(packer->state, &newsize) != BSDIFF_SUCCESS) {
+		ret = BSDIFF_FILE_ERROR;
+		goto cleanup;
+	}
+
+	/* Strings are added as they come, the control block as one sample at the end */
+	while (newpos < newsize) {
+		ret = packer->read_entry_header(packer->state, &ctrl[0], &ctrl[1], &ctrl[2]);
+		if (ret != BSDIFF_SUCCESS && ret != BSDIFF_END_OF_FILE) {
+			ret = BSDIFF_FILE_ERROR;
+			goto cleanup;
+		}
+		if ((ctrl[0] < 0) || (ctrl[1] < 0) ||
+			(ctrl[0] > newsize - newpos) || (ctrl[1] > newsize - newpos - ctrl[0])) {
+			ret = BSDIFF_CORRUPT_PATCH;
+			goto cleanup;
+		}
+		if ((ret = reserve_bytes(&ctrls, 24, &dst)) != BSDIFF_SUCCESS)
+			goto cleanup;
+		dict_write_int64(ctrl[0], dst);
+		dict_write_int64(ctrl[1], dst + 8);
+		dict_write_int64(ctrl[2], dst + 16);
+
+		if ((ret = add_string(s, packer->read_entry_diff, packer->state, ctrl[0])) != BSDIFF_SUCCESS ||
+			(ret = add_string(s, packer->read_entry_extra, packer->state, ctrl[1])) != BSDIFF_SUCCESS)
+			goto cleanup;
+		newpos += ctrl[0] + ctrl[1];
+	}
+
+	start = s->size;
+	if (ctrls.size > 0) {
+		if ((ret = reserve_bytes(s, ctrls.size, &dst)) != BSDIFF_SUCCESS)
+			goto cleanup;
+		memcpy(dst, ctrls.data, ctrls.size);
+	}
+	ret = end_sample(s, start);
+
+cleanup:
+	if (ctrls.data != NULL) { bsdiff_free(ctrls.data); }
+	return ret;
+}
+
+int bsdiff_train_zstd_dict(
+	struct bsdiff_patch_packer *patches,
+	size_t npatches,
+	void *dict_buffer,
+	size_t capacity,
+	size_t *dict_size)
+{
+	int ret;
+	size_t i, n;
+	struct dict_samples s;
+
+	if (patches == NULL || npatches == 0 || dict_buffer == NULL || dict_size == NULL)
+		return BSDIFF_INVALID_ARG;
+
+	memset(&s, 0, sizeof(s));
+	for (i = 0; i < npatches; i++) {
+		assert(patches[i].get_mode(patches[i].state) == BSDIFF_MODE_READ);
+		if ((ret = add_patch(&s, &patches[i])) != BSDIFF_SUCCESS)
+			goto cleanup;
+	}
+	if (s.count > UINT32_MAX) {
+		ret = BSDIFF_SIZE_TOO_LARGE;
+		goto cleanup;
+	}
+
+	n = ZDICT_trainFromBuffer(dict_buffer, capacity, s.data, s.sizes, (unsigned)s.count);
+	if (ZDICT_isError(n)) {
+		ret = BSDIFF_ERROR;
+		goto cleanup;
+	}
+	*dict_size = n;
+	ret = BSDIFF_SUCCESS;
+
+cleanup:
+	if (s.data != NULL) { bsdiff_free(s.data); }
+	if (s.sizes != NULL) { bsdiff_free(s.sizes); }
+	return ret;
+}
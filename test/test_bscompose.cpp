@@ -0,0 +1,181 @@
+#include "bsdiff.h"
+#include <gtest/gtest.h>
+#include <string.h>
+
+#include <vector>
+
+typedef int (*PackerOpenFn)(int, struct bsdiff_stream *,
+                            struct bsdiff_patch_packer *);
+
+static std::vector<uint8_t> Diff(PackerOpenFn open_packer,
+                                 const std::vector<uint8_t> &old_data,
+                                 const std::vector<uint8_t> &new_data) {
+  struct bsdiff_stream old_stream = {0}, new_stream = {0}, patch_stream = {0};
+  struct bsdiff_patch_packer packer = {0};
+  struct bsdiff_ctx ctx = {0};
+  std::vector<uint8_t> patch;
+  const void *buf;
+  size_t size;
+
+  bsdiff_open_memory_stream(BSDIFF_MODE_READ, old_data.data(), old_data.size(),
+                            &old_stream);
+  bsdiff_open_memory_stream(BSDIFF_MODE_READ, new_data.data(), new_data.size(),
+                            &new_stream);
+  bsdiff_open_memory_stream(BSDIFF_MODE_WRITE, nullptr, 0, &patch_stream);
+  open_packer(BSDIFF_MODE_WRITE, &patch_stream, &packer);
+  EXPECT_EQ(bsdiff(&ctx, &old_stream, &new_stream, &packer), BSDIFF_SUCCESS);
+  patch_stream.get_buffer(patch_stream.state, &buf, &size);
+  patch.assign((const uint8_t *)buf, (const uint8_t *)buf + size);
+  bsdiff_close_patch_packer(&packer);
+  bsdiff_close_stream(&patch_stream);
+  bsdiff_close_stream(&new_stream);
+  bsdiff_close_stream(&old_stream);
+  return patch;
+}
+
+static std::vector<uint8_t> Patch(PackerOpenFn open_packer,
+                                  const std::vector<uint8_t> &old_data,
+                                  const std::vector<uint8_t> &patch) {
+  struct bsdiff_stream old_stream = {0}, new_stream = {0}, patch_stream = {0};
+  struct bsdiff_patch_packer packer = {0};
+  struct bsdiff_ctx ctx = {0};
+  std::vector<uint8_t> new_data;
+  const void *buf;
+  size_t size;
+
+  bsdiff_open_memory_stream(BSDIFF_MODE_READ, old_data.data(), old_data.size(),
+                            &old_stream);
+  bsdiff_open_memory_stream(BSDIFF_MODE_WRITE, nullptr, 0, &new_stream);
+  bsdiff_open_memory_stream(BSDIFF_MODE_READ, patch.data(), patch.size(),
+                            &patch_stream);
+  open_packer(BSDIFF_MODE_READ, &patch_stream, &packer);
+  EXPECT_EQ(bspatch(&ctx, &old_stream, &new_stream, &packer), BSDIFF_SUCCESS);
+  new_stream.get_buffer(new_stream.state, &buf, &size);
+  new_data.assign((const uint8_t *)buf, (const uint8_t *)buf + size);
+  bsdiff_close_patch_packer(&packer);
+  bsdiff_close_stream(&patch_stream);
+  bsdiff_close_stream(&new_stream);
+  bsdiff_close_stream(&old_stream);
+  return new_data;
+}
+
+static int Compose(PackerOpenFn in_packer, PackerOpenFn out_packer,
+                   const std::vector<uint8_t> &ab,
+                   const std::vector<uint8_t> &bc, std::vector<uint8_t> &ac,
+                   int64_t max_memory = 0) {
+  struct bsdiff_stream ab_stream = {0}, bc_stream = {0}, ac_stream = {0};
+  struct bsdiff_patch_packer ab_packer = {0}, bc_packer = {0}, ac_packer = {0};
+  struct bsdiff_ctx ctx = {0};
+  const void *buf;
+  size_t size;
+  int ret;
+
+  ctx.max_memory = max_memory;
+  bsdiff_open_memory_stream(BSDIFF_MODE_READ, ab.data(), ab.size(), &ab_stream);
+  bsdiff_open_memory_stream(BSDIFF_MODE_READ, bc.data(), bc.size(), &bc_stream);
+  bsdiff_open_memory_stream(BSDIFF_MODE_WRITE, nullptr, 0, &ac_stream);
+  in_packer(BSDIFF_MODE_READ, &ab_stream, &ab_packer);
+  in_packer(BSDIFF_MODE_READ, &bc_stream, &bc_packer);
+  out_packer(BSDIFF_MODE_WRITE, &ac_stream, &ac_packer);
+  ret = bsdiff_compose(&ctx, &ab_packer, &bc_packer, &ac_packer);
+  if (ret == BSDIFF_SUCCESS) {
+    ac_stream.get_buffer(ac_stream.state, &buf, &size);
+    ac.assign((const uint8_t *)buf, (const uint8_t *)buf + size);
+  }
+  bsdiff_close_patch_packer(&ac_packer);
+  bsdiff_close_patch_packer(&bc_packer);
+  bsdiff_close_patch_packer(&ab_packer);
+  bsdiff_close_stream(&ac_stream);
+  bsdiff_close_stream(&bc_stream);
+  bsdiff_close_stream(&ab_stream);
+  return ret;
+}
+
+// Three versions: B edits A in place and inserts, C moves a block of B,
+// truncates it and appends new data.
+static void MakeVersions(std::vector<uint8_t> &a, std::vector<uint8_t> &b,
+                         std::vector<uint8_t> &c) {
+  uint32_t x = 2024;
+  auto next = [&x]() {
+    x = x * 1103515245 + 12345;
+    return (uint8_t)(x >> 16);
+  };
+  a.resize(200 * 1024);
+  for (auto &v : a)
+    v = next();
+  b = a;
+  for (size_t i = 0; i < b.size(); i += 613)
+    b[i] += 3;
+  b.insert(b.begin() + 50000, 3000, 0x11);
+  for (size_t i = 0; i < 5000; i++)
+    b.insert(b.begin() + 120000, next());
+  c.assign(b.begin() + 100000, b.end());
+  c.insert(c.end(), b.begin(), b.begin() + 90000);
+  for (size_t i = 0; i < c.size(); i += 1021)
+    c[i] ^= 0x80;
+  for (size_t i = 0; i < 7000; i++)
+    c.push_back(next());
+}
+
+TEST(BsComposeTest, ComposeMatchesChain) {
+  std::vector<uint8_t> a, b, c, ac;
+  MakeVersions(a, b, c);
+  std::vector<uint8_t> ab = Diff(bsdiff_open_bz2_patch_packer, a, b);
+  std::vector<uint8_t> bc = Diff(bsdiff_open_bz2_patch_packer, b, c);
+  ASSERT_EQ(Compose(bsdiff_open_bz2_patch_packer, bsdiff_open_bz2_patch_packer,
+                    ab, bc, ac),
+            BSDIFF_SUCCESS);
+  EXPECT_TRUE(Patch(bsdiff_open_bz2_patch_packer, a, ac) == c);
+}
+
+TEST(BsComposeTest, ComposeIntoOtherFormat) {
+  std::vector<uint8_t> a, b, c, ac;
+  MakeVersions(a, b, c);
+  std::vector<uint8_t> ab = Diff(bsdiff_open_zstd_patch_packer, a, b);
+  std::vector<uint8_t> bc = Diff(bsdiff_open_zstd_patch_packer, b, c);
+  ASSERT_EQ(Compose(bsdiff_open_zstd_patch_packer,
+                    bsdiff_open_endsley_patch_packer, ab, bc, ac),
+            BSDIFF_SUCCESS);
+  EXPECT_TRUE(Patch(bsdiff_open_endsley_patch_packer, a, ac) == c);
+}
+
+TEST(BsComposeTest, ComposeWithTinyIntermediate) {
+  std::vector<uint8_t> a, b, c, ac, tiny(1, 0x42);
+  MakeVersions(a, b, c);
+  // A -> 1 byte -> C: nearly all of C becomes literal data
+  std::vector<uint8_t> ab = Diff(bsdiff_open_bz2_patch_packer, a, tiny);
+  std::vector<uint8_t> bc = Diff(bsdiff_open_bz2_patch_packer, tiny, c);
+  ASSERT_EQ(Compose(bsdiff_open_bz2_patch_packer, bsdiff_open_bz2_patch_packer,
+                    ab, bc, ac),
+            BSDIFF_SUCCESS);
+  EXPECT_TRUE(Patch(bsdiff_open_bz2_patch_packer, a, ac) == c);
+}
+
+TEST(BsComposeTest, ComposeLongRuns) {
+  // Runs of diff and extra bytes much longer than what is kept pending
+  std::vector<uint8_t> a(3 * 1024 * 1024), b, c, ac;
+  uint32_t x = 99;
+  for (auto &v : a) {
+    x = x * 1103515245 + 12345;
+    v = (uint8_t)(x >> 16);
+  }
+  b = a;
+  for (size_t i = 0; i < b.size(); i += 4099)
+    b[i] += 1;
+  c = b;
+  for (size_t i = 0; i < 3 * 1024 * 1024; i++) {
+    x = x * 1103515245 + 12345;
+    c.push_back((uint8_t)(x >> 16));
+  }
+  std::vector<uint8_t> ab = Diff(bsdiff_open_zstd_patch_packer, a, b);
+  std::vector<uint8_t> bc = Diff(bsdiff_open_zstd_patch_packer, b, c);
+  ASSERT_EQ(Compose(bsdiff_open_zstd_patch_packer, bsdiff_open_zstd_patch_packer,
+                    ab, bc, ac),
+            BSDIFF_SUCCESS);
+  EXPECT_TRUE(Patch(bsdiff_open_zstd_patch_packer, a, ac) == c);
+
+  // B itself is kept in memory, so it must fit in the budget
+  EXPECT_EQ(Compose(bsdiff_open_zstd_patch_packer, bsdiff_open_zstd_patch_packer,
+                    ab, bc, ac, 1024 * 1024),
+            BSDIFF_OUT_OF_MEMORY);
+}
@@ -1,7 +1,12 @@
 #include "bsdiff.h"
+#include "test_util.h"
 #include <gtest/gtest.h>
 #include <string.h>
 
+#include <atomic>
+#include <thread>
+#include <vector>
+
 class BSDiffApiTest : public ::testing::Test {
 protected:
   void SetUp() override {
@@ -68,6 +73,86 @@ TEST_F(BSDiffApiTest, GeneratePatch) {
   EXPECT_GT(patch_size, 0); // Ensure some patch data was written
 }
 
+// Forwards to an arena, counting the blocks taken from it
+struct CountingAllocator {
+  struct bsdiff_allocator arena;
+  std::atomic<int> allocs;
+};
+
+static void *CountingAlloc(void *state, size_t size) {
+  CountingAllocator *a = (CountingAllocator *)state;
+  a->allocs++;
+  return a->arena.alloc(a->arena.state, size);
+}
+
+static void *CountingResize(void *state, void *ptr, size_t old_size,
+                            size_t size) {
+  CountingAllocator *a = (CountingAllocator *)state;
+  return a->arena.resize(a->arena.state, ptr, old_size, size);
+}
+
+static void CountingRelease(void *state, void *ptr, size_t size) {
+  CountingAllocator *a = (CountingAllocator *)state;
+  a->arena.release(a->arena.state, ptr, size);
+}
+
+TEST_F(BSDiffApiTest, ArenaAllocator) {
+  std::vector<uint8_t> old_data, new_data, expected, result;
+  struct bsdiff_bz2_options opts = {};
+  CountingAllocator counting;
+  struct bsdiff_allocator allocator = {};
+  struct bsdiff_stream old_stream = {0}, new_stream = {0}, patch_stream = {0};
+  struct bsdiff_patch_packer packer = {0};
+  struct bsdiff_ctx ctx = {0};
+  const void *buf;
+  size_t size;
+
+  // The pool threads allocate from the arena as well
+  opts.concurrent = 1;
+  opts.threads = 2;
+  MakeTestData(2 * 1024 * 1024, old_data, new_data);
+  ASSERT_TRUE(MakePatch(Bz2Packer(&opts), old_data, new_data, expected));
+
+  // Small chunks, so both kinds of blocks are used
+  ASSERT_EQ(bsdiff_create_arena_allocator(64 * 1024, &counting.arena), BSDIFF_SUCCESS);
+  counting.allocs = 0;
+  allocator.state = &counting;
+  allocator.alloc = CountingAlloc;
+  allocator.resize = CountingResize;
+  allocator.release = CountingRelease;
+  ctx.allocator = &allocator;
+
+  bsdiff_open_memory_stream(BSDIFF_MODE_READ, old_data.data(), old_data.size(), &old_stream);
+  bsdiff_open_memory_stream(BSDIFF_MODE_READ, new_data.data(), new_data.size(), &new_stream);
+  bsdiff_open_memory_stream(BSDIFF_MODE_WRITE, nullptr, 0, &patch_stream);
+  ASSERT_EQ(bsdiff_open_bz2_patch_packer_ex(BSDIFF_MODE_WRITE, &patch_stream, &opts, &packer),
+            BSDIFF_SUCCESS);
+  EXPECT_EQ(bsdiff(&ctx, &old_stream, &new_stream, &packer), BSDIFF_SUCCESS);
+  patch_stream.get_buffer(patch_stream.state, &buf, &size);
+  EXPECT_TRUE(std::vector<uint8_t>((const uint8_t *)buf, (const uint8_t *)buf + size) == expected);
+  EXPECT_GT(counting.allocs.load(), 0);
+  bsdiff_close_patch_packer(&packer);
+  bsdiff_close_stream(&patch_stream);
+  bsdiff_close_stream(&new_stream);
+
+  // Everything goes at once, then the arena serves the next call
+  bsdiff_reset_arena_allocator(&counting.arena);
+  counting.allocs = 0;
+  bsdiff_open_memory_stream(BSDIFF_MODE_WRITE, nullptr, 0, &new_stream);
+  bsdiff_open_memory_stream(BSDIFF_MODE_READ, expected.data(), expected.size(), &patch_stream);
+  bsdiff_open_bz2_patch_packer(BSDIFF_MODE_READ, &patch_stream, &packer);
+  EXPECT_EQ(bspatch(&ctx, &old_stream, &new_stream, &packer), BSDIFF_SUCCESS);
+  new_stream.get_buffer(new_stream.state, &buf, &size);
+  EXPECT_TRUE(std::vector<uint8_t>((const uint8_t *)buf, (const uint8_t *)buf + size) == new_data);
+  EXPECT_GT(counting.allocs.load(), 0);
+  bsdiff_close_patch_packer(&packer);
+  bsdiff_close_stream(&patch_stream);
+  bsdiff_close_stream(&new_stream);
+  bsdiff_close_stream(&old_stream);
+
+  bsdiff_close_allocator(&counting.arena);
+}
+
 class ZstdBSDiffApiTest : public ::testing::Test {
 protected:
   void SetUp() override {
@@ -133,3 +218,137 @@ TEST_F(ZstdBSDiffApiTest, GeneratePatch) {
 
   EXPECT_GT(patch_size, 0); // Ensure some patch data was written
 }
+
+// Diff with the given stats, they are read once everything is closed
+static void DiffWithStats(const std::vector<uint8_t> &old_data,
+                          const std::vector<uint8_t> &new_data,
+                          struct bsdiff_mem_stats *stats, int *ret) {
+  struct bsdiff_stream old_stream = {0}, new_stream = {0}, patch_stream = {0};
+  struct bsdiff_patch_packer packer = {0};
+  struct bsdiff_ctx ctx = {0};
+
+  ctx.mem_stats = stats;
+  bsdiff_open_memory_stream(BSDIFF_MODE_READ, old_data.data(), old_data.size(), &old_stream);
+  bsdiff_open_memory_stream(BSDIFF_MODE_READ, new_data.data(), new_data.size(), &new_stream);
+  bsdiff_open_memory_stream(BSDIFF_MODE_WRITE, nullptr, 0, &patch_stream);
+  *ret = bsdiff_open_zstd_patch_packer(BSDIFF_MODE_WRITE, &patch_stream, &packer);
+  if (*ret == BSDIFF_SUCCESS)
+    *ret = bsdiff(&ctx, &old_stream, &new_stream, &packer);
+  bsdiff_close_patch_packer(&packer);
+  bsdiff_close_stream(&patch_stream);
+  bsdiff_close_stream(&new_stream);
+  bsdiff_close_stream(&old_stream);
+}
+
+TEST_F(ZstdBSDiffApiTest, CtxMemStatsConcurrent) {
+  std::vector<uint8_t> old_data, new_data;
+  struct bsdiff_mem_stats expected = {}, stats[4] = {};
+  struct bsdiff_ctx ctx = {0};
+  std::vector<std::thread> threads;
+  int ret[4];
+
+  MakeTestData(1024 * 1024, old_data, new_data);
+  DiffWithStats(old_data, new_data, &expected, &ret[0]);
+  ASSERT_EQ(ret[0], BSDIFF_SUCCESS);
+  EXPECT_GT(expected.peak_bytes, (int64_t)old_data.size() * 4);
+  EXPECT_GT(expected.total_allocs, 0);
+
+  // Each call only sees its own allocations
+  for (int i = 0; i < 4; i++)
+    threads.emplace_back(DiffWithStats, std::cref(old_data), std::cref(new_data), &stats[i], &ret[i]);
+  for (auto &t : threads)
+    t.join();
+  for (int i = 0; i < 4; i++) {
+    struct bsdiff_mem_stats s;
+    ctx.mem_stats = &stats[i];
+    bsdiff_get_ctx_mem_stats(&ctx, &s);
+    EXPECT_EQ(ret[i], BSDIFF_SUCCESS);
+    EXPECT_EQ(s.current_bytes, 0);
+    EXPECT_EQ(s.peak_bytes, expected.peak_bytes);
+    EXPECT_EQ(s.total_allocs, expected.total_allocs);
+    EXPECT_EQ(s.total_frees, s.total_allocs);
+  }
+}
+
+TEST_F(ZstdBSDiffApiTest, MaxMemoryStrategies) {
+  std::vector<uint8_t> old_data, new_data, result;
+  MakeTestData(4 * 1024 * 1024, old_data, new_data);
+
+  struct {
+    int64_t max_memory;
+    int ret;
+    int type;
+  } cases[] = {
+      {0, BSDIFF_SUCCESS, BSDIFF_STRATEGY_COMPACT_SA},
+      {12 * 1024 * 1024, BSDIFF_SUCCESS, BSDIFF_STRATEGY_SAMPLED_SA},
+      {900 * 1024, BSDIFF_SUCCESS, BSDIFF_STRATEGY_WINDOWED},
+      {300 * 1024, BSDIFF_OUT_OF_MEMORY, -1},
+  };
+  for (const auto &c : cases) {
+    struct bsdiff_stream old_stream = {0}, new_stream = {0}, patch_stream = {0};
+    struct bsdiff_patch_packer packer = {0};
+    struct bsdiff_strategy strategy = {-1};
+    struct bsdiff_ctx ctx = {0};
+    const void *buf;
+    size_t size;
+
+    ctx.max_memory = c.max_memory;
+    ctx.strategy = &strategy;
+    bsdiff_open_memory_stream(BSDIFF_MODE_READ, old_data.data(), old_data.size(), &old_stream);
+    bsdiff_open_memory_stream(BSDIFF_MODE_READ, new_data.data(), new_data.size(), &new_stream);
+    bsdiff_open_memory_stream(BSDIFF_MODE_WRITE, nullptr, 0, &patch_stream);
+    bsdiff_open_zstd_patch_packer(BSDIFF_MODE_WRITE, &patch_stream, &packer);
+    EXPECT_EQ(bsdiff(&ctx, &old_stream, &new_stream, &packer), c.ret) << c.max_memory;
+    EXPECT_EQ(strategy.type, c.type) << c.max_memory;
+    if (c.ret == BSDIFF_SUCCESS) {
+      EXPECT_TRUE(c.max_memory == 0 || strategy.memory <= c.max_memory);
+      patch_stream.get_buffer(patch_stream.state, &buf, &size);
+      std::vector<uint8_t> patch((const uint8_t *)buf, (const uint8_t *)buf + size);
+      ASSERT_TRUE(ApplyPatch(bsdiff_open_zstd_patch_packer, old_data, patch, result));
+      EXPECT_TRUE(result == new_data) << c.max_memory;
+    }
+    bsdiff_close_patch_packer(&packer);
+    bsdiff_close_stream(&patch_stream);
+    bsdiff_close_stream(&new_stream);
+    bsdiff_close_stream(&old_stream);
+  }
+
+  // Without direct buffers the copies count too: a budget too small for them
+  // fails before they are allocated
+  {
+    struct bsdiff_stream old_stream = {0}, new_stream = {0}, patch_stream = {0};
+    struct bsdiff_patch_packer packer = {0};
+    struct bsdiff_mem_stats stats = {};
+    struct bsdiff_ctx ctx = {0};
+
+    ctx.max_memory = 6 * 1024 * 1024;
+    ctx.mem_stats = &stats;
+    bsdiff_open_memory_stream(BSDIFF_MODE_READ, old_data.data(), old_data.size(), &old_stream);
+    bsdiff_open_memory_stream(BSDIFF_MODE_READ, new_data.data(), new_data.size(), &new_stream);
+    old_stream.get_buffer = nullptr;
+    new_stream.get_buffer = nullptr;
+    bsdiff_open_memory_stream(BSDIFF_MODE_WRITE, nullptr, 0, &patch_stream);
+    bsdiff_open_zstd_patch_packer(BSDIFF_MODE_WRITE, &patch_stream, &packer);
+    EXPECT_EQ(bsdiff(&ctx, &old_stream, &new_stream, &packer), BSDIFF_OUT_OF_MEMORY);
+    bsdiff_get_ctx_mem_stats(&ctx, &stats);
+    EXPECT_LT(stats.peak_bytes, (int64_t)old_data.size());
+    bsdiff_close_patch_packer(&packer);
+    bsdiff_close_stream(&patch_stream);
+    bsdiff_close_stream(&new_stream);
+    bsdiff_close_stream(&old_stream);
+  }
+
+  // From 2 GiB on the suffix array needs 64-bit entries, which is too large
+  // to run here: check the plan only
+  struct bsdiff_ctx ctx = {0};
+  struct bsdiff_strategy strategy;
+  const int64_t large = 3LL << 30;
+  ctx.max_memory = 32LL << 30;
+  ASSERT_EQ(bsdiff_plan_strategy(&ctx, large, 0, &strategy), BSDIFF_SUCCESS);
+  EXPECT_EQ(strategy.type, BSDIFF_STRATEGY_FULL_SA);
+  EXPECT_LE(strategy.memory, ctx.max_memory);
+  ctx.max_memory = 8LL << 30;
+  ASSERT_EQ(bsdiff_plan_strategy(&ctx, large, 0, &strategy), BSDIFF_SUCCESS);
+  EXPECT_EQ(strategy.type, BSDIFF_STRATEGY_SAMPLED_SA);
+  EXPECT_EQ(strategy.sample_step, 4);
+}
@@ -1,7 +1,10 @@
 #include "bsdiff.h"
+#include "test_util.h"
 #include <gtest/gtest.h>
 #include <string.h>
 
+#include <vector>
+
 class BSPatchApiTest : public ::testing::Test {
 protected:
   void SetUp() override {
@@ -123,3 +126,115 @@ TEST_F(ZstdBSPatchApiTest, CorruptPatch) {
   int ret = bspatch(nullptr, &old_stream, &new_stream, &packer);
   EXPECT_NE(ret, BSDIFF_SUCCESS);
 }
+
+struct CheckpointLog {
+  std::vector<struct bsdiff_checkpoint> saved;
+  size_t fail_after;
+};
+
+static int RecordCheckpoint(void *opaque, const struct bsdiff_checkpoint *cp) {
+  CheckpointLog *log = (CheckpointLog *)opaque;
+  if (log->saved.size() == log->fail_after)
+    return BSDIFF_FILE_ERROR;  // Simulate an interruption
+  log->saved.push_back(*cp);
+  return BSDIFF_SUCCESS;
+}
+
+TEST_F(ZstdBSPatchApiTest, SeekableResume) {
+  std::vector<uint8_t> old_data, new_data, patch;
+  MakeTestData(3 * 1024 * 1024, old_data, new_data);
+  ASSERT_TRUE(
+      MakePatch(bsdiff_open_seekable_patch_packer, old_data, new_data, patch));
+
+  struct bsdiff_stream old_stream = {0}, new_stream = {0}, patch_stream = {0};
+  struct bsdiff_patch_packer packer = {0};
+  struct bsdiff_ctx ctx = {0};
+  CheckpointLog log;
+  log.fail_after = 5;
+  ctx.opaque = &log;
+  ctx.checkpoint_interval = 256 * 1024;
+  ctx.checkpoint = RecordCheckpoint;
+
+  bsdiff_open_memory_stream(BSDIFF_MODE_READ, old_data.data(), old_data.size(),
+                            &old_stream);
+  bsdiff_open_memory_stream(BSDIFF_MODE_WRITE, nullptr, 0, &new_stream);
+  bsdiff_open_memory_stream(BSDIFF_MODE_READ, patch.data(), patch.size(),
+                            &patch_stream);
+  ASSERT_EQ(
+      bsdiff_open_seekable_patch_packer(BSDIFF_MODE_READ, &patch_stream, &packer),
+      BSDIFF_SUCCESS);
+  EXPECT_NE(bspatch(&ctx, &old_stream, &new_stream, &packer), BSDIFF_SUCCESS);
+  ASSERT_EQ(log.saved.size(), 5u);
+  bsdiff_close_patch_packer(&packer);
+  bsdiff_close_stream(&patch_stream);
+
+  // Resume into the partially written output from the last checkpoint
+  const struct bsdiff_checkpoint cp = log.saved.back();
+  EXPECT_GT(cp.newpos, 0);
+  log.fail_after = (size_t)-1;
+  bsdiff_open_memory_stream(BSDIFF_MODE_READ, patch.data(), patch.size(),
+                            &patch_stream);
+  ASSERT_EQ(
+      bsdiff_open_seekable_patch_packer(BSDIFF_MODE_READ, &patch_stream, &packer),
+      BSDIFF_SUCCESS);
+  EXPECT_EQ(bspatch_resume(&ctx, &old_stream, &new_stream, &packer, &cp),
+            BSDIFF_SUCCESS);
+
+  const void *buf;
+  size_t size;
+  new_stream.get_buffer(new_stream.state, &buf, &size);
+  ASSERT_EQ(size, new_data.size());
+  EXPECT_EQ(memcmp(buf, new_data.data(), size), 0);
+
+  // A checkpoint that disagrees with the patch is rejected
+  struct bsdiff_checkpoint bad = cp;
+  bad.oldpos += 1;
+  bsdiff_close_patch_packer(&packer);
+  bsdiff_close_stream(&patch_stream);
+  bsdiff_open_memory_stream(BSDIFF_MODE_READ, patch.data(), patch.size(),
+                            &patch_stream);
+  bsdiff_open_seekable_patch_packer(BSDIFF_MODE_READ, &patch_stream, &packer);
+  EXPECT_EQ(bspatch_resume(&ctx, &old_stream, &new_stream, &packer, &bad),
+            BSDIFF_INVALID_ARG);
+
+  bsdiff_close_patch_packer(&packer);
+  bsdiff_close_stream(&patch_stream);
+  bsdiff_close_stream(&new_stream);
+  bsdiff_close_stream(&old_stream);
+}
+
+TEST_F(ZstdBSPatchApiTest, OldFilePageCache) {
+  std::vector<uint8_t> old_data, new_data, patch;
+  MakeTestData(1024 * 1024, old_data, new_data);
+  ASSERT_TRUE(
+      MakePatch(bsdiff_open_zstd_patch_packer, old_data, new_data, patch));
+
+  for (size_t cache_size : {0, 1000, 16 * 1024, 4 * 1024 * 1024}) {
+    struct bsdiff_stream old_stream = {0}, new_stream = {0},
+                         patch_stream = {0};
+    struct bsdiff_patch_packer packer = {0};
+    struct bsdiff_ctx ctx = {0};
+    const void *buf;
+    size_t size;
+
+    // Without get_buffer, the old file is only reachable through seek/read
+    bsdiff_open_memory_stream(BSDIFF_MODE_READ, old_data.data(),
+                              old_data.size(), &old_stream);
+    old_stream.get_buffer = nullptr;
+    bsdiff_open_memory_stream(BSDIFF_MODE_WRITE, nullptr, 0, &new_stream);
+    bsdiff_open_memory_stream(BSDIFF_MODE_READ, patch.data(), patch.size(),
+                              &patch_stream);
+    bsdiff_open_zstd_patch_packer(BSDIFF_MODE_READ, &patch_stream, &packer);
+    ctx.old_cache_size = cache_size;
+    EXPECT_EQ(bspatch(&ctx, &old_stream, &new_stream, &packer),
+              BSDIFF_SUCCESS);
+    new_stream.get_buffer(new_stream.state, &buf, &size);
+    ASSERT_EQ(size, new_data.size());
+    EXPECT_EQ(memcmp(buf, new_data.data(), size), 0) << cache_size;
+
+    bsdiff_close_patch_packer(&packer);
+    bsdiff_close_stream(&patch_stream);
+    bsdiff_close_stream(&new_stream);
+    bsdiff_close_stream(&old_stream);
+  }
+}
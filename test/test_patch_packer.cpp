@@ -0,0 +1,417 @@
+#include "bsdiff.h"
+#include "test_util.h"
+#include <gtest/gtest.h>
+#include <string.h>
+
+#include <vector>
+
+static void ExpectRoundTrip(const PackerOpener &open_packer, size_t size) {
+  std::vector<uint8_t> old_data, new_data, patch, result;
+  MakeTestData(size, old_data, new_data);
+  ASSERT_TRUE(MakePatch(open_packer, old_data, new_data, patch));
+  ASSERT_TRUE(ApplyPatch(open_packer, old_data, patch, result));
+  EXPECT_TRUE(result == new_data);
+}
+
+TEST(PatchPackerTest, Bz2RoundTrip) {
+  ExpectRoundTrip(bsdiff_open_bz2_patch_packer, 64 * 1024);
+}
+
+TEST(PatchPackerTest, ZstdRoundTrip) {
+  ExpectRoundTrip(bsdiff_open_zstd_patch_packer, 64 * 1024);
+}
+
+TEST(PatchPackerTest, SeekableRoundTrip) {
+  // Larger than one frame, so the diff block spans several zstd frames
+  ExpectRoundTrip(bsdiff_open_seekable_patch_packer, 3 * 1024 * 1024);
+}
+
+TEST(PatchPackerTest, SeekableHeaderCounts) {
+  std::vector<uint8_t> old_data, new_data, patch, result;
+  MakeTestData(256 * 1024, old_data, new_data);
+  ASSERT_TRUE(MakePatch(bsdiff_open_seekable_patch_packer, old_data, new_data, patch));
+
+  // Counts far beyond what the patch holds fail without allocating for them
+  for (size_t offset : {8, 16, 24}) {
+    std::vector<uint8_t> corrupt = patch;
+    for (int i = 0; i < 8; i++)
+      corrupt[offset + i] = (uint8_t)((1ULL << 26) >> (8 * i));
+    struct bsdiff_mem_stats stats;
+    bsdiff_reset_mem_stats();
+    EXPECT_FALSE(ApplyPatch(bsdiff_open_seekable_patch_packer, old_data, corrupt, result)) << offset;
+    bsdiff_get_mem_stats(&stats);
+    EXPECT_LT(stats.peak_bytes, 64 * 1024 * 1024) << offset;
+  }
+}
+
+TEST(PatchPackerTest, ZstdWithoutBuffer) {
+  std::vector<uint8_t> old_data, new_data, patch, result;
+  MakeTestData(1024 * 1024, old_data, new_data);
+  ASSERT_TRUE(MakePatch(bsdiff_open_zstd_patch_packer, old_data, new_data, patch));
+
+  // Blocks are decompressed in place from a buffer, or read through the
+  // stream without one
+  ASSERT_TRUE(ApplyPatch(bsdiff_open_zstd_patch_packer, old_data, patch, result));
+  EXPECT_TRUE(result == new_data);
+  ASSERT_TRUE(ApplyPatch(
+      [](int mode, struct bsdiff_stream *stream,
+         struct bsdiff_patch_packer *packer) {
+        stream->get_buffer = nullptr;
+        return bsdiff_open_zstd_patch_packer(mode, stream, packer);
+      },
+      old_data, patch, result));
+  EXPECT_TRUE(result == new_data);
+}
+
+TEST(PatchPackerTest, ZstdOptionsRoundTrip) {
+  struct bsdiff_zstd_options fast = {}, ultra = {}, mixed = {};
+  fast.ctrl.level = fast.diff.level = fast.extra.level = -5;
+  ultra.diff.level = ultra.extra.level = 19;
+  ultra.diff.long_distance_matching = ultra.extra.long_distance_matching = 1;
+  mixed.ctrl.strategy = 1;
+  mixed.diff.level = 1;
+  mixed.extra.level = 22;
+
+  for (const struct bsdiff_zstd_options *opts : {&fast, &ultra, &mixed}) {
+    ExpectRoundTrip(ZstdWriter(opts), 256 * 1024);
+  }
+
+  // A window above the decoder's default limit must be allowed by the reader
+  std::vector<uint8_t> old_data, new_data, patch, result;
+  struct bsdiff_zstd_options large = {};
+  large.diff.window_log = large.extra.window_log = 28;
+  large.max_window_log = 28;
+  MakeTestData(256 * 1024, old_data, new_data);
+  ASSERT_TRUE(MakePatch(ZstdPacker(&large), old_data, new_data, patch));
+  EXPECT_FALSE(ApplyPatch(bsdiff_open_zstd_patch_packer, old_data, patch, result));
+  ASSERT_TRUE(ApplyPatch(ZstdPacker(&large), old_data, patch, result));
+  EXPECT_TRUE(result == new_data);
+}
+
+TEST(PatchPackerTest, ZstdWorkersRoundTrip) {
+  struct bsdiff_zstd_options opts = {};
+  opts.diff.workers = opts.extra.workers = 4;
+  // Output of the worker threads is read by the plain ZSTDDIFF reader
+  ExpectRoundTrip(ZstdWriter(&opts), 4 * 1024 * 1024);
+}
+
+TEST(PatchPackerTest, ZstdVarintCtrl) {
+  std::vector<uint8_t> old_data, new_data, patch, result;
+  struct bsdiff_zstd_options opts = {};
+  opts.varint_ctrl = 1;
+  MakeTestData(1024 * 1024, old_data, new_data);
+  ASSERT_TRUE(MakePatch(ZstdPacker(&opts), old_data, new_data, patch));
+  ASSERT_EQ(memcmp(patch.data(), "ZSTDDIF2", 8), 0);
+  ASSERT_TRUE(ApplyPatch(bsdiff_open_zstd_patch_packer, old_data, patch, result));
+  EXPECT_TRUE(result == new_data);
+
+  // Unknown flags are rejected
+  patch[32] |= 0x80;
+  EXPECT_FALSE(ApplyPatch(bsdiff_open_zstd_patch_packer, old_data, patch, result));
+}
+
+TEST(PatchPackerTest, ZstdZeroRuns) {
+  struct bsdiff_zstd_options zero_runs = {}, all = {};
+  zero_runs.zero_runs = 1;
+  all.zero_runs = all.varint_ctrl = all.concurrent = 1;
+
+  for (const struct bsdiff_zstd_options *opts : {&zero_runs, &all}) {
+    ExpectRoundTrip(ZstdWriter(opts), 2 * 1024 * 1024);
+  }
+}
+
+TEST(PatchPackerTest, ZstdShuffle) {
+  for (int stride : {2, 4, 8, 16}) {
+    struct bsdiff_zstd_options opts = {};
+    opts.ctrl.shuffle = 8;
+    opts.diff.shuffle = opts.extra.shuffle = stride;
+    opts.zero_runs = 1;
+    // An odd size leaves partial elements at the end of the blocks
+    ExpectRoundTrip(ZstdWriter(&opts), 1000003);
+  }
+
+  struct bsdiff_stream stream = {0};
+  struct bsdiff_patch_packer packer = {0};
+  struct bsdiff_zstd_options opts = {};
+  opts.diff.shuffle = 3;
+  bsdiff_open_memory_stream(BSDIFF_MODE_WRITE, nullptr, 0, &stream);
+  EXPECT_EQ(bsdiff_open_zstd_patch_packer_ex(BSDIFF_MODE_WRITE, &stream, &opts,
+                                             &packer),
+            BSDIFF_INVALID_ARG);
+  bsdiff_close_stream(&stream);
+}
+
+TEST(PatchPackerTest, ConcurrentBlocksSamePatch) {
+  std::vector<uint8_t> old_data, new_data, serial, concurrent, result;
+  struct bsdiff_bz2_options bz2_opts = {};
+  struct bsdiff_zstd_options zstd_opts = {};
+  bz2_opts.concurrent = 1;
+  zstd_opts.concurrent = 1;
+  MakeTestData(2 * 1024 * 1024, old_data, new_data);
+
+  // The worker threads produce exactly the bytes of the serial packers
+  ASSERT_TRUE(MakePatch(bsdiff_open_bz2_patch_packer, old_data, new_data, serial));
+  ASSERT_TRUE(MakePatch(Bz2Packer(&bz2_opts), old_data, new_data, concurrent));
+  EXPECT_TRUE(serial == concurrent);
+  ASSERT_TRUE(ApplyPatch(bsdiff_open_bz2_patch_packer, old_data, concurrent, result));
+  EXPECT_TRUE(result == new_data);
+
+  ASSERT_TRUE(MakePatch(bsdiff_open_zstd_patch_packer, old_data, new_data, serial));
+  ASSERT_TRUE(MakePatch(ZstdPacker(&zstd_opts), old_data, new_data, concurrent));
+  EXPECT_TRUE(serial == concurrent);
+}
+
+TEST(PatchPackerTest, SpillToDiskSamePatch) {
+  std::vector<uint8_t> old_data, new_data, in_memory, spilled;
+  struct bsdiff_bz2_options bz2_opts = {};
+  struct bsdiff_zstd_options zstd_opts = {};
+  bz2_opts.spill_threshold = 4096;
+  zstd_opts.spill_threshold = 4096;
+  MakeTestData(1024 * 1024, old_data, new_data);
+
+  // The blocks beyond 4K go through temporary files, the bytes are the same
+  ASSERT_TRUE(MakePatch(bsdiff_open_bz2_patch_packer, old_data, new_data, in_memory));
+  ASSERT_TRUE(MakePatch(Bz2Packer(&bz2_opts), old_data, new_data, spilled));
+  EXPECT_TRUE(in_memory == spilled);
+
+  ASSERT_TRUE(MakePatch(bsdiff_open_zstd_patch_packer, old_data, new_data, in_memory));
+  ASSERT_TRUE(MakePatch(ZstdPacker(&zstd_opts), old_data, new_data, spilled));
+  EXPECT_TRUE(in_memory == spilled);
+}
+
+TEST(PatchPackerTest, Bz2MultiStream) {
+  std::vector<uint8_t> old_data, new_data, single, multi, result;
+  struct bsdiff_bz2_options opts = {};
+  opts.threads = 4;
+  PackerOpener parallel = Bz2Packer(&opts);
+  MakeTestData(4 * 1024 * 1024, old_data, new_data);
+  ASSERT_TRUE(MakePatch(bsdiff_open_bz2_patch_packer, old_data, new_data, single));
+  ASSERT_TRUE(MakePatch(parallel, old_data, new_data, multi));
+  EXPECT_TRUE(single != multi);
+
+  // Concatenated streams decode serially and in parallel, and the parallel
+  // decoder still reads a single stream
+  ASSERT_TRUE(ApplyPatch(bsdiff_open_bz2_patch_packer, old_data, multi, result));
+  EXPECT_TRUE(result == new_data);
+  ASSERT_TRUE(ApplyPatch(parallel, old_data, multi, result));
+  EXPECT_TRUE(result == new_data);
+  ASSERT_TRUE(ApplyPatch(parallel, old_data, single, result));
+  EXPECT_TRUE(result == new_data);
+}
+
+TEST(PatchPackerTest, ZstdOptionsOutOfRange) {
+  struct bsdiff_stream stream = {0};
+  struct bsdiff_patch_packer packer = {0};
+  struct bsdiff_zstd_options opts = {};
+  opts.diff.window_log = 99;
+  bsdiff_open_memory_stream(BSDIFF_MODE_WRITE, nullptr, 0, &stream);
+  EXPECT_EQ(bsdiff_open_zstd_patch_packer_ex(BSDIFF_MODE_WRITE, &stream, &opts,
+                                             &packer),
+            BSDIFF_INVALID_ARG);
+  bsdiff_close_stream(&stream);
+}
+
+static int NoSeek(void *, int64_t, int) { return BSDIFF_FILE_ERROR; }
+static int NoTell(void *, int64_t *) { return BSDIFF_FILE_ERROR; }
+
+TEST(PatchPackerTest, EndsleyRoundTrip) {
+  ExpectRoundTrip(bsdiff_open_endsley_patch_packer, 64 * 1024);
+}
+
+TEST(PatchPackerTest, EndsleyWithoutSeek) {
+  // Behave like a pipe: the packer must never seek or tell
+  ExpectRoundTrip(
+      [](int mode, struct bsdiff_stream *stream,
+         struct bsdiff_patch_packer *packer) {
+        stream->seek = NoSeek;
+        stream->tell = NoTell;
+        return bsdiff_open_endsley_patch_packer(mode, stream, packer);
+      },
+      1024 * 1024);
+}
+
+TEST(PatchPackerTest, RawRoundTrip) {
+  // The memory stream has a buffer, so bspatch reads through views
+  ExpectRoundTrip(bsdiff_open_raw_patch_packer, 256 * 1024);
+}
+
+TEST(PatchPackerTest, RawWithoutBuffer) {
+  std::vector<uint8_t> old_data, new_data, patch, result;
+  MakeTestData(256 * 1024, old_data, new_data);
+  ASSERT_TRUE(MakePatch(bsdiff_open_raw_patch_packer, old_data, new_data, patch));
+  EXPECT_EQ(memcmp(patch.data(), "BSDIFFRW", 8), 0);
+
+  // Without a buffer the entries are copied out of the stream
+  ASSERT_TRUE(ApplyPatch(
+      [](int mode, struct bsdiff_stream *stream,
+         struct bsdiff_patch_packer *packer) {
+        stream->get_buffer = nullptr;
+        int ret = bsdiff_open_raw_patch_packer(mode, stream, packer);
+        EXPECT_TRUE(packer->view_entry_diff == NULL);
+        return ret;
+      },
+      old_data, patch, result));
+  EXPECT_TRUE(result == new_data);
+}
+
+TEST(PatchPackerTest, AdaptiveRoundTrip) {
+  ExpectRoundTrip(bsdiff_open_adaptive_patch_packer, 64 * 1024);
+  ExpectRoundTrip(bsdiff_open_adaptive_patch_packer, 1024 * 1024);
+
+  // Identical files leave the extra block empty
+  std::vector<uint8_t> old_data, new_data, patch, result;
+  MakeTestData(64 * 1024, old_data, new_data);
+  ASSERT_TRUE(MakePatch(bsdiff_open_adaptive_patch_packer, old_data, old_data, patch));
+  ASSERT_TRUE(ApplyPatch(bsdiff_open_adaptive_patch_packer, old_data, patch, result));
+  EXPECT_TRUE(result == old_data);
+
+  // The reserved header bytes must be zero
+  patch[37] = 1;
+  EXPECT_FALSE(ApplyPatch(bsdiff_open_adaptive_patch_packer, old_data, patch, result));
+}
+
+TEST(PatchPackerTest, AdaptiveStoresIncompressibleExtra) {
+  std::vector<uint8_t> old_data, new_data, patch, result;
+  MakeTestData(1024 * 1024, old_data, new_data);
+  // A random tail larger than a sample makes the extra block incompressible
+  uint32_t x = 777;
+  for (size_t i = 0; i < 1024 * 1024; i++) {
+    x = x * 1103515245 + 12345;
+    new_data.push_back((uint8_t)(x >> 16));
+  }
+  ASSERT_TRUE(MakePatch(bsdiff_open_adaptive_patch_packer, old_data, new_data, patch));
+  ASSERT_EQ(memcmp(patch.data(), "BSDIFFAD", 8), 0);
+  EXPECT_NE(patch[32], 0); // ctrl compressed
+  EXPECT_NE(patch[33], 0); // diff compressed
+  EXPECT_EQ(patch[34], 0); // extra stored
+  ASSERT_TRUE(ApplyPatch(bsdiff_open_adaptive_patch_packer, old_data, patch, result));
+  EXPECT_TRUE(result == new_data);
+}
+
+TEST(PatchPackerTest, SeekableRange) {
+  std::vector<uint8_t> old_data, new_data, patch;
+  MakeTestData(3 * 1024 * 1024, old_data, new_data);
+  ASSERT_TRUE(
+      MakePatch(bsdiff_open_seekable_patch_packer, old_data, new_data, patch));
+
+  const int64_t n = (int64_t)new_data.size();
+  const int64_t ranges[][2] = {
+      {0, 0},       {0, 100},           {n / 3 - 10, 5000}, {1024 * 1024 - 7, 20},
+      {n - 100, 100}, {2 * 1024 * 1024 + 5, 300000}, {0, n}, {n, 0}};
+  for (const auto &r : ranges) {
+    struct bsdiff_stream old_stream = {0}, out_stream = {0},
+                         patch_stream = {0};
+    struct bsdiff_patch_packer packer = {0};
+    struct bsdiff_ctx ctx = {0};
+    const void *buf;
+    size_t size;
+
+    bsdiff_open_memory_stream(BSDIFF_MODE_READ, old_data.data(),
+                              old_data.size(), &old_stream);
+    bsdiff_open_memory_stream(BSDIFF_MODE_WRITE, nullptr, 0, &out_stream);
+    bsdiff_open_memory_stream(BSDIFF_MODE_READ, patch.data(), patch.size(),
+                              &patch_stream);
+    ASSERT_EQ(bsdiff_open_seekable_patch_packer(BSDIFF_MODE_READ,
+                                                &patch_stream, &packer),
+              BSDIFF_SUCCESS);
+    EXPECT_EQ(bspatch_range(&ctx, &old_stream, &packer, r[0], r[1],
+                            &out_stream),
+              BSDIFF_SUCCESS);
+    out_stream.get_buffer(out_stream.state, &buf, &size);
+    ASSERT_EQ((int64_t)size, r[1]);
+    EXPECT_EQ(memcmp(buf, new_data.data() + r[0], size), 0)
+        << "range " << r[0] << "+" << r[1];
+
+    bsdiff_close_patch_packer(&packer);
+    bsdiff_close_stream(&patch_stream);
+    bsdiff_close_stream(&out_stream);
+    bsdiff_close_stream(&old_stream);
+  }
+}
+
+TEST(PatchPackerTest, RangeRequiresSeekablePacker) {
+  std::vector<uint8_t> old_data, new_data, patch;
+  MakeTestData(4096, old_data, new_data);
+  ASSERT_TRUE(
+      MakePatch(bsdiff_open_zstd_patch_packer, old_data, new_data, patch));
+
+  struct bsdiff_stream old_stream = {0}, out_stream = {0}, patch_stream = {0};
+  struct bsdiff_patch_packer packer = {0};
+  struct bsdiff_ctx ctx = {0};
+  bsdiff_open_memory_stream(BSDIFF_MODE_READ, old_data.data(), old_data.size(),
+                            &old_stream);
+  bsdiff_open_memory_stream(BSDIFF_MODE_WRITE, nullptr, 0, &out_stream);
+  bsdiff_open_memory_stream(BSDIFF_MODE_READ, patch.data(), patch.size(),
+                            &patch_stream);
+  bsdiff_open_zstd_patch_packer(BSDIFF_MODE_READ, &patch_stream, &packer);
+  EXPECT_EQ(bspatch_range(&ctx, &old_stream, &packer, 0, 10, &out_stream),
+            BSDIFF_INVALID_ARG);
+  bsdiff_close_patch_packer(&packer);
+  bsdiff_close_stream(&patch_stream);
+  bsdiff_close_stream(&out_stream);
+  bsdiff_close_stream(&old_stream);
+}
+
+TEST(PatchPackerTest, ZstdDictionary) {
+  // A family of small, structurally similar updates
+  std::vector<std::vector<uint8_t>> patches;
+  for (uint32_t k = 0; k < 64; k++) {
+    std::vector<uint8_t> old_data(8192), new_data;
+    for (size_t i = 0; i < old_data.size(); i++)
+      old_data[i] = (uint8_t)((i * 7 + k) % 251);
+    new_data = old_data;
+    const char header[] = "PRODUCT-ASSET v2 section=resources locale=en_US ";
+    for (size_t j = 0; j < 4; j++)
+      new_data.insert(new_data.begin() + 1000 * (j + 1) + k, header,
+                      header + sizeof(header) - 1);
+    for (size_t i = k; i < new_data.size(); i += 509)
+      new_data[i] ^= 0x21;
+    patches.emplace_back();
+    ASSERT_TRUE(MakePatch(bsdiff_open_zstd_patch_packer, old_data, new_data,
+                          patches.back()));
+  }
+
+  // Train from all but the last patch
+  std::vector<struct bsdiff_stream> streams(patches.size() - 1);
+  std::vector<struct bsdiff_patch_packer> packers(patches.size() - 1);
+  for (size_t i = 0; i < packers.size(); i++) {
+    bsdiff_open_memory_stream(BSDIFF_MODE_READ, patches[i].data(),
+                              patches[i].size(), &streams[i]);
+    bsdiff_open_zstd_patch_packer(BSDIFF_MODE_READ, &streams[i], &packers[i]);
+  }
+  std::vector<uint8_t> dict_buffer(4096);
+  size_t dict_size = 0;
+  ASSERT_EQ(bsdiff_train_zstd_dict(packers.data(), packers.size(),
+                                   dict_buffer.data(), dict_buffer.size(),
+                                   &dict_size),
+            BSDIFF_SUCCESS);
+  for (size_t i = 0; i < packers.size(); i++) {
+    bsdiff_close_patch_packer(&packers[i]);
+    bsdiff_close_stream(&streams[i]);
+  }
+
+  struct bsdiff_zstd_dict *dict = nullptr;
+  ASSERT_EQ(bsdiff_create_zstd_dict(dict_buffer.data(), dict_size, 19, &dict),
+            BSDIFF_SUCCESS);
+  EXPECT_NE(bsdiff_zstd_dict_id(dict), 0u);
+
+  const struct bsdiff_zstd_dict *dicts[] = {dict};
+  struct bsdiff_zstd_options opts = {};
+  opts.ctrl.dict = opts.diff.dict = opts.extra.dict = dict;
+  opts.dicts = dicts;
+  opts.ndicts = 1;
+  PackerOpener with_dict = ZstdPacker(&opts);
+
+  // The same dictionary serves several patch operations
+  for (int i = 0; i < 3; i++)
+    ExpectRoundTrip(with_dict, 16 * 1024);
+
+  // A reader without the dictionary can't decode the blocks
+  std::vector<uint8_t> old_data, new_data, patch, result;
+  MakeTestData(16 * 1024, old_data, new_data);
+  ASSERT_TRUE(MakePatch(with_dict, old_data, new_data, patch));
+  EXPECT_FALSE(
+      ApplyPatch(bsdiff_open_zstd_patch_packer, old_data, patch, result));
+
+  bsdiff_free_zstd_dict(dict);
+}
@@ -0,0 +1,214 @@
+#include "bsdiff.h"
+#include <gtest/gtest.h>
+#include <string.h>
+#include <vector>
+
+#if !defined(_WIN32)
+#include <stdlib.h>
+#include <unistd.h>
+
+static std::vector<uint8_t> pattern(size_t size) {
+  std::vector<uint8_t> data(size);
+  for (size_t i = 0; i < size; i++)
+    data[i] = (uint8_t)((i * 131) ^ (i >> 9));
+  return data;
+}
+
+TEST(FdStreamTest, FileRoundTrip) {
+  char path[] = "/tmp/bsdiff_fd_stream_XXXXXX";
+  int fd = mkstemp(path);
+  ASSERT_NE(fd, -1);
+  close(fd);
+
+  std::vector<uint8_t> data = pattern(100000);
+  struct bsdiff_fd_stream_options opts = {0};
+  opts.buffer_size = 4096;
+  opts.size_hint = (int64_t)data.size();
+
+  // Small writes through the buffer, a large one around it
+  struct bsdiff_stream stream = {0};
+  ASSERT_EQ(bsdiff_open_fd_file_stream(BSDIFF_MODE_WRITE, path, &opts, &stream), BSDIFF_SUCCESS);
+  EXPECT_EQ(stream.get_mode(stream.state), BSDIFF_MODE_WRITE);
+  size_t pos = 0;
+  for (size_t n = 1; pos + n <= 20000; n = n * 3 + 1) {
+    ASSERT_EQ(stream.write(stream.state, &data[pos], n), BSDIFF_SUCCESS);
+    pos += n;
+  }
+  ASSERT_EQ(stream.write(stream.state, &data[pos], data.size() - pos), BSDIFF_SUCCESS);
+  uint8_t zero = 0;
+  ASSERT_EQ(stream.seek(stream.state, 10, BSDIFF_SEEK_SET), BSDIFF_SUCCESS);
+  ASSERT_EQ(stream.write(stream.state, &zero, 1), BSDIFF_SUCCESS);
+  data[10] = 0;
+  bsdiff_close_stream(&stream);
+
+  ASSERT_EQ(bsdiff_open_fd_file_stream(BSDIFF_MODE_READ, path, &opts, &stream), BSDIFF_SUCCESS);
+  std::vector<uint8_t> buf(data.size() + 10);
+  size_t cb = 0;
+  ASSERT_EQ(stream.read(stream.state, &buf[0], 100, &cb), BSDIFF_SUCCESS);
+  ASSERT_EQ(stream.read(stream.state, &buf[100], 50000, &cb), BSDIFF_SUCCESS);
+  EXPECT_EQ(stream.read(stream.state, &buf[50100], buf.size() - 50100, &cb), BSDIFF_END_OF_FILE);
+  EXPECT_EQ(cb, data.size() - 50100);
+  EXPECT_EQ(memcmp(&buf[0], data.data(), data.size()), 0);
+
+  int64_t off = 0;
+  ASSERT_EQ(stream.seek(stream.state, -5, BSDIFF_SEEK_END), BSDIFF_SUCCESS);
+  ASSERT_EQ(stream.tell(stream.state, &off), BSDIFF_SUCCESS);
+  EXPECT_EQ(off, (int64_t)data.size() - 5);
+  ASSERT_TRUE(stream.pread != nullptr);
+  ASSERT_EQ(stream.pread(stream.state, &buf[0], 3000, 7, &cb), BSDIFF_SUCCESS);
+  EXPECT_EQ(memcmp(&buf[0], &data[7], 3000), 0);
+  bsdiff_close_stream(&stream);
+
+  remove(path);
+}
+
+TEST(FdStreamTest, Pipe) {
+  int fds[2];
+  ASSERT_EQ(pipe(fds), 0);
+
+  std::vector<uint8_t> data = pattern(30000);
+  struct bsdiff_fd_stream_options opts = {0};
+  opts.buffer_size = 4096;
+
+  // The pipe holds at least 64K on Linux, enough to write it all first
+  struct bsdiff_stream out = {0}, in = {0};
+  ASSERT_EQ(bsdiff_open_fd_stream(BSDIFF_MODE_WRITE, fds[1], 1, &opts, &out), BSDIFF_SUCCESS);
+  ASSERT_EQ(out.write(out.state, data.data(), 1000), BSDIFF_SUCCESS);
+  EXPECT_NE(out.seek(out.state, 0, BSDIFF_SEEK_SET), BSDIFF_SUCCESS);
+  ASSERT_EQ(out.write(out.state, &data[1000], data.size() - 1000), BSDIFF_SUCCESS);
+  bsdiff_close_stream(&out);
+
+  ASSERT_EQ(bsdiff_open_fd_stream(BSDIFF_MODE_READ, fds[0], 1, &opts, &in), BSDIFF_SUCCESS);
+  EXPECT_TRUE(in.pread == nullptr);
+  std::vector<uint8_t> buf(data.size());
+  size_t cb = 0, total = 0;
+  while (total < buf.size()) {
+    ASSERT_EQ(in.read(in.state, &buf[total], 777 < buf.size() - total ? 777 : buf.size() - total, &cb), BSDIFF_SUCCESS);
+    total += cb;
+  }
+  EXPECT_EQ(buf, data);
+  EXPECT_EQ(in.read(in.state, &buf[0], 1, &cb), BSDIFF_END_OF_FILE);
+  bsdiff_close_stream(&in);
+}
+
+TEST(FdStreamTest, UringRoundTrip) {
+  char path[] = "/tmp/bsdiff_uring_stream_XXXXXX";
+  int fd = mkstemp(path);
+  ASSERT_NE(fd, -1);
+  close(fd);
+
+  std::vector<uint8_t> data = pattern(200000);
+  struct bsdiff_fd_stream_options opts = {0};
+  opts.buffer_size = 4096;
+  opts.queue_depth = 3;
+
+  // Falls back to the fd stream where io_uring isn't there, same behaviour
+  struct bsdiff_stream stream = {0};
+  ASSERT_EQ(bsdiff_open_uring_stream(BSDIFF_MODE_WRITE, path, &opts, &stream), BSDIFF_SUCCESS);
+  size_t pos = 0;
+  for (size_t n = 1; pos < data.size(); n = n * 5 % 9001 + 1) {
+    size_t cb = n < data.size() - pos ? n : data.size() - pos;
+    ASSERT_EQ(stream.write(stream.state, &data[pos], cb), BSDIFF_SUCCESS);
+    pos += cb;
+  }
+  uint8_t zero[3] = {0};
+  ASSERT_EQ(stream.seek(stream.state, 5000, BSDIFF_SEEK_SET), BSDIFF_SUCCESS);
+  ASSERT_EQ(stream.write(stream.state, zero, 3), BSDIFF_SUCCESS);
+  memset(&data[5000], 0, 3);
+  ASSERT_EQ(stream.flush(stream.state), BSDIFF_SUCCESS);
+  bsdiff_close_stream(&stream);
+
+  ASSERT_EQ(bsdiff_open_uring_stream(BSDIFF_MODE_READ, path, &opts, &stream), BSDIFF_SUCCESS);
+  std::vector<uint8_t> buf(data.size());
+  size_t cb = 0;
+  pos = 0;
+  for (size_t n = 7; pos < data.size(); n = n * 3 % 20011 + 1) {
+    size_t want = n < data.size() - pos ? n : data.size() - pos;
+    ASSERT_EQ(stream.read(stream.state, &buf[pos], want, &cb), BSDIFF_SUCCESS);
+    ASSERT_EQ(cb, want);
+    pos += cb;
+  }
+  EXPECT_EQ(buf, data);
+  EXPECT_EQ(stream.read(stream.state, &buf[0], 1, &cb), BSDIFF_END_OF_FILE);
+
+  // Back and forth, inside and outside the read-ahead window
+  const int64_t offsets[] = {100, 150000, 160000, 4000, 199990};
+  for (int64_t off : offsets) {
+    ASSERT_EQ(stream.seek(stream.state, off, BSDIFF_SEEK_SET), BSDIFF_SUCCESS);
+    size_t want = 5000 < data.size() - off ? 5000 : data.size() - off;
+    ASSERT_EQ(stream.read(stream.state, &buf[0], want, &cb), BSDIFF_SUCCESS);
+    EXPECT_EQ(memcmp(&buf[0], &data[off], want), 0);
+  }
+  bsdiff_close_stream(&stream);
+
+  remove(path);
+}
+
+TEST(FdStreamTest, MmapHints) {
+  char path[] = "/tmp/bsdiff_mmap_hints_XXXXXX";
+  int fd = mkstemp(path);
+  ASSERT_NE(fd, -1);
+  std::vector<uint8_t> data = pattern(3 * 1024 * 1024 + 123);
+  ASSERT_EQ(write(fd, data.data(), data.size()), (ssize_t)data.size());
+  close(fd);
+
+  // Large enough for the huge page aligned mapping
+  struct bsdiff_mmap_stream_options opts = {BSDIFF_ACCESS_RANDOM, 1, 1};
+  struct bsdiff_stream stream = {0};
+  ASSERT_EQ(bsdiff_open_mmap_stream_ex(BSDIFF_MODE_READ, path, &opts, &stream), BSDIFF_SUCCESS);
+  const void *buf = nullptr;
+  size_t size = 0;
+  ASSERT_EQ(stream.get_buffer(stream.state, &buf, &size), BSDIFF_SUCCESS);
+  ASSERT_EQ(size, data.size());
+  EXPECT_EQ(memcmp(buf, data.data(), size), 0);
+  bsdiff_close_stream(&stream);
+
+  remove(path);
+}
+
+#if defined(__linux__)
+// Bytes of anonymous PROT_NONE mappings, which is what a leaked reservation looks like
+static size_t reserved_bytes() {
+  size_t total = 0;
+  FILE *f = fopen("/proc/self/maps", "r");
+  if (!f)
+    return 0;
+  char line[512];
+  while (fgets(line, sizeof(line), f)) {
+    unsigned long lo, hi, inode;
+    char perms[8];
+    if (sscanf(line, "%lx-%lx %7s %*s %*s %lu", &lo, &hi, perms, &inode) == 4 &&
+        strcmp(perms, "---p") == 0 && inode == 0)
+      total += hi - lo;
+  }
+  fclose(f);
+  return total;
+}
+
+TEST(FdStreamTest, MmapHugePagesUnmapReservation) {
+  char path[] = "/tmp/bsdiff_mmap_reserve_XXXXXX";
+  int fd = mkstemp(path);
+  ASSERT_NE(fd, -1);
+  // Not a multiple of the page size, so the mapping ends mid page
+  std::vector<uint8_t> data = pattern(2 * 1024 * 1024 + 123);
+  ASSERT_EQ(write(fd, data.data(), data.size()), (ssize_t)data.size());
+  close(fd);
+
+  struct bsdiff_mmap_stream_options opts = {BSDIFF_ACCESS_SEQUENTIAL, 1, 1};
+  size_t before = reserved_bytes();
+  for (int i = 0; i < 32; i++) {
+    struct bsdiff_stream stream = {0};
+    ASSERT_EQ(bsdiff_open_mmap_stream_ex(BSDIFF_MODE_READ, path, &opts, &stream), BSDIFF_SUCCESS);
+    const void *buf = nullptr;
+    size_t size = 0;
+    ASSERT_EQ(stream.get_buffer(stream.state, &buf, &size), BSDIFF_SUCCESS);
+    ASSERT_EQ(size, data.size());
+    EXPECT_EQ(((const uint8_t*)buf)[size - 1], data[size - 1]);
+    bsdiff_close_stream(&stream);
+  }
+  EXPECT_EQ(reserved_bytes(), before);
+
+  remove(path);
+}
+#endif
+#endif
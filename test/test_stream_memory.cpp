@@ -1,6 +1,7 @@
 #include "bsdiff.h"
 #include <gtest/gtest.h>
 #include <string.h>
+#include <vector>
 
 TEST(MemoryStreamTest, ReadModeBasic) {
   const char *test_data = "Hello, bsdiff memory stream!";
@@ -96,3 +97,82 @@ TEST(MemoryStreamTest, EdgeCases) {
   EXPECT_NE(ret, BSDIFF_SUCCESS); // Should fail to seek before start
   stream.close(stream.state);
 }
+
+TEST(MemoryStreamTest, PositionalRead) {
+  const char *test_data = "Hello, bsdiff memory stream!";
+  size_t test_len = strlen(test_data);
+
+  struct bsdiff_stream stream = {0};
+  int ret =
+      bsdiff_open_memory_stream(BSDIFF_MODE_READ, test_data, test_len, &stream);
+  ASSERT_EQ(ret, BSDIFF_SUCCESS);
+  ASSERT_TRUE(stream.pread != nullptr);
+
+  // pread leaves the position alone
+  char buf[16] = {0};
+  size_t read_bytes = 0;
+  ret = stream.pread(stream.state, buf, 6, 7, &read_bytes);
+  EXPECT_EQ(ret, BSDIFF_SUCCESS);
+  EXPECT_EQ(read_bytes, 6);
+  EXPECT_STREQ(buf, "bsdiff");
+  int64_t pos = -1;
+  stream.tell(stream.state, &pos);
+  EXPECT_EQ(pos, 0);
+
+  // Short read at the end
+  ret = stream.pread(stream.state, buf, 10, test_len - 2, &read_bytes);
+  EXPECT_EQ(ret, BSDIFF_END_OF_FILE);
+  EXPECT_EQ(read_bytes, 2);
+  ret = stream.pread(stream.state, buf, 1, test_len, &read_bytes);
+  EXPECT_EQ(ret, BSDIFF_END_OF_FILE);
+  EXPECT_EQ(read_bytes, 0);
+
+  stream.close(stream.state);
+}
+
+TEST(MemoryStreamTest, ChunkedWrite) {
+  struct bsdiff_stream stream = {0};
+  ASSERT_EQ(bsdiff_open_chunked_memory_stream(16384, &stream), BSDIFF_SUCCESS);
+  EXPECT_EQ(stream.get_mode(stream.state), BSDIFF_MODE_WRITE);
+  EXPECT_TRUE(stream.get_buffer == nullptr);
+
+  std::vector<uint8_t> data(100000);
+  for (size_t i = 0; i < data.size(); i++)
+    data[i] = (uint8_t)(i * 7 + (i >> 8));
+  size_t pos = 0;
+  for (size_t n = 1; pos < data.size(); n = n * 2 % 7919 + 1) {
+    size_t cb = n < data.size() - pos ? n : data.size() - pos;
+    ASSERT_EQ(stream.write(stream.state, &data[pos], cb), BSDIFF_SUCCESS);
+    pos += cb;
+  }
+
+  // Overwrite across a chunk boundary (4K + 8K)
+  std::vector<uint8_t> patch(100, 0xee);
+  ASSERT_EQ(stream.seek(stream.state, 12250, BSDIFF_SEEK_SET), BSDIFF_SUCCESS);
+  ASSERT_EQ(stream.write(stream.state, patch.data(), patch.size()), BSDIFF_SUCCESS);
+  memcpy(&data[12250], patch.data(), patch.size());
+  int64_t tell = 0;
+  stream.tell(stream.state, &tell);
+  EXPECT_EQ(tell, 12350);
+
+  std::vector<uint8_t> out;
+  const void *buf;
+  size_t size;
+  int64_t off = 0;
+  int nchunks = 0;
+  while (stream.get_chunk(stream.state, off, &buf, &size) == BSDIFF_SUCCESS) {
+    EXPECT_LE(size, 16384u);
+    out.insert(out.end(), (const uint8_t *)buf, (const uint8_t *)buf + size);
+    off += (int64_t)size;
+    nchunks++;
+  }
+  EXPECT_EQ(out, data);
+  EXPECT_GT(nchunks, 6);
+
+  // Lookups behind the last one
+  ASSERT_EQ(stream.get_chunk(stream.state, 5, &buf, &size), BSDIFF_SUCCESS);
+  EXPECT_EQ(size, 4096u - 5);
+  EXPECT_EQ(memcmp(buf, &data[5], size), 0);
+
+  stream.close(stream.state);
+}
@@ -0,0 +1,122 @@
+#ifndef __BSDIFF_TEST_UTIL_H__
+#define __BSDIFF_TEST_UTIL_H__
+
+#include "bsdiff.h"
+#include <stdint.h>
+
+#include <functional>
+#include <vector>
+
+// Patch helpers shared by the packer and API tests
+
+typedef std::function<int(int, struct bsdiff_stream *,
+                          struct bsdiff_patch_packer *)>
+    PackerOpener;
+
+// Deterministic test data: 'new' is 'old' with scattered byte changes, an
+// insertion and an appended tail, so patches have diff, extra and seeks.
+static inline void MakeTestData(size_t size, std::vector<uint8_t> &old_data,
+                                std::vector<uint8_t> &new_data) {
+  uint32_t x = 12345;
+  old_data.resize(size);
+  for (size_t i = 0; i < size; i++) {
+    x = x * 1103515245 + 12345;
+    old_data[i] = (uint8_t)(x >> 16);
+  }
+  new_data = old_data;
+  for (size_t i = 0; i < new_data.size(); i += 997)
+    new_data[i] ^= 0x5a;
+  new_data.insert(new_data.begin() + size / 3, 4096, 0x42);
+  for (size_t i = 0; i < 8192; i++) {
+    x = x * 1103515245 + 12345;
+    new_data.push_back((uint8_t)(x >> 16));
+  }
+}
+
+// bz2 packer with options for both modes
+static inline PackerOpener Bz2Packer(const struct bsdiff_bz2_options *opts) {
+  return [opts](int mode, struct bsdiff_stream *stream,
+                struct bsdiff_patch_packer *packer) {
+    return bsdiff_open_bz2_patch_packer_ex(mode, stream, opts, packer);
+  };
+}
+
+// zstd packers with options: both modes, or options for the writer only,
+// to check that the plain reader handles the output
+static inline PackerOpener ZstdPacker(const struct bsdiff_zstd_options *opts) {
+  return [opts](int mode, struct bsdiff_stream *stream,
+                struct bsdiff_patch_packer *packer) {
+    return bsdiff_open_zstd_patch_packer_ex(mode, stream, opts, packer);
+  };
+}
+
+static inline PackerOpener ZstdWriter(const struct bsdiff_zstd_options *opts) {
+  return [opts](int mode, struct bsdiff_stream *stream,
+                struct bsdiff_patch_packer *packer) {
+    return mode == BSDIFF_MODE_WRITE
+               ? bsdiff_open_zstd_patch_packer_ex(mode, stream, opts, packer)
+               : bsdiff_open_zstd_patch_packer(mode, stream, packer);
+  };
+}
+
+static inline bool MakePatch(const PackerOpener &open_packer,
+                             const std::vector<uint8_t> &old_data,
+                             const std::vector<uint8_t> &new_data,
+                             std::vector<uint8_t> &patch) {
+  struct bsdiff_stream old_stream = {0}, new_stream = {0}, patch_stream = {0};
+  struct bsdiff_patch_packer packer = {0};
+  struct bsdiff_ctx ctx = {0};
+  const void *buf;
+  size_t size;
+  int ret;
+
+  bsdiff_open_memory_stream(BSDIFF_MODE_READ, old_data.data(), old_data.size(),
+                            &old_stream);
+  bsdiff_open_memory_stream(BSDIFF_MODE_READ, new_data.data(), new_data.size(),
+                            &new_stream);
+  bsdiff_open_memory_stream(BSDIFF_MODE_WRITE, nullptr, 0, &patch_stream);
+  ret = open_packer(BSDIFF_MODE_WRITE, &patch_stream, &packer);
+  if (ret == BSDIFF_SUCCESS)
+    ret = bsdiff(&ctx, &old_stream, &new_stream, &packer);
+  if (ret == BSDIFF_SUCCESS) {
+    patch_stream.get_buffer(patch_stream.state, &buf, &size);
+    patch.assign((const uint8_t *)buf, (const uint8_t *)buf + size);
+  }
+  bsdiff_close_patch_packer(&packer);
+  bsdiff_close_stream(&patch_stream);
+  bsdiff_close_stream(&new_stream);
+  bsdiff_close_stream(&old_stream);
+  return ret == BSDIFF_SUCCESS;
+}
+
+static inline bool ApplyPatch(const PackerOpener &open_packer,
+                              const std::vector<uint8_t> &old_data,
+                              const std::vector<uint8_t> &patch,
+                              std::vector<uint8_t> &new_data) {
+  struct bsdiff_stream old_stream = {0}, new_stream = {0}, patch_stream = {0};
+  struct bsdiff_patch_packer packer = {0};
+  struct bsdiff_ctx ctx = {0};
+  const void *buf;
+  size_t size;
+  int ret;
+
+  bsdiff_open_memory_stream(BSDIFF_MODE_READ, old_data.data(), old_data.size(),
+                            &old_stream);
+  bsdiff_open_memory_stream(BSDIFF_MODE_WRITE, nullptr, 0, &new_stream);
+  bsdiff_open_memory_stream(BSDIFF_MODE_READ, patch.data(), patch.size(),
+                            &patch_stream);
+  ret = open_packer(BSDIFF_MODE_READ, &patch_stream, &packer);
+  if (ret == BSDIFF_SUCCESS)
+    ret = bspatch(&ctx, &old_stream, &new_stream, &packer);
+  if (ret == BSDIFF_SUCCESS) {
+    new_stream.get_buffer(new_stream.state, &buf, &size);
+    new_data.assign((const uint8_t *)buf, (const uint8_t *)buf + size);
+  }
+  bsdiff_close_patch_packer(&packer);
+  bsdiff_close_stream(&patch_stream);
+  bsdiff_close_stream(&new_stream);
+  bsdiff_close_stream(&old_stream);
+  return ret == BSDIFF_SUCCESS;
+}
+
+#endif // __BSDIFF_TEST_UTIL_H__